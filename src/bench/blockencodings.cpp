@@ -0,0 +1,72 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <blockencodings.h>
+#include <random.h>
+#include <txmempool.h>
+#include <util.h>
+
+#include <boost/thread/thread.hpp>
+
+static const size_t MEMPOOL_TXS = 100000;
+static const size_t BLOCK_TXS = 2000;
+
+// A mempool of MEMPOOL_TXS transactions, and a compact block mining
+// BLOCK_TXS of them spread all over it.
+static void BuildMempoolAndBlock(CTxMemPool& pool, CBlock& block)
+{
+    FastRandomContext rng(true);
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+    block.nBits = 0x207fffff;
+    block.vtx.push_back(MakeTransactionRef(tx));
+    LockPoints lp;
+    for (size_t i = 0; i < MEMPOOL_TXS; i++) {
+        tx.vin[0].prevout = COutPoint(rng.rand256(), 0);
+        CTransactionRef ptx = MakeTransactionRef(tx);
+        pool.addUnchecked(ptx->GetHash(), CTxMemPoolEntry(ptx, 1000, 0, 1, false, 4, lp));
+        if (i % (MEMPOOL_TXS / BLOCK_TXS) == 0)
+            block.vtx.push_back(ptx);
+    }
+}
+
+// One iteration is the mempool lookup of a compact block that is entirely
+// in a large mempool, serially or on the short ID threads.
+static void ReconstructCompactBlock(benchmark::State& state, int nThreads)
+{
+    CTxMemPool pool;
+    CBlock block;
+    BuildMempoolAndBlock(pool, block);
+    const CBlockHeaderAndShortTxIDs cmpctblock(block, true);
+    const std::vector<std::pair<uint256, CTransactionRef>> extra_txn;
+
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(&ThreadShortIDMatch);
+    nShortIDThreads = nThreads;
+    while (state.KeepRunning()) {
+        PartiallyDownloadedBlock partialBlock(&pool);
+        ReadStatus status = partialBlock.InitData(cmpctblock, extra_txn);
+        assert(status == READ_STATUS_OK && partialBlock.GetMissingCount() == 0);
+    }
+    nShortIDThreads = 0;
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+static void CmpctBlockReconstructSerial(benchmark::State& state)
+{
+    ReconstructCompactBlock(state, 0);
+}
+
+static void CmpctBlockReconstructParallel(benchmark::State& state)
+{
+    ReconstructCompactBlock(state, std::max(1, std::min(GetNumCores() - 1, MAX_SHORTID_THREADS)));
+}
+
+BENCHMARK(CmpctBlockReconstructSerial, 20);
+BENCHMARK(CmpctBlockReconstructParallel, 20);
@@ -52,5 +52,52 @@ static void DeserializeAndCheckBlockTest(benchmark::State& state)
     }
 }
 
+// Serving a block to a peer that does not want witnesses: either the
+// deserialize/serialize round trip, or a single pass over the raw block. The
+// test block predates segwit, so give its inputs typical witnesses first.
+static std::vector<unsigned char> WitnessBlock()
+{
+    CDataStream stream((const char*)block_bench::block413567,
+            (const char*)&block_bench::block413567[sizeof(block_bench::block413567)],
+            SER_NETWORK, PROTOCOL_VERSION);
+    CBlock block;
+    stream >> block;
+    for (CTransactionRef& tx : block.vtx) {
+        CMutableTransaction mtx(*tx);
+        for (CTxIn& txin : mtx.vin) {
+            txin.scriptWitness.stack = {std::vector<unsigned char>(72, 0x30), std::vector<unsigned char>(33, 0x02)};
+        }
+        tx = MakeTransactionRef(std::move(mtx));
+    }
+    std::vector<unsigned char> data;
+    CVectorWriter(SER_NETWORK, PROTOCOL_VERSION, data, 0, block);
+    return data;
+}
+
+static void ReserializeBlockNoWitnessTest(benchmark::State& state)
+{
+    const std::vector<unsigned char> data = WitnessBlock();
+
+    while (state.KeepRunning()) {
+        CDataStream stream(data, SER_NETWORK, PROTOCOL_VERSION);
+        CBlock block;
+        stream >> block;
+        std::vector<unsigned char> out;
+        CVectorWriter(SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS, out, 0, block);
+    }
+}
+
+static void StripRawBlockWitnessTest(benchmark::State& state)
+{
+    const std::vector<unsigned char> data = WitnessBlock();
+
+    while (state.KeepRunning()) {
+        std::vector<unsigned char> raw(data);
+        assert(StripRawBlockWitness(raw));
+    }
+}
+
 BENCHMARK(DeserializeBlockTest, 130);
 BENCHMARK(DeserializeAndCheckBlockTest, 160);
+BENCHMARK(ReserializeBlockNoWitnessTest, 60);
+BENCHMARK(StripRawBlockWitnessTest, 1000);
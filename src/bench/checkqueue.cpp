@@ -10,6 +10,7 @@
 #include <vector>
 #include <boost/thread/thread.hpp>
 #include <random.h>
+#include <crypto/sha256.h>
 
 
 static const int MIN_CORES = 2;
@@ -60,3 +61,52 @@ static void CCheckQueueSpeedPrevectorJob(benchmark::State& state)
     tg.join_all();
 }
 BENCHMARK(CCheckQueueSpeedPrevectorJob, 1400);
+
+// Job that does a fixed amount of hashing, roughly the cost of a cheap
+// signature check, so that the benchmarks below are dominated by useful
+// work instead of queue overhead.
+struct HashJob {
+    unsigned char data[32] = {};
+    bool operator()()
+    {
+        for (int i = 0; i < 16; ++i)
+            CSHA256().Write(data, sizeof(data)).Finalize(data);
+        return true;
+    }
+    void swap(HashJob& x) { std::swap(data, x.data); }
+};
+
+// Run the same workload with a fixed total number of threads (including
+// the master) to show how the queue scales.
+static void CCheckQueueScaling(benchmark::State& state, int threads)
+{
+    CCheckQueue<HashJob> queue {QUEUE_BATCH_SIZE};
+    boost::thread_group tg;
+    for (auto x = 0; x < threads - 1; ++x) {
+       tg.create_thread([&]{queue.Thread();});
+    }
+    while (state.KeepRunning()) {
+        CCheckQueueControl<HashJob> control(&queue);
+        for (size_t b = 0; b < BATCHES; ++b) {
+            std::vector<HashJob> vChecks(BATCH_SIZE);
+            control.Add(vChecks);
+        }
+        control.Wait();
+    }
+    tg.interrupt_all();
+    tg.join_all();
+}
+
+static void CCheckQueueScaling_1Thread(benchmark::State& state) { CCheckQueueScaling(state, 1); }
+static void CCheckQueueScaling_2Threads(benchmark::State& state) { CCheckQueueScaling(state, 2); }
+static void CCheckQueueScaling_4Threads(benchmark::State& state) { CCheckQueueScaling(state, 4); }
+static void CCheckQueueScaling_8Threads(benchmark::State& state) { CCheckQueueScaling(state, 8); }
+static void CCheckQueueScaling_16Threads(benchmark::State& state) { CCheckQueueScaling(state, 16); }
+static void CCheckQueueScaling_32Threads(benchmark::State& state) { CCheckQueueScaling(state, 32); }
+
+BENCHMARK(CCheckQueueScaling_1Thread, 20);
+BENCHMARK(CCheckQueueScaling_2Threads, 40);
+BENCHMARK(CCheckQueueScaling_4Threads, 80);
+BENCHMARK(CCheckQueueScaling_8Threads, 160);
+BENCHMARK(CCheckQueueScaling_16Threads, 160);
+BENCHMARK(CCheckQueueScaling_32Threads, 160);
@@ -52,6 +52,20 @@ static void SHA256_32b(benchmark::State& state)
     }
 }
 
+static void SHA256D64Batch(benchmark::State& state, size_t blocks)
+{
+    std::vector<uint8_t> in(64 * blocks, 0);
+    while (state.KeepRunning()) {
+        SHA256D64(in.data(), in.data(), blocks);
+    }
+}
+
+/* Batch sizes that exercise the 1-way, 4-way and 8-way transforms when available */
+static void SHA256D64_1(benchmark::State& state) { SHA256D64Batch(state, 1); }
+static void SHA256D64_4(benchmark::State& state) { SHA256D64Batch(state, 4); }
+static void SHA256D64_8(benchmark::State& state) { SHA256D64Batch(state, 8); }
+static void SHA256D64_1024(benchmark::State& state) { SHA256D64Batch(state, 1024); }
+
 static void SHA512(benchmark::State& state)
 {
     uint8_t hash[CSHA512::OUTPUT_SIZE];
@@ -93,6 +107,10 @@ BENCHMARK(SHA256, 340);
 BENCHMARK(SHA512, 330);
 
 BENCHMARK(SHA256_32b, 4700 * 1000);
+BENCHMARK(SHA256D64_1, 2000 * 1000);
+BENCHMARK(SHA256D64_4, 700 * 1000);
+BENCHMARK(SHA256D64_8, 400 * 1000);
+BENCHMARK(SHA256D64_1024, 7400);
 BENCHMARK(SipHash_32b, 40 * 1000 * 1000);
 BENCHMARK(FastRandom_32bit, 110 * 1000 * 1000);
 BENCHMARK(FastRandom_1bit, 440 * 1000 * 1000);
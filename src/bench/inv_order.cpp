@@ -0,0 +1,114 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <random.h>
+#include <txmempool.h>
+#include <validation.h>
+
+#include <algorithm>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+static const int PEERS = 100;
+static const int POOL_TXS = 2000;
+static const int PEER_TXS = 200;
+
+// A mempool of short chains, and for each peer the transactions waiting to be
+// announced to it.
+static void SetupInvOrder(CTxMemPool& pool, std::vector<std::set<uint256>>& peers)
+{
+    std::vector<uint256> hashes;
+    uint256 prevHash;
+    for (int i = 0; i < POOL_TXS; ++i) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(i % 4 ? prevHash : uint256(), 0);
+        tx.vin[0].scriptSig = CScript() << i;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = COIN;
+        LockPoints lp;
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(MakeTransactionRef(tx), 1000 + i % 7 * 100, 0, 1, false, 4, lp));
+        prevHash = tx.GetHash();
+        hashes.push_back(prevHash);
+    }
+    FastRandomContext rng(true);
+    peers.resize(PEERS);
+    for (std::set<uint256>& peer : peers) {
+        while (peer.size() < PEER_TXS) {
+            peer.insert(hashes[rng.randrange(hashes.size())]);
+        }
+    }
+}
+
+// One iteration is one trickle to every peer: pick the first
+// INVENTORY_BROADCAST_MAX transactions of its inventory in mempool order.
+static void InvOrderCompareInMempool(benchmark::State& state)
+{
+    CTxMemPool pool;
+    std::vector<std::set<uint256>> peers;
+    SetupInvOrder(pool, peers);
+
+    while (state.KeepRunning()) {
+        for (const std::set<uint256>& peer : peers) {
+            std::vector<std::set<uint256>::const_iterator> vInvTx;
+            for (auto it = peer.begin(); it != peer.end(); ++it) {
+                vInvTx.push_back(it);
+            }
+            auto compare = [&pool](std::set<uint256>::const_iterator a, std::set<uint256>::const_iterator b) {
+                return pool.CompareDepthAndScore(*b, *a);
+            };
+            std::make_heap(vInvTx.begin(), vInvTx.end(), compare);
+            for (unsigned int i = 0; i < INVENTORY_BROADCAST_MAX; ++i) {
+                std::pop_heap(vInvTx.begin(), vInvTx.end(), compare);
+                vInvTx.pop_back();
+            }
+        }
+    }
+}
+
+static void InvOrderSharedLookup(benchmark::State& state)
+{
+    CTxMemPool pool;
+    std::vector<std::set<uint256>> peers;
+    SetupInvOrder(pool, peers);
+
+    while (state.KeepRunning()) {
+        std::unordered_map<uint256, DepthAndScore, SaltedTxidHasher> order;
+        for (const std::set<uint256>& peer : peers) {
+            typedef std::pair<DepthAndScore, std::set<uint256>::const_iterator> Candidate;
+            std::vector<Candidate> vInvTx;
+            std::vector<std::set<uint256>::const_iterator> vLookup;
+            for (auto it = peer.begin(); it != peer.end(); ++it) {
+                auto found = order.find(*it);
+                if (found != order.end()) {
+                    vInvTx.emplace_back(found->second, it);
+                } else {
+                    vLookup.push_back(it);
+                }
+            }
+            if (!vLookup.empty()) {
+                LOCK(pool.cs);
+                for (auto it : vLookup) {
+                    DepthAndScore key;
+                    if (pool.GetDepthAndScore(*it, key)) {
+                        order.emplace(*it, key);
+                        vInvTx.emplace_back(key, it);
+                    }
+                }
+            }
+            auto compare = [](const Candidate& a, const Candidate& b) { return b.first < a.first; };
+            std::make_heap(vInvTx.begin(), vInvTx.end(), compare);
+            for (unsigned int i = 0; i < INVENTORY_BROADCAST_MAX; ++i) {
+                std::pop_heap(vInvTx.begin(), vInvTx.end(), compare);
+                vInvTx.pop_back();
+            }
+        }
+    }
+}
+
+BENCHMARK(InvOrderCompareInMempool, 10);
+BENCHMARK(InvOrderSharedLookup, 10);
@@ -0,0 +1,84 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <arith_uint256.h>
+#include <bench/bench.h>
+#include <policy/policy.h>
+#include <txmempool.h>
+#include <validation.h>
+
+#include <vector>
+
+static void AddTx(const CTransactionRef& tx, CTxMemPool& pool)
+{
+    LockPoints lp;
+    pool.addUnchecked(tx->GetHash(), CTxMemPoolEntry(tx, 1000, 0, 1, false, 4, lp));
+}
+
+static CTransactionRef SpendOutputs(const uint256& hash, uint32_t nFirst, uint32_t nInputs, uint32_t nOutputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(nInputs);
+    for (uint32_t i = 0; i < nInputs; i++) {
+        tx.vin[i].prevout = COutPoint(hash, nFirst + i);
+        tx.vin[i].scriptSig = CScript() << OP_1;
+    }
+    tx.vout.resize(nOutputs);
+    for (CTxOut& out : tx.vout) {
+        out.scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        out.nValue = COIN;
+    }
+    return MakeTransactionRef(tx);
+}
+
+// Add 40 chains of 25 transactions, each spending the one before, then
+// remove them again from the root. Every addition and removal walks the
+// ancestors of the transactions involved.
+static void MempoolAncestryChain25(benchmark::State& state)
+{
+    std::vector<std::vector<CTransactionRef>> chains(40);
+    for (size_t i = 0; i < chains.size(); i++) {
+        chains[i].push_back(SpendOutputs(ArithToUint256(arith_uint256(i + 1)), 0, 1, 1));
+        while (chains[i].size() < DEFAULT_ANCESTOR_LIMIT) {
+            chains[i].push_back(SpendOutputs(chains[i].back()->GetHash(), 0, 1, 1));
+        }
+    }
+
+    CTxMemPool pool;
+    LOCK(pool.cs);
+    while (state.KeepRunning()) {
+        for (const auto& chain : chains) {
+            for (const CTransactionRef& tx : chain) {
+                AddTx(tx, pool);
+            }
+        }
+        for (const auto& chain : chains) {
+            pool.removeRecursive(*chain.front());
+        }
+    }
+}
+
+// A transaction with 1000 children in the mempool is disconnected from the
+// chain and re-added, after which its descendants have to be found and
+// updated, and then confirmed again.
+static void MempoolAncestryFanout1000(benchmark::State& state)
+{
+    const CTransactionRef parent = SpendOutputs(uint256S("1"), 0, 1, 1000);
+    CTxMemPool pool;
+    LOCK(pool.cs);
+    for (uint32_t i = 0; i < 1000; i++) {
+        AddTx(SpendOutputs(parent->GetHash(), i, 1, 1), pool);
+    }
+    const std::vector<CTransactionRef> block{parent};
+    const std::vector<uint256> vHashUpdate{parent->GetHash()};
+    while (state.KeepRunning()) {
+        AddTx(parent, pool);
+        pool.UpdateTransactionsFromBlock(vHashUpdate);
+        pool.removeForBlock(block, 2);
+    }
+    assert(pool.size() == 1000);
+}
+
+BENCHMARK(MempoolAncestryChain25, 20);
+BENCHMARK(MempoolAncestryFanout1000, 200);
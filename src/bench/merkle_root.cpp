@@ -0,0 +1,30 @@
+// Copyright (c) 2018-2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+
+#include <uint256.h>
+#include <random.h>
+#include <consensus/merkle.h>
+
+static void MerkleRoot(benchmark::State& state, size_t num_leaves)
+{
+    FastRandomContext rng(true);
+    std::vector<uint256> leaves;
+    leaves.resize(num_leaves);
+    for (auto& item : leaves) {
+        item = rng.rand256();
+    }
+    while (state.KeepRunning()) {
+        bool mutation = false;
+        uint256 hash = ComputeMerkleRoot(std::vector<uint256>(leaves), &mutation);
+        leaves[mutation] = hash;
+    }
+}
+
+static void MerkleRoot_2k(benchmark::State& state) { MerkleRoot(state, 2000); }
+static void MerkleRoot_10k(benchmark::State& state) { MerkleRoot(state, 10000); }
+
+BENCHMARK(MerkleRoot_2k, 3500);
+BENCHMARK(MerkleRoot_10k, 700);
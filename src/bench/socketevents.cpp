@@ -0,0 +1,95 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <random.h>
+#include <socketevents.h>
+#include <util.h>
+
+#include <assert.h>
+#include <memory>
+#include <vector>
+
+#ifndef WIN32
+
+// One iteration is one round of CConnman::ThreadSocketHandler with many idle
+// peers and a single one that has sent something: the peers stay watched, so
+// a round is a wait and reading the pending data of the ready peers.
+// select() is limited to FD_SETSIZE descriptors, so it only runs with 500
+// peers (1000 descriptors); the others also run with 2000.
+static void SocketEventsLoop(benchmark::State& state, SocketEventsMode mode, int peers)
+{
+    RaiseFileDescriptorLimit(2 * peers + 100);
+    std::string error;
+    std::unique_ptr<CSocketEvents> events = CSocketEvents::Make(mode, error);
+    assert(events);
+
+    std::vector<int> local(peers), remote(peers);
+    for (int i = 0; i < peers; ++i) {
+        int fds[2];
+        int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        assert(ret == 0 && events->CanWatch(fds[0]));
+        local[i] = fds[0];
+        remote[i] = fds[1];
+        events->Watch(local[i], i, CSocketEvents::RECV);
+    }
+
+    FastRandomContext rng(true);
+    char c = 0;
+    while (state.KeepRunning()) {
+        const int sender = rng.randrange(peers);
+        ssize_t ret = write(remote[sender], &c, 1);
+        assert(ret == 1);
+
+        events->Wait(1000);
+        int ready = 0;
+        for (const CSocketEvents::Event& event : events->GetReady()) {
+            if (event.events & CSocketEvents::RECV) {
+                ret = read(local[event.id], &c, 1);
+                assert(ret == 1);
+                ++ready;
+            }
+        }
+        assert(ready == 1);
+    }
+
+    for (int i = 0; i < peers; ++i) {
+        close(local[i]);
+        close(remote[i]);
+    }
+}
+
+static void SocketEventsSelect500(benchmark::State& state)
+{
+    SocketEventsLoop(state, SocketEventsMode::SELECT, 500);
+}
+BENCHMARK(SocketEventsSelect500, 2000);
+
+#ifdef USE_POLL
+static void SocketEventsPoll500(benchmark::State& state)
+{
+    SocketEventsLoop(state, SocketEventsMode::POLL, 500);
+}
+static void SocketEventsPoll2000(benchmark::State& state)
+{
+    SocketEventsLoop(state, SocketEventsMode::POLL, 2000);
+}
+BENCHMARK(SocketEventsPoll500, 2000);
+BENCHMARK(SocketEventsPoll2000, 500);
+#endif
+
+#ifdef USE_EPOLL
+static void SocketEventsEpoll500(benchmark::State& state)
+{
+    SocketEventsLoop(state, SocketEventsMode::EPOLL, 500);
+}
+static void SocketEventsEpoll2000(benchmark::State& state)
+{
+    SocketEventsLoop(state, SocketEventsMode::EPOLL, 2000);
+}
+BENCHMARK(SocketEventsEpoll500, 5000);
+BENCHMARK(SocketEventsEpoll2000, 2000);
+#endif
+
+#endif // WIN32
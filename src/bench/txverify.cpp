@@ -0,0 +1,85 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <coins.h>
+#include <key.h>
+#include <policy/policy.h>
+#include <pubkey.h>
+#include <random.h>
+#include <script/interpreter.h>
+#include <script/sigcache.h>
+#include <script/standard.h>
+#include <validation.h>
+#include <util.h>
+
+#include <boost/thread/thread.hpp>
+
+static const size_t NUM_TXS = 2000;
+
+// NUM_TXS independent transactions each spending a P2PKH output in view.
+static std::vector<CTransactionRef> CreateSignedTransactions(CCoinsViewCache& view)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    const CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    FastRandomContext rng(true);
+    std::vector<CTransactionRef> txs;
+    for (size_t i = 0; i < NUM_TXS; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(rng.rand256(), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1000;
+        tx.vout[0].scriptPubKey = scriptPubKey;
+        view.AddCoin(tx.vin[0].prevout, Coin(CTxOut(2000, scriptPubKey), 1, false), false);
+
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 2000, SIGVERSION_BASE);
+        key.Sign(hash, vchSig);
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        tx.vin[0].scriptSig << vchSig << ToByteVector(key.GetPubKey());
+        txs.push_back(MakeTransactionRef(std::move(tx)));
+    }
+    return txs;
+}
+
+// One iteration verifies the scripts of all transactions, without caching
+// anything, on the calling thread only or on the transaction verification
+// threads as well.
+static void VerifyIndependentTransactions(benchmark::State& state, int nThreads)
+{
+    ECCVerifyHandle verify_handle;
+    InitSignatureCache();
+    InitScriptExecutionCache();
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    const std::vector<CTransactionRef> txs = CreateSignedTransactions(view);
+
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(&ThreadTxVerify);
+    std::vector<bool> valid;
+    while (state.KeepRunning()) {
+        LOCK(cs_main);
+        CheckInputsMany(txs, view, STANDARD_SCRIPT_VERIFY_FLAGS, false, valid);
+        assert(std::count(valid.begin(), valid.end(), true) == (int)NUM_TXS);
+    }
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+static void TxVerifySerial(benchmark::State& state)
+{
+    VerifyIndependentTransactions(state, 0);
+}
+
+static void TxVerifyParallel(benchmark::State& state)
+{
+    VerifyIndependentTransactions(state, std::max(1, std::min(GetNumCores() - 1, MAX_TXVERIFY_THREADS)));
+}
+
+BENCHMARK(TxVerifySerial, 10);
+BENCHMARK(TxVerifyParallel, 10);
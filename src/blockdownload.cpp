@@ -0,0 +1,73 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockdownload.h>
+
+#include <validation.h>
+
+#include <algorithm>
+#include <cmath>
+
+/** Weight of the previous average against a new sample, so a peer's speed changing shows within a few blocks. */
+static const int BLOCK_DOWNLOAD_STATS_WEIGHT = 4;
+
+static void UpdateAverage(double& dAverage, double dSample)
+{
+    dAverage += (dSample - dAverage) / BLOCK_DOWNLOAD_STATS_WEIGHT;
+}
+
+void CBlockDownloadStats::Received(size_t nBytes, int64_t nRequestTime, bool fPipelined, int64_t nNow)
+{
+    const double dResponse = std::max<int64_t>(nNow - nRequestTime, 1);
+    if (nSamples == 0) {
+        dBlockBytes = nBytes;
+        dBlockTime = dResponse;
+        dLatency = 0;
+    } else if (fPipelined) {
+        // The peer started on this block when it was done with the previous one.
+        UpdateAverage(dBlockBytes, nBytes);
+        UpdateAverage(dBlockTime, std::max<int64_t>(nNow - std::max(nRequestTime, nLastReceived), 1));
+    } else {
+        // The peer was idle, so the response time is its latency plus the time spent on the block.
+        const double dBlockTimePrev = dBlockTime;
+        UpdateAverage(dBlockBytes, nBytes);
+        UpdateAverage(dBlockTime, std::max(dResponse - dLatency, 1.0));
+        UpdateAverage(dLatency, std::max(dResponse - dBlockTimePrev, 0.0));
+    }
+    nSamples++;
+    nLastReceived = nNow;
+}
+
+int CBlockDownloadStats::GetWindow() const
+{
+    if (!HasSamples()) {
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    }
+    const double dWindow = std::ceil((dLatency + BLOCK_DOWNLOAD_TARGET_QUEUE_TIME) / dBlockTime);
+    return std::max<double>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<double>(MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, dWindow));
+}
+
+double CBlockDownloadStats::GetBandwidth() const
+{
+    return HasSamples() ? dBlockBytes * 1000000 / dBlockTime : 0;
+}
+
+int64_t CBlockDownloadStats::EstimateTime(int nBlocks) const
+{
+    return dLatency + nBlocks * dBlockTime;
+}
+
+int64_t CBlockDownloadStats::EstimateWait(int nPosition, int64_t nDownloadingSince, int64_t nNow) const
+{
+    const int64_t nElapsed = std::max<int64_t>(nNow - nDownloadingSince, 0);
+    if (!HasSamples()) {
+        return nElapsed;
+    }
+    return std::max<int64_t>(nDownloadingSince + (nPosition + 1) * dBlockTime - nNow, nElapsed);
+}
+
+bool ShouldReassignBlock(int64_t nWaitCurrent, int64_t nWaitOther)
+{
+    return nWaitCurrent > nWaitOther * BLOCK_REASSIGN_SPEEDUP && nWaitCurrent - nWaitOther >= BLOCK_REASSIGN_MIN_GAIN;
+}
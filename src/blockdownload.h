@@ -0,0 +1,73 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef STARWELS_BLOCKDOWNLOAD_H
+#define STARWELS_BLOCKDOWNLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Fewest blocks in flight from a peer, however slowly it has delivered them. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 1;
+/** Most blocks in flight from a peer, however quickly it has delivered them. */
+static const int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** Time in microseconds the blocks in flight from a peer should keep it busy for, on top of its latency. */
+static const int64_t BLOCK_DOWNLOAD_TARGET_QUEUE_TIME = 2 * 1000000;
+/** A block in flight is requested from another peer if that one is expected to deliver it this many times sooner... */
+static const int BLOCK_REASSIGN_SPEEDUP = 4;
+/** ...and at least this many microseconds sooner. */
+static const int64_t BLOCK_REASSIGN_MIN_GAIN = 2 * 1000000;
+
+/**
+ * How quickly a peer has been delivering the blocks we asked it for.
+ *
+ * Every requested block that arrives updates moving averages of the block
+ * size, of the time the peer spends sending one block and of the latency
+ * before it starts. A block requested while others were already in flight
+ * from the peer measures the time spent on it since the previous block
+ * arrived. A block requested from an idle peer also measures the round trip.
+ *
+ * The number of blocks to keep in flight from the peer is what it can send
+ * in its latency plus BLOCK_DOWNLOAD_TARGET_QUEUE_TIME, so fast peers are
+ * never left idle and slow ones do not hold on to many blocks.
+ */
+class CBlockDownloadStats
+{
+public:
+    /** Account for a block of nBytes that was requested at nRequestTime, when fPipelined other blocks were in flight from the peer. */
+    void Received(size_t nBytes, int64_t nRequestTime, bool fPipelined, int64_t nNow);
+
+    bool HasSamples() const { return nSamples > 0; }
+    /** Number of blocks to keep in flight from the peer, MAX_BLOCKS_IN_TRANSIT_PER_PEER until it delivered one. */
+    int GetWindow() const;
+    /** Average time in microseconds the peer spends sending one block. */
+    int64_t GetBlockTime() const { return dBlockTime; }
+    /** Average time in microseconds before the peer starts sending a block requested while it is idle. */
+    int64_t GetLatency() const { return dLatency; }
+    /** Bytes per second the peer sends blocks at. */
+    double GetBandwidth() const;
+
+    /** Expected time in microseconds for the peer to deliver nBlocks more blocks if it had nothing in flight. */
+    int64_t EstimateTime(int nBlocks) const;
+    /**
+     * Expected time in microseconds until the block at nPosition in the
+     * peer's queue arrives, the first one having started downloading at
+     * nDownloadingSince. It is never less than the time the peer has
+     * already spent on the queue, so a peer that is late, or that never
+     * delivered anything, looks slower the longer it takes.
+     */
+    int64_t EstimateWait(int nPosition, int64_t nDownloadingSince, int64_t nNow) const;
+
+private:
+    int nSamples = 0;
+    double dBlockBytes = 0;
+    double dBlockTime = 0;
+    double dLatency = 0;
+    int64_t nLastReceived = 0;
+};
+
+/** Whether a block expected from its peer in nWaitCurrent microseconds should rather be requested from a peer expected to deliver it in nWaitOther. */
+bool ShouldReassignBlock(int64_t nWaitCurrent, int64_t nWaitOther);
+
+#endif // STARWELS_BLOCKDOWNLOAD_H
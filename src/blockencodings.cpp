@@ -6,7 +6,10 @@
 #include <consensus/consensus.h>
 #include <consensus/validation.h>
 #include <chainparams.h>
+#include <checkqueue.h>
+#include <core_memusage.h>
 #include <hash.h>
+#include <memusage.h>
 #include <random.h>
 #include <streams.h>
 #include <txmempool.h>
@@ -43,6 +46,57 @@ uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const {
     return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
 }
 
+int nShortIDThreads = 0;
+
+namespace {
+
+typedef std::vector<std::pair<uint256, CTxMemPool::txiter>> TxHashes;
+
+/** Closure matching a range of the mempool against the short IDs of a compact block, run on a short ID thread. */
+class CShortIDMatchCheck
+{
+private:
+    const CBlockHeaderAndShortTxIDs* cmpctblock;
+    const std::unordered_map<uint64_t, uint16_t>* shorttxids;
+    const TxHashes* vTxHashes;
+    size_t nBegin, nEnd;
+    //! The matches, as <index in the block, position in vTxHashes>
+    std::vector<std::pair<uint16_t, size_t>>* vMatches;
+
+public:
+    CShortIDMatchCheck() : cmpctblock(nullptr), shorttxids(nullptr), vTxHashes(nullptr), nBegin(0), nEnd(0), vMatches(nullptr) {}
+    CShortIDMatchCheck(const CBlockHeaderAndShortTxIDs& cmpctblockIn, const std::unordered_map<uint64_t, uint16_t>& shorttxidsIn,
+                       const TxHashes& vTxHashesIn, size_t nBeginIn, size_t nEndIn, std::vector<std::pair<uint16_t, size_t>>& vMatchesIn) :
+        cmpctblock(&cmpctblockIn), shorttxids(&shorttxidsIn), vTxHashes(&vTxHashesIn), nBegin(nBeginIn), nEnd(nEndIn), vMatches(&vMatchesIn) {}
+
+    bool operator()() {
+        for (size_t i = nBegin; i < nEnd; i++) {
+            auto idit = shorttxids->find(cmpctblock->GetShortID((*vTxHashes)[i].first));
+            if (idit != shorttxids->end())
+                vMatches->emplace_back(idit->second, i);
+        }
+        return true;
+    }
+
+    void swap(CShortIDMatchCheck& check) {
+        std::swap(cmpctblock, check.cmpctblock);
+        std::swap(shorttxids, check.shorttxids);
+        std::swap(vTxHashes, check.vTxHashes);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+        std::swap(vMatches, check.vMatches);
+    }
+};
+
+CCheckQueue<CShortIDMatchCheck> shortidqueue(1);
+
+} // namespace
+
+void ThreadShortIDMatch() {
+    RenameThread("starwels-shortid");
+    shortidqueue.Thread();
+}
+
 
 
 ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<std::pair<uint256, CTransactionRef>>& extra_txn) {
@@ -105,29 +159,51 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     {
     LOCK(pool->cs);
     const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
-    for (size_t i = 0; i < vTxHashes.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
-            if (!have_txn[idit->second]) {
-                txn_available[idit->second] = vTxHashes[i].second->GetSharedTx();
-                have_txn[idit->second]  = true;
-                mempool_count++;
-            } else {
-                // If we find two mempool txn that match the short id, just request it.
-                // This should be rare enough that the extra bandwidth doesn't matter,
-                // but eating a round-trip due to FillBlock failure would be annoying
-                if (txn_available[idit->second]) {
-                    txn_available[idit->second].reset();
-                    mempool_count--;
-                }
+    auto MatchMempoolTx = [&](uint16_t index, size_t i) {
+        if (!have_txn[index]) {
+            txn_available[index] = vTxHashes[i].second->GetSharedTx();
+            have_txn[index]  = true;
+            mempool_count++;
+        } else {
+            // If we find two mempool txn that match the short id, just request it.
+            // This should be rare enough that the extra bandwidth doesn't matter,
+            // but eating a round-trip due to FillBlock failure would be annoying
+            if (txn_available[index]) {
+                txn_available[index].reset();
+                mempool_count--;
             }
         }
-        // Though ideally we'd continue scanning for the two-txn-match-shortid case,
-        // the performance win of an early exit here is too good to pass up and worth
-        // the extra risk.
-        if (mempool_count == shorttxids.size())
-            break;
+    };
+    if (nShortIDThreads > 0 && vTxHashes.size() > SHORTID_MATCH_BATCH_SIZE) {
+        // Compute the short IDs of the mempool in batches on the short ID threads,
+        // then go through the matches in mempool order, as the loop below does.
+        const size_t nBatches = (vTxHashes.size() + SHORTID_MATCH_BATCH_SIZE - 1) / SHORTID_MATCH_BATCH_SIZE;
+        std::vector<std::vector<std::pair<uint16_t, size_t>>> vBatchMatches(nBatches);
+        std::vector<CShortIDMatchCheck> vChecks;
+        vChecks.reserve(nBatches);
+        for (size_t i = 0; i < nBatches; i++) {
+            vChecks.emplace_back(cmpctblock, shorttxids, vTxHashes, i * SHORTID_MATCH_BATCH_SIZE,
+                                 std::min<size_t>((i + 1) * SHORTID_MATCH_BATCH_SIZE, vTxHashes.size()), vBatchMatches[i]);
+        }
+        CCheckQueueControl<CShortIDMatchCheck> control(&shortidqueue);
+        control.Add(vChecks);
+        control.Wait();
+        for (const auto& vMatches : vBatchMatches) {
+            for (const auto& match : vMatches)
+                MatchMempoolTx(match.first, match.second);
+        }
+    } else {
+        for (size_t i = 0; i < vTxHashes.size(); i++) {
+            uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
+            std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
+            if (idit != shorttxids.end())
+                MatchMempoolTx(idit->second, i);
+            // Though ideally we'd continue scanning for the two-txn-match-shortid case,
+            // the performance win of an early exit here is too good to pass up and worth
+            // the extra risk.
+            if (mempool_count == shorttxids.size())
+                break;
+        }
     }
     }
 
@@ -216,3 +292,31 @@ ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<
 
     return READ_STATUS_OK;
 }
+
+size_t ExtraTxnsForCompact::TxUsage(const CTransactionRef& tx) const {
+    return RecursiveDynamicUsage(tx) + sizeof(CTransactionRef) + memusage::IncrementalDynamicUsage(setWitnessHashes);
+}
+
+void ExtraTxnsForCompact::EvictOldest() {
+    nTxnsUsage -= TxUsage(txns.front());
+    setWitnessHashes.erase(txns.front()->GetWitnessHash());
+    txns.pop_front();
+}
+
+void ExtraTxnsForCompact::Add(const CTransactionRef& tx) {
+    const size_t nUsage = TxUsage(tx);
+    if (nMaxCount == 0 || nUsage > nMaxUsage)
+        return;
+    if (!setWitnessHashes.insert(tx->GetWitnessHash()).second)
+        return;
+    txns.push_back(tx);
+    nTxnsUsage += nUsage;
+    while (txns.size() > nMaxCount || nTxnsUsage > nMaxUsage)
+        EvictOldest();
+}
+
+void ExtraTxnsForCompact::AppendTo(std::vector<std::pair<uint256, CTransactionRef>>& vTxn) const {
+    vTxn.reserve(vTxn.size() + txns.size());
+    for (const CTransactionRef& tx : txns)
+        vTxn.emplace_back(tx->GetWitnessHash(), tx);
+}
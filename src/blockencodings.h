@@ -7,10 +7,24 @@
 
 #include <primitives/block.h>
 
+#include <deque>
 #include <memory>
+#include <set>
 
 class CTxMemPool;
 
+/** Maximum number of short ID matching threads allowed */
+static const int MAX_SHORTID_THREADS = 16;
+/** -shortidthreads default (number of threads matching compact block short IDs against the mempool) */
+static const int DEFAULT_SHORTID_THREADS = 2;
+/** Number of mempool transactions a short ID thread matches at a time. Smaller mempools are matched serially. */
+static const size_t SHORTID_MATCH_BATCH_SIZE = 4096;
+
+extern int nShortIDThreads;
+
+/** Run an instance of the short ID matching thread */
+void ThreadShortIDMatch();
+
 // Dumb helper to handle CTransaction compression at serialize-time
 struct TransactionCompressor {
 private:
@@ -204,6 +218,45 @@ public:
     ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<std::pair<uint256, CTransactionRef>>& extra_txn);
     bool IsTxAvailable(size_t index) const;
     ReadStatus FillBlock(CBlock& block, const std::vector<CTransactionRef>& vtx_missing);
+
+    size_t GetPrefilledCount() const { return prefilled_count; }
+    //! Transactions found in the mempool, excluding those from extra_txn
+    size_t GetMempoolCount() const { return mempool_count - extra_count; }
+    size_t GetExtraCount() const { return extra_count; }
+    //! Transactions that have to be requested from the peer
+    size_t GetMissingCount() const { return txn_available.size() - prefilled_count - mempool_count; }
+};
+
+/**
+ * Transactions we saw but did not keep in the mempool, such as orphans,
+ * policy rejects and replaced transactions, for compact block
+ * reconstruction to find those that get mined anyway without a
+ * getblocktxn round trip. The oldest are evicted first, once there are more
+ * than nMaxCount of them or once their memory usage exceeds nMaxUsage.
+ */
+class ExtraTxnsForCompact {
+private:
+    const size_t nMaxCount;
+    const size_t nMaxUsage;
+    std::deque<CTransactionRef> txns;
+    std::set<uint256> setWitnessHashes;
+    size_t nTxnsUsage = 0;
+
+    //! Memory used by tx and its entries in txns and setWitnessHashes
+    size_t TxUsage(const CTransactionRef& tx) const;
+    void EvictOldest();
+
+public:
+    ExtraTxnsForCompact(size_t nMaxCountIn, size_t nMaxUsageIn) : nMaxCount(nMaxCountIn), nMaxUsage(nMaxUsageIn) {}
+
+    /** Add tx, unless it is already there or too big to ever fit. */
+    void Add(const CTransactionRef& tx);
+    /** Append the transactions to vTxn, in the <witness hash, reference> form InitData takes. */
+    void AppendTo(std::vector<std::pair<uint256, CTransactionRef>>& vTxn) const;
+
+    size_t size() const { return txns.size(); }
+    size_t DynamicMemoryUsage() const { return nTxnsUsage; }
+    size_t GetMaxUsage() const { return nMaxUsage; }
 };
 
 #endif
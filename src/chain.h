@@ -160,6 +160,10 @@ enum BlockStatus: uint32_t {
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 
     BLOCK_OPT_WITNESS       =   128, //!< block data in blk*.data was received with a witness-enforcing client
+
+    //! Below the base of a loaded UTXO snapshot: validity up to TRANSACTIONS
+    //! is taken from the snapshot, and the scripts were never checked.
+    BLOCK_ASSUMED_VALID     =   256,
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -186,6 +186,9 @@ public:
                         //   (the tx=... number in the SetBestChain debug.log lines)
             3.5         // * estimated number of transactions per second after that timestamp
         };
+
+        // Base heights and hashes of the UTXO snapshots loadtxoutset accepts.
+        m_assumeutxo_data = MapAssumeutxo{};
     }
 };
 
@@ -277,6 +280,9 @@ public:
             3.5         // * estimated number of transactions per second after that timestamp
         };
 
+        // Base heights and hashes of the UTXO snapshots loadtxoutset accepts.
+        m_assumeutxo_data = MapAssumeutxo{};
+
     }
 };
 
@@ -347,6 +353,9 @@ public:
             0
         };
 
+        // Base heights and hashes of the UTXO snapshots loadtxoutset accepts.
+        m_assumeutxo_data = MapAssumeutxo{};
+
         base58Prefixes[PUBKEY_ADDRESS] = std::vector<unsigned char>(1,111);
         base58Prefixes[SCRIPT_ADDRESS] = std::vector<unsigned char>(1,196);
         base58Prefixes[SECRET_KEY] =     std::vector<unsigned char>(1,239);
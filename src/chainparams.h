@@ -25,6 +25,16 @@ struct CCheckpointData {
     MapCheckpoints mapCheckpoints;
 };
 
+/** The UTXO set a snapshot based at some height must hold to be loaded */
+struct AssumeutxoData {
+    //! Same value as gettxoutsetinfo's hash_serialized_2 at that height
+    uint256 hash_serialized;
+    //! Number of transactions in the chain up to and including that block
+    uint64_t nChainTx;
+};
+
+typedef std::map<int, AssumeutxoData> MapAssumeutxo;
+
 struct ChainTxData {
     int64_t nTime;
     int64_t nTxCount;
@@ -72,6 +82,8 @@ public:
     const std::vector<SeedSpec6>& FixedSeeds() const { return vFixedSeeds; }
     const CCheckpointData& Checkpoints() const { return checkpointData; }
     const ChainTxData& TxData() const { return chainTxData; }
+    /** UTXO snapshots that may be loaded, by the height of their base block */
+    const MapAssumeutxo& Assumeutxo() const { return m_assumeutxo_data; }
     void UpdateVersionBitsParameters(Consensus::DeploymentPos d, int64_t nStartTime, int64_t nTimeout);
 protected:
     CChainParams() {}
@@ -91,6 +103,7 @@ protected:
     bool fMineBlocksOnDemand;
     CCheckpointData checkpointData;
     ChainTxData chainTxData;
+    MapAssumeutxo m_assumeutxo_data;
 };
 
 /**
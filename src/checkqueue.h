@@ -8,6 +8,9 @@
 #include <sync.h>
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <vector>
 
 #include <boost/thread/condition_variable.hpp>
@@ -25,13 +28,33 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker owns a deque of pending verifications, and the master
+  * spreads new work over them round-robin. A worker takes batches from the
+  * front of its own deque and, once that is empty, steals from the back of
+  * the others. Each deque has its own lock, so workers normally only
+  * contend with an occasional thief; the shared state is kept in atomics,
+  * and the single mutex is only taken by threads going to sleep or waking
+  * sleepers up.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
-    boost::mutex mutex;
+    //! Maximum number of distinct deques. Additional workers share them.
+    static const unsigned int MAX_SLOTS = 64;
+
+    //! A worker's deque of verifications, and the lock protecting it.
+    struct Slot {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
+    //! Slot 0 belongs to the master, slot i > 0 to the i'th registered worker.
+    std::vector<std::unique_ptr<Slot>> slots;
+
+    //! Mutex used only to sleep on the condition variables below
+    boost::mutex mutexIdle;
 
     //! Worker threads block on this when out of work
     boost::condition_variable condWorker;
@@ -39,88 +62,89 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! The number of worker threads (excluding the master) that ever started.
+    std::atomic<unsigned int> nWorkers;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of workers (excluding the master) that are sleeping.
+    std::atomic<int> nIdle;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! Slot that receives the next added verification.
+    unsigned int nNextSlot;
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
-     * This includes elements that are no longer queued, but still in the
-     * worker's own batches.
+     * This includes elements that are no longer queued, but still in a
+     * worker's own batch.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
+
+    //! Number of verifications still sitting in one of the deques.
+    std::atomic<int> nQueued;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
-    /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    /** Number of slots that Add spreads work over. */
+    unsigned int ActiveSlots() const
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
+        return std::min(nWorkers.load() + 1, (unsigned int)MAX_SLOTS);
+    }
+
+    /**
+     * Move up to nBatchSize verifications into vChecks, preferring the
+     * front of our own deque and otherwise stealing half of another one
+     * from the back.
+     */
+    void Take(unsigned int nSlot, std::vector<T>& vChecks)
+    {
+        const unsigned int nSlots = ActiveSlots();
+        for (unsigned int i = 0; i < nSlots; i++) {
+            const bool fOwn = i == 0;
+            Slot& slot = *slots[(nSlot + i) % nSlots];
+            boost::unique_lock<boost::mutex> lock(slot.mutex);
+            if (slot.queue.empty())
+                continue;
+            // Leave part of our own deque for thieves too, so all workers
+            // finish approximately simultaneously.
+            const unsigned int nAvail = slot.queue.size();
+            const unsigned int nNow = std::max(1U, std::min(nBatchSize, fOwn ? nAvail / 2 : (nAvail + 1) / 2));
+            vChecks.resize(nNow);
+            for (T& check : vChecks) {
+                // Swap jobs out of the deque instead of copying, to keep
+                // the lock short.
+                if (fOwn) {
+                    check.swap(slot.queue.front());
+                    slot.queue.pop_front();
                 } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if (fMaster && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
+                    check.swap(slot.queue.back());
+                    slot.queue.pop_back();
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
             }
-            // execute work
-            for (T& check : vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
-        } while (true);
+            nQueued -= nNow;
+            return;
+        }
+    }
+
+    /** Run a batch, destroy it, and only then mark it as completed. */
+    void Process(std::vector<T>& vChecks)
+    {
+        // Check whether we need to do work at all
+        bool fOk = fAllOk;
+        for (T& check : vChecks)
+            if (fOk)
+                fOk = check();
+        const unsigned int nNow = vChecks.size();
+        vChecks.clear();
+        if (!fOk)
+            fAllOk = false;
+        if (nTodo.fetch_sub(nNow) == nNow) {
+            // We processed the last element; inform the master it can exit and return the result
+            boost::unique_lock<boost::mutex> lock(mutexIdle);
+            condMaster.notify_one();
+        }
     }
 
 public:
@@ -128,33 +152,85 @@ public:
     boost::mutex ControlMutex;
 
     //! Create a new check queue
-    explicit CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), nBatchSize(nBatchSizeIn) {}
+    explicit CCheckQueue(unsigned int nBatchSizeIn) : nWorkers(0), nIdle(0), nNextSlot(0), fAllOk(true), nTodo(0), nQueued(0), nBatchSize(nBatchSizeIn)
+    {
+        slots.reserve(MAX_SLOTS);
+        for (unsigned int i = 0; i < MAX_SLOTS; i++)
+            slots.emplace_back(new Slot);
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        const unsigned int nSlot = 1 + nWorkers++ % (MAX_SLOTS - 1);
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        while (true) {
+            Take(nSlot, vChecks);
+            if (!vChecks.empty()) {
+                Process(vChecks);
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutexIdle);
+            // Add increments nQueued before checking nIdle, and we increment
+            // nIdle before checking nQueued, so one of us sees the other.
+            nIdle++;
+            if (nQueued == 0)
+                condWorker.wait(lock);
+            nIdle--;
+        }
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        while (true) {
+            Take(0, vChecks);
+            if (!vChecks.empty()) {
+                Process(vChecks);
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutexIdle);
+            if (nTodo == 0)
+                break;
+            if (nQueued == 0)
+                condMaster.wait(lock);
+        }
+        bool fRet = fAllOk;
+        // reset the status for new work later
+        fAllOk = true;
+        // return the current status
+        return fRet;
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        for (T& check : vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        nQueued += vChecks.size();
+        const unsigned int nSlots = ActiveSlots();
+        const unsigned int nFirst = nNextSlot % nSlots;
+        const unsigned int nUsed = std::min<size_t>(nSlots, vChecks.size());
+        for (unsigned int i = 0; i < nUsed; i++) {
+            Slot& slot = *slots[(nFirst + i) % nSlots];
+            boost::unique_lock<boost::mutex> lock(slot.mutex);
+            for (size_t j = i; j < vChecks.size(); j += nSlots) {
+                slot.queue.emplace_back();
+                vChecks[j].swap(slot.queue.back());
+            }
+        }
+        nNextSlot = (nFirst + vChecks.size()) % nSlots;
+        if (nIdle > 0) {
+            boost::unique_lock<boost::mutex> lock(mutexIdle);
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
     }
 
     ~CCheckQueue()
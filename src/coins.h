@@ -104,6 +104,7 @@ struct CCoinsCacheEntry
 {
     Coin coin; // The actual cached data.
     unsigned char flags;
+    uint32_t epoch; // The owning cache's access epoch when this entry was last used.
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
@@ -115,8 +116,8 @@ struct CCoinsCacheEntry
          */
     };
 
-    CCoinsCacheEntry() : flags(0) {}
-    explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0) {}
+    CCoinsCacheEntry() : flags(0), epoch(0) {}
+    explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0), epoch(0) {}
 };
 
 typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
@@ -164,8 +165,9 @@ public:
     virtual std::vector<uint256> GetHeadBlocks() const;
 
     //! Do a bulk modification (multiple Coin changes + BestBlock change).
-    //! The passed mapCoins can be modified.
-    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! The passed mapCoins can be modified, unless erase is false, in which
+    //! case its entries are copied rather than moved out and it is left intact.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase = true);
 
     //! Get a cursor to iterate over the whole state
     virtual CCoinsViewCursor *Cursor() const;
@@ -191,12 +193,23 @@ public:
     uint256 GetBestBlock() const override;
     std::vector<uint256> GetHeadBlocks() const override;
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase = true) override;
     CCoinsViewCursor *Cursor() const override;
     size_t EstimateSize() const override;
 };
 
 
+/** Counters describing how well a CCoinsViewCache serves its lookups. */
+struct CCoinsCacheStats
+{
+    //! Lookups answered from the cache
+    uint64_t hits = 0;
+    //! Lookups passed on to the backing view
+    uint64_t misses = 0;
+    //! Unmodified entries dropped by Evict()
+    uint64_t evictions = 0;
+};
+
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
 class CCoinsViewCache : public CCoinsViewBacked
 {
@@ -211,6 +224,10 @@ protected:
     /* Cached dynamic memory usage for the inner Coin objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Stamped on entries as they are used; advanced by every Evict(). */
+    uint32_t cacheEpoch;
+    mutable CCoinsCacheStats cacheStats;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
 
@@ -224,7 +241,7 @@ public:
     bool HaveCoin(const COutPoint &outpoint) const override;
     uint256 GetBestBlock() const override;
     void SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase = true) override;
     CCoinsViewCursor* Cursor() const override {
         throw std::logic_error("CCoinsViewCache cursor iteration not supported.");
     }
@@ -254,6 +271,15 @@ public:
      */
     void AddCoin(const COutPoint& outpoint, Coin&& coin, bool potential_overwrite);
 
+    /**
+     * Insert a coin that was read from the backing view outside of this
+     * cache (e.g. by a prefetch thread), exactly as if a lookup had fetched
+     * it. The coin must be what the backing view currently returns for the
+     * outpoint. Returns false, leaving the cache untouched, if the outpoint
+     * is already cached.
+     */
+    bool PopulateCoin(const COutPoint& outpoint, Coin&& coin);
+
     /**
      * Spend a coin. Pass moveto in order to get the deleted data.
      * If no unspent output exists for the passed outpoint, this call
@@ -268,6 +294,31 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base, like Flush(),
+     * but keep the unspent entries cached (now unmodified) so lookups keep
+     * hitting them. Spent entries are dropped.
+     * If false is returned, the state of this cache (and its backing view) will be undefined.
+     */
+    bool Sync();
+
+    /**
+     * Drop unmodified entries until DynamicMemoryUsage() is at most
+     * nTargetUsage. Entries not used since the previous call and holding
+     * coins created below nYoungHeight go first, then any not used since
+     * the previous call, then any unmodified entry. Modified entries are
+     * never dropped, so call Sync() first to make them eligible.
+     */
+    void Evict(size_t nTargetUsage, int nYoungHeight);
+
+    /**
+     * Move all entries out of the cache, leaving it as empty as Flush() would,
+     * without writing them to the base. The caller is responsible for getting
+     * them to the base, and must make them visible to lookups through it in
+     * the meantime.
+     */
+    CCoinsMap Detach();
+
     /**
      * Removes the UTXO with the given outpoint from the cache, if it is
      * not modified.
@@ -280,6 +331,9 @@ public:
     //! Calculate the size of the cache (in bytes)
     size_t DynamicMemoryUsage() const;
 
+    //! Lookup and eviction counters since this cache was created
+    const CCoinsCacheStats& GetStats() const { return cacheStats; }
+
     /** 
      * Amount of starwelss coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
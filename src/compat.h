@@ -45,9 +45,18 @@
 #include <ifaddrs.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <unistd.h>
 #endif
 
+#ifndef WIN32
+// poll() has no FD_SETSIZE limit, so use it wherever it is available.
+#define USE_POLL
+#endif
+#ifdef __linux__
+#define USE_EPOLL
+#endif
+
 #ifndef WIN32
 typedef unsigned int SOCKET;
 #include <errno.h>
@@ -439,6 +439,24 @@ public:
         }
     }
 
+    /** get_elements returns every element that is not marked for garbage
+     * collection, oldest epoch first, e.g. so that the cache can be written
+     * out and restored later with insert().
+     *
+     * Like setup, get_elements must not run concurrently with insert.
+     */
+    std::vector<Element> get_elements() const
+    {
+        std::vector<Element> elements;
+        for (bool epoch : {false, true}) {
+            for (uint32_t i = 0; i < size; ++i) {
+                if (!collection_flags.bit_is_set(i) && epoch_flags[i] == epoch)
+                    elements.push_back(table[i]);
+            }
+        }
+        return elements;
+    }
+
     /* contains iterates through the hash locations for a given element
      * and checks to see if it is present.
      *
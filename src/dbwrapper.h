@@ -18,6 +18,8 @@
 
 static const size_t DBWRAPPER_PREALLOC_KEY_SIZE = 64;
 static const size_t DBWRAPPER_PREALLOC_VALUE_SIZE = 1024;
+//! Table file size used when bulk loading an empty database
+static const size_t DBWRAPPER_BULK_MAX_FILE_SIZE = 32 << 20;
 
 class dbwrapper_error : public std::runtime_error
 {
@@ -217,8 +219,10 @@ public:
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
+     * @param[in] bulk_load   If true, tune leveldb for ingesting a large amount of data
+     *                        into an empty database.
      */
-    CDBWrapper(const fs::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const fs::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, bool bulk_load = false);
     ~CDBWrapper();
 
     template <typename K, typename V>
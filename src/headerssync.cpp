@@ -0,0 +1,241 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <headerssync.h>
+
+#include <arith_uint256.h>
+#include <pow.h>
+#include <validation.h>
+
+#include <algorithm>
+#include <assert.h>
+
+CHeadersSegments::CHeadersSegments(const CCheckpointData& checkpoints, const Consensus::Params& consensusIn, unsigned int nMaxPeersIn) :
+    mapCheckpoints(checkpoints.mapCheckpoints), consensus(consensusIn), nMaxPeers(nMaxPeersIn)
+{
+    for (auto it = mapCheckpoints.begin(); it != mapCheckpoints.end() && std::next(it) != mapCheckpoints.end(); ++it) {
+        Segment segment;
+        segment.nStartHeight = it->first;
+        segment.hashStart = it->second;
+        segment.nEndHeight = std::next(it)->first;
+        segment.hashEnd = std::next(it)->second;
+        vSegments.push_back(segment);
+    }
+}
+
+int CHeadersSegments::Segment::CursorHeight() const
+{
+    int nHeight = nStartHeight;
+    for (const Batch& batch : batches) {
+        nHeight += batch.headers.size();
+    }
+    return nHeight;
+}
+
+const uint256& CHeadersSegments::Segment::Cursor() const
+{
+    return batches.empty() ? hashStart : batches.back().hashes.back();
+}
+
+bool CHeadersSegments::CheckDifficulty(int nBaseHeight, uint32_t nBaseBits, int nHeight, const std::vector<CBlockHeader>& headers) const
+{
+    for (const CBlockHeader& header : headers) {
+        arith_uint256 bnTarget;
+        arith_uint256 bnEasiest;
+        bnTarget.SetCompact(header.nBits);
+        bnEasiest.SetCompact(GetEasiestWorkAfter(nBaseHeight, nBaseBits, nHeight, consensus));
+        if (bnTarget > bnEasiest) {
+            return false;
+        }
+        nBaseHeight = nHeight++;
+        nBaseBits = header.nBits;
+    }
+    return true;
+}
+
+void CHeadersSegments::Unbuffer(const Batch& batch)
+{
+    nBuffered -= batch.headers.size();
+    auto it = mapPeerBuffered.find(batch.peer);
+    assert(it != mapPeerBuffered.end() && it->second >= batch.headers.size());
+    it->second -= batch.headers.size();
+    if (it->second == 0) {
+        mapPeerBuffered.erase(it);
+    }
+}
+
+void CHeadersSegments::Rewind(Segment& segment, size_t nBatch)
+{
+    if (nBatch >= segment.batches.size()) return;
+    for (size_t i = nBatch; i < segment.batches.size(); i++) {
+        Unbuffer(segment.batches[i]);
+        segment.setFailed.insert(segment.batches[i].peer);
+    }
+    segment.batches.erase(segment.batches.begin() + nBatch, segment.batches.end());
+    // Any answer on its way no longer continues the segment.
+    segment.peer = -1;
+}
+
+bool CHeadersSegments::Assign(NodeId peer, int nBestHeaderHeight, uint32_t nBestHeaderBits, int nPeerHeight, int64_t nNow, Request& request)
+{
+    unsigned int nAssigned = 0;
+    for (Segment& segment : vSegments) {
+        if (segment.peer == -1) continue;
+        if (segment.peer == peer) return false;
+        if (nNow > segment.nRequestTime + HEADERS_SEGMENT_TIMEOUT) {
+            segment.setFailed.insert(segment.peer);
+            segment.peer = -1;
+            continue;
+        }
+        nAssigned++;
+    }
+    if (nAssigned >= nMaxPeers || nBuffered >= MAX_HEADERS_SEGMENTS_BUFFERED || GetBuffered(peer) >= MAX_HEADERS_SEGMENTS_BUFFERED_PER_PEER) {
+        return false;
+    }
+
+    for (Segment& segment : vSegments) {
+        if (segment.nEndHeight > nPeerHeight || segment.setFailed.count(peer)) continue;
+        if (segment.fRequeued) {
+            // The answer connects to the headers chain, and is followed up on there.
+            segment.setFailed.insert(peer);
+            request.hashLocator = segment.hashStart;
+            request.hashStop = segment.hashEnd;
+            return true;
+        }
+        if (segment.nStartHeight <= nBestHeaderHeight) continue;
+        if (segment.peer != -1 || segment.CursorHeight() == segment.nEndHeight) continue;
+        segment.peer = peer;
+        segment.nRequestTime = nNow;
+        if (segment.nStartBits == 0) {
+            segment.nBaseHeight = nBestHeaderHeight;
+            segment.nBaseBits = nBestHeaderBits;
+        }
+        request.hashLocator = segment.Cursor();
+        request.hashStop = segment.hashEnd;
+        return true;
+    }
+    return false;
+}
+
+CHeadersSegments::Result CHeadersSegments::Receive(NodeId peer, const std::vector<CBlockHeader>& headers, const std::vector<uint256>& hashes, int64_t nNow, Request& request)
+{
+    assert(headers.size() == hashes.size());
+    request = Request();
+    for (Segment& segment : vSegments) {
+        if (segment.peer != peer) continue;
+        if (headers.empty() || headers[0].hashPrevBlock != segment.Cursor()) {
+            return Result::UNRELATED;
+        }
+
+        const int nCursorHeight = segment.CursorHeight();
+        const int nHeight = nCursorHeight + headers.size();
+        int nBaseHeight = segment.nBaseHeight;
+        uint32_t nBaseBits = segment.nBaseBits;
+        if (!segment.batches.empty()) {
+            nBaseHeight = nCursorHeight;
+            nBaseBits = segment.batches.back().headers.back().nBits;
+        } else if (segment.nStartBits != 0) {
+            nBaseHeight = segment.nStartHeight;
+            nBaseBits = segment.nStartBits;
+        }
+        if (nHeight > segment.nEndHeight || (nHeight == segment.nEndHeight && hashes.back() != segment.hashEnd) ||
+            !CheckDifficulty(nBaseHeight, nBaseBits, nCursorHeight + 1, headers)) {
+            // What the peer sent for the segment before leads nowhere either.
+            for (size_t i = 0; i < segment.batches.size(); i++) {
+                if (segment.batches[i].peer == peer) {
+                    Rewind(segment, i);
+                    break;
+                }
+            }
+            segment.setFailed.insert(peer);
+            segment.peer = -1;
+            return Result::INVALID;
+        }
+
+        if (segment.batches.empty() || segment.batches.back().peer != peer) {
+            segment.batches.push_back(Batch{peer, {}, {}});
+        }
+        Batch& batch = segment.batches.back();
+        batch.headers.insert(batch.headers.end(), headers.begin(), headers.end());
+        batch.hashes.insert(batch.hashes.end(), hashes.begin(), hashes.end());
+        nBuffered += headers.size();
+        mapPeerBuffered[peer] += headers.size();
+
+        if (nHeight == segment.nEndHeight) {
+            segment.peer = -1;
+            // The difficulty at the start of the next segment is known now.
+            for (Segment& next : vSegments) {
+                if (next.fRequeued || next.nStartHeight != segment.nEndHeight) continue;
+                next.nStartBits = headers.back().nBits;
+                if (!next.batches.empty() && !CheckDifficulty(next.nStartHeight, next.nStartBits, next.nStartHeight + 1, next.batches[0].headers)) {
+                    Rewind(next, 0);
+                }
+            }
+        } else if (headers.size() < MAX_HEADERS_RESULTS) {
+            // The peer has nothing more, so it is not on the chain leading to the checkpoint.
+            segment.setFailed.insert(peer);
+            segment.peer = -1;
+        } else if (nBuffered >= MAX_HEADERS_SEGMENTS_BUFFERED || GetBuffered(peer) >= MAX_HEADERS_SEGMENTS_BUFFERED_PER_PEER) {
+            // Pick up from here once the headers chain took some, or with another peer.
+            segment.peer = -1;
+        } else {
+            segment.nRequestTime = nNow;
+            request.hashLocator = segment.Cursor();
+            request.hashStop = segment.hashEnd;
+        }
+        return Result::ACCEPTED;
+    }
+    return Result::UNRELATED;
+}
+
+bool CHeadersSegments::TakeConnectable(const std::function<bool(const uint256&)>& fKnown, std::vector<Batch>& batches)
+{
+    for (auto it = vSegments.begin(); it != vSegments.end(); ++it) {
+        // A requeued segment is done with once the headers chain got past it.
+        if (!fKnown(it->fRequeued ? it->hashEnd : it->hashStart)) continue;
+        batches = std::move(it->batches);
+        for (const Batch& batch : batches) {
+            Unbuffer(batch);
+        }
+        vSegments.erase(it);
+        return true;
+    }
+    return false;
+}
+
+void CHeadersSegments::Requeue(NodeId peer, int nHeight, const uint256& hash)
+{
+    auto itEnd = mapCheckpoints.upper_bound(nHeight);
+    if (itEnd == mapCheckpoints.end()) return;
+    Segment segment;
+    segment.nStartHeight = nHeight;
+    segment.hashStart = hash;
+    segment.nEndHeight = itEnd->first;
+    segment.hashEnd = itEnd->second;
+    segment.setFailed.insert(peer);
+    segment.fRequeued = true;
+    auto it = std::find_if(vSegments.begin(), vSegments.end(), [&](const Segment& other) { return other.nStartHeight > nHeight; });
+    vSegments.insert(it, segment);
+}
+
+void CHeadersSegments::Release(NodeId peer)
+{
+    for (Segment& segment : vSegments) {
+        if (segment.peer == peer) segment.peer = -1;
+    }
+}
+
+bool CHeadersSegments::IsAssigned(NodeId peer) const
+{
+    for (const Segment& segment : vSegments) {
+        if (segment.peer == peer) return true;
+    }
+    return false;
+}
+
+size_t CHeadersSegments::GetBuffered(NodeId peer) const
+{
+    auto it = mapPeerBuffered.find(peer);
+    return it == mapPeerBuffered.end() ? 0 : it->second;
+}
@@ -0,0 +1,143 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef STARWELS_HEADERSSYNC_H
+#define STARWELS_HEADERSSYNC_H
+
+#include <chainparams.h>
+#include <consensus/params.h>
+#include <net.h>
+#include <primitives/block.h>
+#include <uint256.h>
+
+#include <functional>
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+/** Default for -maxheaderspeers, the number of peers to download headers segments from. */
+static const unsigned int DEFAULT_MAX_HEADERS_PEERS = 4;
+/** Number of downloaded headers kept in memory until the headers chain reaches them, at most. */
+static const size_t MAX_HEADERS_SEGMENTS_BUFFERED = 200000;
+/** Number of those headers that come from a single peer, at most. */
+static const size_t MAX_HEADERS_SEGMENTS_BUFFERED_PER_PEER = MAX_HEADERS_SEGMENTS_BUFFERED / DEFAULT_MAX_HEADERS_PEERS;
+/** Time in microseconds after which a segment whose request went unanswered is handed to another peer. */
+static const int64_t HEADERS_SEGMENT_TIMEOUT = 60 * 1000000;
+
+/**
+ * Stretches of the headers chain between consecutive checkpoints, downloaded
+ * from other peers while the headers sync is still below them.
+ *
+ * As both ends of a segment are known, its headers can be requested before
+ * anything preceding it is known, and checked to link up, to have valid
+ * proof of work, to end at the right checkpoint and to be no easier to mine
+ * than the chain could have become since the start of the segment, or the
+ * tip of the headers chain if that is not known yet. They are kept in memory
+ * until the headers chain reaches the start of the segment, and are then
+ * validated in full by ProcessNewBlockHeaders.
+ */
+class CHeadersSegments
+{
+public:
+    /** A getheaders message to send to a peer. */
+    struct Request {
+        uint256 hashLocator;
+        uint256 hashStop;
+    };
+
+    /** Consecutive headers received from one peer. */
+    struct Batch {
+        NodeId peer;
+        std::vector<CBlockHeader> headers;
+        std::vector<uint256> hashes;
+    };
+
+    enum class Result {
+        UNRELATED, //!< Not a response to a segment request
+        ACCEPTED,
+        INVALID,   //!< Does not lead to the checkpoint ending the segment, or too easy to mine
+    };
+
+    CHeadersSegments(const CCheckpointData& checkpoints, const Consensus::Params& consensusIn, unsigned int nMaxPeersIn);
+
+    /**
+     * Give peer, which claims a chain of nPeerHeight, the lowest segment
+     * above the headers chain, whose tip is at nBestHeaderHeight with
+     * nBestHeaderBits, that nobody is downloading. Returns false if there is
+     * none or enough peers are at it already.
+     */
+    bool Assign(NodeId peer, int nBestHeaderHeight, uint32_t nBestHeaderBits, int nPeerHeight, int64_t nNow, Request& request);
+
+    /**
+     * Keep headers (hashes being their hashes) if they continue the segment
+     * requested from peer. If more of it should be requested, request is set,
+     * otherwise request.hashLocator is null.
+     */
+    Result Receive(NodeId peer, const std::vector<CBlockHeader>& headers, const std::vector<uint256>& hashes, int64_t nNow, Request& request);
+
+    /**
+     * Remove a segment whose start fKnown, and take the headers downloaded for
+     * it. Returns false if the headers chain reached no segment.
+     */
+    bool TakeConnectable(const std::function<bool(const uint256&)>& fKnown, std::vector<Batch>& batches);
+
+    /**
+     * Download again what is left of a segment up to the checkpoint
+     * following nHeight, the height of hash, after the headers that peer
+     * sent for it turned out invalid.
+     */
+    void Requeue(NodeId peer, int nHeight, const uint256& hash);
+
+    /** Stop downloading from peer, e.g. because it disconnected. */
+    void Release(NodeId peer);
+
+    bool IsAssigned(NodeId peer) const;
+    size_t GetBuffered() const { return nBuffered; }
+    size_t GetBuffered(NodeId peer) const;
+    size_t GetSegmentCount() const { return vSegments.size(); }
+
+private:
+    struct Segment {
+        int nStartHeight;
+        uint256 hashStart;
+        int nEndHeight;
+        uint256 hashEnd;
+        std::vector<Batch> batches;
+        NodeId peer = -1;
+        int64_t nRequestTime = 0;
+        //! Peers that could not, or would not, provide the rest of the segment,
+        //! or that were asked for it once requeued
+        std::set<NodeId> setFailed;
+        //! Difficulty of the start checkpoint once known, or zero
+        uint32_t nStartBits = 0;
+        //! Block below the start that the difficulty is bounded from until then
+        int nBaseHeight = 0;
+        uint32_t nBaseBits = 0;
+        //! Handed out again after its headers turned out invalid. Its start is
+        //! known, so the answers go to the headers chain directly.
+        bool fRequeued = false;
+
+        int CursorHeight() const;
+        const uint256& Cursor() const;
+    };
+
+    /**
+     * Whether headers, the first of which is at nHeight, are no easier to mine
+     * than the chain could have become since the block at nBaseHeight with nBaseBits.
+     */
+    bool CheckDifficulty(int nBaseHeight, uint32_t nBaseBits, int nHeight, const std::vector<CBlockHeader>& headers) const;
+    /** Drop the headers of segment from batch nBatch onwards, and ask their senders no more. */
+    void Rewind(Segment& segment, size_t nBatch);
+    void Unbuffer(const Batch& batch);
+
+    std::vector<Segment> vSegments;
+    const MapCheckpoints mapCheckpoints;
+    const Consensus::Params& consensus;
+    const unsigned int nMaxPeers;
+    size_t nBuffered = 0;
+    std::map<NodeId, size_t> mapPeerBuffered;
+};
+
+#endif // STARWELS_HEADERSSYNC_H
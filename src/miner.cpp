@@ -45,6 +45,8 @@
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockWeight = 0;
 
+std::unique_ptr<BlockTemplateBuilder> g_template_builder;
+
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     int64_t nOldTime = pblock->nTime;
@@ -149,7 +151,11 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     int nPackagesSelected = 0;
     int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    if (mempool.IsClusterTracking()) {
+        addChunkTxs(nPackagesSelected);
+    } else {
+        addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    }
 
     int64_t nTime1 = GetTimeMicros();
 
@@ -438,6 +444,231 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
     }
 }
 
+// Chunks of every cluster are sorted by feerate and each depends only on the
+// chunks of its cluster before it, so walking them best first yields
+// transactions in an order they can be mined in. Once a chunk does not fit,
+// the rest of its cluster is skipped, as it may depend on that chunk.
+void BlockAssembler::addChunkTxs(int &nPackagesSelected)
+{
+    std::set<uint64_t> failedClusters;
+
+    // Limit the number of attempts to add chunks to the block when it is
+    // close to full; this is just a simple heuristic to finish quickly if the
+    // mempool has a lot of entries.
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    for (const CTxMemPool::TxChunk& chunk : mempool.GetChunks()) {
+        if (failedClusters.count(chunk.nCluster)) {
+            continue;
+        }
+
+        if (chunk.nModFees < blockMinFeeRate.GetFee(chunk.nSize)) {
+            // Everything else we might consider has a lower fee rate
+            return;
+        }
+
+        int64_t nChunkSigOpsCost = 0;
+        for (const CTxMemPool::txiter it : chunk.vTxs) {
+            nChunkSigOpsCost += it->GetSigOpCost();
+        }
+        const CTxMemPool::setEntries package(chunk.vTxs.begin(), chunk.vTxs.end());
+        if (!TestPackage(chunk.nSize, nChunkSigOpsCost) || !TestPackageTransactions(package)) {
+            failedClusters.insert(chunk.nCluster);
+            ++nConsecutiveFailed;
+
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockWeight >
+                    nBlockMaxWeight - 4000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
+            }
+            continue;
+        }
+
+        nConsecutiveFailed = 0;
+        for (const CTxMemPool::txiter it : chunk.vTxs) {
+            AddToBlock(it);
+        }
+        ++nPackagesSelected;
+    }
+}
+
+BlockTemplateBuilder::BlockTemplateBuilder(const CChainParams& params) : chainparams(params), fActive(false),
+    pindexPrev(nullptr), fMineWitnessTxLast(false), fIncludeWitness(false), fStale(true), fImprovable(false), fCoinbaseDirty(false),
+    nBuildTime(0), nHeight(0), nLockTimeCutoff(0), nBlockWeight(0), nBlockSigOpsCost(0), nFees(0)
+{
+    // Use the limits BlockAssembler applies to its defaults
+    const BlockAssembler::Options options = DefaultOptions(params);
+    blockMinFeeRate = options.blockMinFeeRate;
+    nBlockMaxWeight = std::max<size_t>(4000, std::min<size_t>(MAX_BLOCK_WEIGHT - 4000, options.nBlockMaxWeight));
+}
+
+void BlockTemplateBuilder::Build(bool fMineWitnessTx)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs);
+    int64_t nTimeStart = GetTimeMicros();
+
+    fStale = true;
+    pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(CScript() << OP_TRUE, fMineWitnessTx);
+    pindexPrev = chainActive.Tip();
+    fMineWitnessTxLast = fMineWitnessTx;
+    fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus()) && fMineWitnessTx;
+    nHeight = pindexPrev->nHeight + 1;
+    nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                       ? pindexPrev->GetMedianTimePast()
+                       : pblocktemplate->block.GetBlockTime();
+
+    // Same accounting as BlockAssembler, which reserves room for the coinbase
+    const CBlock& block = pblocktemplate->block;
+    nBlockWeight = 4000;
+    nBlockSigOpsCost = 400;
+    nFees = -pblocktemplate->vTxFees[0];
+    setTxids.clear();
+    setSpent.clear();
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        nBlockWeight += GetTransactionWeight(*block.vtx[i]);
+        nBlockSigOpsCost += pblocktemplate->vTxSigOpsCost[i];
+        setTxids.insert(block.vtx[i]->GetHash());
+        for (const CTxIn& txin : block.vtx[i]->vin) {
+            setSpent.insert(txin.prevout);
+        }
+    }
+
+    fStale = false;
+    fImprovable = false;
+    fCoinbaseDirty = false;
+    nBuildTime = GetTime();
+    stats.nBuilds++;
+    stats.nLastBuildTime = GetTimeMicros() - nTimeStart;
+}
+
+void BlockTemplateBuilder::AppendTransaction(CTxMemPool::txiter it)
+{
+    const CTransaction& tx = it->GetTx();
+    if (setTxids.count(tx.GetHash())) {
+        return;
+    }
+    // Transactions that would not be mined on a new template either
+    if (it->GetModifiedFee() < blockMinFeeRate.GetFee(it->GetTxSize()) ||
+        !IsFinalTx(tx, nHeight, nLockTimeCutoff) ||
+        (!fIncludeWitness && tx.HasWitness())) {
+        return;
+    }
+    // Transactions that spend an output of a transaction left out, or a
+    // conflict, or do not fit: a new template may do better.
+    for (const CTxIn& txin : tx.vin) {
+        if (setSpent.count(txin.prevout) ||
+            (!setTxids.count(txin.prevout.hash) && !pcoinsTip->HaveCoin(txin.prevout))) {
+            fImprovable = true;
+            return;
+        }
+    }
+    if (nBlockWeight + WITNESS_SCALE_FACTOR * it->GetTxSize() >= nBlockMaxWeight ||
+        nBlockSigOpsCost + it->GetSigOpCost() >= MAX_BLOCK_SIGOPS_COST) {
+        fImprovable = true;
+        return;
+    }
+
+    pblocktemplate->block.vtx.emplace_back(it->GetSharedTx());
+    pblocktemplate->vTxFees.push_back(it->GetFee());
+    pblocktemplate->vTxSigOpsCost.push_back(it->GetSigOpCost());
+    nBlockWeight += it->GetTxWeight();
+    nBlockSigOpsCost += it->GetSigOpCost();
+    nFees += it->GetFee();
+    setTxids.insert(tx.GetHash());
+    for (const CTxIn& txin : tx.vin) {
+        setSpent.insert(txin.prevout);
+    }
+    fCoinbaseDirty = true;
+    nLastBlockTx = pblocktemplate->block.vtx.size() - 1;
+    nLastBlockWeight = nBlockWeight;
+}
+
+void BlockTemplateBuilder::UpdateCoinbase()
+{
+    // The coinbase built by CreateNewBlock has a single output, followed by
+    // the witness commitment if there is one; that depends on all
+    // transactions, so it is generated again.
+    CBlock& block = pblocktemplate->block;
+    CMutableTransaction coinbaseTx(*block.vtx[0]);
+    coinbaseTx.vin[0].scriptWitness.SetNull();
+    coinbaseTx.vout.resize(1);
+    coinbaseTx.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
+    block.vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
+    pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(block, pindexPrev, chainparams.GetConsensus());
+    pblocktemplate->vTxFees[0] = -nFees;
+    fCoinbaseDirty = false;
+}
+
+std::unique_ptr<CBlockTemplate> BlockTemplateBuilder::GetTemplate(bool fMineWitnessTx)
+{
+    int64_t nTimeStart = GetTimeMicros();
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    fActive = true;
+
+    if (!pblocktemplate || fStale || pindexPrev != chainActive.Tip() || fMineWitnessTx != fMineWitnessTxLast ||
+        (fImprovable && GetTime() - nBuildTime > TEMPLATE_REBUILD_INTERVAL)) {
+        Build(fMineWitnessTx);
+    } else if (fCoinbaseDirty) {
+        UpdateCoinbase();
+    }
+
+    std::unique_ptr<CBlockTemplate> result(new CBlockTemplate(*pblocktemplate));
+    stats.nLastGetTime = GetTimeMicros() - nTimeStart;
+    return result;
+}
+
+BlockTemplateBuilder::Stats BlockTemplateBuilder::GetStats() const
+{
+    LOCK(cs);
+    return stats;
+}
+
+void BlockTemplateBuilder::UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload)
+{
+    // Notifications are queued, so this may be about a tip the template
+    // was already built on; GetTemplate checks the tip itself anyway.
+    LOCK(cs);
+    if (pindexNew != pindexPrev) {
+        fStale = true;
+    }
+}
+
+void BlockTemplateBuilder::TransactionAddedToMempool(const CTransactionRef& ptx)
+{
+    // Nothing to keep up to date until someone asks for a template
+    if (!fActive) {
+        return;
+    }
+    int64_t nTimeStart = GetTimeMicros();
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+    if (!pblocktemplate || fStale || pindexPrev != chainActive.Tip()) {
+        return;
+    }
+    // The transaction may have left the mempool again since
+    CTxMemPool::txiter it = mempool.mapTx.find(ptx->GetHash());
+    if (it == mempool.mapTx.end()) {
+        return;
+    }
+    const size_t nTxs = pblocktemplate->block.vtx.size();
+    AppendTransaction(it);
+    if (pblocktemplate->block.vtx.size() != nTxs) {
+        stats.nUpdates++;
+        stats.nLastUpdateTime = GetTimeMicros() - nTimeStart;
+    }
+}
+
+void BlockTemplateBuilder::TransactionRemovedFromMempool(const CTransactionRef& ptx)
+{
+    LOCK(cs);
+    if (setTxids.count(ptx->GetHash())) {
+        fStale = true;
+    }
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -7,8 +7,11 @@
 #define STARWELS_MINER_H
 
 #include <primitives/block.h>
+#include <sync.h>
 #include <txmempool.h>
+#include <validationinterface.h>
 
+#include <atomic>
 #include <stdint.h>
 #include <memory>
 #include <boost/multi_index_container.hpp>
@@ -21,6 +24,8 @@ class CScript;
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Seconds before a block template that new transactions could improve is assembled again */
+static const int64_t TEMPLATE_REBUILD_INTERVAL = 5;
 
 struct CBlockTemplate
 {
@@ -170,6 +175,10 @@ private:
       * Increments nPackagesSelected / nDescendantsUpdated with corresponding
       * statistics from the package selection (for logging statistics). */
     void addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated);
+    /** Add transactions chunk by chunk from the mempool's cluster
+      * linearizations, best feerate first. Increments nPackagesSelected with
+      * the number of chunks added. */
+    void addChunkTxs(int &nPackagesSelected);
 
     // helper functions for addPackageTxs()
     /** Remove confirmed (inBlock) entries from given set */
@@ -192,6 +201,75 @@ private:
     int UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
 };
 
+/**
+ * Keeps a block template on the current tip up to date with the mempool, so
+ * that getblocktemplate hands out a copy of it instead of assembling a block
+ * on every call. A transaction entering the mempool is appended to the
+ * template if it fits and spends only confirmed outputs or outputs of
+ * transactions already in the template. The template is assembled from
+ * scratch again on a new tip, when one of its transactions leaves the
+ * mempool, and, every TEMPLATE_REBUILD_INTERVAL seconds at most, when a
+ * transaction could not be appended.
+ *
+ * Appended transactions go at the end in the order they arrived, not by
+ * feerate. While the block has room this only matters for the order, but
+ * once it is full a better transaction is left out until the next rebuild,
+ * so the template is only as good as a full one as of its last rebuild.
+ */
+class BlockTemplateBuilder : public CValidationInterface
+{
+public:
+    struct Stats {
+        uint64_t nBuilds = 0;           //!< Templates assembled from scratch
+        int64_t nLastBuildTime = 0;     //!< Microseconds taken to assemble the last of them
+        uint64_t nUpdates = 0;          //!< Transactions appended to templates
+        int64_t nLastUpdateTime = 0;    //!< Microseconds taken to append the last of them
+        int64_t nLastGetTime = 0;       //!< Microseconds taken to hand out the last template
+    };
+
+    explicit BlockTemplateBuilder(const CChainParams& params);
+
+    /** Return a copy of the template on the current tip, paying to OP_TRUE
+     *  like getblocktemplate's, assembling it first if needed. */
+    std::unique_ptr<CBlockTemplate> GetTemplate(bool fMineWitnessTx);
+    Stats GetStats() const;
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload) override;
+    void TransactionAddedToMempool(const CTransactionRef& ptx) override;
+    void TransactionRemovedFromMempool(const CTransactionRef& ptx) override;
+
+private:
+    void Build(bool fMineWitnessTx);
+    void AppendTransaction(CTxMemPool::txiter it);
+    void UpdateCoinbase();
+
+    const CChainParams& chainparams;
+    CFeeRate blockMinFeeRate;
+    size_t nBlockMaxWeight;
+    std::atomic<bool> fActive;          //!< Whether a template was ever requested
+
+    mutable CCriticalSection cs;
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    const CBlockIndex* pindexPrev;
+    bool fMineWitnessTxLast;
+    bool fIncludeWitness;
+    bool fStale;                        //!< Whether the template must be assembled again
+    bool fImprovable;                   //!< Whether a transaction could not be appended
+    bool fCoinbaseDirty;                //!< Whether the coinbase misses appended fees
+    int64_t nBuildTime;
+    int nHeight;
+    int64_t nLockTimeCutoff;
+    uint64_t nBlockWeight;
+    int64_t nBlockSigOpsCost;
+    CAmount nFees;
+    std::set<uint256> setTxids;         //!< Transactions in the template
+    std::set<COutPoint> setSpent;       //!< Outputs they spend
+    Stats stats;
+};
+
+extern std::unique_ptr<BlockTemplateBuilder> g_template_builder;
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
@@ -43,6 +43,11 @@
 // We add a random period time (0 to 1 seconds) to feeler connections to prevent synchronization.
 #define FEELER_SLEEP_WINDOW 1
 
+/** How long the socket handler waits for events if nothing can wake it up early, in milliseconds. */
+static const int64_t SOCKET_POLL_TIMEOUT_MILLISECONDS = 50;
+/** How long it waits if it can be woken up; this only paces disconnection cleanup and inactivity checks. */
+static const int64_t SOCKET_WAIT_TIMEOUT_MILLISECONDS = 1000;
+
 #if !defined(HAVE_MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -449,6 +454,11 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
         CloseSocket(hSocket);
         return nullptr;
     }
+    if (m_socket_events && !m_socket_events->CanWatch(hSocket)) {
+        LogPrintf("Cannot create connection: socket not usable with -socketevents=%s\n", SocketEventsModeToString(m_socket_events_mode));
+        CloseSocket(hSocket);
+        return nullptr;
+    }
 
     // Add node
     NodeId id = GetNewNodeId();
@@ -710,6 +720,8 @@ void CNode::copyStats(CNodeStats &stats)
         LOCK(cs_vRecv);
         X(mapRecvBytesPerMsgCmd);
         X(nRecvBytes);
+        X(nRecvBufferAllocs);
+        X(nRecvBufferReuses);
     }
     X(fWhitelisted);
 
@@ -744,19 +756,33 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
     nRecvBytes += nBytes;
     while (nBytes > 0) {
 
-        // get current incomplete message, or create a new one
+        // get current incomplete message, or a processed one to reuse, or create a new one
         if (vRecvMsg.empty() ||
-            vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION));
+            vRecvMsg.back().complete()) {
+            {
+                LOCK(cs_recvPool);
+                if (!vRecvPool.empty()) {
+                    vRecvMsg.splice(vRecvMsg.end(), vRecvPool, vRecvPool.begin());
+                    nRecvBufferReuses++;
+                }
+            }
+            if (vRecvMsg.empty() || vRecvMsg.back().complete()) {
+                vRecvMsg.emplace_back(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+                nRecvBufferAllocs++;
+            }
+        }
 
         CNetMessage& msg = vRecvMsg.back();
 
         // absorb network data
         int handled;
+        const size_t nCapacity = msg.vRecv.capacity();
         if (!msg.in_data)
             handled = msg.readHeader(pch, nBytes);
         else
             handled = msg.readData(pch, nBytes);
+        if (msg.vRecv.capacity() != nCapacity)
+            nRecvBufferAllocs++;
 
         if (handled < 0)
             return false;
@@ -814,31 +840,61 @@ int CNode::GetSendVersion() const
 }
 
 
+void CNode::RecycleMessages(std::list<CNetMessage>& msgs)
+{
+    for (CNetMessage& msg : msgs) {
+        msg.Reset(INIT_PROTO_VERSION);
+    }
+    LOCK(cs_recvPool);
+    while (!msgs.empty() && vRecvPool.size() < MAX_POOLED_RECV_MESSAGES) {
+        if (msgs.front().vRecv.capacity() <= MAX_POOLED_RECV_BUFFER_SIZE)
+            vRecvPool.splice(vRecvPool.end(), msgs, msgs.begin());
+        else
+            msgs.pop_front();
+    }
+    msgs.clear();
+}
+
+
+void CNetMessage::Reset(int nVersionIn)
+{
+    hasher.Reset();
+    data_hash.SetNull();
+    in_data = false;
+    nHdrPos = 0;
+    vRecv.clear();
+    vRecv.SetVersion(nVersionIn);
+    nDataPos = 0;
+    nTime = 0;
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     memcpy(&hdrbuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
     // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    }
-    catch (const std::exception&) {
-        return -1;
-    }
+    memcpy(hdr.pchMessageStart, hdrbuf, CMessageHeader::MESSAGE_START_SIZE);
+    memcpy(hdr.pchCommand, hdrbuf + CMessageHeader::MESSAGE_START_SIZE, CMessageHeader::COMMAND_SIZE);
+    hdr.nMessageSize = ReadLE32((const unsigned char*)hdrbuf + CMessageHeader::MESSAGE_SIZE_OFFSET);
+    memcpy(hdr.pchChecksum, hdrbuf + CMessageHeader::CHECKSUM_OFFSET, CMessageHeader::CHECKSUM_SIZE);
 
     // reject messages larger than MAX_SIZE
     if (hdr.nMessageSize > MAX_SIZE)
         return -1;
 
+    // The announced size is only a hint until the data arrives, so do not
+    // allocate more than RECV_BUFFER_READAHEAD of it up front.
+    vRecv.reserve(std::min(hdr.nMessageSize, RECV_BUFFER_READAHEAD));
+
     // switch state to reading message data
     in_data = true;
 
@@ -850,13 +906,14 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+    if (vRecv.capacity() < nDataPos + nCopy) {
+        // Double the buffer, so that large messages are copied a few times
+        // only, but never beyond the total message size.
+        vRecv.reserve(std::min<size_t>(hdr.nMessageSize, std::max<size_t>(nDataPos + nCopy, 2 * vRecv.capacity())));
     }
 
     hasher.Write((const unsigned char*)pch, nCopy);
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -885,7 +942,7 @@ size_t CConnman::SocketSendData(CNode *pnode) const
     size_t nSentSize = 0;
 
     while (it != pnode->vSendMsg.end()) {
-        const auto &data = *it;
+        const auto &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = 0;
         {
@@ -1104,7 +1161,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!m_socket_events->CanWatch(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1147,16 +1204,134 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
+    WakeSocketHandler(pnode);
+}
+
+void CConnman::UpdateSocketEvents(CNode* pnode)
+{
+    // Implement the following logic:
+    // * If there is data to send, wait for sending data. As this only
+    //   happens when optimistic write failed, we choose to first drain the
+    //   write buffer in this case before receiving more. This avoids
+    //   needlessly queueing received data, if the remote peer is not themselves
+    //   receiving data. This means properly utilizing TCP flow control signalling.
+    // * Otherwise, if there is space left in the receive buffer, wait for
+    //   receiving data.
+    // * Hand off all complete messages to the processor, to be handled without
+    //   blocking here.
+    // Errors are reported either way. Whoever changes one of these
+    // conditions while we wait calls WakeSocketHandler(pnode).
+
+    bool select_recv = !pnode->fPauseRecv;
+    bool select_send;
+    {
+        LOCK(pnode->cs_vSend);
+        select_send = !pnode->vSendMsg.empty();
+    }
+
+    LOCK(pnode->cs_hSocket);
+    if (pnode->hSocket == INVALID_SOCKET) {
+        m_socket_events->Unwatch(pnode->GetId());
+        return;
+    }
+    m_socket_events->Watch(pnode->hSocket, pnode->GetId(), select_send ? CSocketEvents::SEND : select_recv ? CSocketEvents::RECV : 0);
+}
+
+void CConnman::ServiceSocket(CNode* pnode, uint8_t events)
+{
+    //
+    // Receive
+    //
+    const bool recvSet = events & CSocketEvents::RECV;
+    const bool sendSet = events & CSocketEvents::SEND;
+    const bool errorSet = events & CSocketEvents::ERR;
+    if (recvSet || errorSet)
+    {
+        // typical socket buffer is 8K-64K
+        char pchBuf[0x10000];
+        int nBytes = 0;
+        {
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET)
+                return;
+            nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        }
+        if (nBytes > 0)
+        {
+            bool notify = false;
+            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
+                pnode->CloseSocketDisconnect();
+            RecordBytesRecv(nBytes);
+            if (notify) {
+                size_t nSizeAdded = 0;
+                auto it(pnode->vRecvMsg.begin());
+                for (; it != pnode->vRecvMsg.end(); ++it) {
+                    if (!it->complete())
+                        break;
+                    nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
+                }
+                {
+                    LOCK(pnode->cs_vProcessMsg);
+                    pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
+                    pnode->nProcessQueueSize += nSizeAdded;
+                    pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
+                }
+                WakeMessageHandler(pnode->GetId());
+            }
+        }
+        else if (nBytes == 0)
+        {
+            // socket closed gracefully
+            if (!pnode->fDisconnect) {
+                LogPrint(BCLog::NET, "socket closed\n");
+            }
+            pnode->CloseSocketDisconnect();
+        }
+        else if (nBytes < 0)
+        {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            {
+                if (!pnode->fDisconnect)
+                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                pnode->CloseSocketDisconnect();
+            }
+        }
+    }
+
+    //
+    // Send
+    //
+    if (sendSet)
+    {
+        LOCK(pnode->cs_vSend);
+        size_t nBytes = SocketSendData(pnode);
+        if (nBytes) {
+            RecordBytesSent(nBytes);
+        }
+    }
 }
 
 void CConnman::ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastHousekeeping = 0;
     while (!interruptNet)
     {
+        // Going over every node is left to at most every
+        // SOCKET_POLL_TIMEOUT_MILLISECONDS, so that a wakeup only costs as
+        // much as the nodes it is about.
+        const int64_t nNow = GetTimeMillis();
+        const bool fHousekeeping = nNow - nLastHousekeeping >= SOCKET_POLL_TIMEOUT_MILLISECONDS;
+        if (fHousekeeping) {
+            nLastHousekeeping = nNow;
+        }
+
         //
         // Disconnect nodes
         //
+        if (fHousekeeping)
         {
             LOCK(cs_vNodes);
             // Disconnect unused nodes
@@ -1173,6 +1348,8 @@ void CConnman::ThreadSocketHandler()
 
                     // close socket and cleanup
                     pnode->CloseSocketDisconnect();
+                    m_socket_events->Unwatch(pnode->GetId());
+                    m_socket_nodes.erase(pnode->GetId());
 
                     // hold in disconnected pool until all refs are released
                     pnode->Release();
@@ -1218,240 +1395,145 @@ void CConnman::ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        for (const ListenSocket& hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+        for (size_t i = 0; i < vhListenSocket.size(); ++i) {
+            m_socket_events->Watch(vhListenSocket[i].socket, -1 - (int64_t)i, CSocketEvents::RECV);
         }
 
+        // Only the nodes that asked to be reconsidered, besides those serviced
+        // below, may wait for other events than last time.
+        std::vector<CNode*> vDirty;
         {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodes)
-            {
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is space left in the receive buffer, select() for
-                //   receiving data.
-                // * Hand off all complete messages to the processor, to be handled without
-                //   blocking here.
-
-                bool select_recv = !pnode->fPauseRecv;
-                bool select_send;
-                {
-                    LOCK(pnode->cs_vSend);
-                    select_send = !pnode->vSendMsg.empty();
-                }
-
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                if (select_send) {
-                    FD_SET(pnode->hSocket, &fdsetSend);
-                    continue;
-                }
-                if (select_recv) {
-                    FD_SET(pnode->hSocket, &fdsetRecv);
-                }
+            std::lock_guard<std::mutex> lock(m_socket_dirty_mutex);
+            vDirty.swap(m_socket_dirty);
+            for (CNode* pnode : vDirty)
+                pnode->fSocketDirty = false;
+        }
+        for (CNode* pnode : vDirty)
+        {
+            // Disconnected nodes are out of vNodes, or about to be.
+            if (!pnode->fDisconnect) {
+                m_socket_nodes[pnode->GetId()] = pnode;
+                UpdateSocketEvents(pnode);
             }
+            pnode->Release();
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        // Without a way to be woken up, poll for changes to the conditions above.
+        const int64_t nTimeout = m_socket_events->CanInterrupt() ? SOCKET_WAIT_TIMEOUT_MILLISECONDS : SOCKET_POLL_TIMEOUT_MILLISECONDS;
+        bool fWaitOk = m_socket_events->Wait(nTimeout);
         if (interruptNet)
             return;
 
-        if (nSelect == SOCKET_ERROR)
+        if (!fWaitOk)
         {
-            if (have_fds)
+            if (!m_socket_nodes.empty() || !vhListenSocket.empty())
             {
                 int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                LogPrintf("socket %s error %s\n", SocketEventsModeToString(m_socket_events_mode), NetworkErrorString(nErr));
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
+            if (!interruptNet.sleep_for(std::chrono::milliseconds(SOCKET_POLL_TIMEOUT_MILLISECONDS)))
                 return;
         }
 
         //
-        // Accept new connections
+        // Accept new connections, and service each socket that is ready
         //
-        for (const ListenSocket& hListenSocket : vhListenSocket)
+        for (const CSocketEvents::Event& event : m_socket_events->GetReady())
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                AcceptConnection(hListenSocket);
+            if (interruptNet)
+                return;
+
+            if (event.id < 0) {
+                if (event.events & CSocketEvents::RECV)
+                    AcceptConnection(vhListenSocket[-1 - event.id]);
+                continue;
             }
+            auto it = m_socket_nodes.find(event.id);
+            if (it == m_socket_nodes.end())
+                continue;
+            ServiceSocket(it->second, event.events);
+            UpdateSocketEvents(it->second);
         }
 
         //
-        // Service each socket
+        // Inactivity checking
         //
-        std::vector<CNode*> vNodesCopy;
+        if (fHousekeeping)
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy)
-                pnode->AddRef();
-        }
-        for (CNode* pnode : vNodesCopy)
-        {
-            if (interruptNet)
-                return;
-
-            //
-            // Receive
-            //
-            bool recvSet = false;
-            bool sendSet = false;
-            bool errorSet = false;
-            {
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-                sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-                errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
-            }
-            if (recvSet || errorSet)
+            int64_t nTime = GetSystemTimeInSeconds();
+            for (CNode* pnode : vNodes)
             {
-                // typical socket buffer is 8K-64K
-                char pchBuf[0x10000];
-                int nBytes = 0;
+                if (nTime - pnode->nTimeConnected > 60)
                 {
-                    LOCK(pnode->cs_hSocket);
-                    if (pnode->hSocket == INVALID_SOCKET)
-                        continue;
-                    nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                }
-                if (nBytes > 0)
-                {
-                    bool notify = false;
-                    if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
-                        pnode->CloseSocketDisconnect();
-                    RecordBytesRecv(nBytes);
-                    if (notify) {
-                        size_t nSizeAdded = 0;
-                        auto it(pnode->vRecvMsg.begin());
-                        for (; it != pnode->vRecvMsg.end(); ++it) {
-                            if (!it->complete())
-                                break;
-                            nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
-                        }
-                        {
-                            LOCK(pnode->cs_vProcessMsg);
-                            pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
-                            pnode->nProcessQueueSize += nSizeAdded;
-                            pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
-                        }
-                        WakeMessageHandler();
+                    if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+                    {
+                        LogPrint(BCLog::NET, "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->GetId());
+                        pnode->fDisconnect = true;
                     }
-                }
-                else if (nBytes == 0)
-                {
-                    // socket closed gracefully
-                    if (!pnode->fDisconnect) {
-                        LogPrint(BCLog::NET, "socket closed\n");
+                    else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+                    {
+                        LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+                        pnode->fDisconnect = true;
                     }
-                    pnode->CloseSocketDisconnect();
-                }
-                else if (nBytes < 0)
-                {
-                    // error
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                    else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+                    {
+                        LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+                        pnode->fDisconnect = true;
+                    }
+                    else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+                    {
+                        LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+                        pnode->fDisconnect = true;
+                    }
+                    else if (!pnode->fSuccessfullyConnected)
                     {
-                        if (!pnode->fDisconnect)
-                            LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                        pnode->CloseSocketDisconnect();
+                        LogPrintf("version handshake timeout from %d\n", pnode->GetId());
+                        pnode->fDisconnect = true;
                     }
                 }
             }
+        }
+    }
+}
 
-            //
-            // Send
-            //
-            if (sendSet)
-            {
-                LOCK(pnode->cs_vSend);
-                size_t nBytes = SocketSendData(pnode);
-                if (nBytes) {
-                    RecordBytesSent(nBytes);
-                }
-            }
+void CConnman::WakeSocketHandler()
+{
+    if (m_socket_events) {
+        m_socket_events->Interrupt();
+    }
+}
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetSystemTimeInSeconds();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint(BCLog::NET, "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->GetId());
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-                else if (!pnode->fSuccessfullyConnected)
-                {
-                    LogPrintf("version handshake timeout from %d\n", pnode->GetId());
-                    pnode->fDisconnect = true;
-                }
-            }
-        }
-        {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodesCopy)
-                pnode->Release();
-        }
+void CConnman::WakeSocketHandler(CNode* pnode)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_socket_dirty_mutex);
+        if (pnode->fSocketDirty)
+            return;
+        pnode->fSocketDirty = true;
+        pnode->AddRef();
+        m_socket_dirty.push_back(pnode);
     }
+    WakeSocketHandler();
 }
 
 void CConnman::WakeMessageHandler()
 {
-    {
-        std::lock_guard<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = true;
+    std::lock_guard<std::mutex> lock(mutexMsgProc);
+    for (const auto& shard : m_msgproc_shards) {
+        shard->fWake = true;
+        shard->cond.notify_one();
     }
-    condMsgProc.notify_one();
+}
+
+void CConnman::WakeMessageHandler(NodeId id)
+{
+    std::lock_guard<std::mutex> lock(mutexMsgProc);
+    if (m_msgproc_shards.empty())
+        return;
+    MessageHandlerShard& shard = *m_msgproc_shards[id % m_msgproc_shards.size()];
+    shard.fWake = true;
+    shard.cond.notify_one();
 }
 
 
@@ -1991,18 +2073,25 @@ void CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
+    WakeSocketHandler(pnode);
 }
 
-void CConnman::ThreadMessageHandler()
+void CConnman::ThreadMessageHandler(size_t nShard)
 {
+    // The shards are not changed while their threads run
+    const size_t nShards = m_msgproc_shards.size();
+    MessageHandlerShard& shard = *m_msgproc_shards[nShard];
+
     while (!flagInterruptMsgProc)
     {
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
+            for (CNode* pnode : vNodes) {
+                if (pnode->GetId() % nShards != nShard)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
@@ -2036,9 +2125,9 @@ void CConnman::ThreadMessageHandler()
 
         std::unique_lock<std::mutex> lock(mutexMsgProc);
         if (!fMoreWork) {
-            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this] { return fMsgProcWake; });
+            shard.cond.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [&shard] { return shard.fWake; });
         }
-        fMsgProcWake = false;
+        shard.fWake = false;
     }
 }
 
@@ -2069,6 +2158,13 @@ bool CConnman::BindListenPort(const CService &addrBind, std::string& strError, b
         LogPrintf("%s\n", strError);
         return false;
     }
+    if (!m_socket_events->CanWatch(hListenSocket))
+    {
+        strError = strprintf("Error: Socket for incoming connections not usable with -socketevents=%s", SocketEventsModeToString(m_socket_events_mode));
+        LogPrintf("%s\n", strError);
+        CloseSocket(hListenSocket);
+        return false;
+    }
 #ifndef WIN32
     // Allow binding if the port is still in TIME_WAIT state after
     // the program was closed and restarted.
@@ -2203,6 +2299,7 @@ CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) : nSeed0(nSeed0In), nSe
     nLastNodeId = 0;
     nSendBufferMaxSize = 0;
     nReceiveFloodSize = 0;
+    nMessageHandlerThreads = 1;
     flagInterruptMsgProc = false;
     SetTryNewOutboundPeer(false);
 
@@ -2261,6 +2358,18 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         nMaxOutboundCycleStartTime = 0;
     }
 
+    std::string strError;
+    m_socket_events = CSocketEvents::Make(m_socket_events_mode, strError);
+    if (!m_socket_events) {
+        if (clientInterface) {
+            clientInterface->ThreadSafeMessageBox(
+                strprintf(_("Cannot wait for network events with %s: %s"), SocketEventsModeToString(m_socket_events_mode), strError),
+                "", CClientUIInterface::MSG_ERROR);
+        }
+        return false;
+    }
+    LogPrintf("Using %s to wait for network events\n", SocketEventsModeToString(m_socket_events_mode));
+
     if (fListen && !InitBinds(connOptions.vBinds, connOptions.vWhiteBinds)) {
         if (clientInterface) {
             clientInterface->ThreadSafeMessageBox(
@@ -2331,7 +2440,10 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
 
     {
         std::unique_lock<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = false;
+        assert(m_msgproc_shards.empty());
+        for (int i = 0; i < nMessageHandlerThreads; i++) {
+            m_msgproc_shards.push_back(MakeUnique<MessageHandlerShard>());
+        }
     }
 
     // Send and receive from sockets, accept connections
@@ -2357,7 +2469,10 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         threadOpenConnections = std::thread(&TraceThread<std::function<void()> >, "opencon", std::function<void()>(std::bind(&CConnman::ThreadOpenConnections, this, connOptions.m_specified_outgoing)));
 
     // Process messages
-    threadMessageHandler = std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (size_t i = 0; i < m_msgproc_shards.size(); i++) {
+        m_msgproc_shards[i]->thread = std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this, i)));
+    }
 
     // Dump network addresses
     scheduler.scheduleEvery(std::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL * 1000);
@@ -2385,10 +2500,13 @@ void CConnman::Interrupt()
     {
         std::lock_guard<std::mutex> lock(mutexMsgProc);
         flagInterruptMsgProc = true;
+        for (const auto& shard : m_msgproc_shards) {
+            shard->cond.notify_all();
+        }
     }
-    condMsgProc.notify_all();
 
     interruptNet();
+    WakeSocketHandler();
     InterruptSocks5(true);
 
     if (semOutbound) {
@@ -2406,8 +2524,15 @@ void CConnman::Interrupt()
 
 void CConnman::Stop()
 {
-    if (threadMessageHandler.joinable())
-        threadMessageHandler.join();
+    // No other thread changes the shards until they are destroyed below
+    for (const auto& shard : m_msgproc_shards) {
+        if (shard->thread.joinable())
+            shard->thread.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutexMsgProc);
+        m_msgproc_shards.clear();
+    }
     if (threadOpenConnections.joinable())
         threadOpenConnections.join();
     if (threadOpenAddedConnections.joinable())
@@ -2423,6 +2548,10 @@ void CConnman::Stop()
         fAddressesInitialized = false;
     }
 
+    // The nodes are deleted below, whatever references these hold.
+    m_socket_dirty.clear();
+    m_socket_nodes.clear();
+
     // Close sockets
     for (CNode* pnode : vNodes)
         pnode->CloseSocketDisconnect();
@@ -2704,6 +2833,8 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nLastRecv = 0;
     nSendBytes = 0;
     nRecvBytes = 0;
+    nRecvBufferAllocs = 0;
+    nRecvBufferReuses = 0;
     nTimeOffset = 0;
     addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
     nVersion = 0;
@@ -2799,21 +2930,33 @@ bool CConnman::NodeFullyConnected(const CNode* pnode)
     return pnode && pnode->fSuccessfullyConnected && !pnode->fDisconnect;
 }
 
-void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
+CSharedNetMsg::CSharedNetMsg(CSerializedNetMsg&& msg) : command(std::move(msg.command))
 {
-    size_t nMessageSize = msg.data.size();
-    size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
-    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
-
     std::vector<unsigned char> serializedHeader;
     serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
-    uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
-    CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
+    uint256 hash = Hash(msg.data.data(), msg.data.data() + msg.data.size());
+    CMessageHeader hdr(Params().MessageStart(), command.c_str(), msg.data.size());
     memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
 
     CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
 
+    header = std::make_shared<const std::vector<unsigned char>>(std::move(serializedHeader));
+    data = std::make_shared<const std::vector<unsigned char>>(std::move(msg.data));
+}
+
+void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
+{
+    PushMessage(pnode, CSharedNetMsg(std::move(msg)));
+}
+
+void CConnman::PushMessage(CNode* pnode, const CSharedNetMsg& msg)
+{
+    size_t nMessageSize = msg.data->size();
+    size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
+    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
+
     size_t nBytesSent = 0;
+    bool fWakeSocketHandler = false;
     {
         LOCK(pnode->cs_vSend);
         bool optimisticSend(pnode->vSendMsg.empty());
@@ -2824,14 +2967,19 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
 
         if (pnode->nSendSize > nSendBufferMaxSize)
             pnode->fPauseSend = true;
-        pnode->vSendMsg.push_back(std::move(serializedHeader));
+        pnode->vSendMsg.push_back(msg.header);
         if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+            pnode->vSendMsg.push_back(msg.data);
 
         // If write queue empty, attempt "optimistic write"
-        if (optimisticSend == true)
+        if (optimisticSend == true) {
             nBytesSent = SocketSendData(pnode);
+            // The socket handler has to wait for sending the rest.
+            fWakeSocketHandler = !pnode->vSendMsg.empty();
+        }
     }
+    if (fWakeSocketHandler)
+        WakeSocketHandler(pnode);
     if (nBytesSent)
         RecordBytesSent(nBytesSent);
 }
@@ -2853,6 +3001,20 @@ int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds) {
     return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
 }
 
+int64_t CConnman::PoissonNextSendInbound(int64_t now, int average_interval_seconds)
+{
+    // Several message handler threads may get here at once; only one of them
+    // draws the next time.
+    int64_t next = m_next_send_inv_to_incoming;
+    while (next < now) {
+        const int64_t drawn = PoissonNextSend(now, average_interval_seconds);
+        if (m_next_send_inv_to_incoming.compare_exchange_weak(next, drawn)) {
+            return drawn;
+        }
+    }
+    return next;
+}
+
 CSipHasher CConnman::GetDeterministicRandomizer(uint64_t id) const
 {
     return CSipHasher(nSeed0, nSeed1).Write(id);
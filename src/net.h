@@ -17,6 +17,7 @@
 #include <policy/feerate.h>
 #include <protocol.h>
 #include <random.h>
+#include <socketevents.h>
 #include <streams.h>
 #include <sync.h>
 #include <uint256.h>
@@ -27,6 +28,7 @@
 #include <stdint.h>
 #include <thread>
 #include <memory>
+#include <unordered_map>
 #include <condition_variable>
 
 #ifndef WIN32
@@ -53,6 +55,12 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 4 MB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 4 * 1000 * 1000;
+/** Receive buffer allocated for a message before any of its data arrived, at most. */
+static const unsigned int RECV_BUFFER_READAHEAD = 256 * 1024;
+/** Number of processed messages each peer keeps around to parse new ones into. */
+static const size_t MAX_POOLED_RECV_MESSAGES = 4;
+/** Processed messages whose buffer grew larger than this are freed instead of pooled. */
+static const size_t MAX_POOLED_RECV_BUFFER_SIZE = 128 * 1024;
 /** Maximum length of strSubVer in `version` message */
 static const unsigned int MAX_SUBVERSION_LENGTH = 256;
 /** Maximum number of automatic outgoing nodes */
@@ -83,6 +91,10 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** -msghandlerthreads default (0 = one per core) */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 0;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
 
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
@@ -113,6 +125,20 @@ struct CSerializedNetMsg
     std::string command;
 };
 
+/**
+ * A message serialized once, and then queued for any number of peers. Its
+ * header and payload are shared by their send queues instead of copied.
+ */
+struct CSharedNetMsg
+{
+    CSharedNetMsg() = default;
+    explicit CSharedNetMsg(CSerializedNetMsg&& msg);
+
+    std::shared_ptr<const std::vector<unsigned char>> header;
+    std::shared_ptr<const std::vector<unsigned char>> data;
+    std::string command;
+};
+
 class NetEventsInterface;
 class CConnman
 {
@@ -145,6 +171,8 @@ public:
         bool m_use_addrman_outgoing = true;
         std::vector<std::string> m_specified_outgoing;
         std::vector<std::string> m_added_nodes;
+        SocketEventsMode socket_events_mode = DefaultSocketEventsMode();
+        int nMessageHandlerThreads = 1;
     };
 
     void Init(const Options& connOptions) {
@@ -158,6 +186,8 @@ public:
         m_msgproc = connOptions.m_msgproc;
         nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
         nReceiveFloodSize = connOptions.nReceiveFloodSize;
+        m_socket_events_mode = connOptions.socket_events_mode;
+        nMessageHandlerThreads = std::max(connOptions.nMessageHandlerThreads, 1);
         {
             LOCK(cs_totalBytesSent);
             nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
@@ -183,6 +213,7 @@ public:
     bool ForNode(NodeId id, std::function<bool(CNode* pnode)> func);
 
     void PushMessage(CNode* pnode, CSerializedNetMsg&& msg);
+    void PushMessage(CNode* pnode, const CSharedNetMsg& msg);
 
     template<typename Callable>
     void ForEachNode(Callable&& func)
@@ -313,7 +344,20 @@ public:
 
     unsigned int GetReceiveFloodSize() const;
 
+    /**
+     * Time of the next transaction inventory trickle to inbound peers, which
+     * share it so that their inventory is sent, and ordered, in one batch.
+     */
+    int64_t PoissonNextSendInbound(int64_t now, int average_interval_seconds);
+
+    /** Wake up every message handler thread. */
     void WakeMessageHandler();
+    /** Wake up the message handler thread in charge of the given node. */
+    void WakeMessageHandler(NodeId id);
+    /** Cut the wait of the socket handler short. */
+    void WakeSocketHandler();
+    /** Make the socket handler reconsider which events to wait for on pnode's socket, e.g. after queueing data to send. */
+    void WakeSocketHandler(CNode* pnode);
 private:
     struct ListenSocket {
         SOCKET socket;
@@ -329,8 +373,12 @@ private:
     void AddOneShot(const std::string& strDest);
     void ProcessOneShot();
     void ThreadOpenConnections(std::vector<std::string> connect);
-    void ThreadMessageHandler();
+    void ThreadMessageHandler(size_t nShard);
     void AcceptConnection(const ListenSocket& hListenSocket);
+    /** Wait for the events pnode is ready for now. Socket handler thread only. */
+    void UpdateSocketEvents(CNode* pnode);
+    /** Receive and send on pnode's socket as events tell. Socket handler thread only. */
+    void ServiceSocket(CNode* pnode, uint8_t events);
     void ThreadSocketHandler();
     void ThreadDNSAddressSeed();
 
@@ -386,6 +434,8 @@ private:
     unsigned int nSendBufferMaxSize;
     unsigned int nReceiveFloodSize;
 
+    std::atomic<int64_t> m_next_send_inv_to_incoming{0};
+
     std::vector<ListenSocket> vhListenSocket;
     std::atomic<bool> fNetworkActive;
     banmap_t setBanned;
@@ -418,20 +468,38 @@ private:
     /** SipHasher seeds for deterministic randomness */
     const uint64_t nSeed0, nSeed1;
 
-    /** flag for waking the message processor. */
-    bool fMsgProcWake;
+    /**
+     * A message handler thread. Nodes are assigned to threads by id, so
+     * that each node's messages are processed by a single thread, in order.
+     */
+    struct MessageHandlerShard {
+        std::thread thread;
+        /** flag for waking the message processor, guarded by mutexMsgProc. */
+        bool fWake = false;
+        std::condition_variable cond;
+    };
 
-    std::condition_variable condMsgProc;
+    int nMessageHandlerThreads;
+    //! Created in Start() and destroyed in Stop(), guarded by mutexMsgProc
+    std::vector<std::unique_ptr<MessageHandlerShard>> m_msgproc_shards;
     std::mutex mutexMsgProc;
     std::atomic<bool> flagInterruptMsgProc;
 
     CThreadInterrupt interruptNet;
 
+    SocketEventsMode m_socket_events_mode = DefaultSocketEventsMode();
+    //! Created in Start(); only the socket handler thread waits on it
+    std::unique_ptr<CSocketEvents> m_socket_events;
+    //! Nodes whose socket events are to be reconsidered, each holding a reference
+    std::vector<CNode*> m_socket_dirty;
+    std::mutex m_socket_dirty_mutex;
+    //! Nodes whose socket is watched, by id; only used by the socket handler thread
+    std::unordered_map<NodeId, CNode*> m_socket_nodes;
+
     std::thread threadDNSAddressSeed;
     std::thread threadSocketHandler;
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
-    std::thread threadMessageHandler;
 
     /** flag for deciding to connect to an extra outbound peer,
      *  in excess of nMaxOutbound
@@ -462,7 +530,8 @@ struct CombinerAll
 };
 
 /**
- * Interface for message handling
+ * Interface for message handling. ProcessMessages and SendMessages may be
+ * called concurrently for different nodes, but never for the same one.
  */
 class NetEventsInterface
 {
@@ -538,6 +607,8 @@ public:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     uint64_t nRecvBytes;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    uint64_t nRecvBufferAllocs;
+    uint64_t nRecvBufferReuses;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -560,7 +631,7 @@ private:
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
@@ -569,8 +640,7 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
@@ -588,10 +658,12 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
+    /** Get ready to parse another message, keeping the capacity of vRecv. */
+    void Reset(int nVersionIn);
+
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
 };
@@ -608,7 +680,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<std::vector<unsigned char>> vSendMsg;
+    std::deque<std::shared_ptr<const std::vector<unsigned char>>> vSendMsg;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
     CCriticalSection cs_vRecv;
@@ -617,10 +689,17 @@ public:
     std::list<CNetMessage> vProcessMsg;
     size_t nProcessQueueSize;
 
+    // Processed messages whose list nodes and buffers are reused by ReceiveMsgBytes
+    CCriticalSection cs_recvPool;
+    std::list<CNetMessage> vRecvPool;
+
     CCriticalSection cs_sendProcessing;
 
     std::deque<CInv> vRecvGetData;
     uint64_t nRecvBytes;
+    // Receive buffers allocated or grown, and taken from vRecvPool instead
+    uint64_t nRecvBufferAllocs;
+    uint64_t nRecvBufferReuses;
     std::atomic<int> nRecvVersion;
 
     std::atomic<int64_t> nLastSend;
@@ -660,6 +739,8 @@ public:
     const uint64_t nKeyedNetGroup;
     std::atomic_bool fPauseRecv;
     std::atomic_bool fPauseSend;
+    //! Waiting in CConnman::m_socket_dirty, guarded by CConnman::m_socket_dirty_mutex
+    bool fSocketDirty = false;
 protected:
 
     mapMsgCmdSize mapSendBytesPerMsgCmd;
@@ -672,6 +753,8 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    //! Guards vAddrToSend and addrKnown, which other nodes' message handlers relay to
+    CCriticalSection cs_addrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -762,6 +845,13 @@ public:
 
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete);
 
+    /**
+     * Hand processed messages back so that later ones can be parsed into
+     * them. Takes everything out of msgs; what does not fit in the pool is
+     * freed.
+     */
+    void RecycleMessages(std::list<CNetMessage>& msgs);
+
     void SetRecvVersion(int nVersionIn)
     {
         nRecvVersion = nVersionIn;
@@ -792,6 +882,7 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrToSend);
         addrKnown.insert(_addr.GetKey());
     }
 
@@ -800,6 +891,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrToSend);
         if (_addr.IsValid() && !addrKnown.contains(_addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand.randrange(vAddrToSend.size())] = _addr;
@@ -852,6 +944,24 @@ public:
     void MaybeSetAddrName(const std::string& addrNameIn);
 };
 
+/**
+ * Messages taken off a node's process queue. They are handed back to the
+ * node once processed, whichever way processing ends.
+ */
+class CProcessedMessages
+{
+public:
+    std::list<CNetMessage> msgs;
+
+    explicit CProcessedMessages(CNode* pnodeIn) : pnode(pnodeIn) {}
+    ~CProcessedMessages() { pnode->RecycleMessages(msgs); }
+
+    CProcessedMessages(const CProcessedMessages&) = delete;
+    CProcessedMessages& operator=(const CProcessedMessages&) = delete;
+
+private:
+    CNode* const pnode;
+};
 
 
 
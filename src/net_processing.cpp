@@ -7,10 +7,12 @@
 
 #include <addrman.h>
 #include <arith_uint256.h>
+#include <blockdownload.h>
 #include <blockencodings.h>
 #include <chainparams.h>
 #include <consensus/validation.h>
 #include <hash.h>
+#include <headerssync.h>
 #include <init.h>
 #include <validation.h>
 #include <merkleblock.h>
@@ -31,6 +33,9 @@
 #include <utilstrencodings.h>
 
 #include <memory>
+#include <unordered_map>
+
+#include <boost/bind.hpp>
 
 #if defined(NDEBUG)
 # error "Starwels cannot be compiled without assertions."
@@ -58,8 +63,7 @@ std::map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(g_cs_orphans);
 std::map<COutPoint, std::set<std::map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(g_cs_orphans);
 void EraseOrphansFor(NodeId peer);
 
-static size_t vExtraTxnForCompactIt GUARDED_BY(g_cs_orphans) = 0;
-static std::vector<std::pair<uint256, CTransactionRef>> vExtraTxnForCompact GUARDED_BY(g_cs_orphans);
+static std::unique_ptr<ExtraTxnsForCompact> extraTxnForCompact GUARDED_BY(g_cs_orphans);
 
 static const uint64_t RANDOMIZER_ID_ADDRESS_RELAY = 0x3cac0035b5866b90ULL; // SHA256("main address relay")[0:8]
 
@@ -114,6 +118,9 @@ namespace {
         const CBlockIndex* pindex;                               //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
         std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
+        int64_t nTime;                                           //!< When the block was requested, in microseconds.
+        bool fPipelined;                                         //!< Whether other blocks were in flight from the peer when it was requested.
+        bool fReassigned;                                        //!< Whether the block was taken over from a slower peer.
     };
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -137,6 +144,32 @@ namespace {
     MapRelay mapRelay;
     /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
+
+    /**
+     * Depth and score of the transactions we are announcing, looked up in the
+     * mempool once for all peers rather than twice per comparison when sorting
+     * each peer's inventory. Cleared on every block, as confirmed ancestors
+     * change them, and when it gets larger than MAX_INV_ORDER_SIZE. Entries
+     * of transactions in g_inv_order_stale are dropped before it is used.
+     */
+    CCriticalSection cs_inv_order;
+    const size_t MAX_INV_ORDER_SIZE = 100000;
+    std::unordered_map<uint256, DepthAndScore, SaltedTxidHasher> g_inv_order GUARDED_BY(cs_inv_order);
+
+    /**
+     * Transactions prioritised, or removed from the mempool (and perhaps
+     * added back since) other than for a block. Filled from mempool
+     * callbacks, which hold mempool.cs, so cs_inv_order_stale is never held
+     * while taking another lock.
+     */
+    CCriticalSection cs_inv_order_stale;
+    std::vector<uint256> g_inv_order_stale GUARDED_BY(cs_inv_order_stale);
+
+    /** Headers downloaded ahead of the headers chain during initial sync, if enabled. */
+    std::unique_ptr<CHeadersSegments> g_headers_segments GUARDED_BY(cs_main);
+
+    /** How compact blocks were reconstructed. Protected by cs_main. */
+    CCompactBlockStats g_compact_block_stats{};
 } // namespace
 
 namespace {
@@ -187,6 +220,10 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! How quickly this peer delivers the blocks we request, sizing how many we keep in flight from it.
+    CBlockDownloadStats m_block_download;
+    //! Number of blocks in flight from this peer that were requested from a faster one instead.
+    uint64_t m_blocks_reassigned;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -254,6 +291,7 @@ struct CNodeState {
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        m_blocks_reassigned = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
@@ -353,13 +391,15 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlockIndex*
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
+    const int64_t nNow = GetTimeMicros();
     std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr)});
+            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr),
+             nNow, state->nBlocksInFlight > 0, false});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
         // We're starting a block download (batch) from this peer.
-        state->nDownloadingSince = GetTimeMicros();
+        state->nDownloadingSince = nNow;
     }
     if (state->nBlocksInFlightValidHeaders == 1 && pindex != nullptr) {
         nPeersWithValidatedDownloads++;
@@ -370,6 +410,38 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlockIndex*
     return true;
 }
 
+// Requires cs_main.
+// Account for a block of nBytes received from nodeid in its download statistics, if it was requested from it.
+void UpdateBlockDownloadStats(NodeId nodeid, const uint256& hash, size_t nBytes) {
+    std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeid) {
+        return;
+    }
+    CNodeState *state = State(nodeid);
+    assert(state != nullptr);
+    const QueuedBlock& queued = *itInFlight->second.second;
+    state->m_block_download.Received(nBytes, queued.nTime, queued.fPipelined, GetTimeMicros());
+}
+
+// Requires cs_main.
+// Whether pindex, in flight from another peer, would likely arrive much sooner if it was requested from nodeid.
+bool ShouldTakeOverBlock(NodeId nodeid, const CBlockIndex* pindex, int64_t nNow) {
+    std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(pindex->GetBlockHash());
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first == nodeid || itInFlight->second.second->fReassigned) {
+        return false;
+    }
+    CNodeState *state = State(nodeid);
+    assert(state != nullptr);
+    if (!state->m_block_download.HasSamples()) {
+        return false;
+    }
+    CNodeState *stateCurrent = State(itInFlight->second.first);
+    assert(stateCurrent != nullptr);
+    const int nPosition = std::distance(stateCurrent->vBlocksInFlight.begin(), itInFlight->second.second);
+    const int64_t nWaitCurrent = stateCurrent->m_block_download.EstimateWait(nPosition, stateCurrent->nDownloadingSince, nNow);
+    return ShouldReassignBlock(nWaitCurrent, state->m_block_download.EstimateTime(state->nBlocksInFlight + 1));
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -462,8 +534,8 @@ bool PeerHasHeader(CNodeState *state, const CBlockIndex *pindex)
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) {
+ *  at most count entries. pindexWaiting is set to the first block on the way that is already in flight. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const CBlockIndex*& pindexWaiting, const Consensus::Params& consensusParams) {
     if (count == 0)
         return;
 
@@ -544,6 +616,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaiting = pindex;
             }
         }
     }
@@ -588,6 +661,9 @@ void PeerLogicValidation::FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTim
     if (state->fSyncStarted)
         nSyncStarted--;
 
+    if (g_headers_segments)
+        g_headers_segments->Release(nodeid);
+
     if (state->nMisbehavior == 0 && state->fCurrentlyConnected) {
         fUpdateConnectionTime = true;
     }
@@ -614,6 +690,30 @@ void PeerLogicValidation::FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTim
     LogPrint(BCLog::NET, "Cleared nodestate for peer=%d\n", nodeid);
 }
 
+// Requires cs_main.
+static void RecordCompactBlockInit(const PartiallyDownloadedBlock& partialBlock)
+{
+    g_compact_block_stats.nBlocks++;
+    g_compact_block_stats.nTxPrefilled += partialBlock.GetPrefilledCount();
+    g_compact_block_stats.nTxMempool += partialBlock.GetMempoolCount();
+    g_compact_block_stats.nTxExtra += partialBlock.GetExtraCount();
+    g_compact_block_stats.nTxMissing += partialBlock.GetMissingCount();
+}
+
+void GetCompactBlockStats(CCompactBlockStats& stats)
+{
+    {
+        LOCK(cs_main);
+        stats = g_compact_block_stats;
+    }
+    LOCK(g_cs_orphans);
+    if (extraTxnForCompact) {
+        stats.nExtraTxns = extraTxnForCompact->size();
+        stats.nExtraTxnsUsage = extraTxnForCompact->DynamicMemoryUsage();
+        stats.nExtraTxnsMaxUsage = extraTxnForCompact->GetMaxUsage();
+    }
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
@@ -626,6 +726,10 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlockWindow = state->m_block_download.GetWindow();
+    stats.dBlockBandwidth = state->m_block_download.GetBandwidth();
+    stats.dBlockLatency = state->m_block_download.GetLatency() / 1e6;
+    stats.nBlocksReassigned = state->m_blocks_reassigned;
     return true;
 }
 
@@ -636,13 +740,22 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
 
 void AddToCompactExtraTransactions(const CTransactionRef& tx) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
 {
-    size_t max_extra_txn = gArgs.GetArg("-blockreconstructionextratxn", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN);
-    if (max_extra_txn <= 0)
-        return;
-    if (!vExtraTxnForCompact.size())
-        vExtraTxnForCompact.resize(max_extra_txn);
-    vExtraTxnForCompact[vExtraTxnForCompactIt] = std::make_pair(tx->GetWitnessHash(), tx);
-    vExtraTxnForCompactIt = (vExtraTxnForCompactIt + 1) % max_extra_txn;
+    if (extraTxnForCompact)
+        extraTxnForCompact->Add(tx);
+}
+
+// Transactions outside the mempool that compact block reconstruction looks at,
+// the orphan pool and the extra transactions, in <witness hash, reference> form.
+static std::vector<std::pair<uint256, CTransactionRef>> GetExtraTxnForCompact() EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
+{
+    std::vector<std::pair<uint256, CTransactionRef>> vExtraTxn;
+    vExtraTxn.reserve(mapOrphanTransactions.size());
+    for (const auto& orphan : mapOrphanTransactions) {
+        vExtraTxn.emplace_back(orphan.second.tx->GetWitnessHash(), orphan.second.tx);
+    }
+    if (extraTxnForCompact)
+        extraTxnForCompact->AppendTo(vExtraTxn);
+    return vExtraTxn;
 }
 
 bool AddOrphanTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
@@ -799,6 +912,14 @@ static bool BlockRequestAllowed(const CBlockIndex* pindex, const Consensus::Para
 PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, CScheduler &scheduler) : connman(connmanIn), m_stale_tip_check_time(0) {
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+    {
+        LOCK(g_cs_orphans);
+        extraTxnForCompact.reset(new ExtraTxnsForCompact(std::max<int64_t>(0, gArgs.GetArg("-blockreconstructionextratxn", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN)),
+            std::max<int64_t>(0, gArgs.GetArg("-blockreconstructionextratxnsize", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN_SIZE)) * 1000000));
+    }
+    if (fCheckpointsEnabled) {
+        g_headers_segments.reset(new CHeadersSegments(Params().Checkpoints(), Params().GetConsensus(), std::max<int64_t>(0, gArgs.GetArg("-maxheaderspeers", DEFAULT_MAX_HEADERS_PEERS))));
+    }
 
     const Consensus::Params& consensusParams = Params().GetConsensus();
     // Stale tip checking and peer eviction are on two different timers, but we
@@ -807,9 +928,36 @@ PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, CScheduler &schedu
     // timer.
     static_assert(EXTRA_PEER_CHECK_INTERVAL < STALE_CHECK_INTERVAL, "peer eviction timer should be less than stale tip check timer");
     scheduler.scheduleEvery(std::bind(&PeerLogicValidation::CheckForStaleTipAndEvictPeers, this, consensusParams), EXTRA_PEER_CHECK_INTERVAL * 1000);
+
+    mempool.NotifyEntryRemoved.connect(boost::bind(&PeerLogicValidation::InvOrderEntryRemoved, this, _1, _2));
+    mempool.NotifyEntryPrioritised.connect(boost::bind(&PeerLogicValidation::InvOrderEntryPrioritised, this, _1));
+}
+
+PeerLogicValidation::~PeerLogicValidation() {
+    mempool.NotifyEntryRemoved.disconnect(boost::bind(&PeerLogicValidation::InvOrderEntryRemoved, this, _1, _2));
+    mempool.NotifyEntryPrioritised.disconnect(boost::bind(&PeerLogicValidation::InvOrderEntryPrioritised, this, _1));
+}
+
+void PeerLogicValidation::InvOrderEntryRemoved(CTransactionRef ptx, MemPoolRemovalReason reason) {
+    // Transactions confirmed, and those conflicting with them, are taken
+    // care of by clearing everything on BlockConnected.
+    if (reason == MemPoolRemovalReason::BLOCK || reason == MemPoolRemovalReason::CONFLICT) return;
+    LOCK(cs_inv_order_stale);
+    g_inv_order_stale.push_back(ptx->GetHash());
+}
+
+void PeerLogicValidation::InvOrderEntryPrioritised(const uint256& hash) {
+    LOCK(cs_inv_order_stale);
+    g_inv_order_stale.push_back(hash);
 }
 
 void PeerLogicValidation::BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex* pindex, const std::vector<CTransactionRef>& vtxConflicted) {
+    {
+        LOCK2(cs_inv_order, cs_inv_order_stale);
+        g_inv_order.clear();
+        g_inv_order_stale.clear();
+    }
+
     LOCK(g_cs_orphans);
 
     std::vector<uint256> vOrphanErase;
@@ -848,6 +996,58 @@ static std::shared_ptr<const CBlockHeaderAndShortTxIDs> most_recent_compact_bloc
 static uint256 most_recent_block_hash;
 static bool fWitnessesPresentInMostRecentCompactBlock;
 
+/**
+ * Messages about the most recent block, which most peers are sent at about
+ * the same time. Each is serialized the first time it is needed, and then
+ * shared by the send queues of all peers. Indexed by whether the peer wants
+ * witnesses.
+ */
+struct RecentBlockMessages {
+    CSharedNetMsg block[2];
+    CSharedNetMsg compact_block[2];
+    CSharedNetMsg headers;
+};
+static RecentBlockMessages most_recent_block_msgs;
+
+/** The BLOCK message for the most recent block. */
+static CSharedNetMsg MostRecentBlockMsg(bool fWantsWitness) EXCLUSIVE_LOCKS_REQUIRED(cs_most_recent_block)
+{
+    CSharedNetMsg& msg = most_recent_block_msgs.block[fWantsWitness];
+    if (!msg.data) {
+        const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+        msg = CSharedNetMsg(msgMaker.Make(fWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, *most_recent_block));
+    }
+    return msg;
+}
+
+/** The CMPCTBLOCK message for the most recent block. */
+static CSharedNetMsg MostRecentCompactBlockMsg(bool fWantsWitness) EXCLUSIVE_LOCKS_REQUIRED(cs_most_recent_block)
+{
+    CSharedNetMsg& msg = most_recent_block_msgs.compact_block[fWantsWitness];
+    if (!msg.data) {
+        const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+        const int nSendFlags = fWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
+        if (fWantsWitness || !fWitnessesPresentInMostRecentCompactBlock) {
+            msg = CSharedNetMsg(msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *most_recent_compact_block));
+        } else {
+            CBlockHeaderAndShortTxIDs cmpctblock(*most_recent_block, false);
+            msg = CSharedNetMsg(msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
+        }
+    }
+    return msg;
+}
+
+/** The HEADERS message announcing just the most recent block. */
+static CSharedNetMsg MostRecentHeadersMsg() EXCLUSIVE_LOCKS_REQUIRED(cs_most_recent_block)
+{
+    CSharedNetMsg& msg = most_recent_block_msgs.headers;
+    if (!msg.data) {
+        const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+        msg = CSharedNetMsg(msgMaker.Make(NetMsgType::HEADERS, std::vector<CBlock>{most_recent_block->GetBlockHeader()}));
+    }
+    return msg;
+}
+
 void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock) {
     std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock = std::make_shared<const CBlockHeaderAndShortTxIDs> (*pblock, true);
     const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
@@ -868,10 +1068,11 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
         most_recent_block = pblock;
         most_recent_compact_block = pcmpctblock;
         fWitnessesPresentInMostRecentCompactBlock = fWitnessEnabled;
+        most_recent_block_msgs = RecentBlockMessages();
     }
 
-    connman->ForEachNode([this, &pcmpctblock, pindex, &msgMaker, fWitnessEnabled, &hashBlock](CNode* pnode) {
-        // TODO: Avoid the repeated-serialization here
+    CSharedNetMsg msg;
+    connman->ForEachNode([this, &pcmpctblock, pindex, &msgMaker, fWitnessEnabled, &hashBlock, &msg](CNode* pnode) {
         if (pnode->nVersion < INVALID_CB_NO_BAN_VERSION || pnode->fDisconnect)
             return;
         ProcessBlockAvailability(pnode->GetId());
@@ -883,7 +1084,11 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
 
             LogPrint(BCLog::NET, "%s sending header-and-ids %s to peer=%d\n", "PeerLogicValidation::NewPoWValidBlock",
                     hashBlock.ToString(), pnode->GetId());
-            connman->PushMessage(pnode, msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
+            // Serialize it only once, for all peers
+            if (!msg.data) {
+                msg = CSharedNetMsg(msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
+            }
+            connman->PushMessage(pnode, msg);
             state.pindexBestHeaderSent = pindex;
         }
     });
@@ -1040,6 +1245,21 @@ static void RelayAddress(const CAddress& addr, bool fReachable, CConnman* connma
     connman->ForEachNodeThen(std::move(sortfunc), std::move(pushfunc));
 }
 
+/** Trigger the peer node to send a getblocks request for the next batch of inventory, if it just got the last block of the previous one. */
+static void SendContinueInv(CNode* pfrom, const uint256& hashContinueTip, const CNetMsgMaker& msgMaker, CConnman* connman)
+{
+    if (!hashContinueTip.IsNull())
+    {
+        // Bypass PushInventory, this must send even if redundant,
+        // and we want it right after the last block so they don't
+        // wait for other stuff first.
+        std::vector<CInv> vInv;
+        vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
+        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
+        pfrom->hashContinue.SetNull();
+    }
+}
+
 void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensusParams, const CInv& inv, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
 {
     bool send = false;
@@ -1075,6 +1295,12 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
         ActivateBestChain(dummy, Params(), a_recent_block);
     }
 
+    const CBlockIndex* pindex = nullptr;
+    CDiskBlockPos blockPos;
+    bool fPeerWantsWitness = false;
+    bool fSendCompact = false;
+    uint256 hashContinueTip;
+    {
     LOCK(cs_main);
     BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
     if (mi != mapBlockIndex.end()) {
@@ -1083,7 +1309,6 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
             LogPrint(BCLog::NET, "%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
         }
     }
-    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
     // disconnect node in case we have reached the outbound limit for serving historical blocks
     // never disconnect whitelisted nodes
     if (send && connman->OutboundTargetReached(true) && ( ((pindexBestHeader != nullptr) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > HISTORICAL_BLOCK_AGE)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
@@ -1106,80 +1331,116 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
     }
     // Pruned nodes may have deleted the block, so check whether
     // it's available before trying to send.
-    if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
-    {
-        std::shared_ptr<const CBlock> pblock;
-        if (a_recent_block && a_recent_block->GetHash() == (*mi).second->GetBlockHash()) {
-            pblock = a_recent_block;
-        } else {
-            // Send block from disk
-            std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
-            if (!ReadBlockFromDisk(*pblockRead, (*mi).second, consensusParams))
+    if (!send || !(mi->second->nStatus & BLOCK_HAVE_DATA))
+        return;
+    pindex = mi->second;
+    // Where the block is on disk is only read under cs_main.
+    blockPos = pindex->GetBlockPos();
+    if (inv.type == MSG_CMPCT_BLOCK) {
+        fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
+        fSendCompact = CanDirectFetch(consensusParams) && pindex->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+    }
+    if (inv.hash == pfrom->hashContinue)
+        hashContinueTip = chainActive.Tip()->GetBlockHash();
+    } // release cs_main, so that other message handlers can go on while we read and send the block
+
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    const bool fFullBlock = inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK || (inv.type == MSG_CMPCT_BLOCK && !fSendCompact);
+    const bool fWitness = inv.type == MSG_WITNESS_BLOCK || (inv.type == MSG_CMPCT_BLOCK && fPeerWantsWitness);
+    std::shared_ptr<const CBlock> pblock;
+    if (a_recent_block && a_recent_block->GetHash() == pindex->GetBlockHash()) {
+        pblock = a_recent_block;
+        if (inv.type != MSG_FILTERED_BLOCK) {
+            // Peers ask for the newest block at about the same time, so
+            // serialize it only once for all of them.
+            CSharedNetMsg msg;
+            {
+                LOCK(cs_most_recent_block);
+                if (most_recent_block_hash == pindex->GetBlockHash())
+                    msg = fFullBlock ? MostRecentBlockMsg(fWitness) : MostRecentCompactBlockMsg(fWitness);
+            }
+            if (msg.data) {
+                connman->PushMessage(pfrom, msg);
+                SendContinueInv(pfrom, hashContinueTip, msgMaker, connman);
+                return;
+            }
+        }
+    } else if (fFullBlock) {
+        // Full blocks are sent as they are stored on disk, only stripping
+        // witnesses if needed, instead of deserializing and serializing them
+        // again. If that fails for any reason, go the long way below.
+        CSerializedNetMsg msg;
+        if (ReadRawBlockFromDisk(msg.data, blockPos, pindex->GetBlockHash(), Params().MessageStart()) && (fWitness || StripRawBlockWitness(msg.data))) {
+            msg.command = NetMsgType::BLOCK;
+            connman->PushMessage(pfrom, std::move(msg));
+            SendContinueInv(pfrom, hashContinueTip, msgMaker, connman);
+            return;
+        }
+    }
+    if (!pblock) {
+        // Send block from disk
+        std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+        if (!ReadBlockFromDisk(*pblockRead, blockPos, consensusParams) || pblockRead->GetHash() != pindex->GetBlockHash()) {
+            // It may have been pruned since we checked
+            LOCK(cs_main);
+            if (pindex->nStatus & BLOCK_HAVE_DATA)
                 assert(!"cannot load block from disk");
-            pblock = pblockRead;
+            LogPrint(BCLog::NET, "Block %s was pruned before it could be sent, disconnect peer=%d\n", inv.hash.ToString(), pfrom->GetId());
+            pfrom->fDisconnect = true;
+            return;
         }
-        if (inv.type == MSG_BLOCK)
-            connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, *pblock));
-        else if (inv.type == MSG_WITNESS_BLOCK)
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, *pblock));
-        else if (inv.type == MSG_FILTERED_BLOCK)
+        pblock = pblockRead;
+    }
+    if (inv.type == MSG_BLOCK)
+        connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, *pblock));
+    else if (inv.type == MSG_WITNESS_BLOCK)
+        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, *pblock));
+    else if (inv.type == MSG_FILTERED_BLOCK)
+    {
+        bool sendMerkleBlock = false;
+        CMerkleBlock merkleBlock;
         {
-            bool sendMerkleBlock = false;
-            CMerkleBlock merkleBlock;
-            {
-                LOCK(pfrom->cs_filter);
-                if (pfrom->pfilter) {
-                    sendMerkleBlock = true;
-                    merkleBlock = CMerkleBlock(*pblock, *pfrom->pfilter);
-                }
+            LOCK(pfrom->cs_filter);
+            if (pfrom->pfilter) {
+                sendMerkleBlock = true;
+                merkleBlock = CMerkleBlock(*pblock, *pfrom->pfilter);
             }
-            if (sendMerkleBlock) {
-                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
-                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                // This avoids hurting performance by pointlessly requiring a round-trip
-                // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                // they must either disconnect and retry or request the full block.
-                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                // however we MUST always provide at least what the remote peer needs
-                typedef std::pair<unsigned int, uint256> PairType;
-                for (PairType& pair : merkleBlock.vMatchedTxn)
-                    connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *pblock->vtx[pair.first]));
-            }
-            // else
-                // no response
-        }
-        else if (inv.type == MSG_CMPCT_BLOCK)
-        {
-            // If a peer is asking for old blocks, we're almost guaranteed
-            // they won't have a useful mempool to match against a compact block,
-            // and we don't feel like constructing the object for them, so
-            // instead we respond with the full, non-compact block.
-            bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
-            int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
-            if (CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
-                if ((fPeerWantsWitness || !fWitnessesPresentInARecentCompactBlock) && a_recent_compact_block && a_recent_compact_block->header.GetHash() == mi->second->GetBlockHash()) {
-                    connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *a_recent_compact_block));
-                } else {
-                    CBlockHeaderAndShortTxIDs cmpctblock(*pblock, fPeerWantsWitness);
-                    connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
-                }
+        }
+        if (sendMerkleBlock) {
+            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
+            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+            // This avoids hurting performance by pointlessly requiring a round-trip
+            // Note that there is currently no way for a node to request any single transactions we didn't send here -
+            // they must either disconnect and retry or request the full block.
+            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+            // however we MUST always provide at least what the remote peer needs
+            typedef std::pair<unsigned int, uint256> PairType;
+            for (PairType& pair : merkleBlock.vMatchedTxn)
+                connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *pblock->vtx[pair.first]));
+        }
+        // else
+            // no response
+    }
+    else if (inv.type == MSG_CMPCT_BLOCK)
+    {
+        // If a peer is asking for old blocks, we're almost guaranteed
+        // they won't have a useful mempool to match against a compact block,
+        // and we don't feel like constructing the object for them, so
+        // instead we respond with the full, non-compact block.
+        int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
+        if (fSendCompact) {
+            if ((fPeerWantsWitness || !fWitnessesPresentInARecentCompactBlock) && a_recent_compact_block && a_recent_compact_block->header.GetHash() == pindex->GetBlockHash()) {
+                connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *a_recent_compact_block));
             } else {
-                connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, *pblock));
+                CBlockHeaderAndShortTxIDs cmpctblock(*pblock, fPeerWantsWitness);
+                connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
             }
-        }
-
-        // Trigger the peer node to send a getblocks request for the next batch of inventory
-        if (inv.hash == pfrom->hashContinue)
-        {
-            // Bypass PushInventory, this must send even if redundant,
-            // and we want it right after the last block so they don't
-            // wait for other stuff first.
-            std::vector<CInv> vInv;
-            vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
-            pfrom->hashContinue.SetNull();
+        } else {
+            connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, *pblock));
         }
     }
+
+    SendContinueInv(pfrom, hashContinueTip, msgMaker, connman);
 }
 
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
@@ -1271,6 +1532,50 @@ inline void static SendBlockTransactions(const CBlock& block, const BlockTransac
     connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCKTXN, resp));
 }
 
+/**
+ * Validate and add the headers downloaded ahead of the headers chain that it
+ * now reaches, and punish the peers that sent invalid ones.
+ */
+static void ConnectHeadersSegments(const CChainParams& chainparams)
+{
+    while (true) {
+        std::vector<CHeadersSegments::Batch> batches;
+        {
+            LOCK(cs_main);
+            auto fKnown = [](const uint256& hash) { return mapBlockIndex.count(hash) != 0; };
+            if (!g_headers_segments || !g_headers_segments->TakeConnectable(fKnown, batches)) {
+                return;
+            }
+        }
+        for (const CHeadersSegments::Batch& batch : batches) {
+            // Let go of cs_main between chunks of the size of a headers message.
+            for (size_t nStart = 0; nStart < batch.headers.size(); nStart += MAX_HEADERS_RESULTS) {
+                const size_t nEnd = std::min<size_t>(batch.headers.size(), nStart + MAX_HEADERS_RESULTS);
+                const std::vector<CBlockHeader> headers(batch.headers.begin() + nStart, batch.headers.begin() + nEnd);
+                const std::vector<uint256> hashes(batch.hashes.begin() + nStart, batch.hashes.begin() + nEnd);
+                CValidationState state;
+                if (!ProcessNewBlockHeaders(headers, state, chainparams, nullptr, nullptr, &hashes)) {
+                    LogPrint(BCLog::NET, "invalid headers downloaded ahead from peer=%d: %s\n", batch.peer, FormatStateMessage(state));
+                    LOCK(cs_main);
+                    int nDoS;
+                    if (state.IsInvalid(nDoS) && nDoS > 0) {
+                        Misbehaving(batch.peer, nDoS);
+                    }
+                    // The rest of the batch, and the batches built on it, are
+                    // of no use: have the segment downloaded again from the
+                    // last header that connected.
+                    BlockMap::const_iterator it = mapBlockIndex.find(headers[0].hashPrevBlock);
+                    if (g_headers_segments && it != mapBlockIndex.end()) {
+                        g_headers_segments->Requeue(batch.peer, it->second->nHeight, it->first);
+                    }
+                    return;
+                }
+            }
+            LogPrint(BCLog::NET, "connected %u headers downloaded ahead from peer=%d\n", batch.headers.size(), batch.peer);
+        }
+    }
+}
+
 bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::vector<CBlockHeader>& headers, const CChainParams& chainparams, bool punish_duplicate_invalid)
 {
     const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
@@ -1281,12 +1586,49 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
         return true;
     }
 
+    // Hash the headers and check their proof of work before taking cs_main.
+    CValidationState state;
+    std::vector<uint256> hashes;
+    if (!CheckBlockHeaders(headers, hashes, state, chainparams.GetConsensus())) {
+        int nDoS = 0;
+        state.IsInvalid(nDoS);
+        LOCK(cs_main);
+        Misbehaving(pfrom->GetId(), nDoS);
+        return error("invalid header received");
+    }
+    for (size_t i = 1; i < nCount; i++) {
+        if (headers[i].hashPrevBlock != hashes[i - 1]) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 20);
+            return error("non-continuous headers sequence");
+        }
+    }
+
     bool received_new_header = false;
     const CBlockIndex *pindexLast = nullptr;
     {
         LOCK(cs_main);
         CNodeState *nodestate = State(pfrom->GetId());
 
+        // Headers we asked for ahead of the headers chain are kept aside
+        // until the chain reaches them.
+        if (g_headers_segments && mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end()) {
+            CHeadersSegments::Request request;
+            switch (g_headers_segments->Receive(pfrom->GetId(), headers, hashes, GetTimeMicros(), request)) {
+            case CHeadersSegments::Result::UNRELATED:
+                break;
+            case CHeadersSegments::Result::INVALID:
+                Misbehaving(pfrom->GetId(), 100);
+                return error("headers segment does not lead to its checkpoint, or is too easy to mine");
+            case CHeadersSegments::Result::ACCEPTED:
+                LogPrint(BCLog::NET, "received %u headers ahead of the headers chain, up to %s (peer=%d)\n", nCount, hashes.back().ToString(), pfrom->GetId());
+                if (!request.hashLocator.IsNull()) {
+                    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS, CBlockLocator({request.hashLocator}), request.hashStop));
+                }
+                return true;
+            }
+        }
+
         // If this looks like it could be a block announcement (nCount <
         // MAX_BLOCKS_TO_ANNOUNCE), use special logic for handling headers that
         // don't connect:
@@ -1299,14 +1641,14 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
             nodestate->nUnconnectingHeaders++;
             connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256()));
             LogPrint(BCLog::NET, "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
-                    headers[0].GetHash().ToString(),
+                    hashes[0].ToString(),
                     headers[0].hashPrevBlock.ToString(),
                     pindexBestHeader->nHeight,
                     pfrom->GetId(), nodestate->nUnconnectingHeaders);
             // Set hashLastUnknownBlock for this peer, so that if we
             // eventually get the headers - even from a different peer -
             // we can use this peer to download.
-            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+            UpdateBlockAvailability(pfrom->GetId(), hashes.back());
 
             if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0) {
                 Misbehaving(pfrom->GetId(), 20);
@@ -1314,25 +1656,15 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
             return true;
         }
 
-        uint256 hashLastBlock;
-        for (const CBlockHeader& header : headers) {
-            if (!hashLastBlock.IsNull() && header.hashPrevBlock != hashLastBlock) {
-                Misbehaving(pfrom->GetId(), 20);
-                return error("non-continuous headers sequence");
-            }
-            hashLastBlock = header.GetHash();
-        }
-
         // If we don't have the last header, then they'll have given us
         // something new (if these headers are valid).
-        if (mapBlockIndex.find(hashLastBlock) == mapBlockIndex.end()) {
+        if (mapBlockIndex.find(hashes.back()) == mapBlockIndex.end()) {
             received_new_header = true;
         }
     }
 
-    CValidationState state;
     CBlockHeader first_invalid_header;
-    if (!ProcessNewBlockHeaders(headers, state, chainparams, &pindexLast, &first_invalid_header)) {
+    if (!ProcessNewBlockHeaders(headers, state, chainparams, &pindexLast, &first_invalid_header, &hashes)) {
         int nDoS;
         if (state.IsInvalid(nDoS)) {
             LOCK(cs_main);
@@ -1377,6 +1709,8 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
         }
     }
 
+    ConnectHeadersSegments(chainparams);
+
     {
         LOCK(cs_main);
         CNodeState *nodestate = State(pfrom->GetId());
@@ -1398,10 +1732,14 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
 
         if (nCount == MAX_HEADERS_RESULTS) {
             // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrint(BCLog::NET, "more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->GetId(), pfrom->nStartingHeight);
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexLast), uint256()));
+            // If we got further than pindexLast already, e.g. with headers
+            // downloaded ahead from other peers, continue from there instead.
+            const CBlockIndex* pindexContinue = pindexLast;
+            if (pindexBestHeader->GetAncestor(pindexLast->nHeight) == pindexLast) {
+                pindexContinue = pindexBestHeader;
+            }
+            LogPrint(BCLog::NET, "more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexContinue->nHeight, pfrom->GetId(), pfrom->nStartingHeight);
+            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexContinue), uint256()));
         }
 
         bool fCanDirectFetch = CanDirectFetch(chainparams.GetConsensus());
@@ -2123,6 +2461,17 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Verify the scripts before taking cs_main for the rest of the
+        // checks, so signature checking does not hold up other threads.
+        bool fAlreadyHave;
+        {
+            LOCK2(cs_main, g_cs_orphans);
+            fAlreadyHave = AlreadyHave(inv);
+        }
+        if (!fAlreadyHave) {
+            PreverifyTransactions(mempool, {ptx});
+        }
+
         LOCK2(cs_main, g_cs_orphans);
 
         bool fMissingInputs = false;
@@ -2155,6 +2504,14 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 vWorkQueue.pop_front();
                 if (itByPrev == mapOrphanTransactionsByPrev.end())
                     continue;
+                // The orphans spending the same output are usually unrelated,
+                // so verify all their scripts at once.
+                std::vector<CTransactionRef> vOrphans;
+                for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
+                    if (!setMisbehaving.count((*mi)->second.fromPeer))
+                        vOrphans.push_back((*mi)->second.tx);
+                }
+                PreverifyTransactions(mempool, vOrphans);
                 for (auto mi = itByPrev->second.begin();
                      mi != itByPrev->second.end();
                      ++mi)
@@ -2404,7 +2761,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 }
 
                 PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
-                ReadStatus status = partialBlock.InitData(cmpctblock, vExtraTxnForCompact);
+                ReadStatus status = partialBlock.InitData(cmpctblock, GetExtraTxnForCompact());
                 if (status == READ_STATUS_INVALID) {
                     MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
                     Misbehaving(pfrom->GetId(), 100);
@@ -2412,24 +2769,28 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                     return true;
                 } else if (status == READ_STATUS_FAILED) {
                     // Duplicate txindexes, the block is now in-flight, so just request it
+                    g_compact_block_stats.nFullBlockFallbacks++;
                     std::vector<CInv> vInv(1);
                     vInv[0] = CInv(MSG_BLOCK | GetFetchFlags(pfrom), cmpctblock.header.GetHash());
                     connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETDATA, vInv));
                     return true;
                 }
 
+                RecordCompactBlockInit(partialBlock);
                 BlockTransactionsRequest req;
                 for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
                     if (!partialBlock.IsTxAvailable(i))
                         req.indexes.push_back(i);
                 }
                 if (req.indexes.empty()) {
+                    g_compact_block_stats.nReconstructed++;
                     // Dirty hack to jump to BLOCKTXN code (TODO: move message handling into their own functions)
                     BlockTransactions txn;
                     txn.blockhash = cmpctblock.header.GetHash();
                     blockTxnMsg << txn;
                     fProcessBLOCKTXN = true;
                 } else {
+                    g_compact_block_stats.nRoundTrips++;
                     req.blockhash = pindex->GetBlockHash();
                     connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETBLOCKTXN, req));
                 }
@@ -2440,14 +2801,16 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 // Optimistically try to reconstruct anyway since we might be
                 // able to without any round trips.
                 PartiallyDownloadedBlock tempBlock(&mempool);
-                ReadStatus status = tempBlock.InitData(cmpctblock, vExtraTxnForCompact);
+                ReadStatus status = tempBlock.InitData(cmpctblock, GetExtraTxnForCompact());
                 if (status != READ_STATUS_OK) {
                     // TODO: don't ignore failures
                     return true;
                 }
+                RecordCompactBlockInit(tempBlock);
                 std::vector<CTransactionRef> dummy;
                 status = tempBlock.FillBlock(*pblock, dummy);
                 if (status == READ_STATUS_OK) {
+                    g_compact_block_stats.nReconstructed++;
                     fBlockReconstructed = true;
                 }
             }
@@ -2521,6 +2884,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
 
         std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
         bool fBlockRead = false;
+        // Take the partial block out of the in-flight state, so that the
+        // block can be reconstructed and checked without holding cs_main.
+        // It can only be filled once anyway.
+        std::unique_ptr<PartiallyDownloadedBlock> partialBlock;
         {
             LOCK(cs_main);
 
@@ -2530,16 +2897,26 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 LogPrint(BCLog::NET, "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->GetId());
                 return true;
             }
+            partialBlock = std::move(it->second.second->partialBlock);
+        }
 
-            PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
-            ReadStatus status = partialBlock.FillBlock(*pblock, resp.txn);
+        ReadStatus status = partialBlock->FillBlock(*pblock, resp.txn);
+        {
+            LOCK(cs_main);
+
+            // Another peer may have delivered the block in the meantime, in
+            // which case its download state is no longer ours to reset.
+            std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+            const bool fStillInFlight = it != mapBlocksInFlight.end() && it->second.first == pfrom->GetId();
             if (status == READ_STATUS_INVALID) {
-                MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+                if (fStillInFlight)
+                    MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
                 Misbehaving(pfrom->GetId(), 100);
                 LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->GetId());
                 return true;
             } else if (status == READ_STATUS_FAILED) {
                 // Might have collided, fall back to getdata now :(
+                g_compact_block_stats.nFullBlockFallbacks++;
                 std::vector<CInv> invs;
                 invs.push_back(CInv(MSG_BLOCK | GetFetchFlags(pfrom), resp.blockhash));
                 connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::GETDATA, invs));
@@ -2561,7 +2938,8 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 // though the block was successfully read, and rely on the
                 // handling in ProcessNewBlock to ensure the block index is
                 // updated, reject messages go out, etc.
-                MarkBlockAsReceived(resp.blockhash); // it is now an empty pointer
+                if (fStillInFlight)
+                    MarkBlockAsReceived(resp.blockhash);
                 fBlockRead = true;
                 // mapBlockSource is only used for sending reject messages and DoS scores,
                 // so the race between here and cs_main in ProcessNewBlock is fine.
@@ -2618,6 +2996,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
     else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+        const size_t nBlockBytes = vRecv.size();
         vRecv >> *pblock;
 
         LogPrint(BCLog::NET, "received block %s peer=%d\n", pblock->GetHash().ToString(), pfrom->GetId());
@@ -2626,6 +3005,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         const uint256 hash(pblock->GetHash());
         {
             LOCK(cs_main);
+            UpdateBlockDownloadStats(pfrom->GetId(), hash, nBlockBytes);
             // Also always process if we requested the block explicitly, as we may
             // need it even though it is not a candidate for a new best tip.
             forceProcessing |= MarkBlockAsReceived(hash);
@@ -2664,7 +3044,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         std::vector<CAddress> vAddr = connman->GetAddresses();
         FastRandomContext insecure_rand;
         for (const CAddress &addr : vAddr)
@@ -2910,7 +3293,10 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     if (pfrom->fPauseSend)
         return false;
 
-    std::list<CNetMessage> msgs;
+    // The message goes back to pfrom's receive pool when we are done with it
+    CProcessedMessages processed(pfrom);
+    std::list<CNetMessage>& msgs = processed.msgs;
+    bool fUnpaused;
     {
         LOCK(pfrom->cs_vProcessMsg);
         if (pfrom->vProcessMsg.empty())
@@ -2918,9 +3304,15 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
         // Just take one message
         msgs.splice(msgs.begin(), pfrom->vProcessMsg, pfrom->vProcessMsg.begin());
         pfrom->nProcessQueueSize -= msgs.front().vRecv.size() + CMessageHeader::HEADER_SIZE;
+        const bool fWasPaused = pfrom->fPauseRecv;
         pfrom->fPauseRecv = pfrom->nProcessQueueSize > connman->GetReceiveFloodSize();
+        fUnpaused = fWasPaused && !pfrom->fPauseRecv;
         fMoreWork = !pfrom->vProcessMsg.empty();
     }
+    if (fUnpaused) {
+        // The socket handler is not waiting for data from this peer.
+        connman->WakeSocketHandler(pfrom);
+    }
     CNetMessage& msg(msgs.front());
 
     msg.SetVersion(pfrom->GetRecvVersion());
@@ -3134,23 +3526,6 @@ void PeerLogicValidation::CheckForStaleTipAndEvictPeers(const Consensus::Params
     }
 }
 
-class CompareInvMempoolOrder
-{
-    CTxMemPool *mp;
-public:
-    explicit CompareInvMempoolOrder(CTxMemPool *_mempool)
-    {
-        mp = _mempool;
-    }
-
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
-    {
-        /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
-    }
-};
-
 bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptMsgProc)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -3211,6 +3586,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
+            LOCK(pto->cs_addrToSend);
             std::vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             for (const CAddress& addr : pto->vAddrToSend)
@@ -3259,6 +3635,16 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                 connman->PushMessage(pto, msgMaker.Make(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexStart), uint256()));
             }
         }
+        // While the headers sync is far behind, download headers further
+        // ahead from other peers.
+        if (g_headers_segments && !state.fSyncStarted && fFetch && !pto->fClient && !fImporting && !fReindex &&
+                pindexBestHeader->GetBlockTime() <= GetAdjustedTime() - 24 * 60 * 60) {
+            CHeadersSegments::Request request;
+            if (g_headers_segments->Assign(pto->GetId(), pindexBestHeader->nHeight, pindexBestHeader->nBits, pto->nStartingHeight, GetTimeMicros(), request)) {
+                LogPrint(BCLog::NET, "getheaders ahead from %s to peer=%d\n", request.hashLocator.ToString(), pto->GetId());
+                connman->PushMessage(pto, msgMaker.Make(NetMsgType::GETHEADERS, CBlockLocator({request.hashLocator}), request.hashStop));
+            }
+        }
 
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
@@ -3348,12 +3734,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                     {
                         LOCK(cs_most_recent_block);
                         if (most_recent_block_hash == pBestIndex->GetBlockHash()) {
-                            if (state.fWantsCmpctWitness || !fWitnessesPresentInMostRecentCompactBlock)
-                                connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *most_recent_compact_block));
-                            else {
-                                CBlockHeaderAndShortTxIDs cmpctblock(*most_recent_block, state.fWantsCmpctWitness);
-                                connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
-                            }
+                            connman->PushMessage(pto, MostRecentCompactBlockMsg(state.fWantsCmpctWitness));
                             fGotBlockFromCache = true;
                         }
                     }
@@ -3375,7 +3756,16 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                         LogPrint(BCLog::NET, "%s: sending header %s to peer=%d\n", __func__,
                                 vHeaders.front().GetHash().ToString(), pto->GetId());
                     }
-                    connman->PushMessage(pto, msgMaker.Make(NetMsgType::HEADERS, vHeaders));
+                    bool fGotHeadersFromCache = false;
+                    if (vHeaders.size() == 1) {
+                        LOCK(cs_most_recent_block);
+                        if (most_recent_block_hash == pBestIndex->GetBlockHash()) {
+                            connman->PushMessage(pto, MostRecentHeadersMsg());
+                            fGotHeadersFromCache = true;
+                        }
+                    }
+                    if (!fGotHeadersFromCache)
+                        connman->PushMessage(pto, msgMaker.Make(NetMsgType::HEADERS, vHeaders));
                     state.pindexBestHeaderSent = pBestIndex;
                 } else
                     fRevertToInv = true;
@@ -3431,8 +3821,12 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
             bool fSendTrickle = pto->fWhitelisted;
             if (pto->nNextInvSend < nNow) {
                 fSendTrickle = true;
-                // Use half the delay for outbound peers, as there is less privacy concern for them.
-                pto->nNextInvSend = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL >> !pto->fInbound);
+                if (pto->fInbound) {
+                    pto->nNextInvSend = connman->PoissonNextSendInbound(nNow, INVENTORY_BROADCAST_INTERVAL);
+                } else {
+                    // Use half the delay for outbound peers, as there is less privacy concern for them.
+                    pto->nNextInvSend = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL >> 1);
+                }
             }
 
             // Time to send but the peer has requested we not relay transactions.
@@ -3476,11 +3870,45 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
 
             // Determine transactions to relay
             if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                std::vector<std::set<uint256>::iterator> vInvTx;
+                // Produce a vector with all candidates for sending, along
+                // with their depth and score. Those no longer in the mempool
+                // are not worth sending.
+                typedef std::pair<DepthAndScore, std::set<uint256>::iterator> InvTxCandidate;
+                std::vector<InvTxCandidate> vInvTx;
                 vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
+                {
+                    LOCK(cs_inv_order);
+                    {
+                        LOCK(cs_inv_order_stale);
+                        for (const uint256& hash : g_inv_order_stale) {
+                            g_inv_order.erase(hash);
+                        }
+                        g_inv_order_stale.clear();
+                    }
+                    std::vector<std::set<uint256>::iterator> vLookup;
+                    for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
+                        auto found = g_inv_order.find(*it);
+                        if (found != g_inv_order.end()) {
+                            vInvTx.emplace_back(found->second, it);
+                        } else {
+                            vLookup.push_back(it);
+                        }
+                    }
+                    if (!vLookup.empty()) {
+                        if (g_inv_order.size() + vLookup.size() > MAX_INV_ORDER_SIZE) {
+                            g_inv_order.clear();
+                        }
+                        LOCK(mempool.cs);
+                        for (std::set<uint256>::iterator it : vLookup) {
+                            DepthAndScore key;
+                            if (mempool.GetDepthAndScore(*it, key)) {
+                                g_inv_order.emplace(*it, key);
+                                vInvTx.emplace_back(key, it);
+                            } else {
+                                pto->setInventoryTxToSend.erase(it);
+                            }
+                        }
+                    }
                 }
                 CAmount filterrate = 0;
                 {
@@ -3489,7 +3917,11 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                 }
                 // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
                 // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
+                // As std::make_heap produces a max-heap, we want the entries with the
+                // fewest ancestors/highest fee to sort later.
+                auto compareInvMempoolOrder = [](const InvTxCandidate& a, const InvTxCandidate& b) {
+                    return b.first < a.first;
+                };
                 std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
@@ -3498,7 +3930,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                 while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
                     // Fetch the top element from the heap
                     std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
+                    std::set<uint256>::iterator it = vInvTx.back().second;
                     vInvTx.pop_back();
                     uint256 hash = *it;
                     // Remove it from the to-be-sent set
@@ -3608,14 +4040,31 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
         // Message: getdata (blocks)
         //
         std::vector<CInv> vGetData;
-        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        const int nBlockWindow = state.m_block_download.GetWindow();
+        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nBlockWindow) {
             std::vector<const CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            const CBlockIndex* pindexWaiting = nullptr;
+            FindNextBlocksToDownload(pto->GetId(), nBlockWindow - state.nBlocksInFlight, vToDownload, staller, pindexWaiting, consensusParams);
+            // Rather than waiting for the first block in flight to time out or stall the
+            // download window, request it from this peer if it would arrive much sooner.
+            if (pindexWaiting && ShouldTakeOverBlock(pto->GetId(), pindexWaiting, nNow)) {
+                const NodeId nodeSlow = mapBlocksInFlight[pindexWaiting->GetBlockHash()].first;
+                State(nodeSlow)->m_blocks_reassigned++;
+                LogPrint(BCLog::NET, "Reassigning block %s (%d) from peer=%d to peer=%d\n", pindexWaiting->GetBlockHash().ToString(),
+                    pindexWaiting->nHeight, nodeSlow, pto->GetId());
+                if (state.nBlocksInFlight + (int)vToDownload.size() >= nBlockWindow) {
+                    vToDownload.pop_back();
+                }
+                vToDownload.insert(vToDownload.begin(), pindexWaiting);
+            }
             for (const CBlockIndex *pindex : vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
+                if (pindex == pindexWaiting) {
+                    mapBlocksInFlight[pindex->GetBlockHash()].second->fReassigned = true;
+                }
                 LogPrint(BCLog::NET, "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->GetId());
             }
@@ -16,8 +16,10 @@ static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
 static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 /** Minimum time between orphan transactions expire time checks in seconds */
 static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
-/** Default number of orphan+recently-replaced txn to keep around for block reconstruction */
-static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
+/** Default number of orphan+rejected+recently-replaced txn to keep around for block reconstruction */
+static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 1000;
+/** Default for -blockreconstructionextratxnsize, maximum memory usage of those txn in megabytes */
+static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN_SIZE = 10;
 /** Headers download timeout expressed in microseconds
  *  Timeout = base + per_header * (expected number of headers) */
 static constexpr int64_t HEADERS_DOWNLOAD_TIMEOUT_BASE = 15 * 60 * 1000000; // 15 minutes
@@ -41,6 +43,7 @@ private:
 
 public:
     explicit PeerLogicValidation(CConnman* connman, CScheduler &scheduler);
+    ~PeerLogicValidation();
 
     void BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex* pindexConnected, const std::vector<CTransactionRef>& vtxConflicted) override;
     void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload) override;
@@ -67,6 +70,10 @@ public:
 
 private:
     int64_t m_stale_tip_check_time; //! Next time to check for stale tip
+
+    /** Mempool callbacks marking transactions whose depth or score may have changed */
+    void InvOrderEntryRemoved(CTransactionRef ptx, MemPoolRemovalReason reason);
+    void InvOrderEntryPrioritised(const uint256& hash);
 };
 
 struct CNodeStateStats {
@@ -74,8 +81,28 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlockWindow;
+    double dBlockBandwidth;
+    double dBlockLatency;
+    uint64_t nBlocksReassigned;
+};
+
+struct CCompactBlockStats {
+    uint64_t nBlocks;             //!< Compact blocks we started reconstructing
+    uint64_t nReconstructed;      //!< Of which reconstructed without a getblocktxn round trip
+    uint64_t nRoundTrips;         //!< getblocktxn requests sent
+    uint64_t nFullBlockFallbacks; //!< Full blocks requested because reconstruction failed
+    uint64_t nTxPrefilled;
+    uint64_t nTxMempool;
+    uint64_t nTxExtra;            //!< Found among orphans and extra txn
+    uint64_t nTxMissing;
+    size_t nExtraTxns;
+    size_t nExtraTxnsUsage;
+    size_t nExtraTxnsMaxUsage;
 };
 
+/** Get statistics about compact block reconstruction */
+void GetCompactBlockStats(CCompactBlockStats& stats);
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 /** Increase a node's misbehavior score. */
@@ -71,6 +71,25 @@ unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nF
     return bnNew.GetCompact();
 }
 
+unsigned int GetEasiestWorkAfter(int nBaseHeight, unsigned int nBaseBits, int nHeight, const Consensus::Params& params)
+{
+    const arith_uint256 bnPowLimit = UintToArith256(params.powLimit);
+    if (params.fPowAllowMinDifficultyBlocks)
+        return bnPowLimit.GetCompact();
+    if (params.fPowNoRetargeting)
+        return nBaseBits;
+
+    arith_uint256 bnEasiest;
+    bnEasiest.SetCompact(nBaseBits);
+    const int64_t nInterval = params.DifficultyAdjustmentInterval();
+    for (int64_t nAdjustments = nHeight / nInterval - nBaseHeight / nInterval; nAdjustments > 0; nAdjustments--) {
+        if (bnEasiest > bnPowLimit / 4)
+            return bnPowLimit.GetCompact();
+        bnEasiest *= 4;
+    }
+    return bnEasiest.GetCompact();
+}
+
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params& params)
 {
     bool fNegative;
@@ -17,6 +17,13 @@ class uint256;
 unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params&);
 unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nFirstBlockTime, const Consensus::Params&);
 
+/**
+ * Return the easiest target, in compact form, that a block at nHeight can have
+ * on a chain whose block at nBaseHeight has nBaseBits, the target growing at
+ * most fourfold at each difficulty adjustment in between.
+ */
+unsigned int GetEasiestWorkAfter(int nBaseHeight, unsigned int nBaseBits, int nHeight, const Consensus::Params&);
+
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&);
 
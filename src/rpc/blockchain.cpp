@@ -23,6 +23,7 @@
 #include <txmempool.h>
 #include <util.h>
 #include <utilstrencodings.h>
+#include <utxosnapshot.h>
 #include <hash.h>
 #include <validationinterface.h>
 #include <warnings.h>
@@ -823,59 +824,39 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nBogoSize(0), nDiskSize(0), nTotalAmount(0) {}
 };
 
-static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
-{
-    assert(!outputs.empty());
-    ss << hash;
-    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
-    stats.nTransactions++;
-    for (const auto output : outputs) {
-        ss << VARINT(output.first + 1);
-        ss << output.second.out.scriptPubKey;
-        ss << VARINT(output.second.out.nValue);
-        stats.nTransactionOutputs++;
-        stats.nTotalAmount += output.second.out.nValue;
-        stats.nBogoSize += 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
-                           2 /* scriptPubKey len */ + output.second.out.scriptPubKey.size() /* scriptPubKey */;
-    }
-    ss << VARINT(0);
-}
-
 //! Calculate statistics about the unspent transaction output set
 static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
 {
     std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor());
     assert(pcursor);
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = pcursor->GetBestBlock();
     {
         LOCK(cs_main);
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
     }
-    ss << stats.hashBlock;
+    CUTXOSetHasher hasher(stats.hashBlock);
     uint256 prevkey;
-    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         COutPoint key;
         Coin coin;
         if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
-            if (!outputs.empty() && key.hash != prevkey) {
-                ApplyStats(stats, ss, prevkey, outputs);
-                outputs.clear();
+            if (stats.nTransactions == 0 || key.hash != prevkey) {
+                stats.nTransactions++;
+                prevkey = key.hash;
             }
-            prevkey = key.hash;
-            outputs[key.n] = std::move(coin);
+            stats.nTransactionOutputs++;
+            stats.nTotalAmount += coin.out.nValue;
+            stats.nBogoSize += 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
+                               2 /* scriptPubKey len */ + coin.out.scriptPubKey.size() /* scriptPubKey */;
+            hasher.Add(key, coin);
         } else {
             return error("%s: unable to read value", __func__);
         }
         pcursor->Next();
     }
-    if (!outputs.empty()) {
-        ApplyStats(stats, ss, prevkey, outputs);
-    }
-    stats.hashSerialized = ss.GetHash();
+    stats.hashSerialized = hasher.GetHash();
     stats.nDiskSize = view->EstimateSize();
     return true;
 }
@@ -971,6 +952,46 @@ UniValue gettxoutsetinfo(const JSONRPCRequest& request)
     return ret;
 }
 
+UniValue getcoinscacheinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw std::runtime_error(
+            "getcoinscacheinfo\n"
+            "\nReturns statistics about the in-memory cache of the unspent transaction output set.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"usage\": n,             (numeric) Memory used by the cache, in bytes\n"
+            "  \"maxusage\": n,          (numeric) Memory the cache may use before it is written to disk (see -dbcache)\n"
+            "  \"pendingusage\": n,      (numeric) Memory held by coins still being written in the background (see -backgroundflush)\n"
+            "  \"retainusage\": n,       (numeric) Memory kept filled with recently used coins after a write (see -dbcacheretain)\n"
+            "  \"entries\": n,           (numeric) Number of cached outputs\n"
+            "  \"hits\": n,              (numeric) Lookups answered from the cache since startup\n"
+            "  \"misses\": n,            (numeric) Lookups that had to go to the database since startup\n"
+            "  \"hitrate\": x.xxx,       (numeric) hits / (hits + misses)\n"
+            "  \"evictions\": n          (numeric) Cached outputs dropped to stay within retainusage since startup\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcoinscacheinfo", "")
+            + HelpExampleRpc("getcoinscacheinfo", "")
+        );
+
+    LOCK(cs_main);
+    const CCoinsCacheStats& stats = pcoinsTip->GetStats();
+    uint64_t lookups = stats.hits + stats.misses;
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("usage", (int64_t)pcoinsTip->DynamicMemoryUsage()));
+    ret.push_back(Pair("maxusage", (int64_t)nCoinCacheUsage));
+    ret.push_back(Pair("pendingusage", (int64_t)pcoinsdbview->PendingMemoryUsage()));
+    ret.push_back(Pair("retainusage", (int64_t)(nCoinCacheUsage / 100 * nCoinCacheRetain)));
+    ret.push_back(Pair("entries", (int64_t)pcoinsTip->GetCacheSize()));
+    ret.push_back(Pair("hits", stats.hits));
+    ret.push_back(Pair("misses", stats.misses));
+    ret.push_back(Pair("hitrate", lookups ? (double)stats.hits / lookups : 0.0));
+    ret.push_back(Pair("evictions", stats.evictions));
+    return ret;
+}
+
 UniValue gettxout(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 2 || request.params.size() > 3)
@@ -1618,6 +1639,105 @@ UniValue savemempool(const JSONRPCRequest& request)
     return NullUniValue;
 }
 
+UniValue dumptxoutset(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1) {
+        throw std::runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrite the unspent transaction output set at the current tip to a snapshot file.\n"
+            "\nArguments:\n"
+            "1. \"path\"           (string, required) Path to the snapshot file. Relative paths are relative to the data directory.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"coins_written\": n,          (numeric) The number of coins written\n"
+            "  \"base_hash\": \"hash\",        (string) The hash of the block the snapshot was taken at\n"
+            "  \"base_height\": n,            (numeric) The height of that block\n"
+            "  \"path\": \"path\",             (string) The absolute path of the snapshot file\n"
+            "  \"hash_serialized_2\": \"hash\" (string) The serialized hash of the set, as reported by gettxoutsetinfo\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+    }
+
+    fs::path path = fs::absolute(request.params[0].get_str(), GetDataDir());
+    if (fs::exists(path)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+    }
+
+    SnapshotMetadata metadata;
+    std::unique_ptr<CCoinsViewCursor> pcursor;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        // The cursor iterates a consistent view of the database as of now, so
+        // the file can be written without holding cs_main.
+        pcursor.reset(pcoinsdbview->Cursor());
+        const CBlockIndex* tip = chainActive.Tip();
+        assert(pcursor->GetBestBlock() == tip->GetBlockHash());
+        memcpy(metadata.message_start, Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE);
+        metadata.base_hash = tip->GetBlockHash();
+        metadata.base_height = tip->nHeight;
+        metadata.chain_tx = tip->nChainTx;
+        metadata.headers.reserve(tip->nHeight);
+        for (int height = 1; height <= tip->nHeight; ++height) {
+            metadata.headers.push_back(chainActive[height]->GetBlockHeader());
+        }
+    }
+
+    std::string error;
+    if (!WriteUTXOSnapshot(*pcursor, metadata, path, error)) {
+        throw JSONRPCError(RPC_MISC_ERROR, error);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("coins_written", metadata.coins_count));
+    ret.push_back(Pair("base_hash", metadata.base_hash.GetHex()));
+    ret.push_back(Pair("base_height", metadata.base_height));
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("hash_serialized_2", metadata.utxo_hash.GetHex()));
+    return ret;
+}
+
+UniValue loadtxoutset(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1) {
+        throw std::runtime_error(
+            "loadtxoutset \"path\"\n"
+            "\nReplace the chainstate of a freshly started pruned node with a snapshot written by dumptxoutset.\n"
+            "The snapshot's base block becomes the tip; the blocks below it are never downloaded or validated.\n"
+            "Only a snapshot whose UTXO set hash is built in for the height of its base block is accepted.\n"
+            "\nArguments:\n"
+            "1. \"path\"           (string, required) Path to the snapshot file. Relative paths are relative to the data directory.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"coins_loaded\": n,           (numeric) The number of coins loaded\n"
+            "  \"base_hash\": \"hash\",        (string) The hash of the block the snapshot was taken at\n"
+            "  \"base_height\": n,            (numeric) The height of that block\n"
+            "  \"hash_serialized_2\": \"hash\" (string) The serialized hash of the set, as reported by gettxoutsetinfo\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadtxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("loadtxoutset", "\"utxo.dat\"")
+        );
+    }
+
+    fs::path path = fs::absolute(request.params[0].get_str(), GetDataDir());
+    SnapshotMetadata metadata;
+    std::string error;
+    if (!LoadUTXOSnapshot(path, Params(), metadata, error)) {
+        throw JSONRPCError(RPC_MISC_ERROR, error);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("coins_loaded", metadata.coins_count));
+    ret.push_back(Pair("base_hash", metadata.base_hash.GetHex()));
+    ret.push_back(Pair("base_height", metadata.base_height));
+    ret.push_back(Pair("hash_serialized_2", metadata.utxo_hash.GetHex()));
+    return ret;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         argNames
   //  --------------------- ------------------------  -----------------------  ----------
@@ -1637,9 +1757,12 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getrawmempool",          &getrawmempool,          {"verbose"} },
     { "blockchain",         "gettxout",               &gettxout,               {"txid","n","include_mempool"} },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {} },
+    { "blockchain",         "getcoinscacheinfo",      &getcoinscacheinfo,      {} },
     { "blockchain",         "pruneblockchain",        &pruneblockchain,        {"height"} },
     { "blockchain",         "savemempool",            &savemempool,            {} },
     { "blockchain",         "verifychain",            &verifychain,            {"checklevel","nblocks"} },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           {"path"} },
+    { "blockchain",         "loadtxoutset",           &loadtxoutset,           {"path"} },
 
     { "blockchain",         "preciousblock",          &preciousblock,          {"blockhash"} },
 
@@ -199,6 +199,11 @@ UniValue getmininginfo(const JSONRPCRequest& request)
             "  \"difficulty\": xxx.xxxxx    (numeric) The current difficulty\n"
             "  \"networkhashps\": nnn,      (numeric) The network hashes per second\n"
             "  \"pooledtx\": n              (numeric) The size of the mempool\n"
+            "  \"templatebuilds\": n        (numeric) Block templates assembled from scratch for getblocktemplate\n"
+            "  \"templatebuildtime\": n     (numeric) Microseconds taken to assemble the last of them\n"
+            "  \"templateupdates\": n       (numeric) Transactions appended to block templates as they entered the mempool\n"
+            "  \"templateupdatetime\": n    (numeric) Microseconds taken to append the last of them\n"
+            "  \"templategettime\": n       (numeric) Microseconds taken to hand out the last block template\n"
             "  \"chain\": \"xxxx\",           (string) current network name as defined in BIP70 (main, ai, regtest)\n"
             "  \"warnings\": \"...\"          (string) any network and blockchain warnings\n"
             "  \"errors\": \"...\"            (string) DEPRECATED. Same as warnings. Only shown when starwelsd is started with -deprecatedrpc=getmininginfo\n"
@@ -218,6 +223,14 @@ UniValue getmininginfo(const JSONRPCRequest& request)
     obj.push_back(Pair("difficulty",       (double)GetDifficulty()));
     obj.push_back(Pair("networkhashps",    getnetworkhashps(request)));
     obj.push_back(Pair("pooledtx",         (uint64_t)mempool.size()));
+    if (g_template_builder) {
+        const BlockTemplateBuilder::Stats stats = g_template_builder->GetStats();
+        obj.push_back(Pair("templatebuilds",     stats.nBuilds));
+        obj.push_back(Pair("templatebuildtime",  stats.nLastBuildTime));
+        obj.push_back(Pair("templateupdates",    stats.nUpdates));
+        obj.push_back(Pair("templateupdatetime", stats.nLastUpdateTime));
+        obj.push_back(Pair("templategettime",    stats.nLastGetTime));
+    }
     obj.push_back(Pair("chain",            Params().NetworkIDString()));
     if (IsDeprecatedRPCEnabled("getmininginfo")) {
         obj.push_back(Pair("errors",       GetWarnings("statusbar")));
@@ -502,34 +515,15 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     bool fSupportsSegwit = setClientRules.find(segwit_info.name) != setClientRules.end();
 
     // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static std::unique_ptr<CBlockTemplate> pblocktemplate;
-    // Cache whether the last invocation was with segwit support, to avoid returning
-    // a segwit-block to a non-segwit caller.
-    static bool fLastTemplateSupportsSegwit = true;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5) ||
-        fLastTemplateSupportsSegwit != fSupportsSegwit)
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = nullptr;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-        fLastTemplateSupportsSegwit = fSupportsSegwit;
-
-        // Create new block
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy, fSupportsSegwit);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
+    if (!g_template_builder)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block template builder not available");
+    // The builder keeps its template up to date with the chain and mempool,
+    // so it only hands out a copy; it is only assembled again when needed.
+    nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    std::unique_ptr<CBlockTemplate> pblocktemplate = g_template_builder->GetTemplate(fSupportsSegwit);
+    if (!pblocktemplate)
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
     const Consensus::Params& consensusParams = Params().GetConsensus();
 
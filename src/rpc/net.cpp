@@ -84,6 +84,8 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
             "    \"lastrecv\": ttt,           (numeric) The time in seconds since epoch (Jan 1 1970 GMT) of the last receive\n"
             "    \"bytessent\": n,            (numeric) The total bytes sent\n"
             "    \"bytesrecv\": n,            (numeric) The total bytes received\n"
+            "    \"recvbufallocs\": n,        (numeric) The number of times a receive buffer was allocated or grown\n"
+            "    \"recvbufreuses\": n,        (numeric) The number of messages received into the buffer of an earlier one\n"
             "    \"conntime\": ttt,           (numeric) The connection time in seconds since epoch (Jan 1 1970 GMT)\n"
             "    \"timeoffset\": ttt,         (numeric) The time offset in seconds\n"
             "    \"pingtime\": n,             (numeric) ping time (if available)\n"
@@ -101,6 +103,10 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ],\n"
+            "    \"inflight_window\": n,      (numeric) The number of blocks we keep in flight from this peer, sized from how fast it delivers them\n"
+            "    \"block_bandwidth\": n,      (numeric) The rate, in bytes per second, at which this peer sends the blocks we request\n"
+            "    \"block_latency\": n,        (numeric) The time, in seconds, this peer takes to start sending a block we request\n"
+            "    \"blocks_reassigned\": n,    (numeric) The number of blocks in flight from this peer that were requested from a faster one\n"
             "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,              (numeric) The total bytes sent aggregated by message type\n"
@@ -142,6 +148,8 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
         obj.push_back(Pair("lastrecv", stats.nLastRecv));
         obj.push_back(Pair("bytessent", stats.nSendBytes));
         obj.push_back(Pair("bytesrecv", stats.nRecvBytes));
+        obj.push_back(Pair("recvbufallocs", stats.nRecvBufferAllocs));
+        obj.push_back(Pair("recvbufreuses", stats.nRecvBufferReuses));
         obj.push_back(Pair("conntime", stats.nTimeConnected));
         obj.push_back(Pair("timeoffset", stats.nTimeOffset));
         if (stats.dPingTime > 0.0)
@@ -167,6 +175,10 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("inflight_window", statestats.nBlockWindow));
+            obj.push_back(Pair("block_bandwidth", statestats.dBlockBandwidth));
+            obj.push_back(Pair("block_latency", statestats.dBlockLatency));
+            obj.push_back(Pair("blocks_reassigned", statestats.nBlocksReassigned));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -392,6 +404,52 @@ UniValue getnettotals(const JSONRPCRequest& request)
     return obj;
 }
 
+UniValue getcompactblockstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 0)
+        throw std::runtime_error(
+            "getcompactblockstats\n"
+            "\nReturns how compact blocks received since startup were reconstructed.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"blocks\": n,              (numeric) Compact blocks we started reconstructing\n"
+            "  \"reconstructed\": n,       (numeric) Of which reconstructed without requesting any transactions\n"
+            "  \"roundtrips\": n,          (numeric) Requests for missing transactions (getblocktxn) sent\n"
+            "  \"fallbacks\": n,           (numeric) Full blocks requested because reconstruction failed\n"
+            "  \"txn_prefilled\": n,       (numeric) Transactions sent along in the compact blocks\n"
+            "  \"txn_mempool\": n,         (numeric) Transactions found in the mempool\n"
+            "  \"txn_extra\": n,           (numeric) Transactions found among orphans and extra transactions\n"
+            "  \"txn_missing\": n,         (numeric) Transactions we did not have\n"
+            "  \"hitrate\": x.xxx,         (numeric) Fraction of the transactions not sent along that we had\n"
+            "  \"extra_txn\": n,           (numeric) Rejected, orphan and replaced transactions kept for reconstruction\n"
+            "  \"extra_txn_usage\": n,     (numeric) Their memory usage in bytes\n"
+            "  \"extra_txn_maxusage\": n   (numeric) Maximum memory usage, see -blockreconstructionextratxnsize\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcompactblockstats", "")
+            + HelpExampleRpc("getcompactblockstats", "")
+        );
+
+    CCompactBlockStats stats;
+    GetCompactBlockStats(stats);
+    const uint64_t nTxHave = stats.nTxMempool + stats.nTxExtra;
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("blocks", stats.nBlocks));
+    obj.push_back(Pair("reconstructed", stats.nReconstructed));
+    obj.push_back(Pair("roundtrips", stats.nRoundTrips));
+    obj.push_back(Pair("fallbacks", stats.nFullBlockFallbacks));
+    obj.push_back(Pair("txn_prefilled", stats.nTxPrefilled));
+    obj.push_back(Pair("txn_mempool", stats.nTxMempool));
+    obj.push_back(Pair("txn_extra", stats.nTxExtra));
+    obj.push_back(Pair("txn_missing", stats.nTxMissing));
+    obj.push_back(Pair("hitrate", nTxHave + stats.nTxMissing ? (double)nTxHave / (nTxHave + stats.nTxMissing) : 1.0));
+    obj.push_back(Pair("extra_txn", (uint64_t)stats.nExtraTxns));
+    obj.push_back(Pair("extra_txn_usage", (uint64_t)stats.nExtraTxnsUsage));
+    obj.push_back(Pair("extra_txn_maxusage", (uint64_t)stats.nExtraTxnsMaxUsage));
+    return obj;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -634,6 +692,7 @@ static const CRPCCommand commands[] =
     { "network",            "disconnectnode",         &disconnectnode,         {"address", "nodeid"} },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       {"node"} },
     { "network",            "getnettotals",           &getnettotals,           {} },
+    { "network",            "getcompactblockstats",   &getcompactblockstats,   {} },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         {} },
     { "network",            "setban",                 &setban,                 {"subnet", "command", "bantime", "absolute"} },
     { "network",            "listbanned",             &listbanned,             {} },
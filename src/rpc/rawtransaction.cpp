@@ -1034,6 +1034,98 @@ UniValue sendrawtransaction(const JSONRPCRequest& request)
     return hashTx.GetHex();
 }
 
+UniValue submitpackage(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw std::runtime_error(
+            "submitpackage [\"hexstring\",...] ( allowhighfees )\n"
+            "\nSubmits a package of raw transactions to local node and network, to be accepted to the mempool together.\n"
+            "The package is a child transaction and its unconfirmed parents, with the parents first. Parents that pay too\n"
+            "little to be accepted on their own are accepted if the fees of the whole package make up for them.\n"
+            "Either all of the package is accepted or none of it.\n"
+            "\nArguments:\n"
+            "1. \"hexstrings\"   (array, required) The hex strings of the raw transactions, the child last\n"
+            "2. allowhighfees    (boolean, optional, default=false) Allow high fees\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txids\": [\"hex\",...],   (array) The transaction hashes, in package order\n"
+            "  \"fees\": x.xxx,          (numeric) The fees of the package in " + CURRENCY_UNIT + ", including those already in the mempool\n"
+            "  \"vsize\": n,             (numeric) The virtual size of the package\n"
+            "  \"feerate\": x.xxx        (numeric) The feerate of the package in " + CURRENCY_UNIT + "/kB\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("submitpackage", "\"[\\\"parenthex\\\",\\\"childhex\\\"]\"")
+            + HelpExampleRpc("submitpackage", "[\"parenthex\",\"childhex\"]")
+        );
+
+    ObserveSafeMode();
+
+    RPCTypeCheck(request.params, {UniValue::VARR, UniValue::VBOOL});
+
+    const UniValue& hexstrings = request.params[0].get_array();
+    if (hexstrings.size() > MAX_PACKAGE_COUNT)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Too many transactions in package (max %u)", MAX_PACKAGE_COUNT));
+    std::vector<CTransactionRef> package;
+    for (size_t i = 0; i < hexstrings.size(); i++) {
+        CMutableTransaction mtx;
+        if (!DecodeHexTx(mtx, hexstrings[i].get_str()))
+            throw JSONRPCError(RPC_DESERIALIZATION_ERROR, strprintf("TX decode failed for transaction %u", i));
+        package.push_back(MakeTransactionRef(std::move(mtx)));
+    }
+
+    CAmount nMaxRawTxFee = maxTxFee;
+    if (!request.params[1].isNull() && request.params[1].get_bool())
+        nMaxRawTxFee = 0;
+
+    CValidationState state;
+    uint256 failed_txid;
+    if (!AcceptPackageToMemoryPool(mempool, state, package, &failed_txid, nMaxRawTxFee)) {
+        std::string strError = strprintf("%i: %s", state.GetRejectCode(), state.GetRejectReason());
+        if (!failed_txid.IsNull())
+            strError += strprintf(" (transaction %s)", failed_txid.GetHex());
+        throw JSONRPCError(RPC_TRANSACTION_REJECTED, strError);
+    }
+
+    // As for sendrawtransaction, make sure the wallet saw the transactions
+    // before returning.
+    std::promise<void> promise;
+    CallFunctionInValidationInterfaceQueue([&promise] {
+        promise.set_value();
+    });
+    promise.get_future().wait();
+
+    UniValue txids(UniValue::VARR);
+    CAmount nFees = 0;
+    size_t nSize = 0;
+    {
+        LOCK(mempool.cs);
+        for (const CTransactionRef& tx : package) {
+            txids.push_back(tx->GetHash().GetHex());
+            CTxMemPool::txiter it = mempool.mapTx.find(tx->GetHash());
+            if (it == mempool.mapTx.end()) continue;
+            nFees += it->GetModifiedFee();
+            nSize += it->GetTxSize();
+        }
+    }
+
+    if (g_connman) {
+        for (const CTransactionRef& tx : package) {
+            CInv inv(MSG_TX, tx->GetHash());
+            g_connman->ForEachNode([&inv](CNode* pnode)
+            {
+                pnode->PushInventory(inv);
+            });
+        }
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("txids", txids));
+    result.push_back(Pair("fees", ValueFromAmount(nFees)));
+    result.push_back(Pair("vsize", (uint64_t)nSize));
+    result.push_back(Pair("feerate", ValueFromAmount(CFeeRate(nFees, nSize).GetFeePerK())));
+    return result;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         argNames
   //  --------------------- ------------------------  -----------------------  ----------
@@ -1042,6 +1134,7 @@ static const CRPCCommand commands[] =
     { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   {"hexstring","iswitness"} },
     { "rawtransactions",    "decodescript",           &decodescript,           {"hexstring"} },
     { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     {"hexstring","allowhighfees"} },
+    { "rawtransactions",    "submitpackage",          &submitpackage,          {"hexstrings","allowhighfees"} },
     { "rawtransactions",    "combinerawtransaction",  &combinerawtransaction,  {"txs"} },
     { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     {"hexstring","prevtxs","privkeys","sighashtype"} }, /* uses wallet if enabled */
 
@@ -28,6 +28,8 @@ private:
     typedef CuckooCache::cache<uint256, SignatureCacheHasher> map_type;
     map_type setValid;
     boost::shared_mutex cs_sigcache;
+    //! Whether entries were added under the current nonce
+    bool fUsed = false;
 
 public:
     CSignatureCache()
@@ -52,6 +54,27 @@ public:
     {
         boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
         setValid.insert(entry);
+        fUsed = true;
+    }
+
+    void GetContents(uint256& nonceOut, std::vector<uint256>& entries)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        nonceOut = nonce;
+        entries = setValid.get_elements();
+    }
+
+    bool SetContents(const uint256& nonceIn, const std::vector<uint256>& entries)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        // Entries computed under our own nonce would become unreachable.
+        if (fUsed)
+            return false;
+        nonce = nonceIn;
+        for (const uint256& entry : entries)
+            setValid.insert(entry);
+        fUsed = true;
+        return true;
     }
     uint32_t setup_bytes(size_t n)
     {
@@ -80,6 +103,16 @@ void InitSignatureCache()
             (nElems*sizeof(uint256)) >>20, (nMaxCacheSize*2)>>20, nElems);
 }
 
+void GetSignatureCacheContents(uint256& nonce, std::vector<uint256>& entries)
+{
+    signatureCache.GetContents(nonce, entries);
+}
+
+bool SetSignatureCacheContents(const uint256& nonce, const std::vector<uint256>& entries)
+{
+    return signatureCache.SetContents(nonce, entries);
+}
+
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
     uint256 entry;
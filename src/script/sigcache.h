@@ -53,4 +53,13 @@ public:
 
 void InitSignatureCache();
 
+/** Return the signature cache's nonce and entries, to persist them across restarts. */
+void GetSignatureCacheContents(uint256& nonce, std::vector<uint256>& entries);
+/**
+ * Restore contents returned by GetSignatureCacheContents. This replaces the
+ * nonce, so it fails if anything was added to the cache already. Must be
+ * called before signatures are verified on other threads.
+ */
+bool SetSignatureCacheContents(const uint256& nonce, const std::vector<uint256>& entries);
+
 #endif // STARWELS_SCRIPT_SIGCACHE_H
@@ -0,0 +1,433 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <socketevents.h>
+
+#include <netbase.h>
+#include <util.h>
+
+#include <assert.h>
+#include <vector>
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+namespace {
+
+/** select(): rebuilds its descriptor sets on every call, limited to FD_SETSIZE. */
+class CSocketEventsSelect : public CSocketEvents
+{
+public:
+    CSocketEventsSelect() : CSocketEvents(SocketEventsMode::SELECT) {}
+
+    bool CanWatch(SOCKET s) const override
+    {
+#ifdef WIN32
+        return true;
+#else
+        return s < FD_SETSIZE;
+#endif
+    }
+
+protected:
+    bool Add(SOCKET s, uint8_t events) override { return true; }
+    bool Modify(SOCKET s, uint8_t events) override { return true; }
+    void Remove(SOCKET s) override {}
+
+    bool DoWait(int64_t timeout_ms) override
+    {
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        fd_set fdsetError;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        SOCKET hSocketMax = 0;
+        bool have_fds = false;
+
+        for (const auto& watched : m_watched) {
+            const SOCKET s = watched.first;
+            FD_SET(s, &fdsetError);
+            if (watched.second.events & RECV) FD_SET(s, &fdsetRecv);
+            if (watched.second.events & SEND) FD_SET(s, &fdsetSend);
+            hSocketMax = std::max(hSocketMax, s);
+            have_fds = true;
+        }
+        if (m_wake_recv != INVALID_SOCKET) {
+            FD_SET(m_wake_recv, &fdsetRecv);
+            hSocketMax = std::max(hSocketMax, m_wake_recv);
+            have_fds = true;
+        }
+
+        struct timeval timeout = MillisToTimeval(timeout_ms);
+        int nSelect = select(have_fds ? hSocketMax + 1 : 0, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        if (nSelect == SOCKET_ERROR) {
+            // Let the caller try to read from every socket, so the bad ones get closed.
+            for (const auto& watched : m_watched) {
+                m_ready[watched.first] = RECV;
+            }
+            return false;
+        }
+
+        for (const auto& watched : m_watched) {
+            const SOCKET s = watched.first;
+            uint8_t events = (FD_ISSET(s, &fdsetRecv) ? RECV : 0) |
+                             (FD_ISSET(s, &fdsetSend) ? SEND : 0) |
+                             (FD_ISSET(s, &fdsetError) ? ERR : 0);
+            if (events) m_ready[s] = events;
+        }
+        if (m_wake_recv != INVALID_SOCKET && FD_ISSET(m_wake_recv, &fdsetRecv)) {
+            m_ready[m_wake_recv] = RECV;
+        }
+        return true;
+    }
+};
+
+#ifdef USE_POLL
+/** poll(): keeps its descriptor array between calls and has no descriptor limit. */
+class CSocketEventsPoll : public CSocketEvents
+{
+private:
+    std::vector<struct pollfd> m_fds;
+    std::unordered_map<SOCKET, size_t> m_index;
+
+    static short ToPoll(uint8_t events)
+    {
+        return (events & RECV ? POLLIN : 0) | (events & SEND ? POLLOUT : 0);
+    }
+
+public:
+    CSocketEventsPoll() : CSocketEvents(SocketEventsMode::POLL) {}
+
+protected:
+    bool Add(SOCKET s, uint8_t events) override
+    {
+        struct pollfd pollfd = {};
+        pollfd.fd = s;
+        pollfd.events = ToPoll(events);
+        m_index[s] = m_fds.size();
+        m_fds.push_back(pollfd);
+        return true;
+    }
+
+    bool Modify(SOCKET s, uint8_t events) override
+    {
+        m_fds[m_index.at(s)].events = ToPoll(events);
+        return true;
+    }
+
+    void Remove(SOCKET s) override
+    {
+        auto it = m_index.find(s);
+        if (it == m_index.end()) return;
+        const size_t index = it->second;
+        m_index.erase(it);
+        if (index != m_fds.size() - 1) {
+            m_fds[index] = m_fds.back();
+            m_index[m_fds[index].fd] = index;
+        }
+        m_fds.pop_back();
+    }
+
+    bool DoWait(int64_t timeout_ms) override
+    {
+        int nRet = poll(m_fds.data(), m_fds.size(), timeout_ms);
+        if (nRet < 0) {
+            return errno == EINTR;
+        }
+        for (size_t i = 0; nRet > 0 && i < m_fds.size(); ++i) {
+            const short revents = m_fds[i].revents;
+            if (!revents) continue;
+            --nRet;
+            m_ready[m_fds[i].fd] = (revents & POLLIN ? RECV : 0) |
+                                   (revents & POLLOUT ? SEND : 0) |
+                                   (revents & (POLLERR | POLLHUP | POLLNVAL) ? ERR : 0);
+        }
+        return true;
+    }
+};
+#endif
+
+#ifdef USE_EPOLL
+/** epoll: the kernel keeps the registrations, and a wait only costs as much as the number of ready sockets. */
+class CSocketEventsEpoll : public CSocketEvents
+{
+private:
+    //! Maximum number of events collected by one epoll_wait()
+    static const int MAX_EVENTS = 1024;
+
+    int m_epoll_fd = -1;
+    std::vector<struct epoll_event> m_events;
+
+    bool Control(int op, SOCKET s, uint8_t events)
+    {
+        struct epoll_event event = {};
+        event.events = (events & RECV ? EPOLLIN : 0u) | (events & SEND ? EPOLLOUT : 0u);
+        event.data.fd = s;
+        return epoll_ctl(m_epoll_fd, op, s, &event) == 0;
+    }
+
+public:
+    CSocketEventsEpoll() : CSocketEvents(SocketEventsMode::EPOLL) {}
+
+    ~CSocketEventsEpoll()
+    {
+        if (m_epoll_fd != -1) close(m_epoll_fd);
+    }
+
+protected:
+    bool Init(std::string& error) override
+    {
+        if (!CSocketEvents::Init(error)) return false;
+        m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epoll_fd == -1) {
+            error = strprintf("epoll_create1 failed: %s", NetworkErrorString(errno));
+            return false;
+        }
+        m_events.resize(MAX_EVENTS);
+        return true;
+    }
+
+    bool Add(SOCKET s, uint8_t events) override
+    {
+        return Control(EPOLL_CTL_ADD, s, events) || (errno == EEXIST && Control(EPOLL_CTL_MOD, s, events));
+    }
+
+    bool Modify(SOCKET s, uint8_t events) override
+    {
+        return Control(EPOLL_CTL_MOD, s, events) || (errno == ENOENT && Control(EPOLL_CTL_ADD, s, events));
+    }
+
+    void Remove(SOCKET s) override
+    {
+        // Closing a descriptor already removes it, so failures are expected here.
+        Control(EPOLL_CTL_DEL, s, 0);
+    }
+
+    bool DoWait(int64_t timeout_ms) override
+    {
+        int nRet = epoll_wait(m_epoll_fd, m_events.data(), m_events.size(), timeout_ms);
+        if (nRet < 0) {
+            return errno == EINTR;
+        }
+        for (int i = 0; i < nRet; ++i) {
+            const uint32_t events = m_events[i].events;
+            m_ready[m_events[i].data.fd] = (events & EPOLLIN ? RECV : 0) |
+                                           (events & EPOLLOUT ? SEND : 0) |
+                                           (events & (EPOLLERR | EPOLLHUP) ? ERR : 0);
+        }
+        return true;
+    }
+};
+#endif
+
+} // namespace
+
+bool SocketEventsModeFromString(const std::string& str, SocketEventsMode& mode)
+{
+    if (str == "select") {
+        mode = SocketEventsMode::SELECT;
+        return true;
+    }
+#ifdef USE_POLL
+    if (str == "poll") {
+        mode = SocketEventsMode::POLL;
+        return true;
+    }
+#endif
+#ifdef USE_EPOLL
+    if (str == "epoll") {
+        mode = SocketEventsMode::EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+std::string SocketEventsModeToString(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SocketEventsMode::SELECT: return "select";
+    case SocketEventsMode::POLL: return "poll";
+    case SocketEventsMode::EPOLL: return "epoll";
+    }
+    assert(false);
+}
+
+std::string SupportedSocketEventsModes()
+{
+    std::string modes = "select";
+#ifdef USE_POLL
+    modes += ", poll";
+#endif
+#ifdef USE_EPOLL
+    modes += ", epoll";
+#endif
+    return modes;
+}
+
+SocketEventsMode DefaultSocketEventsMode()
+{
+#if defined(USE_EPOLL)
+    return SocketEventsMode::EPOLL;
+#elif defined(USE_POLL)
+    return SocketEventsMode::POLL;
+#else
+    return SocketEventsMode::SELECT;
+#endif
+}
+
+std::unique_ptr<CSocketEvents> CSocketEvents::Make(SocketEventsMode mode, std::string& error)
+{
+    std::unique_ptr<CSocketEvents> events;
+    switch (mode) {
+    case SocketEventsMode::SELECT:
+        events.reset(new CSocketEventsSelect());
+        break;
+    case SocketEventsMode::POLL:
+#ifdef USE_POLL
+        events.reset(new CSocketEventsPoll());
+#endif
+        break;
+    case SocketEventsMode::EPOLL:
+#ifdef USE_EPOLL
+        events.reset(new CSocketEventsEpoll());
+#endif
+        break;
+    }
+    if (!events) {
+        error = strprintf("%s is not supported on this platform", SocketEventsModeToString(mode));
+        return nullptr;
+    }
+    if (!events->Init(error)) {
+        return nullptr;
+    }
+    if (events->m_wake_recv != INVALID_SOCKET && !events->Add(events->m_wake_recv, RECV)) {
+        error = strprintf("cannot watch wakeup pipe: %s", NetworkErrorString(WSAGetLastError()));
+        return nullptr;
+    }
+    return events;
+}
+
+const uint8_t CSocketEvents::RECV;
+const uint8_t CSocketEvents::SEND;
+const uint8_t CSocketEvents::ERR;
+
+CSocketEvents::CSocketEvents(SocketEventsMode mode) : m_mode(mode) {}
+
+CSocketEvents::~CSocketEvents()
+{
+    if (m_wake_recv != INVALID_SOCKET) CloseSocket(m_wake_recv);
+    if (m_wake_send != INVALID_SOCKET) CloseSocket(m_wake_send);
+}
+
+bool CSocketEvents::Init(std::string& error)
+{
+#ifndef WIN32
+    int fds[2];
+    if (pipe(fds) != 0) {
+        error = strprintf("cannot create wakeup pipe: %s", NetworkErrorString(errno));
+        return false;
+    }
+    m_wake_recv = fds[0];
+    m_wake_send = fds[1];
+    for (int fd : fds) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (!SetSocketNonBlocking(fd, true)) {
+            error = strprintf("cannot set up wakeup pipe: %s", NetworkErrorString(errno));
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+void CSocketEvents::Watch(SOCKET s, int64_t id, uint8_t events)
+{
+    events &= RECV | SEND;
+    auto it = m_watched.find(s);
+    if (it != m_watched.end() && it->second.id != id) {
+        // The descriptor was closed and reused for another socket since it
+        // was watched; start over with the new one.
+        Remove(s);
+        m_ids.erase(it->second.id);
+        m_watched.erase(it);
+        it = m_watched.end();
+    }
+    if (it == m_watched.end()) {
+        if (!Add(s, events)) {
+            LogPrint(BCLog::NET, "cannot watch socket %d: %s\n", s, NetworkErrorString(WSAGetLastError()));
+            return;
+        }
+        m_watched.emplace(s, Registration{id, events});
+        m_ids[id] = s;
+        return;
+    }
+    if (it->second.events != events) {
+        if (!Modify(s, events)) {
+            LogPrint(BCLog::NET, "cannot watch socket %d: %s\n", s, NetworkErrorString(WSAGetLastError()));
+            Remove(s);
+            m_ids.erase(id);
+            m_watched.erase(it);
+            return;
+        }
+        it->second.events = events;
+    }
+}
+
+void CSocketEvents::Unwatch(int64_t id)
+{
+    auto it = m_ids.find(id);
+    if (it == m_ids.end()) return;
+    auto itWatched = m_watched.find(it->second);
+    if (itWatched != m_watched.end() && itWatched->second.id == id) {
+        Remove(it->second);
+        m_watched.erase(itWatched);
+    }
+    m_ids.erase(it);
+}
+
+bool CSocketEvents::Wait(int64_t timeout_ms)
+{
+    m_ready.clear();
+    m_events.clear();
+    bool ret = DoWait(timeout_ms);
+    for (const auto& ready : m_ready) {
+        if (ready.first == m_wake_recv) {
+            // Clear the flag before draining, so an Interrupt() racing with this
+            // either leaves a byte in the pipe or is covered by this wakeup.
+            m_wake_pending = false;
+#ifndef WIN32
+            char buf[64];
+            while (read(m_wake_recv, buf, sizeof(buf)) > 0) {}
+#endif
+            continue;
+        }
+        auto it = m_watched.find(ready.first);
+        if (it != m_watched.end()) {
+            m_events.push_back(Event{ready.first, it->second.id, ready.second});
+        }
+    }
+    return ret;
+}
+
+uint8_t CSocketEvents::GetEvents(SOCKET s) const
+{
+    for (const Event& event : m_events) {
+        if (event.socket == s) return event.events;
+    }
+    return 0;
+}
+
+void CSocketEvents::Interrupt()
+{
+#ifndef WIN32
+    if (m_wake_send == INVALID_SOCKET || m_wake_pending.exchange(true)) return;
+    char c = 0;
+    if (write(m_wake_send, &c, 1) != 1) {
+        m_wake_pending = false;
+    }
+#endif
+}
@@ -0,0 +1,131 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef STARWELS_SOCKETEVENTS_H
+#define STARWELS_SOCKETEVENTS_H
+
+#include <compat.h>
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/** System facilities CConnman can use to wait for socket readiness. */
+enum class SocketEventsMode {
+    SELECT,
+    POLL,
+    EPOLL,
+};
+
+/** Parse a -socketevents value. Returns false if it is unknown or not supported on this platform. */
+bool SocketEventsModeFromString(const std::string& str, SocketEventsMode& mode);
+std::string SocketEventsModeToString(SocketEventsMode mode);
+/** Comma separated list of the -socketevents values supported on this platform. */
+std::string SupportedSocketEventsModes();
+/** The most scalable mode supported on this platform. */
+SocketEventsMode DefaultSocketEventsMode();
+
+/**
+ * Waits for readiness on a changing set of sockets.
+ *
+ * Sockets are declared with Watch(), which also changes the events waited
+ * for, and stay watched until Unwatch(). Wait() then reports the sockets
+ * that are ready. The poll and epoll backends keep their registrations
+ * between waits and only make system calls for changes, so that a round
+ * costs as much as the sockets that changed or are ready, not as all the
+ * watched ones. select() goes over all of them on every call.
+ *
+ * A Wait() can be cut short from any thread with Interrupt(), so callers do
+ * not need to wake up periodically to pick up new interest.
+ */
+class CSocketEvents
+{
+public:
+    static const uint8_t RECV = 1;
+    static const uint8_t SEND = 2;
+    //! Reported when the socket has an error or was hung up, whatever was asked for
+    static const uint8_t ERR = 4;
+
+    struct Event {
+        SOCKET socket;
+        int64_t id;
+        uint8_t events;
+    };
+
+    /** Create a backend, or return nullptr and set error if it could not be set up. */
+    static std::unique_ptr<CSocketEvents> Make(SocketEventsMode mode, std::string& error);
+
+    virtual ~CSocketEvents();
+
+    CSocketEvents(const CSocketEvents&) = delete;
+    CSocketEvents& operator=(const CSocketEvents&) = delete;
+
+    SocketEventsMode GetMode() const { return m_mode; }
+
+    /** Whether s can be watched at all. select() is limited to descriptors below FD_SETSIZE. */
+    virtual bool CanWatch(SOCKET s) const { return true; }
+
+    /**
+     * Wait for events (a combination of RECV and SEND, possibly none) on s
+     * from now on. id tells apart sockets that reuse a descriptor after
+     * another was closed, so it must be unique per socket (e.g. a node id).
+     */
+    void Watch(SOCKET s, int64_t id, uint8_t events);
+
+    /** Stop watching the socket watched with id, which may have been closed already. */
+    void Unwatch(int64_t id);
+
+    /**
+     * Wait up to timeout_ms for events on the watched sockets, or until
+     * Interrupt() is called. Returns false if waiting failed.
+     */
+    bool Wait(int64_t timeout_ms);
+
+    /** The sockets the last Wait() reported events for. */
+    const std::vector<Event>& GetReady() const { return m_events; }
+
+    /** Events reported for s by the last Wait(), looked up among the ready sockets. */
+    uint8_t GetEvents(SOCKET s) const;
+
+    /** Make the current or next Wait() return early. Safe to call from any thread. */
+    void Interrupt();
+
+    /** Whether Interrupt() works on this platform. */
+    bool CanInterrupt() const { return m_wake_recv != INVALID_SOCKET; }
+
+protected:
+    struct Registration {
+        int64_t id;
+        uint8_t events;
+    };
+
+    const SocketEventsMode m_mode;
+    std::unordered_map<SOCKET, Registration> m_watched;
+    std::unordered_map<int64_t, SOCKET> m_ids;
+    //! Filled by DoWait()
+    std::unordered_map<SOCKET, uint8_t> m_ready;
+    std::vector<Event> m_events;
+
+    //! Self-pipe that Interrupt() writes to, watched by every backend
+    SOCKET m_wake_recv = INVALID_SOCKET;
+    SOCKET m_wake_send = INVALID_SOCKET;
+    std::atomic<bool> m_wake_pending{false};
+
+    explicit CSocketEvents(SocketEventsMode mode);
+
+    virtual bool Init(std::string& error);
+    //! Start watching s
+    virtual bool Add(SOCKET s, uint8_t events) = 0;
+    //! Change the events watched on s
+    virtual bool Modify(SOCKET s, uint8_t events) = 0;
+    //! Stop watching s, which may have been closed already
+    virtual void Remove(SOCKET s) = 0;
+    //! Wait for events and put them in m_ready
+    virtual bool DoWait(int64_t timeout_ms) = 0;
+};
+
+#endif // STARWELS_SOCKETEVENTS_H
@@ -0,0 +1,94 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockdownload.h>
+#include <test/test_starwels.h>
+#include <validation.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockdownload_tests, BasicTestingSetup)
+
+// Request nBlocks blocks of nBytes from an idle peer at nStart. It starts
+// answering after nLatency and then sends one every nBlockTime. Returns when
+// the last one arrived.
+static int64_t DownloadBatch(CBlockDownloadStats& stats, int nBlocks, size_t nBytes, int64_t nStart, int64_t nLatency, int64_t nBlockTime)
+{
+    for (int i = 0; i < nBlocks; i++) {
+        stats.Received(nBytes, nStart, i > 0, nStart + nLatency + (i + 1) * nBlockTime);
+    }
+    return nStart + nLatency + nBlocks * nBlockTime;
+}
+
+static CBlockDownloadStats MeasurePeer(int64_t nLatency, int64_t nBlockTime)
+{
+    CBlockDownloadStats stats;
+    int64_t nTime = 1000000000;
+    for (int i = 0; i < 20; i++) {
+        nTime = DownloadBatch(stats, 8, 1000000, nTime + 1000000, nLatency, nBlockTime);
+    }
+    return stats;
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_window)
+{
+    // Until a peer delivered something, it gets the usual window.
+    CBlockDownloadStats stats;
+    BOOST_CHECK(!stats.HasSamples());
+    BOOST_CHECK_EQUAL(stats.GetWindow(), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(stats.GetBandwidth(), 0);
+
+    // 1 MB blocks every 50 ms after 100 ms: enough in flight for 2.1 seconds.
+    CBlockDownloadStats fast = MeasurePeer(100000, 50000);
+    BOOST_CHECK(fast.HasSamples());
+    BOOST_CHECK(fast.GetLatency() > 80000 && fast.GetLatency() < 120000);
+    BOOST_CHECK(fast.GetBlockTime() > 45000 && fast.GetBlockTime() < 55000);
+    BOOST_CHECK(fast.GetBandwidth() > 18e6 && fast.GetBandwidth() < 22e6);
+    BOOST_CHECK(fast.GetWindow() > MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK(fast.GetWindow() <= MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // 1 MB blocks every 5 seconds after 500 ms: one at a time.
+    CBlockDownloadStats slow = MeasurePeer(500000, 5000000);
+    BOOST_CHECK(slow.GetLatency() > 400000 && slow.GetLatency() < 600000);
+    BOOST_CHECK(slow.GetBandwidth() > 180e3 && slow.GetBandwidth() < 220e3);
+    BOOST_CHECK_EQUAL(slow.GetWindow(), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A peer that slows down gets a smaller window within a few blocks.
+    int64_t nTime = 2000000000;
+    nTime = DownloadBatch(fast, 8, 1000000, nTime, 100000, 1000000);
+    BOOST_CHECK(fast.GetWindow() <= 4);
+    // And a larger one again once it speeds up.
+    DownloadBatch(fast, 8, 1000000, nTime, 100000, 50000);
+    BOOST_CHECK(fast.GetWindow() > MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_reassign)
+{
+    CBlockDownloadStats fast = MeasurePeer(100000, 50000);
+    CBlockDownloadStats slow = MeasurePeer(500000, 5000000);
+    const int64_t nNow = 3000000000;
+
+    // The first block in flight from the slow peer, which it has been on for a
+    // second, is expected in 4 more, and from the fast one in 150 ms.
+    const int64_t nWaitSlow = slow.EstimateWait(0, nNow - 1000000, nNow);
+    BOOST_CHECK(nWaitSlow > 3500000 && nWaitSlow < 4500000);
+    BOOST_CHECK(ShouldReassignBlock(nWaitSlow, fast.EstimateTime(1)));
+    // Not if the fast peer already has a lot in flight.
+    BOOST_CHECK(!ShouldReassignBlock(nWaitSlow, fast.EstimateTime(64)));
+    // Nor the other way around.
+    BOOST_CHECK(!ShouldReassignBlock(fast.EstimateWait(0, nNow - 10000, nNow), slow.EstimateTime(1)));
+
+    // A peer that is late looks slower the longer it takes.
+    BOOST_CHECK_EQUAL(slow.EstimateWait(0, nNow - 30000000, nNow), 30000000);
+    // As does one that never delivered anything.
+    CBlockDownloadStats unknown;
+    BOOST_CHECK_EQUAL(unknown.EstimateWait(3, nNow - 10000000, nNow), 10000000);
+    BOOST_CHECK(ShouldReassignBlock(unknown.EstimateWait(3, nNow - 10000000, nNow), fast.EstimateTime(1)));
+
+    // Too small a gain is not worth downloading the block twice.
+    BOOST_CHECK(!ShouldReassignBlock(BLOCK_REASSIGN_MIN_GAIN - 1, 0));
+    BOOST_CHECK(ShouldReassignBlock(BLOCK_REASSIGN_MIN_GAIN, 0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include <blockencodings.h>
 #include <consensus/merkle.h>
+#include <core_memusage.h>
 #include <chainparams.h>
 #include <random.h>
 
@@ -317,6 +318,106 @@ BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
     }
 }
 
+BOOST_AUTO_TEST_CASE(ExtraTxnsRoundTripTest)
+{
+    CTxMemPool pool;
+    CBlock block(BuildBlockTestCase());
+    const size_t nUsage1 = RecursiveDynamicUsage(block.vtx[1]);
+    const size_t nUsage2 = RecursiveDynamicUsage(block.vtx[2]);
+    BOOST_CHECK(nUsage2 > nUsage1);
+
+    // Nothing is kept when there is no room for it.
+    ExtraTxnsForCompact disabled(0, 1000000);
+    disabled.Add(block.vtx[1]);
+    BOOST_CHECK_EQUAL(disabled.size(), 0U);
+    ExtraTxnsForCompact tiny(10, nUsage1 / 2);
+    tiny.Add(block.vtx[1]);
+    BOOST_CHECK_EQUAL(tiny.size(), 0U);
+    BOOST_CHECK_EQUAL(tiny.DynamicMemoryUsage(), 0U);
+
+    // The oldest transactions are evicted when over the count limit...
+    ExtraTxnsForCompact counted(1, 1000000);
+    counted.Add(block.vtx[1]);
+    counted.Add(block.vtx[1]);
+    BOOST_CHECK_EQUAL(counted.size(), 1U);
+    counted.Add(block.vtx[2]);
+    BOOST_CHECK_EQUAL(counted.size(), 1U);
+    std::vector<std::pair<uint256, CTransactionRef>> vTxn;
+    counted.AppendTo(vTxn);
+    BOOST_CHECK(vTxn.size() == 1 && vTxn[0].first == block.vtx[2]->GetWitnessHash());
+
+    // ...and when over the memory limit.
+    ExtraTxnsForCompact sized(10, nUsage2 + nUsage1 / 2);
+    sized.Add(block.vtx[1]);
+    const size_t nEntryUsage1 = sized.DynamicMemoryUsage();
+    BOOST_CHECK(nEntryUsage1 >= nUsage1);
+    sized.Add(block.vtx[2]);
+    BOOST_CHECK_EQUAL(sized.size(), 1U);
+    BOOST_CHECK(sized.DynamicMemoryUsage() > nEntryUsage1 && sized.DynamicMemoryUsage() <= sized.GetMaxUsage());
+    sized.Add(block.vtx[1]);
+    BOOST_CHECK_EQUAL(sized.size(), 1U);
+    BOOST_CHECK_EQUAL(sized.DynamicMemoryUsage(), nEntryUsage1);
+
+    // Transactions only found among the extra ones need no round trip.
+    ExtraTxnsForCompact extra(10, 1000000);
+    extra.Add(block.vtx[1]);
+    extra.Add(block.vtx[2]);
+    std::vector<std::pair<uint256, CTransactionRef>> vExtraTxn;
+    extra.AppendTo(vExtraTxn);
+
+    CBlockHeaderAndShortTxIDs shortIDs(block, true);
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs, vExtraTxn) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 0U);
+    BOOST_CHECK_EQUAL(partialBlock.GetExtraCount(), 2U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMissingCount(), 0U);
+
+    CBlock block2;
+    std::vector<CTransactionRef> vtx_missing;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(ParallelShortIDMatchTest)
+{
+    // A mempool large enough to be matched in several batches on the short ID
+    // threads, and a block with some of its transactions and one it lacks.
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+    CBlock block;
+    block.nBits = 0x207fffff;
+    block.vtx.push_back(MakeTransactionRef(tx));
+    for (size_t i = 0; i < 3 * SHORTID_MATCH_BATCH_SIZE + 100; i++) {
+        tx.vin[0].prevout = COutPoint(InsecureRand256(), 0);
+        CTransactionRef ptx = MakeTransactionRef(tx);
+        pool.addUnchecked(ptx->GetHash(), entry.FromTx(*ptx));
+        if (i % 100 == 0)
+            block.vtx.push_back(ptx);
+    }
+    tx.vin[0].prevout = COutPoint(InsecureRand256(), 0);
+    block.vtx.push_back(MakeTransactionRef(tx));
+    CBlockHeaderAndShortTxIDs shortIDs(block, true);
+
+    BOOST_REQUIRE(nShortIDThreads > 0);
+    const int nShortIDThreadsPrev = nShortIDThreads;
+    for (int nThreads : {nShortIDThreadsPrev, 0}) {
+        nShortIDThreads = nThreads;
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs, extra_txn) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), block.vtx.size() - 2);
+        BOOST_CHECK_EQUAL(partialBlock.GetMissingCount(), 1U);
+        for (size_t i = 0; i < block.vtx.size() - 1; i++)
+            BOOST_CHECK(partialBlock.IsTxAvailable(i));
+        BOOST_CHECK(!partialBlock.IsTxAvailable(block.vtx.size() - 1));
+    }
+    nShortIDThreads = nShortIDThreadsPrev;
+}
+
 BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest) {
     BlockTransactionsRequest req1;
     req1.blockhash = InsecureRand256();
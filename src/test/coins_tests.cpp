@@ -4,6 +4,7 @@
 
 #include <coins.h>
 #include <script/standard.h>
+#include <txdb.h>
 #include <uint256.h>
 #include <undo.h>
 #include <utilstrencodings.h>
@@ -52,7 +53,7 @@ public:
 
     uint256 GetBestBlock() const override { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) override
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool erase = true) override
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
@@ -63,7 +64,11 @@ public:
                     map_.erase(it->first);
                 }
             }
-            mapCoins.erase(it++);
+            if (erase) {
+                mapCoins.erase(it++);
+            } else {
+                ++it;
+            }
         }
         if (!hashBlock.IsNull())
             hashBestBlock_ = hashBlock;
@@ -255,6 +260,99 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(uncached_an_entry);
 }
 
+// This test is similar to coins_cache_simulation_test, except that the cache
+// in the middle of a fixed stack is written with Sync() and trimmed with
+// Evict() rather than emptied with Flush(), the way -dbcacheretain writes
+// pcoinsTip while a block's view is layered on top of it.
+BOOST_AUTO_TEST_CASE(coins_cache_sync_simulation_test)
+{
+    bool synced_an_entry = false;
+    bool evicted_an_entry = false;
+    bool kept_an_entry = false;
+    bool found_an_entry = false;
+    bool missed_an_entry = false;
+
+    // A simple map to track what we expect the cache stack to represent.
+    std::map<COutPoint, Coin> result;
+
+    CCoinsViewTest base;
+    CCoinsViewCacheTest middle(&base);
+    std::unique_ptr<CCoinsViewCacheTest> top(new CCoinsViewCacheTest(&middle));
+
+    std::vector<uint256> txids;
+    txids.resize(NUM_SIMULATION_ITERATIONS / 8);
+    for (unsigned int i = 0; i < txids.size(); i++) {
+        txids[i] = InsecureRand256();
+    }
+
+    for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS; i++) {
+        const COutPoint outpoint(txids[InsecureRandRange(txids.size())], 0);
+        Coin& coin = result[outpoint];
+        BOOST_CHECK(top->AccessCoin(outpoint) == coin);
+
+        if (InsecureRandRange(5) == 0 || coin.IsSpent()) {
+            Coin newcoin;
+            newcoin.out.nValue = InsecureRand32();
+            newcoin.nHeight = 1 + InsecureRandRange(i + 1);
+            newcoin.out.scriptPubKey.assign(InsecureRandBits(6), 0);
+            coin = newcoin;
+            top->AddCoin(outpoint, std::move(newcoin), true);
+        } else {
+            coin.Clear();
+            top->SpendCoin(outpoint);
+        }
+
+        if (InsecureRandRange(20) == 0) {
+            // Hand the changes of a "block" down to the middle cache.
+            BOOST_CHECK(top->Flush());
+            if (InsecureRandBool()) {
+                top.reset(new CCoinsViewCacheTest(&middle));
+            }
+        }
+
+        if (InsecureRandRange(100) == 0) {
+            // Write the middle cache, keeping a random share of it.
+            const size_t nCached = middle.GetCacheSize();
+            const uint64_t nEvictions = middle.GetStats().evictions;
+            BOOST_CHECK(middle.Sync());
+            synced_an_entry |= nCached > 0;
+            middle.Evict(InsecureRandRange(middle.DynamicMemoryUsage() + 1), InsecureRandRange(i + 1));
+            evicted_an_entry |= middle.GetStats().evictions > nEvictions;
+            kept_an_entry |= middle.GetCacheSize() > 0;
+            middle.SelfTest();
+        }
+
+        // Once every 1000 iterations and at the end, verify the full cache.
+        if (InsecureRandRange(1000) == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
+            for (const auto& entry : result) {
+                bool have = top->HaveCoin(entry.first);
+                const Coin& cached = top->AccessCoin(entry.first);
+                BOOST_CHECK(have == !cached.IsSpent());
+                BOOST_CHECK(cached == entry.second);
+                (cached.IsSpent() ? missed_an_entry : found_an_entry) = true;
+            }
+            top->SelfTest();
+            middle.SelfTest();
+        }
+    }
+
+    // Everything ends up in the base.
+    BOOST_CHECK(top->Flush());
+    BOOST_CHECK(middle.Sync());
+    for (const auto& entry : result) {
+        Coin coin;
+        bool found = base.GetCoin(entry.first, coin) && !coin.IsSpent();
+        BOOST_CHECK_EQUAL(found, !entry.second.IsSpent());
+        if (found) BOOST_CHECK(coin == entry.second);
+    }
+
+    BOOST_CHECK(synced_an_entry);
+    BOOST_CHECK(evicted_an_entry);
+    BOOST_CHECK(kept_an_entry);
+    BOOST_CHECK(found_an_entry);
+    BOOST_CHECK(missed_an_entry);
+}
+
 // Store of all necessary tx and undo data for next test
 typedef std::map<COutPoint, std::tuple<CTransaction,CTxUndo,Coin>> UtxoData;
 UtxoData utxoData;
@@ -656,6 +754,137 @@ BOOST_AUTO_TEST_CASE(ccoins_access)
     CheckAccessCoin(VALUE1, VALUE2, VALUE2, DIRTY|FRESH, DIRTY|FRESH);
 }
 
+void CheckPopulateCoin(CAmount cache_value, CAmount expected_value, char cache_flags, char expected_flags)
+{
+    SingleEntryCacheTest test(ABSENT, cache_value, cache_flags);
+    Coin coin;
+    SetCoinsValue(VALUE3, coin);
+    BOOST_CHECK_EQUAL(test.cache.PopulateCoin(OUTPOINT, std::move(coin)), cache_value == ABSENT);
+    test.cache.SelfTest();
+
+    CAmount result_value;
+    char result_flags;
+    GetCoinsMapEntry(test.cache.map(), result_value, result_flags);
+    BOOST_CHECK_EQUAL(result_value, expected_value);
+    BOOST_CHECK_EQUAL(result_flags, expected_flags);
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_populate)
+{
+    /* Check PopulateCoin behavior, inserting a coin read from the backing
+     * view out of band into a cache, and checking the resulting entry. An
+     * existing entry must never be replaced, and a new one must be clean.
+     *
+     *                Cache   Result  Cache        Result
+     *                Value   Value   Flags        Flags
+     */
+    CheckPopulateCoin(ABSENT, VALUE3, NO_ENTRY   , 0          );
+    CheckPopulateCoin(PRUNED, PRUNED, 0          , 0          );
+    CheckPopulateCoin(PRUNED, PRUNED, FRESH      , FRESH      );
+    CheckPopulateCoin(PRUNED, PRUNED, DIRTY      , DIRTY      );
+    CheckPopulateCoin(PRUNED, PRUNED, DIRTY|FRESH, DIRTY|FRESH);
+    CheckPopulateCoin(VALUE2, VALUE2, 0          , 0          );
+    CheckPopulateCoin(VALUE2, VALUE2, FRESH      , FRESH      );
+    CheckPopulateCoin(VALUE2, VALUE2, DIRTY      , DIRTY      );
+    CheckPopulateCoin(VALUE2, VALUE2, DIRTY|FRESH, DIRTY|FRESH);
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_populate_simulation)
+{
+    /* Interleave random changes to a cache with coins "prefetched" from its
+     * backing view, the way CCoinsPrefetch reads them before a block is
+     * connected. A prefetched coin may be stale by the time it is applied,
+     * e.g. when an earlier transaction of the block spent it, so PopulateCoin
+     * must leave spent, modified and other existing entries alone.
+     */
+    bool populated_an_entry = false;
+    bool kept_a_spent_entry = false;
+    bool kept_a_dirty_entry = false;
+
+    std::map<COutPoint, Coin> result;
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    std::vector<COutPoint> outpoints;
+    for (unsigned int i = 0; i < 200; i++) {
+        outpoints.emplace_back(InsecureRand256(), 0);
+    }
+
+    for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS / 4; i++) {
+        const COutPoint& outpoint = outpoints[InsecureRandRange(outpoints.size())];
+        Coin& coin = result[outpoint];
+
+        if (InsecureRandRange(3) == 0) {
+            // Prefetch the coin from the backing view and apply it later.
+            Coin fetched;
+            bool found = base.GetCoin(outpoint, fetched) && !fetched.IsSpent();
+            if (InsecureRandBool()) {
+                // Something else touched the coin in the meantime.
+                Coin newcoin;
+                newcoin.out.nValue = InsecureRand32();
+                newcoin.nHeight = 1;
+                if (InsecureRandBool() && !coin.IsSpent()) {
+                    cache.SpendCoin(outpoint);
+                    coin.Clear();
+                } else {
+                    cache.AddCoin(outpoint, std::move(newcoin), true);
+                    coin = cache.AccessCoin(outpoint);
+                }
+            }
+            if (found) {
+                CCoinsMap::const_iterator it = cache.map().find(outpoint);
+                const bool cached = it != cache.map().end();
+                const CCoinsCacheEntry before = cached ? it->second : CCoinsCacheEntry();
+                BOOST_CHECK_EQUAL(cache.PopulateCoin(outpoint, std::move(fetched)), !cached);
+                it = cache.map().find(outpoint);
+                BOOST_CHECK(it != cache.map().end());
+                if (cached) {
+                    BOOST_CHECK(it->second.coin == before.coin);
+                    BOOST_CHECK_EQUAL(it->second.flags, before.flags);
+                    if (before.coin.IsSpent()) kept_a_spent_entry = true;
+                    if (before.flags & CCoinsCacheEntry::DIRTY) kept_a_dirty_entry = true;
+                } else {
+                    BOOST_CHECK_EQUAL(it->second.flags, 0);
+                    populated_an_entry = true;
+                }
+            }
+        } else if (InsecureRandBool() && !coin.IsSpent()) {
+            cache.SpendCoin(outpoint);
+            coin.Clear();
+        } else {
+            Coin newcoin;
+            newcoin.out.nValue = InsecureRand32();
+            newcoin.nHeight = 1;
+            cache.AddCoin(outpoint, std::move(newcoin), true);
+            coin = cache.AccessCoin(outpoint);
+        }
+
+        // The cache still represents exactly the changes made to it.
+        BOOST_CHECK(cache.AccessCoin(outpoint) == coin);
+
+        if (InsecureRandRange(500) == 0) {
+            BOOST_CHECK(cache.Flush());
+            cache.SelfTest();
+        }
+    }
+
+    cache.SelfTest();
+    for (const auto& entry : result) {
+        BOOST_CHECK(cache.AccessCoin(entry.first) == entry.second);
+    }
+    BOOST_CHECK(cache.Flush());
+    for (const auto& entry : result) {
+        Coin coin;
+        bool found = base.GetCoin(entry.first, coin) && !coin.IsSpent();
+        BOOST_CHECK_EQUAL(found, !entry.second.IsSpent());
+        if (found) BOOST_CHECK(coin == entry.second);
+    }
+
+    BOOST_CHECK(populated_an_entry);
+    BOOST_CHECK(kept_a_spent_entry);
+    BOOST_CHECK(kept_a_dirty_entry);
+}
+
 void CheckSpendCoins(CAmount base_value, CAmount cache_value, CAmount expected_value, char cache_flags, char expected_flags)
 {
     SingleEntryCacheTest test(base_value, cache_value, cache_flags);
@@ -855,4 +1084,114 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+BOOST_FIXTURE_TEST_CASE(ccoins_background_flush, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true, true);
+    CCoinsViewCache cache(&db);
+    const uint256 hashBlock1 = InsecureRand256();
+    const uint256 hashBlock2 = InsecureRand256();
+
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 1000; ++i) {
+        outpoints.emplace_back(InsecureRand256(), 0);
+        Coin coin;
+        coin.out.nValue = i + 1;
+        coin.nHeight = 1;
+        cache.AddCoin(outpoints.back(), std::move(coin), false);
+    }
+    cache.SetBestBlock(hashBlock1);
+
+    // Detach the cache and write it in the background, continuing on the
+    // empty cache: every coin stays visible while and after it is written.
+    size_t usage = cache.DynamicMemoryUsage();
+    CCoinsMap mapCoins = cache.Detach();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    BOOST_CHECK_EQUAL(mapCoins.size(), 1000U);
+    BOOST_CHECK(db.BatchWriteAsync(std::move(mapCoins), hashBlock1, usage));
+    BOOST_CHECK(db.GetBestBlock() == hashBlock1);
+    for (int i = 0; i < 500; ++i) {
+        BOOST_CHECK(cache.SpendCoin(outpoints[i]));
+    }
+    for (int i = 0; i < 1000; ++i) {
+        BOOST_CHECK_EQUAL(db.HaveCoin(outpoints[i]), true);
+        BOOST_CHECK_EQUAL(cache.HaveCoin(outpoints[i]), i >= 500);
+    }
+    BOOST_CHECK(db.WaitForWrite());
+    BOOST_CHECK_EQUAL(db.PendingMemoryUsage(), 0U);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock1);
+
+    // A second write on top of the first one.
+    cache.SetBestBlock(hashBlock2);
+    usage = cache.DynamicMemoryUsage();
+    BOOST_CHECK(db.BatchWriteAsync(cache.Detach(), hashBlock2, usage));
+    for (int i = 0; i < 1000; ++i) {
+        Coin coin;
+        BOOST_CHECK_EQUAL(db.GetCoin(outpoints[i], coin), i >= 500);
+    }
+    BOOST_CHECK(db.WaitForWrite());
+    BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+
+    std::unique_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+    size_t count = 0;
+    for (; pcursor->Valid(); pcursor->Next()) ++count;
+    BOOST_CHECK_EQUAL(count, 500U);
+}
+
+BOOST_FIXTURE_TEST_CASE(ccoins_sync_evict, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true, true);
+    CCoinsViewCache cache(&db);
+
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 100; ++i) {
+        outpoints.emplace_back(InsecureRand256(), 0);
+        Coin coin;
+        coin.out.nValue = i + 1;
+        coin.nHeight = i + 1;
+        cache.AddCoin(outpoints.back(), std::move(coin), false);
+    }
+    cache.SetBestBlock(InsecureRand256());
+
+    // Sync writes the coins but keeps them cached; spent ones are dropped.
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 100U);
+    for (const COutPoint& outpoint : outpoints) {
+        BOOST_CHECK(db.HaveCoin(outpoint));
+    }
+    BOOST_CHECK(cache.SpendCoin(outpoints[0]));
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 99U);
+    BOOST_CHECK(!db.HaveCoin(outpoints[0]));
+
+    // Start a new epoch, then use some coins and add a modified one.
+    cache.Evict(std::numeric_limits<size_t>::max(), 0);
+    CCoinsCacheStats stats = cache.GetStats();
+    for (int i = 10; i < 20; ++i) {
+        BOOST_CHECK(cache.HaveCoin(outpoints[i]));
+    }
+    BOOST_CHECK(!cache.HaveCoin(COutPoint(InsecureRand256(), 0)));
+    BOOST_CHECK_EQUAL(cache.GetStats().hits, stats.hits + 10);
+    BOOST_CHECK_EQUAL(cache.GetStats().misses, stats.misses + 1);
+    const COutPoint dirty(InsecureRand256(), 0);
+    cache.AddCoin(dirty, Coin(CTxOut(1, CScript()), 1, false), false);
+
+    // Evicting just enough drops the unused coins below the young height
+    // (1-9 and 20-89) and nothing else.
+    const size_t entry_usage = memusage::MallocUsage(sizeof(memusage::unordered_node<CCoinsMap::value_type>));
+    cache.Evict(cache.DynamicMemoryUsage() - 79 * entry_usage, 91);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 21U);
+    BOOST_CHECK_EQUAL(cache.GetStats().evictions, 79U);
+    for (int i = 1; i < 100; ++i) {
+        BOOST_CHECK_EQUAL(cache.HaveCoinInCache(outpoints[i]), (i >= 10 && i < 20) || i >= 90);
+        BOOST_CHECK(db.HaveCoin(outpoints[i]));
+    }
+
+    // Modified entries are never evicted.
+    cache.Evict(0, 0);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+    BOOST_CHECK(cache.HaveCoinInCache(dirty));
+    BOOST_CHECK_EQUAL(cache.GetStats().evictions, 99U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
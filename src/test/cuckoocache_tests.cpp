@@ -6,6 +6,7 @@
 #include <script/sigcache.h>
 #include <test/test_starwels.h>
 #include <random.h>
+#include <set>
 #include <thread>
 
 /** Test Suite for CuckooCache
@@ -377,4 +378,42 @@ BOOST_AUTO_TEST_CASE(cuckoocache_generations)
     test_cache_generations<CuckooCache::cache<uint256, SignatureCacheHasher>>();
 }
 
+/** Check that get_elements returns exactly the elements that were inserted
+ * and not erased, and that they can be restored into a fresh cache.
+ */
+template <typename Cache>
+void test_cache_get_elements(size_t megabytes)
+{
+    local_rand_ctx = FastRandomContext(true);
+    Cache set{};
+    set.setup_bytes(megabytes << 20);
+    // Stay well below capacity so that nothing is evicted.
+    std::vector<uint256> hashes(1000);
+    for (uint256& hash : hashes) {
+        insecure_GetRandHash(hash);
+        set.insert(hash);
+    }
+    for (size_t i = 0; i < hashes.size(); i += 2)
+        set.contains(hashes[i], true);
+
+    std::vector<uint256> elements = set.get_elements();
+    BOOST_CHECK_EQUAL(elements.size(), hashes.size() / 2);
+    std::set<uint256> kept(elements.begin(), elements.end());
+    for (size_t i = 0; i < hashes.size(); ++i)
+        BOOST_CHECK_EQUAL(kept.count(hashes[i]), i % 2);
+
+    Cache restored{};
+    restored.setup_bytes(megabytes << 20);
+    for (const uint256& element : elements)
+        restored.insert(element);
+    for (size_t i = 1; i < hashes.size(); i += 2)
+        BOOST_CHECK(restored.contains(hashes[i], false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_get_elements)
+{
+    size_t megabytes = 1;
+    test_cache_get_elements<CuckooCache::cache<uint256, SignatureCacheHasher>>(megabytes);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
@@ -119,6 +119,31 @@ BOOST_AUTO_TEST_CASE(dbwrapper_iterator)
     }
 }
 
+// Test that data loaded in bulk mode reads back after reopening normally
+BOOST_AUTO_TEST_CASE(dbwrapper_bulk_load)
+{
+    fs::path ph = fs::temp_directory_path() / fs::unique_path();
+    std::vector<uint256> values;
+    {
+        CDBWrapper dbw(ph, (1 << 20), false, true, true, true);
+        for (uint32_t i = 0; i < 4; ++i) {
+            CDBBatch batch(dbw);
+            for (uint32_t j = 0; j < 1000; ++j) {
+                values.push_back(InsecureRand256());
+                batch.Write(std::make_pair('b', i * 1000 + j), values.back());
+            }
+            BOOST_CHECK(dbw.WriteBatch(batch));
+        }
+    }
+
+    CDBWrapper dbw(ph, (1 << 20), false, false, true);
+    for (uint32_t i = 0; i < values.size(); ++i) {
+        uint256 res;
+        BOOST_CHECK(dbw.Read(std::make_pair('b', i), res));
+        BOOST_CHECK(res == values[i]);
+    }
+}
+
 // Test that we do not obfuscation if there is existing data.
 BOOST_AUTO_TEST_CASE(existing_data_no_obfuscate)
 {
@@ -0,0 +1,293 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <arith_uint256.h>
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <headerssync.h>
+#include <test/test_starwels.h>
+#include <validation.h>
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(headerssync_tests, BasicTestingSetup)
+
+/** Easiest difficulty on the main chain */
+static const uint32_t POW_LIMIT_BITS = 0x1d00ffff;
+
+struct TestChain {
+    std::vector<CBlockHeader> headers;
+    std::vector<uint256> hashes;
+
+    explicit TestChain(int nHeight, uint32_t nSeed = 0, uint32_t nBits = POW_LIMIT_BITS)
+    {
+        for (int i = 0; i <= nHeight; i++) {
+            CBlockHeader header;
+            header.nNonce = nSeed + i;
+            header.nBits = nBits;
+            if (i > 0) header.hashPrevBlock = hashes.back();
+            headers.push_back(header);
+            hashes.push_back(header.GetHash());
+        }
+    }
+
+    // Headers of heights nFrom to nTo, included.
+    void Get(int nFrom, int nTo, std::vector<CBlockHeader>& headersOut, std::vector<uint256>& hashesOut) const
+    {
+        headersOut.assign(headers.begin() + nFrom, headers.begin() + nTo + 1);
+        hashesOut.assign(hashes.begin() + nFrom, hashes.begin() + nTo + 1);
+    }
+};
+
+static CCheckpointData Checkpoints(const TestChain& chain, const std::vector<int>& heights)
+{
+    CCheckpointData data;
+    for (int nHeight : heights) {
+        data.mapCheckpoints[nHeight] = chain.hashes[nHeight];
+    }
+    return data;
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_download)
+{
+    const TestChain chain(6000);
+    CHeadersSegments segments(Checkpoints(chain, {0, 10, 5000, 6000}), Params().GetConsensus(), 4);
+    BOOST_CHECK_EQUAL(segments.GetSegmentCount(), 3U);
+
+    // The lowest segment above the headers chain goes first, and only to peers that have all of it.
+    CHeadersSegments::Request request;
+    BOOST_REQUIRE(segments.Assign(1, 0, POW_LIMIT_BITS, 6000, 0, request));
+    BOOST_CHECK(request.hashLocator == chain.hashes[10]);
+    BOOST_CHECK(request.hashStop == chain.hashes[5000]);
+    BOOST_CHECK(segments.IsAssigned(1));
+    BOOST_CHECK(!segments.Assign(1, 0, POW_LIMIT_BITS, 6000, 0, request));
+    BOOST_CHECK(!segments.Assign(2, 0, POW_LIMIT_BITS, 5999, 0, request));
+    BOOST_REQUIRE(segments.Assign(3, 0, POW_LIMIT_BITS, 6000, 0, request));
+    BOOST_CHECK(request.hashLocator == chain.hashes[5000]);
+
+    std::vector<CBlockHeader> headers;
+    std::vector<uint256> hashes;
+
+    // Headers that do not continue the segment are left to the caller.
+    chain.Get(1, 2000, headers, hashes);
+    BOOST_CHECK(segments.Receive(1, headers, hashes, 0, request) == CHeadersSegments::Result::UNRELATED);
+    chain.Get(11, 2010, headers, hashes);
+    BOOST_CHECK(segments.Receive(2, headers, hashes, 0, request) == CHeadersSegments::Result::UNRELATED);
+
+    // A full message is followed up on.
+    BOOST_CHECK(segments.Receive(1, headers, hashes, 0, request) == CHeadersSegments::Result::ACCEPTED);
+    BOOST_CHECK(request.hashLocator == chain.hashes[2010]);
+    BOOST_CHECK(request.hashStop == chain.hashes[5000]);
+    BOOST_CHECK_EQUAL(segments.GetBuffered(), 2000U);
+
+    // Reaching the checkpoint completes the segment.
+    chain.Get(5001, 6000, headers, hashes);
+    BOOST_CHECK(segments.Receive(3, headers, hashes, 0, request) == CHeadersSegments::Result::ACCEPTED);
+    BOOST_CHECK(request.hashLocator.IsNull());
+    BOOST_CHECK(!segments.IsAssigned(3));
+    BOOST_CHECK(!segments.Assign(3, 0, POW_LIMIT_BITS, 6000, 0, request));
+
+    chain.Get(2011, 4010, headers, hashes);
+    BOOST_CHECK(segments.Receive(1, headers, hashes, 0, request) == CHeadersSegments::Result::ACCEPTED);
+    chain.Get(4011, 5000, headers, hashes);
+    BOOST_CHECK(segments.Receive(1, headers, hashes, 0, request) == CHeadersSegments::Result::ACCEPTED);
+    BOOST_CHECK(request.hashLocator.IsNull());
+    BOOST_CHECK_EQUAL(segments.GetBuffered(), 5990U);
+
+    // Segments are taken, in full, once the headers chain reaches their start.
+    std::vector<CHeadersSegments::Batch> batches;
+    BOOST_CHECK(!segments.TakeConnectable([&](const uint256& hash) { return hash == chain.hashes[1]; }, batches));
+    BOOST_CHECK(segments.TakeConnectable([&](const uint256& hash) { return hash == chain.hashes[0]; }, batches));
+    BOOST_CHECK(batches.empty());
+    BOOST_CHECK(segments.TakeConnectable([&](const uint256& hash) { return hash == chain.hashes[10]; }, batches));
+    BOOST_REQUIRE_EQUAL(batches.size(), 1U);
+    BOOST_CHECK_EQUAL(batches[0].peer, 1);
+    BOOST_REQUIRE_EQUAL(batches[0].headers.size(), 4990U);
+    BOOST_CHECK(batches[0].hashes.front() == chain.hashes[11]);
+    BOOST_CHECK(batches[0].hashes.back() == chain.hashes[5000]);
+    BOOST_CHECK(segments.TakeConnectable([&](const uint256& hash) { return hash == chain.hashes[5000]; }, batches));
+    BOOST_REQUIRE_EQUAL(batches.size(), 1U);
+    BOOST_CHECK_EQUAL(batches[0].peer, 3);
+    BOOST_CHECK_EQUAL(segments.GetBuffered(), 0U);
+    BOOST_CHECK_EQUAL(segments.GetSegmentCount(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_failures)
+{
+    const TestChain chain(6000);
+    const TestChain fork(6000, 1000000);
+    CHeadersSegments segments(Checkpoints(chain, {0, 3000, 6000}), Params().GetConsensus(), 4);
+    std::vector<CBlockHeader> headers;
+    std::vector<uint256> hashes;
+    CHeadersSegments::Request request;
+
+    // A peer that stops short of the checkpoint is not asked again, and
+    // another one picks up where it stopped.
+    BOOST_REQUIRE(segments.Assign(1, 0, POW_LIMIT_BITS, 6000, 0, request));
+    chain.Get(3001, 3100, headers, hashes);
+    BOOST_CHECK(segments.Receive(1, headers, hashes, 0, request) == CHeadersSegments::Result::ACCEPTED);
+    BOOST_CHECK(request.hashLocator.IsNull());
+    BOOST_CHECK(!segments.Assign(1, 0, POW_LIMIT_BITS, 6000, 0, request));
+    BOOST_REQUIRE(segments.Assign(2, 0, POW_LIMIT_BITS, 6000, 0, request));
+    BOOST_CHECK(request.hashLocator == chain.hashes[3100]);
+
+    // A peer that does not answer in time is replaced.
+    BOOST_CHECK(!segments.Assign(3, 0, POW_LIMIT_BITS, 6000, HEADERS_SEGMENT_TIMEOUT, request));
+    BOOST_REQUIRE(segments.Assign(3, 0, POW_LIMIT_BITS, 6000, HEADERS_SEGMENT_TIMEOUT + 1, request));
+    BOOST_CHECK(!segments.IsAssigned(2));
+    BOOST_CHECK(request.hashLocator == chain.hashes[3100]);
+
+    // Headers past the checkpoint, or not matching it, are invalid.
+    headers.assign(fork.headers.begin() + 1, fork.headers.begin() + 2901);
+    hashes.assign(fork.hashes.begin() + 1, fork.hashes.begin() + 2901);
+    headers[0].hashPrevBlock = chain.hashes[3100];
+    hashes.assign(hashes.size(), uint256());
+    BOOST_CHECK(segments.Receive(3, headers, hashes, 0, request) == CHeadersSegments::Result::INVALID);
+    BOOST_CHECK(!segments.IsAssigned(3));
+    BOOST_CHECK(!segments.Assign(3, 0, POW_LIMIT_BITS, 6000, HEADERS_SEGMENT_TIMEOUT + 1, request));
+
+    BOOST_REQUIRE(segments.Assign(4, 0, POW_LIMIT_BITS, 6000, 0, request));
+    chain.Get(3101, 6000, headers, hashes);
+    headers.push_back(headers.back());
+    hashes.push_back(hashes.back());
+    BOOST_CHECK(segments.Receive(4, headers, hashes, 0, request) == CHeadersSegments::Result::INVALID);
+    BOOST_CHECK_EQUAL(segments.GetBuffered(), 100U);
+
+    // A disconnected peer lets go of its segment.
+    BOOST_REQUIRE(segments.Assign(5, 0, POW_LIMIT_BITS, 6000, 0, request));
+    segments.Release(5);
+    BOOST_CHECK(!segments.IsAssigned(5));
+
+    // Nothing is given out below the headers chain, or when disabled.
+    BOOST_CHECK(!segments.Assign(6, 3000, POW_LIMIT_BITS, 6000, 0, request));
+    CHeadersSegments disabled(Checkpoints(chain, {0, 3000, 6000}), Params().GetConsensus(), 0);
+    BOOST_CHECK(!disabled.Assign(1, 0, POW_LIMIT_BITS, 6000, 0, request));
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_difficulty)
+{
+    // 256 times harder than the easiest difficulty, and four times easier.
+    const uint32_t nBits = 0x1c00ffff;
+    arith_uint256 bnEasier;
+    bnEasier.SetCompact(nBits);
+    bnEasier *= 4;
+    const TestChain chain(6000, 0, nBits);
+    const TestChain easier(6000, 1000000, bnEasier.GetCompact());
+    const TestChain cheap(6000, 2000000);
+    CHeadersSegments segments(Checkpoints(chain, {0, 100, 3000, 6000}), Params().GetConsensus(), 4);
+    std::vector<CBlockHeader> headers;
+    std::vector<uint256> hashes;
+    CHeadersSegments::Request request;
+
+    // A segment cannot get easier than the headers chain could have become
+    // by then, one difficulty adjustment away.
+    BOOST_REQUIRE(segments.Assign(1, 0, nBits, 6000, 0, request));
+    BOOST_REQUIRE(segments.Assign(2, 0, nBits, 6000, 0, request));
+    BOOST_CHECK(request.hashLocator == chain.hashes[3000]);
+    cheap.Get(3001, 5000, headers, hashes);
+    headers[0].hashPrevBlock = chain.hashes[3000];
+    BOOST_CHECK(segments.Receive(2, headers, hashes, 0, request) == CHeadersSegments::Result::INVALID);
+    BOOST_CHECK_EQUAL(segments.GetBuffered(), 0U);
+
+    BOOST_REQUIRE(segments.Assign(3, 0, nBits, 6000, 0, request));
+    easier.Get(3001, 5000, headers, hashes);
+    headers[0].hashPrevBlock = chain.hashes[3000];
+    BOOST_CHECK(segments.Receive(3, headers, hashes, 0, request) == CHeadersSegments::Result::ACCEPTED);
+    BOOST_CHECK_EQUAL(segments.GetBuffered(3), 2000U);
+
+    // Nor can it get easier between two adjustments.
+    chain.Get(101, 2100, headers, hashes);
+    headers[1000].nBits = bnEasier.GetCompact();
+    BOOST_CHECK(segments.Receive(1, headers, hashes, 0, request) == CHeadersSegments::Result::INVALID);
+    BOOST_REQUIRE(segments.Assign(4, 0, nBits, 6000, 0, request));
+    BOOST_CHECK(request.hashLocator == chain.hashes[100]);
+    chain.Get(101, 2100, headers, hashes);
+    BOOST_CHECK(segments.Receive(4, headers, hashes, 0, request) == CHeadersSegments::Result::ACCEPTED);
+    chain.Get(2101, 3000, headers, hashes);
+    BOOST_CHECK(segments.Receive(4, headers, hashes, 0, request) == CHeadersSegments::Result::ACCEPTED);
+
+    // Once the start of the next segment is known, the headers it got that
+    // are easier than that are dropped, and it is downloaded again.
+    BOOST_CHECK_EQUAL(segments.GetBuffered(3), 0U);
+    BOOST_CHECK_EQUAL(segments.GetBuffered(), 2900U);
+    BOOST_REQUIRE(segments.Assign(5, 0, nBits, 6000, 0, request));
+    BOOST_CHECK(request.hashLocator == chain.hashes[3000]);
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_peer_limit)
+{
+    const int nEnd = MAX_HEADERS_SEGMENTS_BUFFERED_PER_PEER + 10000;
+    const TestChain chain(nEnd);
+    CHeadersSegments segments(Checkpoints(chain, {0, 1, nEnd}), Params().GetConsensus(), 4);
+    std::vector<CBlockHeader> headers;
+    std::vector<uint256> hashes;
+    CHeadersSegments::Request request;
+
+    // A peer stops being asked for more once it sent its share.
+    BOOST_REQUIRE(segments.Assign(1, 0, POW_LIMIT_BITS, nEnd, 0, request));
+    int nHeight = 1;
+    while (!request.hashLocator.IsNull()) {
+        chain.Get(nHeight + 1, nHeight + MAX_HEADERS_RESULTS, headers, hashes);
+        BOOST_REQUIRE(segments.Receive(1, headers, hashes, 0, request) == CHeadersSegments::Result::ACCEPTED);
+        nHeight += MAX_HEADERS_RESULTS;
+    }
+    BOOST_CHECK_EQUAL(segments.GetBuffered(1), MAX_HEADERS_SEGMENTS_BUFFERED_PER_PEER);
+    BOOST_CHECK(!segments.IsAssigned(1));
+    BOOST_CHECK(!segments.Assign(1, 0, POW_LIMIT_BITS, nEnd, 0, request));
+
+    // Another one goes on from there.
+    BOOST_REQUIRE(segments.Assign(2, 0, POW_LIMIT_BITS, nEnd, 0, request));
+    BOOST_CHECK(request.hashLocator == chain.hashes[nHeight]);
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_requeue)
+{
+    const TestChain chain(6000);
+    CHeadersSegments segments(Checkpoints(chain, {0, 3000, 6000}), Params().GetConsensus(), 4);
+    CHeadersSegments::Request request;
+
+    // A segment whose headers did not all connect is asked for again from
+    // the last one that did, below the headers chain too, but not from the
+    // peer that sent them, nor twice from the same peer.
+    std::vector<CHeadersSegments::Batch> batches;
+    BOOST_CHECK(segments.TakeConnectable([&](const uint256& hash) { return hash == chain.hashes[0]; }, batches));
+    segments.Requeue(1, 100, chain.hashes[100]);
+    BOOST_CHECK_EQUAL(segments.GetSegmentCount(), 2U);
+    BOOST_CHECK(!segments.Assign(1, 100, POW_LIMIT_BITS, 3000, 0, request));
+    BOOST_REQUIRE(segments.Assign(2, 100, POW_LIMIT_BITS, 6000, 0, request));
+    BOOST_CHECK(request.hashLocator == chain.hashes[100]);
+    BOOST_CHECK(request.hashStop == chain.hashes[3000]);
+    BOOST_CHECK(!segments.IsAssigned(2));
+    BOOST_REQUIRE(segments.Assign(2, 100, POW_LIMIT_BITS, 6000, 0, request));
+    BOOST_CHECK(request.hashLocator == chain.hashes[3000]);
+
+    // It is done with once the headers chain reaches its end.
+    BOOST_CHECK(!segments.TakeConnectable([&](const uint256& hash) { return hash == chain.hashes[100]; }, batches));
+    BOOST_CHECK(segments.TakeConnectable([&](const uint256& hash) { return hash == chain.hashes[100] || hash == chain.hashes[3000]; }, batches));
+    BOOST_CHECK(batches.empty());
+    BOOST_CHECK_EQUAL(segments.GetSegmentCount(), 1U);
+
+    // Nothing is requeued past the last checkpoint.
+    segments.Requeue(1, 6000, chain.hashes[6000]);
+    BOOST_CHECK_EQUAL(segments.GetSegmentCount(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(headerssync_check_headers)
+{
+    // Hashing and proof of work checks of whole messages, without cs_main.
+    const TestChain chain(10);
+    std::vector<uint256> hashes;
+    CValidationState state;
+    BOOST_CHECK(!CheckBlockHeaders(chain.headers, hashes, state, Params().GetConsensus()));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "high-hash");
+
+    std::vector<CBlockHeader> headers{Params().GenesisBlock().GetBlockHeader()};
+    BOOST_CHECK(CheckBlockHeaders(headers, hashes, state, Params().GetConsensus()));
+    BOOST_REQUIRE_EQUAL(hashes.size(), 1U);
+    BOOST_CHECK(hashes[0] == Params().GenesisBlock().GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -571,4 +571,183 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolDepthAndScoreTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+
+    // A few chains of transactions, some with equal fee rates.
+    std::vector<uint256> hashes;
+    for (int chain = 0; chain < 4; chain++) {
+        uint256 prevHash;
+        for (int depth = 0; depth < 4; depth++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(prevHash, 0);
+            tx.vin[0].scriptSig = CScript() << chain;
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+            tx.vout[0].nValue = COIN;
+            pool.addUnchecked(tx.GetHash(), entry.Fee(1000LL * ((chain + depth) % 3)).FromTx(tx));
+            prevHash = tx.GetHash();
+            hashes.push_back(prevHash);
+        }
+    }
+    hashes.push_back(InsecureRand256());
+
+    // Comparing looked up values orders transactions like CompareDepthAndScore.
+    LOCK(pool.cs);
+    for (const uint256& a : hashes) {
+        for (const uint256& b : hashes) {
+            DepthAndScore keyA, keyB;
+            if (!pool.GetDepthAndScore(a, keyA)) {
+                BOOST_CHECK(a == hashes.back());
+                BOOST_CHECK(!pool.CompareDepthAndScore(a, b));
+            } else if (!pool.GetDepthAndScore(b, keyB)) {
+                BOOST_CHECK(pool.CompareDepthAndScore(a, b));
+            } else {
+                BOOST_CHECK_EQUAL(keyA < keyB, pool.CompareDepthAndScore(a, b));
+                BOOST_CHECK(keyA.hash == a);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPrioritiseNotifyTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    std::vector<uint256> notified;
+    pool.NotifyEntryPrioritised.connect([&](const uint256& hash) { notified.push_back(hash); });
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = COIN;
+
+    // A delta for a transaction not in the mempool changes no score yet.
+    pool.PrioritiseTransaction(tx.GetHash(), 1000);
+    BOOST_CHECK(notified.empty());
+
+    pool.addUnchecked(tx.GetHash(), entry.Fee(1000).FromTx(tx));
+    DepthAndScore before, after;
+    {
+        LOCK(pool.cs);
+        BOOST_CHECK(pool.GetDepthAndScore(tx.GetHash(), before));
+    }
+    pool.PrioritiseTransaction(tx.GetHash(), 1000);
+    BOOST_CHECK_EQUAL(notified.size(), 1U);
+    BOOST_CHECK(notified[0] == tx.GetHash());
+    LOCK(pool.cs);
+    BOOST_CHECK(pool.GetDepthAndScore(tx.GetHash(), after));
+    BOOST_CHECK_EQUAL(after.nModFee, before.nModFee + 1000);
+}
+
+static std::vector<std::vector<uint256>> GetChunkHashes(CTxMemPool& pool)
+{
+    std::vector<std::vector<uint256>> chunks;
+    for (const CTxMemPool::TxChunk& chunk : pool.GetChunks()) {
+        chunks.emplace_back();
+        for (CTxMemPool::txiter it : chunk.vTxs) {
+            chunks.back().push_back(it->GetTx().GetHash());
+        }
+    }
+    return chunks;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolClusterTest)
+{
+    CTxMemPool pool;
+    pool.SetClusterTracking(true, 100);
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    // Transactions of equal size: tx2 pays for its parent tx1, tx3 pays well
+    // but its child tx4 pays nothing, and tx5 stands alone.
+    std::vector<CMutableTransaction> txs(6);
+    const CAmount fees[] = {0, 0, 20000, 15000, 0, 5000};
+    for (int i = 1; i <= 5; i++) {
+        txs[i].vin.resize(1);
+        txs[i].vin[0].scriptSig = CScript() << i;
+        if (i == 2 || i == 4) {
+            txs[i].vin[0].prevout = COutPoint(txs[i - 1].GetHash(), 0);
+        }
+        txs[i].vout.resize(1);
+        txs[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txs[i].vout[0].nValue = COIN;
+        pool.addUnchecked(txs[i].GetHash(), entry.Fee(fees[i]).FromTx(txs[i]));
+    }
+
+    // One chunk per feerate, best first, with parents before children.
+    std::vector<std::vector<uint256>> expected{{txs[3].GetHash()}, {txs[1].GetHash(), txs[2].GetHash()}, {txs[5].GetHash()}, {txs[4].GetHash()}};
+    BOOST_CHECK(GetChunkHashes(pool) == expected);
+
+    // A new child of tx2 would join the cluster of tx1 and tx2.
+    CTxMemPool::setEntries setAncestors{pool.mapTx.find(txs[2].GetHash()), pool.mapTx.find(txs[1].GetHash())};
+    BOOST_CHECK_EQUAL(pool.CalculateClusterSize(setAncestors, 100), 3);
+    BOOST_CHECK_EQUAL(pool.CalculateClusterSize(setAncestors, 1), 2);
+
+    // Prioritisation reorders chunks.
+    pool.PrioritiseTransaction(txs[5].GetHash(), 20000);
+    expected = {{txs[5].GetHash()}, {txs[3].GetHash()}, {txs[1].GetHash(), txs[2].GetHash()}, {txs[4].GetHash()}};
+    BOOST_CHECK(GetChunkHashes(pool) == expected);
+
+    // Eviction takes the worst chunk as a whole: first tx4, then tx1 and tx2.
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+    BOOST_CHECK(!pool.exists(txs[4].GetHash()));
+    GetChunkHashes(pool);
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK(!pool.exists(txs[1].GetHash()) && !pool.exists(txs[2].GetHash()));
+    CFeeRate maxFeeRateRemoved(20000, GetVirtualTransactionSize(txs[1]) + GetVirtualTransactionSize(txs[2]));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
+
+    // Clusters split up once transactions are mined.
+    pool.addUnchecked(txs[4].GetHash(), entry.Fee(0).FromTx(txs[4]));
+    std::vector<CTransactionRef> block{MakeTransactionRef(txs[3])};
+    pool.removeForBlock(block, 1);
+    expected = {{txs[5].GetHash()}, {txs[4].GetHash()}};
+    BOOST_CHECK(GetChunkHashes(pool) == expected);
+
+    // Turning tracking off and on again linearizes everything from scratch.
+    pool.SetClusterTracking(false, 100);
+    BOOST_CHECK(!pool.IsClusterTracking());
+    pool.SetClusterTracking(true, 100);
+    BOOST_CHECK(GetChunkHashes(pool) == expected);
+
+    // A cluster over the search limit, as a reorg can leave behind, is still
+    // linearized with every parent ahead of its children.
+    pool.SetClusterTracking(true, 2);
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << 6;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = COIN;
+    }
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(0).FromTx(txParent));
+    std::vector<CMutableTransaction> txChildren(2);
+    for (int i = 0; i < 2; i++) {
+        txChildren[i].vin.resize(1);
+        txChildren[i].vin[0].prevout = COutPoint(txParent.GetHash(), i);
+        txChildren[i].vout.resize(1);
+        txChildren[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChildren[i].vout[0].nValue = COIN;
+        pool.addUnchecked(txChildren[i].GetHash(), entry.Fee(i * 30000).FromTx(txChildren[i]));
+    }
+    std::vector<uint256> vOrder;
+    for (const std::vector<uint256>& chunk : GetChunkHashes(pool)) {
+        for (const uint256& hash : chunk) {
+            if (hash == txParent.GetHash() || hash == txChildren[0].GetHash() || hash == txChildren[1].GetHash()) {
+                vOrder.push_back(hash);
+            }
+        }
+    }
+    BOOST_CHECK_EQUAL(vOrder.size(), 3);
+    BOOST_CHECK(vOrder.front() == txParent.GetHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
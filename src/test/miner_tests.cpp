@@ -520,4 +520,108 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+// Spend output 0 of prev, paying to coinbaseKey, with the given fee.
+static CMutableTransaction SpendToKey(const CTransaction& prev, const CKey& key, CAmount nFee, uint32_t nLockTime = 0)
+{
+    const CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.nLockTime = nLockTime;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(prev.GetHash(), 0);
+    if (nLockTime) {
+        tx.vin[0].nSequence = 0;
+    }
+    tx.vout.resize(1);
+    tx.vout[0].nValue = prev.vout[0].nValue - nFee;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(prev.vout[0].scriptPubKey, tx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+BOOST_FIXTURE_TEST_CASE(BlockTemplateBuilder_updates, TestChain100Setup)
+{
+    BlockTemplateBuilder builder(Params());
+    RegisterValidationInterface(&builder);
+    // Let notifications about the test chain pass before the first template
+    SyncWithValidationInterfaceQueue();
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate = builder.GetTemplate(true);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+    BOOST_CHECK_EQUAL(builder.GetStats().nBuilds, 1);
+
+    // A transaction and its child are appended as they enter the mempool.
+    const CMutableTransaction parent = SpendToKey(coinbaseTxns[0], coinbaseKey, 10000);
+    const CMutableTransaction child = SpendToKey(parent, coinbaseKey, 20000);
+    for (const CMutableTransaction& tx : {parent, child}) {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, MakeTransactionRef(tx), nullptr, nullptr, false, 0));
+    }
+    SyncWithValidationInterfaceQueue();
+
+    pblocktemplate = builder.GetTemplate(true);
+    BOOST_CHECK_EQUAL(builder.GetStats().nBuilds, 1);
+    BOOST_CHECK_EQUAL(builder.GetStats().nUpdates, 2);
+    const CBlock& block = pblocktemplate->block;
+    BOOST_CHECK_EQUAL(block.vtx.size(), 3);
+    BOOST_CHECK(block.vtx[1]->GetHash() == parent.GetHash());
+    BOOST_CHECK(block.vtx[2]->GetHash() == child.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -30000);
+    BOOST_CHECK_EQUAL(block.vtx[0]->vout[0].nValue, GetBlockSubsidy(chainActive.Height() + 1, Params().GetConsensus()) + 30000);
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(TestBlockValidity(state, Params(), block, chainActive.Tip(), false, false));
+    }
+
+    // A new tip makes it assemble the template again.
+    CreateAndProcessBlock({parent, child}, CScript() << OP_TRUE);
+    BOOST_CHECK_EQUAL(chainActive.Height(), 101);
+    SyncWithValidationInterfaceQueue();
+    pblocktemplate = builder.GetTemplate(true);
+    BOOST_CHECK_EQUAL(builder.GetStats().nBuilds, 2);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+
+    UnregisterValidationInterface(&builder);
+}
+
+BOOST_FIXTURE_TEST_CASE(CreateNewBlock_clusters, TestChain100Setup)
+{
+    // Let the first three coinbases mature.
+    for (int i = 0; i < 2; i++) {
+        CreateAndProcessBlock({}, CScript() << OP_TRUE);
+    }
+    mempool.SetClusterTracking(true, DEFAULT_CLUSTER_LIMIT);
+    TestMemPoolEntryHelper entry;
+
+    // child pays for parent, other pays less than the two of them together,
+    // and locked, the best chunk, cannot be mined yet, so neither can its
+    // child, although that pays better than any other chunk.
+    const CMutableTransaction parent = SpendToKey(coinbaseTxns[0], coinbaseKey, 0);
+    const CMutableTransaction child = SpendToKey(parent, coinbaseKey, 50000);
+    const CMutableTransaction other = SpendToKey(coinbaseTxns[1], coinbaseKey, 20000);
+    const CMutableTransaction locked = SpendToKey(coinbaseTxns[2], coinbaseKey, 40000, chainActive.Height() + 10);
+    const CMutableTransaction lockedChild = SpendToKey(locked, coinbaseKey, 30000);
+    mempool.addUnchecked(parent.GetHash(), entry.Fee(0).FromTx(parent));
+    mempool.addUnchecked(child.GetHash(), entry.Fee(50000).FromTx(child));
+    mempool.addUnchecked(other.GetHash(), entry.Fee(20000).FromTx(other));
+    mempool.addUnchecked(locked.GetHash(), entry.Fee(40000).FromTx(locked));
+    mempool.addUnchecked(lockedChild.GetHash(), entry.Fee(30000).FromTx(lockedChild));
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(Params()).CreateNewBlock(CScript() << OP_TRUE);
+    const CBlock& block = pblocktemplate->block;
+    BOOST_CHECK_EQUAL(block.vtx.size(), 4);
+    BOOST_CHECK(block.vtx[1]->GetHash() == parent.GetHash());
+    BOOST_CHECK(block.vtx[2]->GetHash() == child.GetHash());
+    BOOST_CHECK(block.vtx[3]->GetHash() == other.GetHash());
+    BOOST_CHECK_EQUAL(block.vtx[0]->vout[0].nValue, GetBlockSubsidy(chainActive.Height() + 1, Params().GetConsensus()) + 70000);
+
+    mempool.clear();
+    mempool.SetClusterTracking(false, DEFAULT_CLUSTER_LIMIT);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -10,6 +10,7 @@
 #include <streams.h>
 #include <net.h>
 #include <netbase.h>
+#include <netmessagemaker.h>
 #include <chainparams.h>
 #include <util.h>
 
@@ -187,4 +188,99 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(shared_message_test)
+{
+    CConnman connman(0x1337, 0x1337);
+    CAddress addr(CService(CNetAddr(), 7777), NODE_NETWORK);
+    std::unique_ptr<CNode> pnode1(new CNode(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, CAddress(), "", false));
+    std::unique_ptr<CNode> pnode2(new CNode(1, NODE_NETWORK, 0, INVALID_SOCKET, addr, 1, 1, CAddress(), "", false));
+
+    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+    CSharedNetMsg msg(msgMaker.Make(NetMsgType::PING, uint64_t(42)));
+    BOOST_CHECK_EQUAL(msg.command, NetMsgType::PING);
+    BOOST_CHECK_EQUAL(msg.header->size(), (size_t)CMessageHeader::HEADER_SIZE);
+    BOOST_CHECK_EQUAL(msg.data->size(), sizeof(uint64_t));
+
+    // The send queues of both nodes reference the same buffers.
+    connman.PushMessage(pnode1.get(), msg);
+    connman.PushMessage(pnode2.get(), msg);
+    BOOST_REQUIRE_EQUAL(pnode1->vSendMsg.size(), 2U);
+    BOOST_REQUIRE_EQUAL(pnode2->vSendMsg.size(), 2U);
+    BOOST_CHECK(pnode1->vSendMsg[0] == msg.header && pnode2->vSendMsg[0] == msg.header);
+    BOOST_CHECK(pnode1->vSendMsg[1] == msg.data && pnode2->vSendMsg[1] == msg.data);
+    BOOST_CHECK_EQUAL(pnode1->nSendSize, (size_t)CMessageHeader::HEADER_SIZE + sizeof(uint64_t));
+
+    // Which hold the same bytes as the same message pushed the usual way.
+    connman.PushMessage(pnode1.get(), msgMaker.Make(NetMsgType::PING, uint64_t(42)));
+    BOOST_REQUIRE_EQUAL(pnode1->vSendMsg.size(), 4U);
+    BOOST_CHECK(*pnode1->vSendMsg[2] == *msg.header);
+    BOOST_CHECK(*pnode1->vSendMsg[3] == *msg.data);
+}
+
+static std::vector<char> WireMessage(CSerializedNetMsg msg)
+{
+    CSharedNetMsg shared(std::move(msg));
+    std::vector<char> wire(shared.header->begin(), shared.header->end());
+    wire.insert(wire.end(), shared.data->begin(), shared.data->end());
+    return wire;
+}
+
+BOOST_AUTO_TEST_CASE(recv_buffer_pool_test)
+{
+    CAddress addr(CService(CNetAddr(), 7777), NODE_NETWORK);
+    std::unique_ptr<CNode> pnode(new CNode(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, CAddress(), "", false));
+
+    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+    const std::vector<char> wire = WireMessage(msgMaker.Make(NetMsgType::PING, uint64_t(42)));
+
+    // A message parsed in small pieces ends up with its exact contents.
+    std::list<CNetMessage> msgs;
+    msgs.emplace_back(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+    CNetMessage& msg = msgs.back();
+    for (size_t pos = 0; pos < wire.size();) {
+        int handled = msg.in_data ? msg.readData(&wire[pos], 5) : msg.readHeader(&wire[pos], std::min<size_t>(5, wire.size() - pos));
+        BOOST_REQUIRE(handled > 0);
+        pos += handled;
+    }
+    BOOST_REQUIRE(msg.complete());
+    BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), NetMsgType::PING);
+    BOOST_CHECK_EQUAL(msg.vRecv.size(), sizeof(uint64_t));
+    BOOST_CHECK(memcmp(msg.GetMessageHash().begin(), msg.hdr.pchChecksum, CMessageHeader::CHECKSUM_SIZE) == 0);
+    uint64_t nonce;
+    msg.vRecv >> nonce;
+    BOOST_CHECK_EQUAL(nonce, 42U);
+
+    // Without anything in the pool, receiving allocates.
+    bool complete;
+    BOOST_CHECK(pnode->ReceiveMsgBytes(wire.data(), wire.size(), complete));
+    BOOST_CHECK(complete);
+    CNodeStats stats;
+    pnode->copyStats(stats);
+    BOOST_CHECK_EQUAL(stats.nRecvBufferAllocs, 2U);
+    BOOST_CHECK_EQUAL(stats.nRecvBufferReuses, 0U);
+
+    // A processed message is handed back, and the next one is received into
+    // it without allocating.
+    pnode->RecycleMessages(msgs);
+    BOOST_CHECK(msgs.empty());
+    BOOST_CHECK(pnode->ReceiveMsgBytes(wire.data(), wire.size(), complete));
+    BOOST_CHECK(complete);
+    pnode->copyStats(stats);
+    BOOST_CHECK_EQUAL(stats.nRecvBufferAllocs, 2U);
+    BOOST_CHECK_EQUAL(stats.nRecvBufferReuses, 1U);
+
+    // The pool is bounded in size, and does not keep large buffers.
+    for (size_t i = 0; i < MAX_POOLED_RECV_MESSAGES + 2; ++i) {
+        msgs.emplace_back(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+    }
+    msgs.front().vRecv.reserve(MAX_POOLED_RECV_BUFFER_SIZE + 1);
+    pnode->RecycleMessages(msgs);
+    BOOST_CHECK(msgs.empty());
+    LOCK(pnode->cs_recvPool);
+    BOOST_CHECK_EQUAL(pnode->vRecvPool.size(), MAX_POOLED_RECV_MESSAGES);
+    for (const CNetMessage& pooled : pnode->vRecvPool) {
+        BOOST_CHECK(pooled.vRecv.capacity() <= MAX_POOLED_RECV_BUFFER_SIZE);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -61,6 +61,20 @@ BOOST_AUTO_TEST_CASE(get_next_work_upper_limit_actual)
     BOOST_CHECK_EQUAL(CalculateNextWorkRequired(&pindexLast, nLastRetargetTime, chainParams->GetConsensus()), 0x1d00e1fd);
 }
 
+BOOST_AUTO_TEST_CASE(get_easiest_work_after)
+{
+    const auto chainParams = CreateChainParams(CBaseChainParams::MAIN);
+    const Consensus::Params& params = chainParams->GetConsensus();
+    BOOST_CHECK_EQUAL(GetEasiestWorkAfter(0, 0x1c00ffff, 2015, params), 0x1c00ffffU);
+    BOOST_CHECK_EQUAL(GetEasiestWorkAfter(2015, 0x1c00ffff, 2016, params), 0x1c03fffcU);
+    BOOST_CHECK_EQUAL(GetEasiestWorkAfter(0, 0x1c00ffff, 4031, params), 0x1c03fffcU);
+    BOOST_CHECK_EQUAL(GetEasiestWorkAfter(0, 0x1c00ffff, 4032, params), 0x1c0ffff0U);
+    BOOST_CHECK_EQUAL(GetEasiestWorkAfter(0, 0x1c00ffff, 100000, params), 0x1d00ffffU);
+
+    const auto regtestParams = CreateChainParams(CBaseChainParams::REGTEST);
+    BOOST_CHECK_EQUAL(GetEasiestWorkAfter(0, 0x1c00ffff, 1, regtestParams->GetConsensus()), 0x207fffffU);
+}
+
 BOOST_AUTO_TEST_CASE(GetBlockProofEquivalentTime_test)
 {
     const auto chainParams = CreateChainParams(CBaseChainParams::MAIN);
@@ -0,0 +1,115 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <primitives/block.h>
+#include <random.h>
+#include <streams.h>
+#include <test/test_starwels.h>
+#include <validation.h>
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(rawblock_tests, TestChain100Setup)
+
+static std::vector<unsigned char> SerializeBlock(const CBlock& block, int nVersion)
+{
+    std::vector<unsigned char> data;
+    CVectorWriter(SER_NETWORK, nVersion, data, 0, block);
+    return data;
+}
+
+static CScript RandomScript()
+{
+    CScript script;
+    script.assign(InsecureRandBits(5), OP_TRUE);
+    return script;
+}
+
+BOOST_AUTO_TEST_CASE(rawblock_strip_witness)
+{
+    CBlock block;
+    block.nVersion = 4;
+    block.hashPrevBlock = InsecureRand256();
+    block.nNonce = InsecureRand32();
+    for (int i = 0; i < 50; i++) {
+        CMutableTransaction tx;
+        tx.nVersion = 2;
+        tx.nLockTime = InsecureRand32();
+        // Some transactions without witnesses, and some with many inputs or
+        // outputs so that their counts take more than one byte.
+        const int nIn = 1 + (i % 10 == 0 ? 300 : InsecureRandRange(3));
+        for (int j = 0; j < nIn; j++) {
+            tx.vin.emplace_back(COutPoint(InsecureRand256(), InsecureRand32()), RandomScript(), InsecureRand32());
+            if (i % 3 != 0) {
+                for (int k = InsecureRandRange(4); k > 0; k--) {
+                    tx.vin.back().scriptWitness.stack.push_back(std::vector<unsigned char>(InsecureRandRange(300), 0x42));
+                }
+            }
+        }
+        const int nOut = 1 + (i % 7 == 0 ? 260 : InsecureRandRange(3));
+        for (int j = 0; j < nOut; j++) {
+            tx.vout.emplace_back(InsecureRand32(), RandomScript());
+        }
+        block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+
+    std::vector<unsigned char> data = SerializeBlock(block, PROTOCOL_VERSION);
+    const std::vector<unsigned char> stripped = SerializeBlock(block, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS);
+    BOOST_CHECK(data.size() > stripped.size());
+    BOOST_CHECK(StripRawBlockWitness(data));
+    BOOST_CHECK(data == stripped);
+
+    // Stripping a block without witnesses leaves it as it is.
+    BOOST_CHECK(StripRawBlockWitness(data));
+    BOOST_CHECK(data == stripped);
+
+    // Truncated or extended blocks are rejected.
+    data = SerializeBlock(block, PROTOCOL_VERSION);
+    data.resize(data.size() - 1);
+    BOOST_CHECK(!StripRawBlockWitness(data));
+    data = SerializeBlock(block, PROTOCOL_VERSION);
+    data.push_back(0);
+    BOOST_CHECK(!StripRawBlockWitness(data));
+}
+
+BOOST_AUTO_TEST_CASE(rawblock_read)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    for (const CBlockIndex* pindex : {chainActive.Genesis(), chainActive[50], chainActive.Tip()}) {
+        CBlock block;
+        BOOST_REQUIRE(ReadBlockFromDisk(block, pindex, consensusParams));
+        std::vector<unsigned char> data;
+        BOOST_REQUIRE(ReadRawBlockFromDisk(data, pindex, Params().MessageStart()));
+        BOOST_CHECK(data == SerializeBlock(block, PROTOCOL_VERSION));
+        BOOST_CHECK(StripRawBlockWitness(data));
+        BOOST_CHECK(data == SerializeBlock(block, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS));
+    }
+
+    // The message start guards against reading from a wrong position.
+    CMessageHeader::MessageStartChars wrongStart = {0, 0, 0, 0};
+    std::vector<unsigned char> data;
+    BOOST_CHECK(!ReadRawBlockFromDisk(data, chainActive.Tip(), wrongStart));
+
+    // So does the block hash against reading another block.
+    CBlockIndex index(*chainActive[50]);
+    index.phashBlock = chainActive[49]->phashBlock;
+    BOOST_CHECK(!ReadRawBlockFromDisk(data, &index, Params().MessageStart()));
+
+    // Blocks are served from a position taken under cs_main.
+    CDiskBlockPos pos;
+    {
+        LOCK(cs_main);
+        pos = chainActive.Tip()->GetBlockPos();
+    }
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pos, consensusParams));
+    BOOST_CHECK(ReadRawBlockFromDisk(data, pos, block.GetHash(), Params().MessageStart()));
+    BOOST_CHECK(data == SerializeBlock(block, PROTOCOL_VERSION));
+    BOOST_CHECK(!ReadRawBlockFromDisk(data, pos, chainActive[99]->GetBlockHash(), Params().MessageStart()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
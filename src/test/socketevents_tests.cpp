@@ -0,0 +1,122 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <socketevents.h>
+#include <test/test_starwels.h>
+#include <utiltime.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(socketevents_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(socketevents_modes)
+{
+    SocketEventsMode mode;
+    BOOST_CHECK(SocketEventsModeFromString("select", mode));
+    BOOST_CHECK(mode == SocketEventsMode::SELECT);
+    BOOST_CHECK(!SocketEventsModeFromString("kqueue", mode));
+    BOOST_CHECK(SocketEventsModeFromString(SocketEventsModeToString(DefaultSocketEventsMode()), mode));
+    BOOST_CHECK(mode == DefaultSocketEventsMode());
+}
+
+#ifndef WIN32
+static std::vector<SocketEventsMode> SupportedModes()
+{
+    std::vector<SocketEventsMode> modes;
+    for (const char* str : {"select", "poll", "epoll"}) {
+        SocketEventsMode mode;
+        if (SocketEventsModeFromString(str, mode)) modes.push_back(mode);
+    }
+    return modes;
+}
+
+static void SendByte(int fd)
+{
+    char c = 0;
+    BOOST_REQUIRE_EQUAL(write(fd, &c, 1), 1);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_wait)
+{
+    for (SocketEventsMode mode : SupportedModes()) {
+        BOOST_TEST_MESSAGE(SocketEventsModeToString(mode));
+        std::string error;
+        std::unique_ptr<CSocketEvents> events = CSocketEvents::Make(mode, error);
+        BOOST_REQUIRE(events);
+        BOOST_CHECK(events->CanInterrupt());
+
+        int fds[2];
+        BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+        // Nothing to read yet, but there is room to write.
+        events->Watch(fds[0], 1, CSocketEvents::RECV);
+        BOOST_CHECK(events->Wait(0));
+        BOOST_CHECK_EQUAL(events->GetEvents(fds[0]), 0);
+        events->Watch(fds[0], 1, CSocketEvents::RECV | CSocketEvents::SEND);
+        BOOST_CHECK(events->Wait(1000));
+        BOOST_CHECK_EQUAL(events->GetEvents(fds[0]), CSocketEvents::SEND);
+
+        SendByte(fds[1]);
+        events->Watch(fds[0], 1, CSocketEvents::RECV);
+        BOOST_CHECK(events->Wait(1000));
+        BOOST_REQUIRE_EQUAL(events->GetReady().size(), 1U);
+        BOOST_CHECK_EQUAL(events->GetReady()[0].socket, fds[0]);
+        BOOST_CHECK_EQUAL(events->GetReady()[0].id, 1);
+        BOOST_CHECK_EQUAL(events->GetReady()[0].events, CSocketEvents::RECV);
+
+        // Sockets stay watched until told otherwise.
+        BOOST_CHECK(events->Wait(0));
+        BOOST_CHECK_EQUAL(events->GetEvents(fds[0]), CSocketEvents::RECV);
+        char c;
+        BOOST_REQUIRE_EQUAL(read(fds[0], &c, 1), 1);
+
+        // Interrupt() cuts a wait short, whether it comes before or during it.
+        int64_t nStart = GetTimeMillis();
+        events->Interrupt();
+        events->Interrupt();
+        BOOST_CHECK(events->Wait(30000));
+        BOOST_CHECK(GetTimeMillis() - nStart < 15000);
+        std::thread thread([&events] {
+            MilliSleep(100);
+            events->Interrupt();
+        });
+        BOOST_CHECK(events->Wait(30000));
+        thread.join();
+        BOOST_CHECK(GetTimeMillis() - nStart < 15000);
+
+        // A descriptor reused by a new socket is watched afresh, and
+        // unwatching the old one leaves it be.
+        close(fds[0]);
+        close(fds[1]);
+        int fds2[2];
+        BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds2), 0);
+        BOOST_CHECK_EQUAL(fds2[0], fds[0]);
+        SendByte(fds2[1]);
+        events->Watch(fds2[0], 2, CSocketEvents::RECV);
+        events->Unwatch(1);
+        BOOST_CHECK(events->Wait(1000));
+        BOOST_CHECK_EQUAL(events->GetEvents(fds2[0]), CSocketEvents::RECV);
+
+        // An unwatched socket is not reported.
+        events->Unwatch(2);
+        BOOST_CHECK(events->Wait(0));
+        BOOST_CHECK(events->GetReady().empty());
+        BOOST_REQUIRE_EQUAL(read(fds2[0], &c, 1), 1);
+
+        // Hanging up is reported as readable (and as an error by some backends).
+        close(fds2[1]);
+        events->Watch(fds2[0], 2, CSocketEvents::RECV);
+        BOOST_CHECK(events->Wait(1000));
+        BOOST_CHECK(events->GetEvents(fds2[0]) & CSocketEvents::RECV);
+        close(fds2[0]);
+    }
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
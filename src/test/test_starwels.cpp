@@ -4,6 +4,7 @@
 
 #include <test/test_starwels.h>
 
+#include <blockencodings.h>
 #include <chainparams.h>
 #include <consensus/consensus.h>
 #include <consensus/validation.h>
@@ -96,6 +97,15 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
         nScriptCheckThreads = 3;
         for (int i=0; i < nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        nCoinsPrefetchThreads = 2;
+        for (int i=0; i < nCoinsPrefetchThreads; i++)
+            threadGroup.create_thread(&ThreadCoinsPrefetch);
+        nShortIDThreads = 2;
+        for (int i=0; i < nShortIDThreads; i++)
+            threadGroup.create_thread(&ThreadShortIDMatch);
+        nTxVerifyThreads = 2;
+        for (int i=0; i < nTxVerifyThreads; i++)
+            threadGroup.create_thread(&ThreadTxVerify);
         g_connman = std::unique_ptr<CConnman>(new CConnman(0x1337, 0x1337)); // Deterministic randomness for tests.
         connman = g_connman.get();
         peerLogic.reset(new PeerLogicValidation(connman, scheduler));
@@ -7,6 +7,7 @@
 #include <amount.h>
 #include <consensus/validation.h>
 #include <primitives/transaction.h>
+#include <script/interpreter.h>
 #include <script/script.h>
 #include <test/test_starwels.h>
 
@@ -58,4 +59,101 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_reject_coinbase, TestChain100Setup)
     BOOST_CHECK_EQUAL(nDoS, 100);
 }
 
+// Spend output n of prev, which pays to key, to nOutputs P2PK outputs of key.
+static CMutableTransaction CreateSpend(const CKey& key, const CTransaction& prev, uint32_t n, CAmount nFee, int nOutputs = 1, bool fBadSig = false)
+{
+    CMutableTransaction tx;
+    tx.nVersion = 1;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(prev.GetHash(), n);
+    tx.vout.resize(nOutputs);
+    for (CTxOut& out : tx.vout) {
+        out.nValue = (prev.vout[n].nValue - nFee) / nOutputs;
+        out.scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    }
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(prev.vout[n].scriptPubKey, tx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    if (fBadSig) vchSig[10] ^= 1;
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+static bool SubmitPackage(const std::vector<CMutableTransaction>& txs, CValidationState& state, uint256& failed_txid)
+{
+    std::vector<CTransactionRef> package;
+    for (const CMutableTransaction& tx : txs) {
+        package.push_back(MakeTransactionRef(tx));
+    }
+    state = CValidationState();
+    failed_txid.SetNull();
+    return AcceptPackageToMemoryPool(mempool, state, package, &failed_txid, 0 /* nAbsurdFee */);
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_accept_package, TestChain100Setup)
+{
+    // A parent paying no fee at all, with two outputs.
+    const CMutableTransaction parent = CreateSpend(coinbaseKey, coinbaseTxns[0], 0, 0, 2);
+    const CMutableTransaction child = CreateSpend(coinbaseKey, parent, 0, 20000);
+    const CMutableTransaction sibling = CreateSpend(coinbaseKey, parent, 1, 20000);
+    const CMutableTransaction cheap_child = CreateSpend(coinbaseKey, parent, 0, 0);
+    const CMutableTransaction bad_child = CreateSpend(coinbaseKey, parent, 0, 20000, 1, true);
+    CValidationState state;
+    uint256 failed_txid;
+
+    // The parent does not get in on its own.
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(!AcceptToMemoryPool(mempool, state, MakeTransactionRef(parent), nullptr /* pfMissingInputs */,
+                                        nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */));
+        BOOST_CHECK_EQUAL(state.GetRejectReason(), "min relay fee not met");
+    }
+
+    // Packages of the wrong shape are turned down before looking at them.
+    BOOST_CHECK(!SubmitPackage({}, state, failed_txid));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-empty");
+    BOOST_CHECK(!SubmitPackage({child, parent}, state, failed_txid));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-not-sorted");
+    BOOST_CHECK(!SubmitPackage({parent, sibling, child}, state, failed_txid));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-not-child-with-parents");
+    BOOST_CHECK(!SubmitPackage({parent, parent}, state, failed_txid));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-contains-duplicates");
+    BOOST_CHECK(!SubmitPackage({parent, child, cheap_child}, state, failed_txid));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "conflict-in-package");
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    // A child that does not pay for itself does not pay for its parent either.
+    BOOST_CHECK(!SubmitPackage({parent, cheap_child}, state, failed_txid));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "insufficient fee");
+    BOOST_CHECK(failed_txid == cheap_child.GetHash());
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    // An invalid child takes its parent down with it.
+    BOOST_CHECK(!SubmitPackage({parent, bad_child}, state, failed_txid));
+    BOOST_CHECK(state.IsInvalid());
+    BOOST_CHECK(failed_txid == bad_child.GetHash());
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    // A child paying enough for both gets them in.
+    BOOST_CHECK(SubmitPackage({parent, child}, state, failed_txid));
+    BOOST_CHECK_EQUAL(mempool.size(), 2);
+    BOOST_CHECK(mempool.exists(parent.GetHash()) && mempool.exists(child.GetHash()));
+    {
+        LOCK(mempool.cs);
+        CTxMemPool::txiter it = mempool.mapTx.find(child.GetHash());
+        BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 2);
+        BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 20000);
+    }
+
+    // Submitting it again changes nothing.
+    BOOST_CHECK(SubmitPackage({parent, child}, state, failed_txid));
+    BOOST_CHECK_EQUAL(mempool.size(), 2);
+
+    // Nor does a package conflicting with it.
+    BOOST_CHECK(!SubmitPackage({parent, bad_child}, state, failed_txid));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "txn-mempool-conflict");
+    BOOST_CHECK_EQUAL(mempool.size(), 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
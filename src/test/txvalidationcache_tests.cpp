@@ -2,7 +2,9 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <clientversion.h>
 #include <consensus/validation.h>
+#include <hash.h>
 #include <key.h>
 #include <validation.h>
 #include <miner.h>
@@ -11,6 +13,7 @@
 #include <random.h>
 #include <script/standard.h>
 #include <script/sign.h>
+#include <streams.h>
 #include <test/test_starwels.h>
 #include <utiltime.h>
 #include <core_io.h>
@@ -368,4 +371,211 @@ BOOST_FIXTURE_TEST_CASE(checkinputs_test, TestChain100Setup)
     }
 }
 
+static bool HasCachedScripts(const CTransaction& tx)
+{
+    LOCK(cs_main);
+    CValidationState state;
+    PrecomputedTransactionData txdata(tx);
+    std::vector<CScriptCheck> checks;
+    BOOST_CHECK(CheckInputs(tx, state, *pcoinsTip, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, true, txdata, &checks));
+    // No checks are handed out for a cache hit.
+    return checks.empty();
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_preverify, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // Split a mature coinbase into outputs to be spent independently.
+    const int nSpends = 10;
+    CMutableTransaction funding;
+    funding.nVersion = 1;
+    funding.vin.resize(1);
+    funding.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    funding.vout.resize(nSpends);
+    for (int i = 0; i < nSpends; i++) {
+        funding.vout[i].nValue = coinbaseTxns[0].vout[0].nValue / (nSpends + 1);
+        funding.vout[i].scriptPubKey = scriptPubKey;
+    }
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, funding, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    funding.vin[0].scriptSig << vchSig;
+    CBlock block = CreateAndProcessBlock({funding}, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+
+    std::vector<CMutableTransaction> spends(nSpends);
+    std::vector<CTransactionRef> txs;
+    for (int i = 0; i < nSpends; i++) {
+        spends[i].nVersion = 1;
+        spends[i].vin.resize(1);
+        spends[i].vin[0].prevout = COutPoint(funding.GetHash(), i);
+        spends[i].vout.resize(1);
+        // The one before last pays no fee, so it is rejected before its
+        // scripts are looked at.
+        spends[i].vout[0].nValue = funding.vout[i].nValue - (i == nSpends - 2 ? 0 : 1000);
+        spends[i].vout[0].scriptPubKey = scriptPubKey;
+        vchSig.clear();
+        hash = SignatureHash(scriptPubKey, spends[i], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        // The last one gets a bad signature.
+        if (i == nSpends - 1) vchSig[10] ^= 1;
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        spends[i].vin[0].scriptSig << vchSig;
+        txs.push_back(MakeTransactionRef(spends[i]));
+    }
+    // Also one with missing inputs, which is left alone.
+    CMutableTransaction orphan = spends[0];
+    orphan.vin[0].prevout.hash = GetRandHash();
+    txs.push_back(MakeTransactionRef(orphan));
+
+    for (int i = 0; i < nSpends; i++) {
+        BOOST_CHECK(!HasCachedScripts(*txs[i]));
+    }
+    BOOST_CHECK_EQUAL(PreverifyTransactions(mempool, txs), nSpends - 2);
+    for (int i = 0; i < nSpends; i++) {
+        BOOST_CHECK_EQUAL(HasCachedScripts(*txs[i]), i < nSpends - 2);
+    }
+
+    // Acceptance does not depend on it, and the script failure is reported
+    // as if AcceptToMemoryPool had found it.
+    for (int i = 0; i < nSpends; i++) {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK_EQUAL(AcceptToMemoryPool(mempool, state, txs[i], nullptr, nullptr, false, 0), i < nSpends - 2);
+        int nDoS = 0;
+        if (i == nSpends - 2) {
+            BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 0);
+            BOOST_CHECK_EQUAL(state.GetRejectReason(), "min relay fee not met");
+        } else if (i == nSpends - 1) {
+            BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+            BOOST_CHECK_EQUAL(state.GetRejectReason().find("mandatory-script-verify-flag-failed"), 0);
+        }
+    }
+    BOOST_CHECK(!ToMemPool(orphan));
+    BOOST_CHECK_EQUAL(mempool.size(), nSpends - 2);
+
+    // Nothing to verify once they are in the mempool.
+    BOOST_CHECK_EQUAL(PreverifyTransactions(mempool, txs), 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(prevalidated_block_hits_cache, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // Split a mature coinbase into outputs to be spent independently.
+    const int nSpends = 4;
+    CMutableTransaction funding;
+    funding.nVersion = 1;
+    funding.vin.resize(1);
+    funding.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    funding.vout.resize(2 * nSpends);
+    for (CTxOut& out : funding.vout) {
+        out.nValue = coinbaseTxns[0].vout[0].nValue / (2 * nSpends + 1);
+        out.scriptPubKey = scriptPubKey;
+    }
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, funding, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    funding.vin[0].scriptSig << vchSig;
+    CreateAndProcessBlock({funding}, scriptPubKey);
+
+    // Put spends of those in the mempool, then forget the script executions
+    // cached on the way, as if they were accepted under other flags.
+    int nOutput = 0;
+    auto fill_mempool = [&]() {
+        std::vector<CMutableTransaction> spends(nSpends);
+        for (CMutableTransaction& spend : spends) {
+            spend.nVersion = 1;
+            spend.vin.resize(1);
+            spend.vin[0].prevout = COutPoint(funding.GetHash(), nOutput);
+            spend.vout.resize(1);
+            spend.vout[0].nValue = funding.vout[nOutput++].nValue - 1000;
+            spend.vout[0].scriptPubKey = scriptPubKey;
+            vchSig.clear();
+            hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+            BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+            vchSig.push_back((unsigned char)SIGHASH_ALL);
+            spend.vin[0].scriptSig << vchSig;
+            BOOST_CHECK(ToMemPool(spend));
+        }
+        InitScriptExecutionCache();
+        return spends;
+    };
+
+    uint64_t nHitsBefore, nMissesBefore, nHits, nMisses;
+
+    // Without prevalidation, the block verifies every script itself. (The
+    // block template the test builds on is checked too, so there are at
+    // least as many lookups as spends.)
+    std::vector<CMutableTransaction> spends = fill_mempool();
+    GetScriptExecutionCacheStats(nHitsBefore, nMissesBefore);
+    CreateAndProcessBlock(spends, scriptPubKey);
+    GetScriptExecutionCacheStats(nHits, nMisses);
+    BOOST_CHECK_EQUAL(nHits - nHitsBefore, 0);
+    BOOST_CHECK_GE(nMisses - nMissesBefore, nSpends);
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    // With it, every transaction of the block is found in the cache.
+    spends = fill_mempool();
+    BOOST_CHECK_EQUAL(PrevalidateMempool(), nSpends);
+    BOOST_CHECK_EQUAL(PrevalidateMempool(), 0);
+    GetScriptExecutionCacheStats(nHitsBefore, nMissesBefore);
+    CreateAndProcessBlock(spends, scriptPubKey);
+    GetScriptExecutionCacheStats(nHits, nMisses);
+    BOOST_CHECK_GE(nHits - nHitsBefore, nSpends);
+    BOOST_CHECK_EQUAL(nMisses - nMissesBefore, 0);
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(sigcache_file, TestingSetup)
+{
+    SignatureCacheContents contents;
+    contents.sigNonce = InsecureRand256();
+    contents.scriptNonce = InsecureRand256();
+    for (int i = 0; i < 10; i++) {
+        contents.sigEntries.push_back(InsecureRand256());
+        contents.scriptEntries.push_back(InsecureRand256());
+    }
+    contents.scriptEntries.pop_back();
+
+    const fs::path path = GetDataDir() / "sigcache_test.dat";
+    BOOST_CHECK(WriteSignatureCacheFile(path, contents));
+    SignatureCacheContents read;
+    BOOST_CHECK(ReadSignatureCacheFile(path, read));
+    BOOST_CHECK(read.sigNonce == contents.sigNonce);
+    BOOST_CHECK(read.sigEntries == contents.sigEntries);
+    BOOST_CHECK(read.scriptNonce == contents.scriptNonce);
+    BOOST_CHECK(read.scriptEntries == contents.scriptEntries);
+
+    // A well-formed file from another client version or for other script
+    // flags is not trusted.
+    for (int i = 0; i < 2; i++) {
+        {
+            CAutoFile file(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+            CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+            uint64_t version = 2;
+            int nClientVersion = CLIENT_VERSION + (i == 0);
+            uint32_t nFlags = STANDARD_SCRIPT_VERIFY_FLAGS ^ (i == 1 ? SCRIPT_VERIFY_CLEANSTACK : 0);
+            hasher << version << nClientVersion << nFlags << contents.sigNonce << contents.sigEntries << contents.scriptNonce << contents.scriptEntries;
+            file << version << nClientVersion << nFlags << contents.sigNonce << contents.sigEntries << contents.scriptNonce << contents.scriptEntries;
+            file << hasher.GetHash();
+        }
+        BOOST_CHECK(!ReadSignatureCacheFile(path, read));
+    }
+
+    // Nor is a corrupt one.
+    BOOST_CHECK(WriteSignatureCacheFile(path, contents));
+    {
+        CAutoFile file(fsbridge::fopen(path, "r+b"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(fseek(file.Get(), 60, SEEK_SET) == 0);
+        unsigned char ch = 0xff;
+        file << ch;
+    }
+    BOOST_CHECK(!ReadSignatureCacheFile(path, read));
+    fs::remove(path);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,205 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <coins.h>
+#include <consensus/validation.h>
+#include <fs.h>
+#include <random.h>
+#include <test/test_starwels.h>
+#include <txdb.h>
+#include <utxosnapshot.h>
+#include <validation.h>
+
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(utxosnapshot_tests, TestingSetup)
+
+static std::map<COutPoint, Coin> FillCoinsDB(CCoinsViewDB& db, const uint256& hashBlock)
+{
+    std::map<COutPoint, Coin> coins;
+    CCoinsMap map;
+    // Enough coins for more than one chunk, some transactions with many
+    // outputs, and output indexes whose VARINT takes three bytes.
+    for (int i = 0; coins.size() < UTXO_SNAPSHOT_CHUNK_SIZE + 5000; ++i) {
+        const uint256 txid = InsecureRand256();
+        const uint32_t first = i % 1000 == 0 ? 16000 + InsecureRandRange(1000) : 0;
+        const int outputs = 1 + InsecureRandRange(3);
+        for (int j = 0; j < outputs; ++j) {
+            COutPoint outpoint(txid, first + j);
+            Coin coin;
+            coin.out.nValue = InsecureRand32();
+            coin.out.scriptPubKey.assign(InsecureRandBits(6), 0x6a);
+            coin.nHeight = 1 + InsecureRandRange(100000);
+            coin.fCoinBase = InsecureRandBool();
+            coins[outpoint] = coin;
+            CCoinsCacheEntry& entry = map[outpoint];
+            entry.coin = coin;
+            entry.flags = CCoinsCacheEntry::DIRTY;
+        }
+    }
+    BOOST_CHECK(db.BatchWrite(map, hashBlock));
+    return coins;
+}
+
+BOOST_AUTO_TEST_CASE(utxosnapshot_roundtrip)
+{
+    CCoinsViewDB db(1 << 23, true, true);
+    const uint256 hashBlock = InsecureRand256();
+    std::map<COutPoint, Coin> coins = FillCoinsDB(db, hashBlock);
+
+    SnapshotMetadata metadata;
+    memcpy(metadata.message_start, Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE);
+    metadata.base_hash = hashBlock;
+    metadata.base_height = 2;
+    metadata.chain_tx = 3;
+    metadata.headers.resize(2);
+    metadata.headers[1].nNonce = 42;
+
+    const fs::path path = GetDataDir() / "utxo.dat";
+    std::unique_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+    std::string error;
+    BOOST_CHECK(WriteUTXOSnapshot(*pcursor, metadata, path, error));
+    BOOST_CHECK_EQUAL(metadata.coins_count, coins.size());
+
+    CUTXOSnapshotReader reader;
+    BOOST_CHECK(reader.Open(path, error));
+    const SnapshotMetadata& read = reader.GetMetadata();
+    BOOST_CHECK(read.base_hash == hashBlock);
+    BOOST_CHECK_EQUAL(read.base_height, 2);
+    BOOST_CHECK_EQUAL(read.chain_tx, 3U);
+    BOOST_CHECK_EQUAL(read.headers.size(), 2U);
+    BOOST_CHECK_EQUAL(read.headers[1].nNonce, 42U);
+    BOOST_CHECK_EQUAL(read.coins_count, coins.size());
+    BOOST_CHECK(read.utxo_hash == metadata.utxo_hash);
+
+    size_t chunks = 0;
+    size_t found = 0;
+    std::vector<std::pair<COutPoint, Coin>> chunk;
+    while (reader.ReadChunk(chunk)) {
+        ++chunks;
+        for (const auto& item : chunk) {
+            auto it = coins.find(item.first);
+            BOOST_REQUIRE(it != coins.end());
+            BOOST_CHECK(it->second.out == item.second.out);
+            BOOST_CHECK_EQUAL(it->second.nHeight, item.second.nHeight);
+            BOOST_CHECK_EQUAL(it->second.fCoinBase, item.second.fCoinBase);
+            ++found;
+        }
+    }
+    BOOST_CHECK_EQUAL(chunks, 2U);
+    BOOST_CHECK_EQUAL(found, coins.size());
+
+    // Any corruption is caught by the checksum before decoding starts.
+    std::vector<char> data;
+    {
+        std::ifstream in(path.string(), std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    data[data.size() / 2] ^= 1;
+    const fs::path pathBad = GetDataDir() / "utxo_bad.dat";
+    {
+        std::ofstream out(pathBad.string(), std::ios::binary);
+        out.write(data.data(), data.size());
+    }
+    CUTXOSnapshotReader badReader;
+    BOOST_CHECK(!badReader.Open(pathBad, error));
+}
+
+/** Parameters of the test chain that know about a UTXO snapshot */
+class AssumeutxoParams : public CChainParams
+{
+public:
+    explicit AssumeutxoParams(const CChainParams& params) : CChainParams(params) {}
+    void SetAssumeutxo(int height, const AssumeutxoData& data) { m_assumeutxo_data[height] = data; }
+};
+
+BOOST_FIXTURE_TEST_CASE(utxosnapshot_activate, TestChain100Setup)
+{
+    // Dump the UTXO set at the tip of the test chain.
+    SnapshotMetadata metadata;
+    std::unique_ptr<CCoinsViewCursor> pcursor;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        pcursor.reset(pcoinsdbview->Cursor());
+        const CBlockIndex* tip = chainActive.Tip();
+        memcpy(metadata.message_start, Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE);
+        metadata.base_hash = tip->GetBlockHash();
+        metadata.base_height = tip->nHeight;
+        metadata.chain_tx = tip->nChainTx;
+        for (int height = 1; height <= tip->nHeight; ++height) {
+            metadata.headers.push_back(chainActive[height]->GetBlockHeader());
+        }
+    }
+    const fs::path path = GetDataDir() / "utxo.dat";
+    std::string error;
+    BOOST_REQUIRE(WriteUTXOSnapshot(*pcursor, metadata, path, error));
+    pcursor.reset();
+
+    // Start over from an empty chainstate on a pruned node.
+    UnloadBlockIndex();
+    pcoinsTip.reset();
+    pcoinsdbview.reset(new CCoinsViewDB(1 << 23, true));
+    pcoinsTip.reset(new CCoinsViewCache(pcoinsdbview.get()));
+    pblocktree.reset(new CBlockTreeDB(1 << 20, true));
+    BOOST_REQUIRE(LoadGenesisBlock(Params()));
+    {
+        CValidationState state;
+        BOOST_REQUIRE(ActivateBestChain(state, Params()));
+    }
+    fPruneMode = true;
+
+    // The snapshot is only taken if its hash is known for its height.
+    SnapshotMetadata loaded;
+    BOOST_CHECK(!LoadUTXOSnapshot(path, Params(), loaded, error));
+    BOOST_CHECK_EQUAL(error, strprintf("No UTXO snapshot is known at height %d", metadata.base_height));
+    AssumeutxoParams params(Params());
+    params.SetAssumeutxo(metadata.base_height, AssumeutxoData{InsecureRand256(), metadata.chain_tx});
+    BOOST_CHECK(!LoadUTXOSnapshot(path, params, loaded, error));
+    BOOST_CHECK_EQUAL(chainActive.Height(), 0);
+    params.SetAssumeutxo(metadata.base_height, AssumeutxoData{metadata.utxo_hash, metadata.chain_tx});
+    BOOST_CHECK(LoadUTXOSnapshot(path, params, loaded, error));
+    BOOST_CHECK_EQUAL(loaded.coins_count, metadata.coins_count);
+
+    // The base block is the tip, and the blocks below it are not taken to
+    // have had their scripts checked.
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(chainActive.Tip()->GetBlockHash() == metadata.base_hash);
+        BOOST_CHECK_EQUAL(chainActive.Tip()->nChainTx, metadata.chain_tx);
+        BOOST_CHECK(pcoinsTip->GetBestBlock() == metadata.base_hash);
+        for (int height = 1; height <= metadata.base_height; ++height) {
+            const CBlockIndex* pindex = chainActive[height];
+            BOOST_CHECK(pindex->nStatus & BLOCK_ASSUMED_VALID);
+            BOOST_CHECK(pindex->IsValid(BLOCK_VALID_TRANSACTIONS));
+            BOOST_CHECK(!pindex->IsValid(BLOCK_VALID_SCRIPTS));
+        }
+    }
+    pcursor.reset(pcoinsdbview->Cursor());
+    CUTXOSetHasher hasher(metadata.base_hash);
+    for (; pcursor->Valid(); pcursor->Next()) {
+        COutPoint key;
+        Coin coin;
+        BOOST_REQUIRE(pcursor->GetKey(key) && pcursor->GetValue(coin));
+        hasher.Add(key, coin);
+    }
+    pcursor.reset();
+    BOOST_CHECK(hasher.GetHash() == metadata.utxo_hash);
+
+    // Blocks on top of it are validated as usual.
+    CreateAndProcessBlock({}, CScript() << OP_TRUE);
+    BOOST_CHECK_EQUAL(chainActive.Height(), metadata.base_height + 1);
+    BOOST_CHECK(chainActive.Tip()->IsValid(BLOCK_VALID_SCRIPTS));
+    BOOST_CHECK(!(chainActive.Tip()->nStatus & BLOCK_ASSUMED_VALID));
+
+    fPruneMode = false;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -54,19 +54,53 @@ struct CoinEntry {
 
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, bool fBulkLoad) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, fBulkLoad)
 {
 }
 
+CCoinsViewDB::~CCoinsViewDB()
+{
+    WaitForWrite();
+}
+
 bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        LOCK(cs_pending);
+        if (m_pending) {
+            CCoinsMap::const_iterator it = m_pending->find(outpoint);
+            if (it != m_pending->end()) {
+                coin = it->second.coin;
+                return !coin.IsSpent();
+            }
+        }
+    }
     return db.Read(CoinEntry(&outpoint), coin);
 }
 
 bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    {
+        LOCK(cs_pending);
+        if (m_pending) {
+            CCoinsMap::const_iterator it = m_pending->find(outpoint);
+            if (it != m_pending->end()) {
+                return !it->second.coin.IsSpent();
+            }
+        }
+    }
     return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        LOCK(cs_pending);
+        if (m_pending) {
+            return m_pending_block;
+        }
+    }
+    return ReadBestBlock();
+}
+
+uint256 CCoinsViewDB::ReadBestBlock() const {
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
@@ -81,7 +115,80 @@ std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const {
     return vhashHeadBlocks;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase) {
+    if (!WaitForWrite()) {
+        return false;
+    }
+    bool ret = WriteCoins(mapCoins, hashBlock);
+    if (erase) {
+        mapCoins.clear();
+    }
+    return ret;
+}
+
+bool CCoinsViewDB::BatchWriteAsync(CCoinsMap &&mapCoins, const uint256 &hashBlock, size_t nUsage, const std::function<void(const std::string&)>& fnFailed) {
+    if (!WaitForWrite()) {
+        return false;
+    }
+    LOCK(cs_writer);
+    {
+        LOCK(cs_pending);
+        m_pending.reset(new CCoinsMap(std::move(mapCoins)));
+        m_pending_block = hashBlock;
+        m_pending_usage = nUsage;
+    }
+    m_writer = std::thread([this, fnFailed] {
+        RenameThread("starwels-coinsflush");
+        int64_t nStart = GetTimeMicros();
+        std::string strError;
+        try {
+            // Lookups keep reading m_pending while it is being written, so
+            // leave it intact until the write is complete.
+            if (!WriteCoins(*m_pending, m_pending_block)) {
+                strError = "write batch failed";
+            }
+        } catch (const std::exception& e) {
+            strError = e.what();
+        }
+        LogPrint(BCLog::COINDB, "Background coin database write took %.2fs\n", (GetTimeMicros() - nStart) * 0.000001);
+        std::unique_ptr<const CCoinsMap> written;
+        {
+            LOCK(cs_pending);
+            if (strError.empty()) {
+                written = std::move(m_pending);
+                m_pending_usage = 0;
+            } else {
+                // Keep serving the unwritten coins; the node is about to shut down.
+                m_pending_failed = true;
+            }
+        }
+        if (!strError.empty()) {
+            LogPrintf("Error writing to coin database in the background: %s\n", strError);
+            if (fnFailed) {
+                fnFailed(strError);
+            }
+        }
+    });
+    return true;
+}
+
+bool CCoinsViewDB::WaitForWrite() const {
+    {
+        LOCK(cs_writer);
+        if (m_writer.joinable()) {
+            m_writer.join();
+        }
+    }
+    LOCK(cs_pending);
+    return !m_pending_failed;
+}
+
+size_t CCoinsViewDB::PendingMemoryUsage() const {
+    LOCK(cs_pending);
+    return m_pending_usage;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
@@ -89,7 +196,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     int crash_simulate = gArgs.GetArg("-dbcrashratio", 0);
     assert(!hashBlock.IsNull());
 
-    uint256 old_tip = GetBestBlock();
+    uint256 old_tip = ReadBestBlock();
     if (old_tip.IsNull()) {
         // We may be in the middle of replaying.
         std::vector<uint256> old_heads = GetHeadBlocks();
@@ -106,7 +213,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     batch.Erase(DB_BEST_BLOCK);
     batch.Write(DB_HEAD_BLOCKS, std::vector<uint256>{hashBlock, old_tip});
 
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
             CoinEntry entry(&it->first);
             if (it->second.coin.IsSpent())
@@ -116,8 +223,6 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
         if (batch.SizeEstimate() > batch_size) {
             LogPrint(BCLog::COINDB, "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
             db.WriteBatch(batch);
@@ -142,6 +247,36 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     return ret;
 }
 
+bool CCoinsViewDB::WriteSnapshotCoins(const std::vector<std::pair<COutPoint, Coin>>& coins, const uint256 &hashBlock, bool fFinal) {
+    if (!WaitForWrite()) {
+        return false;
+    }
+    CDBBatch batch(db);
+    assert(!hashBlock.IsNull());
+
+    uint256 old_tip = ReadBestBlock();
+    if (old_tip.IsNull()) {
+        std::vector<uint256> old_heads = GetHeadBlocks();
+        if (old_heads.size() == 2) {
+            assert(old_heads[0] == hashBlock);
+            old_tip = old_heads[1];
+        }
+    }
+
+    batch.Erase(DB_BEST_BLOCK);
+    batch.Write(DB_HEAD_BLOCKS, std::vector<uint256>{hashBlock, old_tip});
+    for (const auto& coin : coins) {
+        batch.Write(CoinEntry(&coin.first), coin.second);
+    }
+    if (fFinal) {
+        batch.Erase(DB_HEAD_BLOCKS);
+        batch.Write(DB_BEST_BLOCK, hashBlock);
+    }
+
+    LogPrint(BCLog::COINDB, "Writing snapshot batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+    return db.WriteBatch(batch);
+}
+
 size_t CCoinsViewDB::EstimateSize() const
 {
     return db.EstimateSize(DB_COIN, (char)(DB_COIN+1));
@@ -172,7 +307,8 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 
 CCoinsViewCursor *CCoinsViewDB::Cursor() const
 {
-    CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper&>(db).NewIterator(), GetBestBlock());
+    WaitForWrite();
+    CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper&>(db).NewIterator(), ReadBestBlock());
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
@@ -9,10 +9,13 @@
 #include <coins.h>
 #include <dbwrapper.h>
 #include <chain.h>
+#include <sync.h>
 
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -38,6 +41,8 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! Max memory allocated to coin DB specific cache when building a chainstate from scratch, on top of -dbcache (MiB)
+static const int64_t nMaxBulkCoinsDBCache = 256;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -69,16 +74,57 @@ class CCoinsViewDB final : public CCoinsView
 {
 protected:
     CDBWrapper db;
+
+    //! Coins being written by a background flush, served to readers until the write completes
+    mutable CCriticalSection cs_pending;
+    std::unique_ptr<const CCoinsMap> m_pending;
+    uint256 m_pending_block;
+    size_t m_pending_usage = 0;
+    bool m_pending_failed = false;
+    mutable CCriticalSection cs_writer;
+    mutable std::thread m_writer;
+
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! Best block as written to the database, ignoring any background write
+    uint256 ReadBestBlock() const;
+
 public:
-    explicit CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    /**
+     * With fBulkLoad, the database is expected to start out empty and be
+     * filled by a reindex, initial sync or snapshot load, and leveldb is
+     * tuned for that write-heavy load.
+     */
+    explicit CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool fBulkLoad = false);
+    ~CCoinsViewDB();
 
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
     bool HaveCoin(const COutPoint &outpoint) const override;
     uint256 GetBestBlock() const override;
     std::vector<uint256> GetHeadBlocks() const override;
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase = true) override;
     CCoinsViewCursor *Cursor() const override;
 
+    /**
+     * Write mapCoins to the database on a background thread, after waiting
+     * for the previous background write. Until it is done, lookups through
+     * this view are answered from mapCoins, and GetBestBlock() returns
+     * hashBlock. nUsage is the memory mapCoins holds, reported by
+     * PendingMemoryUsage(). If the write fails, fnFailed is called with the
+     * error on the writer thread. Returns false if the previous write failed.
+     */
+    bool BatchWriteAsync(CCoinsMap &&mapCoins, const uint256 &hashBlock, size_t nUsage, const std::function<void(const std::string&)>& fnFailed = {});
+    /** Wait for the background write, if any. Returns false if it failed. */
+    bool WaitForWrite() const;
+    //! Memory held by coins that are being written in the background
+    size_t PendingMemoryUsage() const;
+
+    /**
+     * Write coins loaded from a UTXO snapshot based at hashBlock. The database
+     * stays marked as being in transition to hashBlock until a final call
+     * with fFinal set, so an interrupted load is detected at startup.
+     */
+    bool WriteSnapshotCoins(const std::vector<std::pair<COutPoint, Coin>>& coins, const uint256 &hashBlock, bool fFinal);
+
     //! Attempt to update from an older database format. Returns whether an error occurred.
     bool Upgrade();
     size_t EstimateSize() const override;
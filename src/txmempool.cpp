@@ -37,6 +37,9 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFe
     nSizeWithAncestors = GetTxSize();
     nModFeesWithAncestors = nFee;
     nSigOpCostWithAncestors = sigOpCost;
+
+    m_epoch = 0;
+    m_cluster = 0;
 }
 
 void CTxMemPoolEntry::UpdateFeeDelta(int64_t newFeeDelta)
@@ -61,13 +64,17 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    const EpochGuard epoch(*this);
+    std::vector<txiter> stageEntries, vAllDescendants;
+    for (const txiter childEntry : GetMemPoolChildren(updateIt)) {
+        visited(childEntry);
+        stageEntries.push_back(childEntry);
+    }
 
     while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
+        const txiter cit = stageEntries.back();
+        stageEntries.pop_back();
+        vAllDescendants.push_back(cit);
         const setEntries &setChildren = GetMemPoolChildren(cit);
         for (const txiter childEntry : setChildren) {
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
@@ -75,25 +82,28 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendan
                 // We've already calculated this one, just add the entries for this set
                 // but don't traverse again.
                 for (const txiter cacheEntry : cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
+                    if (!visited(cacheEntry)) {
+                        vAllDescendants.push_back(cacheEntry);
+                    }
                 }
-            } else if (!setAllDescendants.count(childEntry)) {
+            } else if (!visited(childEntry)) {
                 // Schedule for later processing
-                stageEntries.insert(childEntry);
+                stageEntries.push_back(childEntry);
             }
         }
     }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
+    // vAllDescendants now contains all in-mempool descendants of updateIt.
     // Update and add to cached descendant map
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    for (txiter cit : setAllDescendants) {
+    std::vector<txiter> &cached = cachedDescendants[updateIt];
+    for (txiter cit : vAllDescendants) {
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
             modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
+            cached.push_back(cit);
             // Update ancestor state for each descendant
             mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1, updateIt->GetSigOpCost()));
         }
@@ -152,8 +162,11 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
     LOCK(cs);
+    const EpochGuard epoch(*this);
 
-    setEntries parentHashes;
+    // Ancestors still to walk. Each is marked visited when staged, so it is
+    // staged only once.
+    std::vector<txiter> stage;
     const CTransaction &tx = entry.GetTx();
 
     if (fSearchForParents) {
@@ -162,9 +175,9 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
-                if (parentHashes.size() + 1 > limitAncestorCount) {
+            if (piter != mapTx.end() && !visited(piter)) {
+                stage.push_back(piter);
+                if (stage.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
                 }
@@ -174,16 +187,19 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        for (const txiter &piter : GetMemPoolParents(it)) {
+            visited(piter);
+            stage.push_back(piter);
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
-    while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
+    while (!stage.empty()) {
+        txiter stageit = stage.back();
+        stage.pop_back();
 
         setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -200,10 +216,10 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
         for (const txiter &phash : setMemPoolParents) {
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (!visited(phash)) {
+                stage.push_back(phash);
             }
-            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
+            if (stage.size() + setAncestors.size() + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
                 return false;
             }
@@ -329,7 +345,8 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
 }
 
 CTxMemPool::CTxMemPool(CBlockPolicyEstimator* estimator) :
-    nTransactionsUpdated(0), minerPolicyEstimator(estimator)
+    nTransactionsUpdated(0), minerPolicyEstimator(estimator), m_epoch(0), m_has_epoch_guard(false),
+    fTrackClusters(false), nClusterSearchLimit(0), nLastCluster(0), cachedClusterUsage(0)
 {
     _clear(); //lock free clear
 
@@ -366,6 +383,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     LOCK(cs);
     indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
     mapLinks.insert(make_pair(newit, TxLinks()));
+    InvalidateCluster(newit);
 
     // Update transaction for any feeDelta created by PrioritiseTransaction
     // TODO: refactor so that the fee delta is calculated before inserting
@@ -432,6 +450,11 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
     } else
         vTxHashes.clear();
 
+    if (fTrackClusters) {
+        InvalidateCluster(it);
+        setClusterDirty.erase(it);
+    }
+
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
     cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
@@ -449,27 +472,57 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 // can save time by not iterating over those entries.
 void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants)
 {
-    setEntries stage;
+    const EpochGuard epoch(*this);
+    std::vector<txiter> stage;
     if (setDescendants.count(entryit) == 0) {
-        stage.insert(entryit);
+        visited(entryit);
+        stage.push_back(entryit);
     }
     // Traverse down the children of entry, only adding children that are not
     // accounted for in setDescendants already (because those children have either
     // already been walked, or will be walked in this iteration).
     while (!stage.empty()) {
-        txiter it = *stage.begin();
+        txiter it = stage.back();
+        stage.pop_back();
         setDescendants.insert(it);
-        stage.erase(it);
 
         const setEntries &setChildren = GetMemPoolChildren(it);
         for (const txiter &childiter : setChildren) {
-            if (!setDescendants.count(childiter)) {
-                stage.insert(childiter);
+            if (!visited(childiter) && !setDescendants.count(childiter)) {
+                stage.push_back(childiter);
             }
         }
     }
 }
 
+uint64_t CTxMemPool::CalculateClusterSize(const setEntries &setAncestors, uint64_t limitClusterCount) const
+{
+    const EpochGuard epoch(*this);
+    std::vector<txiter> stage;
+    for (txiter ancestorit : setAncestors) {
+        visited(ancestorit);
+        stage.push_back(ancestorit);
+    }
+    // The new transaction itself
+    uint64_t nCount = 1;
+    while (!stage.empty() && nCount <= limitClusterCount) {
+        const txiter it = stage.back();
+        stage.pop_back();
+        nCount++;
+        for (const txiter &parentit : GetMemPoolParents(it)) {
+            if (!visited(parentit)) {
+                stage.push_back(parentit);
+            }
+        }
+        for (const txiter &childit : GetMemPoolChildren(it)) {
+            if (!visited(childit)) {
+                stage.push_back(childit);
+            }
+        }
+    }
+    return nCount;
+}
+
 void CTxMemPool::removeRecursive(const CTransaction &origTx, MemPoolRemovalReason reason)
 {
     // Remove transaction from memory pool
@@ -591,6 +644,7 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 void CTxMemPool::_clear()
 {
     mapLinks.clear();
+    ClearClusters();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
@@ -736,21 +790,46 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
+
+    if (fTrackClusters) {
+        // Every entry is either waiting to be linearized or in one chunk.
+        size_t nChunkTxs = 0;
+        for (const auto& cluster : mapClusters) {
+            for (size_t i = 0; i < cluster.second.size(); i++) {
+                const TxChunk& chunk = *cluster.second[i];
+                assert(chunk.nCluster == cluster.first && chunk.nIndex == i);
+                for (txiter chunkit : chunk.vTxs) {
+                    assert(chunkit->m_cluster == cluster.first && !setClusterDirty.count(chunkit));
+                }
+                nChunkTxs += chunk.vTxs.size();
+            }
+        }
+        for (txiter dirtyit : setClusterDirty) {
+            assert(dirtyit->m_cluster == 0);
+        }
+        assert(nChunkTxs + setClusterDirty.size() == mapTx.size());
+    }
 }
 
 bool CTxMemPool::CompareDepthAndScore(const uint256& hasha, const uint256& hashb)
 {
     LOCK(cs);
-    indexed_transaction_set::const_iterator i = mapTx.find(hasha);
+    DepthAndScore a, b;
+    if (!GetDepthAndScore(hasha, a)) return false;
+    if (!GetDepthAndScore(hashb, b)) return true;
+    return a < b;
+}
+
+bool CTxMemPool::GetDepthAndScore(const uint256& hash, DepthAndScore& result) const
+{
+    AssertLockHeld(cs);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    indexed_transaction_set::const_iterator j = mapTx.find(hashb);
-    if (j == mapTx.end()) return true;
-    uint64_t counta = i->GetCountWithAncestors();
-    uint64_t countb = j->GetCountWithAncestors();
-    if (counta == countb) {
-        return CompareTxMemPoolEntryByScore()(*i, *j);
-    }
-    return counta < countb;
+    result.nCountWithAncestors = i->GetCountWithAncestors();
+    result.nModFee = i->GetModifiedFee();
+    result.nTxSize = i->GetTxSize();
+    result.hash = i->GetTx().GetHash();
+    return true;
 }
 
 namespace {
@@ -841,6 +920,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
         txiter it = mapTx.find(hash);
         if (it != mapTx.end()) {
             mapTx.modify(it, update_fee_delta(delta));
+            InvalidateCluster(it);
             // Now update all ancestors' modified fees with descendants
             setEntries setAncestors;
             uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -857,6 +937,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
                 mapTx.modify(descendantIt, update_ancestor_state(0, nFeeDelta, 0, 0));
             }
             ++nTransactionsUpdated;
+            NotifyEntryPrioritised(hash);
         }
     }
     LogPrintf("PrioritiseTransaction: %s feerate += %s\n", hash.ToString(), FormatMoney(nFeeDelta));
@@ -907,7 +988,7 @@ bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
     // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage + memusage::DynamicUsage(setChunks) + memusage::DynamicUsage(mapClusters) + memusage::DynamicUsage(setClusterDirty) + cachedClusterUsage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
@@ -951,7 +1032,11 @@ void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
         cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
     } else if (!add && mapLinks[entry].children.erase(child)) {
         cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    } else {
+        return;
     }
+    InvalidateCluster(entry);
+    InvalidateCluster(child);
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
@@ -961,7 +1046,11 @@ void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
         cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
     } else if (!add && mapLinks[entry].parents.erase(parent)) {
         cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    } else {
+        return;
     }
+    InvalidateCluster(entry);
+    InvalidateCluster(parent);
 }
 
 const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
@@ -1018,19 +1107,31 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpends
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
     while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+        setEntries stage;
+        CFeeRate removed;
+        if (fTrackClusters) {
+            // Chunks of a cluster are sorted by feerate, so the worst chunk
+            // overall is the last of its cluster and nothing depends on it.
+            const TxChunk& worst = *GetChunks().rbegin();
+            removed = CFeeRate(worst.nModFees, worst.nSize);
+            for (txiter chunkit : worst.vTxs) {
+                CalculateDescendants(chunkit, stage);
+            }
+            assert(stage.size() == worst.vTxs.size());
+        } else {
+            indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+            removed = CFeeRate(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+            CalculateDescendants(mapTx.project<0>(it), stage);
+        }
 
         // We set the new mempool min fee to the feerate of the removed set, plus the
         // "minimum reasonable fee rate" (ie some value under which we consider txn
         // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
         // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
         removed += incrementalRelayFee;
         trackPackageRemoved(removed);
         maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
 
-        setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
         nTxnRemoved += stage.size();
 
         std::vector<CTransaction> txn;
@@ -1063,3 +1164,219 @@ bool CTxMemPool::TransactionWithinChainLimit(const uint256& txid, size_t chainLi
 }
 
 SaltedTxidHasher::SaltedTxidHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+CTxMemPool::EpochGuard::EpochGuard(const CTxMemPool& in) : pool(in)
+{
+    assert(!pool.m_has_epoch_guard);
+    ++pool.m_epoch;
+    pool.m_has_epoch_guard = true;
+}
+
+CTxMemPool::EpochGuard::~EpochGuard()
+{
+    // Entries marked in this epoch are older than any later one.
+    ++pool.m_epoch;
+    pool.m_has_epoch_guard = false;
+}
+
+void CTxMemPool::SetClusterTracking(bool fTrack, size_t nSearchLimit)
+{
+    LOCK(cs);
+    ClearClusters();
+    fTrackClusters = fTrack;
+    nClusterSearchLimit = nSearchLimit;
+    if (fTrackClusters) {
+        for (txiter it = mapTx.begin(); it != mapTx.end(); ++it) {
+            setClusterDirty.insert(it);
+        }
+    }
+}
+
+void CTxMemPool::ClearClusters()
+{
+    for (txiter it = mapTx.begin(); it != mapTx.end(); ++it) {
+        it->m_cluster = 0;
+    }
+    setChunks.clear();
+    mapClusters.clear();
+    setClusterDirty.clear();
+    cachedClusterUsage = 0;
+}
+
+void CTxMemPool::InvalidateCluster(txiter it)
+{
+    if (!fTrackClusters) {
+        return;
+    }
+    auto clusterit = mapClusters.find(it->m_cluster);
+    if (clusterit == mapClusters.end()) {
+        setClusterDirty.insert(it);
+        return;
+    }
+    for (const indexed_chunk_set::iterator& chunkit : clusterit->second) {
+        for (txiter member : chunkit->vTxs) {
+            member->m_cluster = 0;
+            setClusterDirty.insert(member);
+        }
+        cachedClusterUsage -= memusage::DynamicUsage(chunkit->vTxs);
+        setChunks.erase(chunkit);
+    }
+    cachedClusterUsage -= memusage::DynamicUsage(clusterit->second);
+    mapClusters.erase(clusterit);
+}
+
+static bool HigherFeerate(CAmount nFeesA, int64_t nSizeA, CAmount nFeesB, int64_t nSizeB)
+{
+    return (double)nFeesA * nSizeB > (double)nFeesB * nSizeA;
+}
+
+void CTxMemPool::LinearizeClusterSearch(const std::vector<txiter>& cluster, std::vector<txiter>& vOrder) const
+{
+    const size_t n = cluster.size();
+    std::map<txiter, size_t, CompareIteratorByHash> mapPos;
+    for (size_t i = 0; i < n; i++) {
+        mapPos.emplace(cluster[i], i);
+    }
+
+    // Ancestors (including itself) and descendants of every transaction, by
+    // position in the cluster. All of them are in the cluster.
+    std::vector<std::vector<size_t>> vAncestors(n), vDescendants(n);
+    for (size_t i = 0; i < n; i++) {
+        const EpochGuard epoch(*this);
+        std::vector<txiter> stage{cluster[i]};
+        visited(cluster[i]);
+        while (!stage.empty()) {
+            const txiter it = stage.back();
+            stage.pop_back();
+            const size_t pos = mapPos.at(it);
+            vAncestors[i].push_back(pos);
+            vDescendants[pos].push_back(i);
+            for (const txiter &parentit : GetMemPoolParents(it)) {
+                if (!visited(parentit)) {
+                    stage.push_back(parentit);
+                }
+            }
+        }
+    }
+
+    // Repeatedly pick the transaction whose ancestors not picked yet have the
+    // highest feerate, and append those ancestors, parents first.
+    std::vector<CAmount> vFees(n, 0);
+    std::vector<int64_t> vSizes(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t pos : vAncestors[i]) {
+            vFees[i] += cluster[pos]->GetModifiedFee();
+            vSizes[i] += cluster[pos]->GetTxSize();
+        }
+    }
+    std::vector<bool> vPicked(n, false);
+    while (vOrder.size() < n) {
+        size_t best = n;
+        for (size_t i = 0; i < n; i++) {
+            if (!vPicked[i] && (best == n || HigherFeerate(vFees[i], vSizes[i], vFees[best], vSizes[best]))) {
+                best = i;
+            }
+        }
+        std::vector<size_t> vAdd;
+        for (size_t pos : vAncestors[best]) {
+            if (!vPicked[pos]) {
+                vAdd.push_back(pos);
+            }
+        }
+        // An ancestor has fewer ancestors than any of its descendants.
+        std::stable_sort(vAdd.begin(), vAdd.end(), [&vAncestors](size_t a, size_t b) {
+            return vAncestors[a].size() < vAncestors[b].size();
+        });
+        for (size_t pos : vAdd) {
+            const txiter it = cluster[pos];
+            vPicked[pos] = true;
+            for (size_t desc : vDescendants[pos]) {
+                vFees[desc] -= it->GetModifiedFee();
+                vSizes[desc] -= it->GetTxSize();
+            }
+            vOrder.push_back(it);
+        }
+    }
+}
+
+void CTxMemPool::LinearizeCluster(const std::vector<txiter>& cluster)
+{
+    const size_t n = cluster.size();
+    std::vector<txiter> vOrder;
+    vOrder.reserve(n);
+    if (n > nClusterSearchLimit) {
+        // Only a reorg grows a cluster past the limit, and the search below
+        // is quadratic in its size. An ancestor has fewer ancestors than any
+        // of its descendants, so this order still puts parents first.
+        vOrder = cluster;
+        std::stable_sort(vOrder.begin(), vOrder.end(), [](txiter a, txiter b) {
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        });
+    } else {
+        LinearizeClusterSearch(cluster, vOrder);
+    }
+
+    // Start a chunk for every transaction and merge it into the chunks
+    // before it for as long as it pays a higher feerate than they do.
+    std::vector<TxChunk> vChunks;
+    for (txiter it : vOrder) {
+        vChunks.push_back(TxChunk{it->GetModifiedFee(), (int64_t)it->GetTxSize(), 0, 0, {it}});
+        while (vChunks.size() > 1) {
+            TxChunk& last = vChunks.back();
+            TxChunk& prev = vChunks[vChunks.size() - 2];
+            if (!HigherFeerate(last.nModFees, last.nSize, prev.nModFees, prev.nSize)) {
+                break;
+            }
+            prev.nModFees += last.nModFees;
+            prev.nSize += last.nSize;
+            prev.vTxs.insert(prev.vTxs.end(), last.vTxs.begin(), last.vTxs.end());
+            vChunks.pop_back();
+        }
+    }
+
+    const uint64_t nCluster = ++nLastCluster;
+    std::vector<indexed_chunk_set::iterator>& vClusterChunks = mapClusters[nCluster];
+    vClusterChunks.reserve(vChunks.size());
+    for (size_t i = 0; i < vChunks.size(); i++) {
+        vChunks[i].nCluster = nCluster;
+        vChunks[i].nIndex = i;
+        for (txiter it : vChunks[i].vTxs) {
+            it->m_cluster = nCluster;
+        }
+        cachedClusterUsage += memusage::DynamicUsage(vChunks[i].vTxs);
+        vClusterChunks.push_back(setChunks.insert(std::move(vChunks[i])).first);
+    }
+    cachedClusterUsage += memusage::DynamicUsage(vClusterChunks);
+}
+
+const CTxMemPool::indexed_chunk_set& CTxMemPool::GetChunks()
+{
+    AssertLockHeld(cs);
+    assert(fTrackClusters);
+    while (!setClusterDirty.empty()) {
+        // Collect the cluster of a changed entry. A change to a cluster
+        // invalidates all of it, so none of its entries is linearized.
+        std::vector<txiter> cluster{*setClusterDirty.begin()};
+        {
+            const EpochGuard epoch(*this);
+            visited(cluster.front());
+            for (size_t i = 0; i < cluster.size(); i++) {
+                for (const txiter &parentit : GetMemPoolParents(cluster[i])) {
+                    if (!visited(parentit)) {
+                        cluster.push_back(parentit);
+                    }
+                }
+                for (const txiter &childit : GetMemPoolChildren(cluster[i])) {
+                    if (!visited(childit)) {
+                        cluster.push_back(childit);
+                    }
+                }
+            }
+        }
+        for (txiter it : cluster) {
+            setClusterDirty.erase(it);
+        }
+        LinearizeCluster(cluster);
+    }
+    return setChunks;
+}
@@ -128,6 +128,8 @@ public:
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t m_epoch; //!< Last traversal of the mempool that visited this entry
+    mutable uint64_t m_cluster; //!< Linearized cluster this entry is in, 0 if none
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -257,6 +259,32 @@ public:
     }
 };
 
+/**
+ * What CTxMemPool::CompareDepthAndScore looks at of an entry, so that
+ * transactions can be ordered the same way without holding the mempool lock.
+ */
+struct DepthAndScore
+{
+    uint64_t nCountWithAncestors;
+    CAmount nModFee;
+    size_t nTxSize;
+    uint256 hash;
+
+    /** Fewer ancestors first, then by descending score like CompareTxMemPoolEntryByScore. */
+    bool operator<(const DepthAndScore& b) const
+    {
+        if (nCountWithAncestors != b.nCountWithAncestors) {
+            return nCountWithAncestors < b.nCountWithAncestors;
+        }
+        double f1 = (double)nModFee * b.nTxSize;
+        double f2 = (double)b.nModFee * nTxSize;
+        if (f1 == f2) {
+            return b.hash < hash;
+        }
+        return f1 > f2;
+    }
+};
+
 class CompareTxMemPoolEntryByEntryTime
 {
 public:
@@ -492,10 +520,41 @@ public:
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
 
+    /**
+     * A cluster is a set of mempool transactions connected through spends.
+     * When clusters are tracked, each one is linearized into an order its
+     * transactions can be mined in, which is cut into chunks of
+     * non-increasing feerate. A chunk is mined or evicted as a whole.
+     */
+    struct TxChunk {
+        CAmount nModFees;           //!< Sum of modified fees of the transactions
+        int64_t nSize;              //!< Sum of virtual sizes of the transactions
+        uint64_t nCluster;          //!< Cluster the chunk is part of
+        size_t nIndex;              //!< Position of the chunk in the cluster
+        std::vector<txiter> vTxs;   //!< Transactions, parents before children
+    };
+
+    /** Sort chunks by feerate, best first, and chunks of a cluster in order */
+    struct CompareTxChunkByFeerate {
+        bool operator()(const TxChunk& a, const TxChunk& b) const
+        {
+            double f1 = (double)a.nModFees * b.nSize;
+            double f2 = (double)b.nModFees * a.nSize;
+            if (f1 != f2) {
+                return f1 > f2;
+            }
+            if (a.nCluster != b.nCluster) {
+                return a.nCluster < b.nCluster;
+            }
+            return a.nIndex < b.nIndex;
+        }
+    };
+    typedef std::set<TxChunk, CompareTxChunkByFeerate> indexed_chunk_set;
+
     const setEntries & GetMemPoolParents(txiter entry) const;
     const setEntries & GetMemPoolChildren(txiter entry) const;
 private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    typedef std::map<txiter, std::vector<txiter>, CompareIteratorByHash> cacheMap;
 
     struct TxLinks {
         setEntries parents;
@@ -508,8 +567,54 @@ private:
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
+    mutable uint64_t m_epoch;           //!< Epoch of the current traversal
+    mutable bool m_has_epoch_guard;     //!< Whether a traversal is going on
+
+    /**
+     * Traversals of the transaction graph mark the entries they reach with a
+     * fresh epoch instead of collecting them in a std::set, so telling
+     * whether an entry was reached before is a comparison. Only one traversal
+     * can go on at a time.
+     */
+    class EpochGuard
+    {
+    private:
+        const CTxMemPool& pool;
+
+    public:
+        explicit EpochGuard(const CTxMemPool& in);
+        ~EpochGuard();
+    };
+
+    /** Mark an entry reached by the current traversal, returning whether it was already */
+    bool visited(txiter it) const
+    {
+        assert(m_has_epoch_guard);
+        const bool ret = it->m_epoch >= m_epoch;
+        it->m_epoch = std::max(it->m_epoch, m_epoch);
+        return ret;
+    }
+
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
+    bool fTrackClusters;                //!< Whether clusters are linearized
+    size_t nClusterSearchLimit;         //!< Largest cluster linearized by feerate search
+    uint64_t nLastCluster;              //!< Identifier of the last cluster linearized
+    uint64_t cachedClusterUsage;        //!< Dynamic memory usage of the chunks of all clusters
+    indexed_chunk_set setChunks;        //!< Chunks of all linearized clusters
+    std::map<uint64_t, std::vector<indexed_chunk_set::iterator>> mapClusters; //!< Chunks of each cluster, in order
+    setEntries setClusterDirty;         //!< Entries whose cluster must be linearized again
+
+    /** Forget the linearization of the cluster of an entry after it changed */
+    void InvalidateCluster(txiter it);
+    /** Linearize a cluster and add its chunks to setChunks. Clusters of more
+     *  than nClusterSearchLimit transactions, which only a reorg can create,
+     *  are taken in ancestor count order instead of searched. */
+    void LinearizeCluster(const std::vector<txiter>& cluster);
+    /** Order a cluster by repeatedly picking the ancestor set of highest feerate */
+    void LinearizeClusterSearch(const std::vector<txiter>& cluster, std::vector<txiter>& vOrder) const;
+    void ClearClusters();
+
 public:
     indirectmap<COutPoint, const CTransaction*> mapNextTx;
     std::map<uint256, CAmount> mapDeltas;
@@ -527,6 +632,16 @@ public:
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(double dFrequency = 1.0) { nCheckFrequency = static_cast<uint32_t>(dFrequency * 4294967295.0); }
 
+    /** Turn linearization of clusters, used for mining and eviction, on or
+     *  off. Clusters of more than nSearchLimit transactions are linearized in
+     *  linear-logarithmic rather than quadratic time. */
+    void SetClusterTracking(bool fTrack, size_t nSearchLimit);
+    bool IsClusterTracking() const { return fTrackClusters; }
+
+    /** Linearize the clusters that changed since the last call, and return the
+     *  chunks of all clusters. Requires cs and cluster tracking. */
+    const indexed_chunk_set& GetChunks();
+
     // addUnchecked must updated state for all ancestors of a given transaction,
     // to track size/count of descendant transactions.  First version of
     // addUnchecked can be used to have it call CalculateMemPoolAncestors(), and
@@ -545,6 +660,8 @@ public:
     void clear();
     void _clear(); //lock free
     bool CompareDepthAndScore(const uint256& hasha, const uint256& hashb);
+    /** Look up what CompareDepthAndScore compares hash by. Returns false if it is not in the mempool. */
+    bool GetDepthAndScore(const uint256& hash, DepthAndScore& result) const;
     void queryHashes(std::vector<uint256>& vtxid);
     bool isSpent(const COutPoint& outpoint);
     unsigned int GetTransactionsUpdated() const;
@@ -598,6 +715,11 @@ public:
      *  already in it.  */
     void CalculateDescendants(txiter it, setEntries &setDescendants);
 
+    /** Count the transactions of the cluster that a new transaction with the
+     *  in-mempool ancestors setAncestors would join, itself included. Counting
+     *  stops once limitClusterCount is exceeded. */
+    uint64_t CalculateClusterSize(const setEntries &setAncestors, uint64_t limitClusterCount) const;
+
     /** The minimum fee to get into the mempool, which may itself not be enough
       *  for larger-sized transactions.
       *  The incrementalRelayFee policy variable is used to bound the time it
@@ -607,6 +729,9 @@ public:
     CFeeRate GetMinFee(size_t sizelimit) const;
 
     /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
+      *  With cluster tracking, the chunk with the lowest feerate goes first,
+      *  otherwise the transaction with the lowest descendant score and its
+      *  descendants.
       *  pvNoSpendsRemaining, if set, will be populated with the list of outpoints
       *  which are not in mempool which no longer have any spends in this mempool.
       */
@@ -644,6 +769,8 @@ public:
 
     boost::signals2::signal<void (CTransactionRef)> NotifyEntryAdded;
     boost::signals2::signal<void (CTransactionRef, MemPoolRemovalReason)> NotifyEntryRemoved;
+    /** Fired, with cs held, when the fee delta of a transaction in the mempool changes */
+    boost::signals2::signal<void (const uint256&)> NotifyEntryPrioritised;
 
 private:
     /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
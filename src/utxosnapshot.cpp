@@ -0,0 +1,411 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <utxosnapshot.h>
+
+#include <clientversion.h>
+#include <compressor.h>
+#include <serialize.h>
+#include <streams.h>
+#include <util.h>
+#include <version.h>
+
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const unsigned char SNAPSHOT_MAGIC[5] = {'u', 't', 'x', 'o', 0xff};
+const uint16_t SNAPSHOT_VERSION = 1;
+
+/** Size of the footer: coin count, UTXO set hash and file checksum. */
+const size_t SNAPSHOT_FOOTER_SIZE = 8 + 32 + 32;
+
+/**
+ * Chunks are closed early once their compressed outputs reach this size, so
+ * every column stays well below the deserialization limit of MAX_SIZE even
+ * for sets full of large scripts.
+ */
+const size_t SNAPSHOT_CHUNK_MAX_BYTES = 16 << 20;
+
+/** Minimal deserialization stream over a range of memory, which is not copied. */
+class SpanReader
+{
+private:
+    const unsigned char* m_data;
+    size_t m_size;
+    size_t m_pos = 0;
+
+public:
+    SpanReader(const unsigned char* data, size_t size) : m_data(data), m_size(size) {}
+
+    int GetType() const { return SER_DISK; }
+    int GetVersion() const { return CLIENT_VERSION; }
+
+    void read(char* dst, size_t n)
+    {
+        if (n > m_size - m_pos) {
+            throw std::ios_base::failure("SpanReader::read(): end of data");
+        }
+        memcpy(dst, m_data + m_pos, n);
+        m_pos += n;
+    }
+
+    void ignore(size_t n)
+    {
+        if (n > m_size - m_pos) {
+            throw std::ios_base::failure("SpanReader::ignore(): end of data");
+        }
+        m_pos += n;
+    }
+
+    template<typename T>
+    SpanReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj);
+        return *this;
+    }
+
+    /** Return a reader over the next length-prefixed column, without copying it. */
+    SpanReader ReadColumn()
+    {
+        uint64_t len = ReadCompactSize(*this);
+        if (len > m_size - m_pos) {
+            throw std::ios_base::failure("SpanReader::ReadColumn(): end of data");
+        }
+        SpanReader column(m_data + m_pos, len);
+        m_pos += len;
+        return column;
+    }
+
+    size_t pos() const { return m_pos; }
+    bool empty() const { return m_pos == m_size; }
+};
+
+/**
+ * Order of outpoints in the coins database, and so in a snapshot: by txid
+ * bytes, then by the serialized VARINT of the output index. That encoding is
+ * not order-preserving beyond two bytes, so indexes are compared encoded.
+ */
+bool OutPointKeyLess(const COutPoint& a, const COutPoint& b)
+{
+    int cmp = a.hash.Compare(b.hash);
+    if (cmp != 0) return cmp < 0;
+    if (a.n < 128 && b.n < 128) return a.n < b.n;
+    std::vector<unsigned char> ka, kb;
+    uint32_t na = a.n, nb = b.n;
+    CVectorWriter(SER_DISK, CLIENT_VERSION, ka, 0, VARINT(na));
+    CVectorWriter(SER_DISK, CLIENT_VERSION, kb, 0, VARINT(nb));
+    return ka < kb;
+}
+
+/** Serialize one chunk of coins, sorted by outpoint, in column order. */
+void SerializeChunk(std::vector<unsigned char>& out, const std::vector<std::pair<COutPoint, Coin>>& coins)
+{
+    std::vector<unsigned char> txids, runs, vouts, codes, txouts;
+    CVectorWriter wtxids(SER_DISK, CLIENT_VERSION, txids, 0);
+    CVectorWriter wruns(SER_DISK, CLIENT_VERSION, runs, 0);
+    CVectorWriter wvouts(SER_DISK, CLIENT_VERSION, vouts, 0);
+    CVectorWriter wcodes(SER_DISK, CLIENT_VERSION, codes, 0);
+    CVectorWriter wtxouts(SER_DISK, CLIENT_VERSION, txouts, 0);
+
+    // Outputs of the same transaction are adjacent, so the txid column only
+    // holds each txid once, together with the length of its run of outputs.
+    uint64_t run = 0;
+    for (size_t i = 0; i < coins.size(); ++i) {
+        const COutPoint& outpoint = coins[i].first;
+        const Coin& coin = coins[i].second;
+        if (i == 0 || outpoint.hash != coins[i - 1].first.hash) {
+            if (run) wruns << VARINT(run);
+            wtxids << outpoint.hash;
+            run = 0;
+        }
+        ++run;
+        uint32_t n = outpoint.n;
+        uint32_t code = coin.nHeight * 2 + coin.fCoinBase;
+        wvouts << VARINT(n);
+        wcodes << VARINT(code);
+        wtxouts << CTxOutCompressor(REF(coin.out));
+    }
+    if (run) wruns << VARINT(run);
+
+    out.clear();
+    CVectorWriter(SER_DISK, CLIENT_VERSION, out, 0, (uint32_t)coins.size(), txids, runs, vouts, codes, txouts);
+}
+
+} // namespace
+
+CUTXOSetHasher::CUTXOSetHasher(const uint256& hashBlock) : ss(SER_GETHASH, PROTOCOL_VERSION)
+{
+    ss << hashBlock;
+}
+
+void CUTXOSetHasher::ApplyOutputs()
+{
+    ss << prevkey;
+    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
+    for (const auto& output : outputs) {
+        ss << VARINT(output.first + 1);
+        ss << output.second.out.scriptPubKey;
+        ss << VARINT(output.second.out.nValue);
+    }
+    ss << VARINT(0);
+    outputs.clear();
+}
+
+void CUTXOSetHasher::Add(const COutPoint& outpoint, const Coin& coin)
+{
+    if (!outputs.empty() && outpoint.hash != prevkey) {
+        ApplyOutputs();
+    }
+    prevkey = outpoint.hash;
+    outputs[outpoint.n] = coin;
+}
+
+uint256 CUTXOSetHasher::GetHash()
+{
+    if (!outputs.empty()) {
+        ApplyOutputs();
+    }
+    return ss.GetHash();
+}
+
+bool WriteUTXOSnapshot(CCoinsViewCursor& cursor, SnapshotMetadata& metadata, const fs::path& path, std::string& error)
+{
+    int64_t nStart = GetTimeMicros();
+    fs::path pathTmp = path.string() + ".new";
+    FILE* filestr = fsbridge::fopen(pathTmp, "wb");
+    if (!filestr) {
+        error = strprintf("Unable to open %s for writing", pathTmp.string());
+        return false;
+    }
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    CHashWriter checksum(SER_DISK, CLIENT_VERSION);
+    CUTXOSetHasher hasher(metadata.base_hash);
+
+    try {
+        std::vector<unsigned char> buf;
+        CVectorWriter(SER_DISK, CLIENT_VERSION, buf, 0, FLATDATA(SNAPSHOT_MAGIC), SNAPSHOT_VERSION,
+            FLATDATA(metadata.message_start), metadata.base_hash, metadata.base_height, metadata.chain_tx, metadata.headers);
+        file.write((const char*)buf.data(), buf.size());
+        checksum.write((const char*)buf.data(), buf.size());
+
+        std::vector<std::pair<COutPoint, Coin>> coins;
+        coins.reserve(UTXO_SNAPSHOT_CHUNK_SIZE);
+        size_t chunk_bytes = 0;
+        uint64_t coins_count = 0;
+        while (true) {
+            bool valid = cursor.Valid();
+            if (valid) {
+                COutPoint key;
+                Coin coin;
+                if (!cursor.GetKey(key) || !cursor.GetValue(coin)) {
+                    error = "Unable to read from the coins database";
+                    return false;
+                }
+                hasher.Add(key, coin);
+                chunk_bytes += coin.out.scriptPubKey.size();
+                coins.emplace_back(key, std::move(coin));
+                cursor.Next();
+            }
+            if (coins.size() == UTXO_SNAPSHOT_CHUNK_SIZE || chunk_bytes >= SNAPSHOT_CHUNK_MAX_BYTES || (!valid && !coins.empty())) {
+                SerializeChunk(buf, coins);
+                file.write((const char*)buf.data(), buf.size());
+                checksum.write((const char*)buf.data(), buf.size());
+                coins_count += coins.size();
+                coins.clear();
+                chunk_bytes = 0;
+            }
+            if (!valid) break;
+        }
+
+        metadata.coins_count = coins_count;
+        metadata.utxo_hash = hasher.GetHash();
+        buf.clear();
+        CVectorWriter(SER_DISK, CLIENT_VERSION, buf, 0, (uint32_t)0, metadata.coins_count, metadata.utxo_hash);
+        file.write((const char*)buf.data(), buf.size());
+        checksum.write((const char*)buf.data(), buf.size());
+        file << checksum.GetHash();
+
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, path)) {
+            throw std::runtime_error("Rename failed");
+        }
+    } catch (const std::exception& e) {
+        error = strprintf("Failed to write UTXO snapshot: %s", e.what());
+        return false;
+    }
+    LogPrintf("Wrote UTXO snapshot of %u coins at %s to %s in %.2fs\n", metadata.coins_count,
+        metadata.base_hash.ToString(), path.string(), (GetTimeMicros() - nStart) * 0.000001);
+    return true;
+}
+
+CUTXOSnapshotReader::~CUTXOSnapshotReader()
+{
+    Close();
+}
+
+void CUTXOSnapshotReader::Close()
+{
+#ifndef WIN32
+    if (m_begin) {
+        munmap((void*)m_begin, m_size);
+    }
+#else
+    m_buffer.clear();
+    m_buffer.shrink_to_fit();
+#endif
+    m_begin = nullptr;
+    m_size = 0;
+}
+
+bool CUTXOSnapshotReader::Open(const fs::path& path, std::string& error)
+{
+    Close();
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1) {
+        error = strprintf("Unable to open %s", path.string());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        error = strprintf("Unable to read %s", path.string());
+        return false;
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error = strprintf("Unable to map %s", path.string());
+        return false;
+    }
+    // Chunks are only decoded front to back.
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    m_begin = (const unsigned char*)map;
+    m_size = st.st_size;
+#else
+    // No mapping on Windows; read the file into memory instead.
+    FILE* file = fsbridge::fopen(path, "rb");
+    if (!file) {
+        error = strprintf("Unable to open %s", path.string());
+        return false;
+    }
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+        m_buffer.insert(m_buffer.end(), buf, buf + n);
+    }
+    fclose(file);
+    m_begin = m_buffer.data();
+    m_size = m_buffer.size();
+#endif
+
+    if (m_size < sizeof(SNAPSHOT_MAGIC) + SNAPSHOT_FOOTER_SIZE ||
+        memcmp(m_begin, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        error = strprintf("%s is not a UTXO snapshot", path.string());
+        return false;
+    }
+    if (Hash(m_begin, m_begin + m_size - 32) != uint256(std::vector<unsigned char>(m_begin + m_size - 32, m_begin + m_size))) {
+        error = strprintf("Checksum mismatch in %s", path.string());
+        return false;
+    }
+
+    try {
+        SpanReader header(m_begin, m_size - SNAPSHOT_FOOTER_SIZE);
+        unsigned char magic[sizeof(SNAPSHOT_MAGIC)];
+        uint16_t version;
+        header >> FLATDATA(magic) >> version;
+        if (version != SNAPSHOT_VERSION) {
+            error = strprintf("Unsupported UTXO snapshot version %u", version);
+            return false;
+        }
+        header >> FLATDATA(m_metadata.message_start) >> m_metadata.base_hash >> m_metadata.base_height >> m_metadata.chain_tx >> m_metadata.headers;
+        m_pos = header.pos();
+
+        m_chunks_end = m_size - SNAPSHOT_FOOTER_SIZE;
+        SpanReader footer(m_begin + m_chunks_end, SNAPSHOT_FOOTER_SIZE);
+        footer >> m_metadata.coins_count >> m_metadata.utxo_hash;
+    } catch (const std::exception& e) {
+        error = strprintf("Malformed UTXO snapshot header: %s", e.what());
+        return false;
+    }
+    m_coins_read = 0;
+    m_hasher.reset(new CUTXOSetHasher(m_metadata.base_hash));
+    return true;
+}
+
+bool CUTXOSnapshotReader::ReadChunk(std::vector<std::pair<COutPoint, Coin>>& coins)
+{
+    coins.clear();
+    if (!m_hasher) return false;
+
+    SpanReader stream(m_begin + m_pos, m_chunks_end - m_pos);
+    uint32_t count;
+    stream >> count;
+    if (count == 0) {
+        m_pos += stream.pos();
+        if (m_pos != m_chunks_end) {
+            throw std::ios_base::failure("UTXO snapshot has trailing data");
+        }
+        if (m_coins_read != m_metadata.coins_count) {
+            throw std::ios_base::failure("UTXO snapshot coin count mismatch");
+        }
+        if (m_hasher->GetHash() != m_metadata.utxo_hash) {
+            throw std::ios_base::failure("UTXO snapshot set hash mismatch");
+        }
+        m_hasher.reset();
+        return false;
+    }
+    if (count > UTXO_SNAPSHOT_CHUNK_SIZE) {
+        throw std::ios_base::failure("UTXO snapshot chunk too large");
+    }
+
+    SpanReader txids = stream.ReadColumn();
+    SpanReader runs = stream.ReadColumn();
+    SpanReader vouts = stream.ReadColumn();
+    SpanReader codes = stream.ReadColumn();
+    SpanReader txouts = stream.ReadColumn();
+
+    coins.reserve(count);
+    uint256 txid;
+    uint64_t run = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (run == 0) {
+            txids >> txid;
+            run = ReadVarInt<SpanReader, uint64_t>(runs);
+            if (run == 0) {
+                throw std::ios_base::failure("UTXO snapshot has an empty txid run");
+            }
+        }
+        --run;
+        COutPoint outpoint(txid, ReadVarInt<SpanReader, uint32_t>(vouts));
+        uint32_t code = ReadVarInt<SpanReader, uint32_t>(codes);
+        Coin coin;
+        coin.nHeight = code >> 1;
+        coin.fCoinBase = code & 1;
+        txouts >> REF(CTxOutCompressor(coin.out));
+
+        // Sorted and unique, as the coins database iterates them.
+        if (m_coins_read > 0 && !OutPointKeyLess(m_last_outpoint, outpoint)) {
+            throw std::ios_base::failure("UTXO snapshot coins are not sorted");
+        }
+        m_last_outpoint = outpoint;
+        ++m_coins_read;
+        m_hasher->Add(outpoint, coin);
+        coins.emplace_back(outpoint, std::move(coin));
+    }
+    if (run != 0 || !txids.empty() || !runs.empty() || !vouts.empty() || !codes.empty() || !txouts.empty()) {
+        throw std::ios_base::failure("UTXO snapshot chunk columns do not match its coin count");
+    }
+    m_pos += stream.pos();
+    return true;
+}
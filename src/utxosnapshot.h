@@ -0,0 +1,115 @@
+// Copyright (c) 2019 The Starwels developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef STARWELS_UTXOSNAPSHOT_H
+#define STARWELS_UTXOSNAPSHOT_H
+
+#include <coins.h>
+#include <fs.h>
+#include <hash.h>
+#include <primitives/block.h>
+#include <protocol.h>
+#include <uint256.h>
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/** Number of coins stored per column chunk in a UTXO snapshot file. */
+static const uint32_t UTXO_SNAPSHOT_CHUNK_SIZE = 65536;
+
+/** Description of the chain state a UTXO snapshot was taken at. */
+struct SnapshotMetadata
+{
+    //! Network the snapshot belongs to
+    CMessageHeader::MessageStartChars message_start;
+    //! Block whose resulting UTXO set the snapshot holds
+    uint256 base_hash;
+    int base_height = 0;
+    //! Number of transactions in the chain up to and including the base block
+    uint64_t chain_tx = 0;
+    //! Headers from height 1 up to and including the base block
+    std::vector<CBlockHeader> headers;
+    //! Number of coins in the snapshot
+    uint64_t coins_count = 0;
+    //! Same value as gettxoutsetinfo's hash_serialized_2 at the base block
+    uint256 utxo_hash;
+};
+
+/**
+ * Computes the serialized UTXO set hash reported by gettxoutsetinfo from
+ * coins added in cursor (txid, vout) order.
+ */
+class CUTXOSetHasher
+{
+private:
+    CHashWriter ss;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
+
+    void ApplyOutputs();
+
+public:
+    explicit CUTXOSetHasher(const uint256& hashBlock);
+    void Add(const COutPoint& outpoint, const Coin& coin);
+    //! Invalidates the object
+    uint256 GetHash();
+};
+
+/**
+ * Write the UTXO set visible through cursor to path. Coins are grouped in
+ * chunks, each stored as separate txid, vout, height/coinbase and compressed
+ * output columns, and the file ends with a double-SHA256 of its contents.
+ * metadata.coins_count and metadata.utxo_hash are filled in on success.
+ */
+bool WriteUTXOSnapshot(CCoinsViewCursor& cursor, SnapshotMetadata& metadata, const fs::path& path, std::string& error);
+
+/**
+ * Streaming reader for files produced by WriteUTXOSnapshot. The file is
+ * memory mapped and decoded one chunk at a time, so memory use stays bounded
+ * by the chunk size rather than the size of the UTXO set.
+ */
+class CUTXOSnapshotReader
+{
+private:
+    const unsigned char* m_begin = nullptr;
+    size_t m_size = 0;
+    size_t m_pos = 0;
+    //! End of the chunk data, before the footer
+    size_t m_chunks_end = 0;
+#ifdef WIN32
+    std::vector<unsigned char> m_buffer;
+#endif
+    SnapshotMetadata m_metadata;
+    uint64_t m_coins_read = 0;
+    COutPoint m_last_outpoint;
+    std::unique_ptr<CUTXOSetHasher> m_hasher;
+
+    void Close();
+
+public:
+    CUTXOSnapshotReader() {}
+    ~CUTXOSnapshotReader();
+
+    CUTXOSnapshotReader(const CUTXOSnapshotReader&) = delete;
+    CUTXOSnapshotReader& operator=(const CUTXOSnapshotReader&) = delete;
+
+    /** Map path, verify its checksum and parse its metadata. */
+    bool Open(const fs::path& path, std::string& error);
+
+    const SnapshotMetadata& GetMetadata() const { return m_metadata; }
+
+    /**
+     * Decode the next chunk into coins. Returns false once every chunk has
+     * been read, after checking that the coins decoded match the footer's
+     * count and UTXO set hash. Throws std::ios_base::failure on malformed
+     * input.
+     */
+    bool ReadChunk(std::vector<std::pair<COutPoint, Coin>>& coins);
+};
+
+#endif // STARWELS_UTXOSNAPSHOT_H
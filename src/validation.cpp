@@ -34,12 +34,14 @@
 #include <txmempool.h>
 #include <ui_interface.h>
 #include <undo.h>
+#include <utxosnapshot.h>
 #include <util.h>
 #include <utilmoneystr.h>
 #include <utilstrencodings.h>
 #include <validationinterface.h>
 #include <warnings.h>
 
+#include <deque>
 #include <future>
 #include <sstream>
 
@@ -103,6 +105,8 @@ class ConnectTrace;
  * library, callbacks via the validation interface, or read/write-to-disk
  * functions (eventually this will also be via callbacks).
  */
+class CCoinsPrefetch;
+
 class CChainState {
 private:
     /**
@@ -160,13 +164,14 @@ public:
 
     bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams, std::shared_ptr<const CBlock> pblock);
 
-    bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex);
+    bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, const uint256* pHashChecked = nullptr);
     bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock);
 
     // Block (dis)connection on a given view:
     DisconnectResult DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view);
     bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                    CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck = false);
+                    CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck = false,
+                    CCoinsPrefetch* prefetch = nullptr);
 
     // Block disconnection on our pcoinsTip:
     bool DisconnectTip(CValidationState& state, const CChainParams& chainparams, DisconnectedBlockTransactions *disconnectpool);
@@ -178,6 +183,9 @@ public:
 
     bool ReplayBlocks(const CChainParams& params, CCoinsView* view);
     bool RewindBlockIndex(const CChainParams& params);
+
+    /** Make pindexBase the tip after its UTXO set was loaded from a snapshot. */
+    void ActivateSnapshotBase(CBlockIndex* pindexBase, uint64_t nChainTxBase, const Consensus::Params& consensusParams);
     bool LoadGenesisBlock(const CChainParams& chainparams);
 
     void PruneBlockIndexCandidates();
@@ -188,7 +196,7 @@ private:
     bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, bool& fInvalidFound, ConnectTrace& connectTrace);
     bool ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const std::shared_ptr<const CBlock>& pblock, ConnectTrace& connectTrace, DisconnectedBlockTransactions &disconnectpool);
 
-    CBlockIndex* AddToBlockIndex(const CBlockHeader& block);
+    CBlockIndex* AddToBlockIndex(const CBlockHeader& block, const uint256* pHash = nullptr);
     /** Create a new block index entry for a given block hash */
     CBlockIndex * InsertBlockIndex(const uint256& hash);
     void CheckBlockIndex(const Consensus::Params& consensusParams);
@@ -212,6 +220,10 @@ CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 uint256 hashBestBlock;
 int nScriptCheckThreads = 0;
+int nCoinsPrefetchThreads = 0;
+int nTxVerifyThreads = 0;
+bool fPrevalidateMempool = DEFAULT_PREVALIDATE_MEMPOOL;
+bool fBackgroundFlush = DEFAULT_BACKGROUND_FLUSH;
 std::atomic_bool fImporting(false);
 std::atomic_bool fReindex(false);
 bool fTxIndex = false;
@@ -222,6 +234,7 @@ bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 size_t nCoinCacheUsage = 5000 * 300;
+int nCoinCacheRetain = DEFAULT_COINS_CACHE_RETAIN;
 uint64_t nPruneTarget = 0;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
 bool fEnableReplacement = DEFAULT_ENABLE_REPLACEMENT;
@@ -425,6 +438,12 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
 
 // Returns the script flags which should be checked for a given block
 static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& chainparams);
+// Returns the script flags which should be checked for a block building on pindexPrev
+static unsigned int GetNextBlockScriptFlags(const CBlockIndex* pindexPrev, const Consensus::Params& chainparams);
+// Queue a transaction that entered the mempool for background prevalidation
+static void QueueMempoolPrevalidation(const CTransactionRef& ptx);
+// Wake the background prevalidation thread up after a tip change
+static void NotifyMempoolPrevalidationTip();
 
 static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     int expired = pool.Expire(GetTime() - age);
@@ -476,6 +495,16 @@ void UpdateMempoolForReorg(DisconnectedBlockTransactions &disconnectpool, bool f
 {
     AssertLockHeld(cs_main);
     std::vector<uint256> vHashUpdate;
+    if (fAddToMempool) {
+        // Most of them do not depend on each other, so verify their scripts
+        // all at once before re-adding them one by one.
+        std::vector<CTransactionRef> vTxs;
+        vTxs.reserve(disconnectpool.queuedTx.size());
+        for (const CTransactionRef& ptx : disconnectpool.queuedTx.get<insertion_order>()) {
+            vTxs.push_back(ptx);
+        }
+        PreverifyTransactions(mempool, vTxs, true /* bypass_limits */);
+    }
     // disconnectpool's insertion_order index sorts the entries from
     // oldest to newest, but the oldest entry will be the last tx from the
     // latest mined block that was disconnected.
@@ -547,9 +576,180 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
     return CheckInputs(tx, state, view, true, flags, cacheSigStore, true, txdata);
 }
 
+/** Script verification flags loose transactions must pass to be accepted to the mempool */
+static unsigned int GetMempoolScriptFlags(const CChainParams& chainparams)
+{
+    unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    if (!chainparams.RequireStandard()) {
+        flags = gArgs.GetArg("-promiscuousmempoolflags", flags);
+    }
+    return flags;
+}
+
+namespace {
+
+/** Outcome of the script checks of one transaction in a CTxScriptBatch */
+struct CTxScriptBatchResult
+{
+    std::atomic<bool> failed{false};
+    //! Input whose script failed, or -1 if it failed before any script ran
+    int nFailedIn = -1;
+    ScriptError error = SCRIPT_ERR_UNKNOWN_ERROR;
+};
+
+/** One script check of a transaction in a CTxScriptBatch */
+class CTxScriptBatchCheck
+{
+private:
+    CScriptCheck m_check;
+    CTxScriptBatchResult* m_result;
+    int m_in;
+
+public:
+    CTxScriptBatchCheck() : m_result(nullptr), m_in(0) {}
+    CTxScriptBatchCheck(CScriptCheck& check, CTxScriptBatchResult* result, int nIn) : m_result(result), m_in(nIn) { m_check.swap(check); }
+
+    bool operator()()
+    {
+        // Once one input failed the rest of the transaction does not matter.
+        bool expected = false;
+        if (!m_result->failed.load(std::memory_order_relaxed) && !m_check() &&
+            m_result->failed.compare_exchange_strong(expected, true)) {
+            // Read once the batch is done, which orders it after this.
+            m_result->nFailedIn = m_in;
+            m_result->error = m_check.GetScriptError();
+        }
+        // Other transactions in the batch are unaffected.
+        return true;
+    }
+
+    void swap(CTxScriptBatchCheck& check)
+    {
+        m_check.swap(check.m_check);
+        std::swap(m_result, check.m_result);
+        std::swap(m_in, check.m_in);
+    }
+};
+
+} // namespace
+
+static CCheckQueue<CTxScriptBatchCheck> txverifyqueue(32);
+
+void ThreadTxVerify() {
+    RenameThread("starwels-txverify");
+    txverifyqueue.Thread();
+}
+
+/**
+ * The script checks of a batch of unrelated transactions. Unlike those of a
+ * block they do not stand or fall together, so the result is kept per
+ * transaction.
+ */
+class CTxScriptBatch
+{
+private:
+    struct Entry {
+        CTransactionRef ptx;
+        PrecomputedTransactionData txdata;
+        //! The outputs the inputs spend, to look into a failure
+        std::vector<CTxOut> vSpent;
+        CTxScriptBatchResult result;
+
+        explicit Entry(const CTransactionRef& ptxIn) : ptx(ptxIn), txdata(*ptxIn) {}
+    };
+
+    const unsigned int m_flags;
+    const bool m_cache_sig_store;
+    // A deque, as the checks point into the entries.
+    std::deque<Entry> m_entries;
+    std::vector<CTxScriptBatchCheck> m_checks;
+
+public:
+    CTxScriptBatch(unsigned int flags, bool cacheSigStore) : m_flags(flags), m_cache_sig_store(cacheSigStore) {}
+
+    /** Queue the checks of a transaction whose inputs are all in inputs. Requires cs_main. */
+    void Add(const CTransactionRef& ptx, const CCoinsViewCache& inputs)
+    {
+        m_entries.emplace_back(ptx);
+        Entry& entry = m_entries.back();
+        CValidationState state;
+        std::vector<CScriptCheck> vChecks;
+        if (!CheckInputs(*ptx, state, inputs, true, m_flags, m_cache_sig_store, true, entry.txdata, &vChecks)) {
+            entry.result.failed = true;
+            return;
+        }
+        // Nothing to do if the result is in the script execution cache already.
+        if (vChecks.empty()) return;
+        // CheckInputs hands out one check per input, in order.
+        for (const CTxIn& txin : ptx->vin) {
+            entry.vSpent.push_back(inputs.AccessCoin(txin.prevout).out);
+        }
+        for (size_t i = 0; i < vChecks.size(); i++) {
+            m_checks.emplace_back(vChecks[i], &entry.result, i);
+        }
+    }
+
+    /** Run all queued checks on the transaction verification threads. */
+    void Verify()
+    {
+        if (m_checks.empty()) return;
+        CCheckQueueControl<CTxScriptBatchCheck> control(&txverifyqueue);
+        control.Add(m_checks);
+        control.Wait();
+        m_checks.clear();
+    }
+
+    size_t size() const { return m_entries.size(); }
+    const CTransaction& GetTx(size_t i) const { return *m_entries[i].ptx; }
+    bool IsValid(size_t i) const { return !m_entries[i].result.failed.load(std::memory_order_relaxed); }
+
+    /**
+     * Set state to the failure of transaction i the way AcceptToMemoryPool
+     * reports it, looking at the failed input only. Returns false if it did
+     * not fail in a script.
+     */
+    bool GetScriptFailure(size_t i, CValidationState& state)
+    {
+        Entry& entry = m_entries[i];
+        if (IsValid(i) || entry.result.nFailedIn < 0) return false;
+        const CTransaction& tx = *entry.ptx;
+        const unsigned int nIn = entry.result.nFailedIn;
+        const CTxOut& out = entry.vSpent[nIn];
+        const std::string strError = ScriptErrorString(entry.result.error);
+        // Failures of non-mandatory flags do not get the peer banned, see CheckInputs.
+        if ((m_flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) &&
+            CScriptCheck(out, tx, nIn, m_flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, m_cache_sig_store, &entry.txdata)()) {
+            state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", strError));
+        } else {
+            state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", strError));
+        }
+        // Only the witness is missing, so the transaction itself may be fine.
+        if (!tx.HasWitness() &&
+            CScriptCheck(out, tx, nIn, m_flags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), m_cache_sig_store, &entry.txdata)() &&
+            !CScriptCheck(out, tx, nIn, m_flags & ~SCRIPT_VERIFY_CLEANSTACK, m_cache_sig_store, &entry.txdata)()) {
+            state.SetCorruptionPossible();
+        }
+        return true;
+    }
+};
+
+/**
+ * Script failures PreverifyTransactions found in its last batch, by witness
+ * hash, with the flags they were found with. AcceptToMemoryPool reports them
+ * instead of verifying the scripts again. Requires cs_main.
+ */
+static std::map<uint256, std::pair<unsigned int, CValidationState>> mapPreverifyFailures;
+
+
+/**
+ * With pbatch set, only run the checks that come before the scripts, and on
+ * success queue the script checks in pbatch instead of running them, without
+ * adding the transaction to the mempool.
+ */
 static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx,
                               bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache)
+                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache,
+                              bool in_package = false, CTxScriptBatch* pbatch = nullptr)
 {
     const CTransaction& tx = *ptx;
     const uint256 hash = tx.GetHash();
@@ -601,6 +801,10 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         auto itConflicting = pool.mapNextTx.find(txin.prevout);
         if (itConflicting != pool.mapNextTx.end())
         {
+            // A package cannot be rolled back once it replaced something.
+            if (in_package) {
+                return state.Invalid(false, REJECT_DUPLICATE, "txn-mempool-conflict");
+            }
             const CTransaction *ptxConflicting = itConflicting->second;
             if (!setConflicts.count(ptxConflicting->GetHash()))
             {
@@ -748,6 +952,15 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
             return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
         }
+        if (pool.IsClusterTracking()) {
+            // Clusters are linearized as a whole, so their size is bounded too.
+            size_t nLimitCluster = gArgs.GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT);
+            uint64_t nClusterSize = pool.CalculateClusterSize(setAncestors, nLimitCluster);
+            if (nClusterSize > nLimitCluster) {
+                return state.DoS(0, false, REJECT_NONSTANDARD, "too-large-cluster", false,
+                                 strprintf("exceeds cluster size limit [limit: %u]", nLimitCluster));
+            }
+        }
 
         // A transaction that spends outputs that would be replaced by it is invalid. Now
         // that we have the set of all ancestors we can detect this
@@ -892,9 +1105,21 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
             }
         }
 
-        unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
-        if (!chainparams.RequireStandard()) {
-            scriptVerifyFlags = gArgs.GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
+        const unsigned int scriptVerifyFlags = GetMempoolScriptFlags(chainparams);
+
+        if (pbatch) {
+            pbatch->Add(ptx, view);
+            return true;
+        }
+        // Scripts PreverifyTransactions saw fail are not verified again.
+        auto itFailure = mapPreverifyFailures.find(tx.GetWitnessHash());
+        if (itFailure != mapPreverifyFailures.end()) {
+            std::pair<unsigned int, CValidationState> failure = std::move(itFailure->second);
+            mapPreverifyFailures.erase(itFailure);
+            if (failure.first == scriptVerifyFlags) {
+                state = failure.second;
+                return false;
+            }
         }
 
         // Check against previous transactions
@@ -978,7 +1203,11 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         }
     }
 
-    GetMainSignals().TransactionAddedToMempool(ptx);
+    // For packages this is done once all of it is in.
+    if (!in_package) {
+        GetMainSignals().TransactionAddedToMempool(ptx);
+        QueueMempoolPrevalidation(ptx);
+    }
 
     return true;
 }
@@ -1008,6 +1237,141 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return AcceptToMemoryPoolWithTime(chainparams, pool, state, tx, pfMissingInputs, GetTime(), plTxnReplaced, bypass_limits, nAbsurdFee);
 }
 
+/** Check the shape of a package, without looking at the chain or the mempool */
+static bool CheckPackage(const std::vector<CTransactionRef>& package, CValidationState& state)
+{
+    if (package.empty()) {
+        return state.Invalid(false, REJECT_INVALID, "package-empty");
+    }
+    if (package.size() > MAX_PACKAGE_COUNT) {
+        return state.DoS(0, false, REJECT_NONSTANDARD, "package-too-many-transactions");
+    }
+    int64_t nPackageSize = 0;
+    std::map<uint256, size_t> mapIndex;
+    std::set<COutPoint> setSpent;
+    for (size_t i = 0; i < package.size(); i++) {
+        const CTransaction& tx = *package[i];
+        nPackageSize += GetVirtualTransactionSize(tx);
+        if (!mapIndex.emplace(tx.GetHash(), i).second) {
+            return state.Invalid(false, REJECT_INVALID, "package-contains-duplicates");
+        }
+        for (const CTxIn& txin : tx.vin) {
+            if (!setSpent.insert(txin.prevout).second) {
+                return state.Invalid(false, REJECT_INVALID, "conflict-in-package");
+            }
+        }
+    }
+    if (nPackageSize > MAX_PACKAGE_SIZE * 1000) {
+        return state.DoS(0, false, REJECT_NONSTANDARD, "package-too-large");
+    }
+
+    // Parents must come before the transactions spending them ...
+    for (size_t i = 0; i < package.size(); i++) {
+        for (const CTxIn& txin : package[i]->vin) {
+            auto it = mapIndex.find(txin.prevout.hash);
+            if (it != mapIndex.end() && it->second >= i) {
+                return state.Invalid(false, REJECT_INVALID, "package-not-sorted");
+            }
+        }
+    }
+    // ... and all of them must be parents of the last one.
+    std::set<uint256> setChildParents;
+    for (const CTxIn& txin : package.back()->vin) {
+        setChildParents.insert(txin.prevout.hash);
+    }
+    for (size_t i = 0; i + 1 < package.size(); i++) {
+        if (!setChildParents.count(package[i]->GetHash())) {
+            return state.Invalid(false, REJECT_INVALID, "package-not-child-with-parents");
+        }
+    }
+    return true;
+}
+
+bool AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState& state, const std::vector<CTransactionRef>& package,
+                               uint256* pfailed_txid, const CAmount nAbsurdFee)
+{
+    if (!CheckPackage(package, state)) return false;
+
+    // The parents are not in the mempool yet, so this only gets the
+    // transactions spending confirmed outputs, but those are usually most.
+    // Their fees are judged for the package as a whole, after the scripts.
+    PreverifyTransactions(pool, package, true /* bypass_limits */);
+
+    const CChainParams& chainparams = Params();
+    const int64_t nAcceptTime = GetTime();
+    std::vector<COutPoint> coins_to_uncache;
+    std::vector<CTransactionRef> vAdded;
+    bool fAccepted = true;
+    {
+        LOCK2(cs_main, pool.cs);
+        CAmount nPackageFees = 0;
+        size_t nPackageSize = 0;
+        for (const CTransactionRef& ptx : package) {
+            // What is there already had its fees judged when it got in.
+            if (pool.exists(ptx->GetHash())) continue;
+            // Fees are checked for the package as a whole below, and the
+            // mempool is only trimmed once all of it is in.
+            bool fMissingInputs = false;
+            if (!AcceptToMemoryPoolWorker(chainparams, pool, state, ptx, &fMissingInputs, nAcceptTime, nullptr,
+                                          true /* bypass_limits */, nAbsurdFee, coins_to_uncache, true /* in_package */)) {
+                if (fMissingInputs && !state.IsInvalid()) {
+                    state.Invalid(false, REJECT_INVALID, "missing-inputs");
+                }
+                if (pfailed_txid) *pfailed_txid = ptx->GetHash();
+                fAccepted = false;
+                break;
+            }
+            vAdded.push_back(ptx);
+            CTxMemPool::txiter it = pool.mapTx.find(ptx->GetHash());
+            nPackageFees += it->GetModifiedFee();
+            nPackageSize += it->GetTxSize();
+        }
+
+        if (fAccepted && !vAdded.empty()) {
+            const size_t nMaxMempool = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+            CFeeRate minFeeRate = std::max(pool.GetMinFee(nMaxMempool), ::minRelayTxFee);
+            // With anything added, the child is too, as it spends all the rest.
+            CTxMemPool::txiter itChild = pool.mapTx.find(package.back()->GetHash());
+            if (itChild->GetModifiedFee() < minFeeRate.GetFee(itChild->GetTxSize())) {
+                // The parents may be paid for by the child, but not the other way around.
+                if (pfailed_txid) *pfailed_txid = package.back()->GetHash();
+                fAccepted = state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient fee", false,
+                    strprintf("child pays %d < %d", itChild->GetModifiedFee(), minFeeRate.GetFee(itChild->GetTxSize())));
+            } else if (nPackageFees < minFeeRate.GetFee(nPackageSize)) {
+                fAccepted = state.DoS(0, false, REJECT_INSUFFICIENTFEE, "package-fee-too-low", false,
+                    strprintf("%d < %d", nPackageFees, minFeeRate.GetFee(nPackageSize)));
+            } else {
+                LimitMempoolSize(pool, nMaxMempool, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+                for (const CTransactionRef& ptx : vAdded) {
+                    if (!pool.exists(ptx->GetHash())) {
+                        fAccepted = state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (!fAccepted) {
+            // Removing a parent takes the rest of the package with it.
+            for (const CTransactionRef& ptx : vAdded) {
+                if (pool.exists(ptx->GetHash())) {
+                    pool.removeRecursive(*ptx, MemPoolRemovalReason::UNKNOWN);
+                }
+            }
+            for (const COutPoint& outpoint : coins_to_uncache)
+                pcoinsTip->Uncache(outpoint);
+        } else {
+            for (const CTransactionRef& ptx : vAdded) {
+                GetMainSignals().TransactionAddedToMempool(ptx);
+                QueueMempoolPrevalidation(ptx);
+            }
+        }
+    }
+    CValidationState stateDummy;
+    FlushStateToDisk(chainparams, stateDummy, FLUSH_STATE_PERIODIC);
+    return fAccepted;
+}
+
 /**
  * Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock.
  * If blockIndex is provided, the transaction is fetched from the corresponding block.
@@ -1138,10 +1502,169 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
         return false;
     if (block.GetHash() != pindex->GetBlockHash())
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
-                pindex->ToString(), pindex->GetBlockPos().ToString());
+                pindex->ToString(), blockPos.ToString());
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CDiskBlockPos& pos, const uint256& hash, const CMessageHeader::MessageStartChars& messageStart)
+{
+    // The block is preceded by the message start and its size, see WriteBlockToDisk
+    CDiskBlockPos hpos = pos;
+    if (hpos.nPos < CMessageHeader::MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("%s: invalid position %s", __func__, hpos.ToString());
+    hpos.nPos -= CMessageHeader::MESSAGE_START_SIZE + sizeof(unsigned int);
+
+    CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, hpos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blkStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blkStart) >> nSize;
+        if (memcmp(blkStart, messageStart, CMessageHeader::MESSAGE_START_SIZE) != 0)
+            return error("%s: block magic mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_SIZE)
+            return error("%s: invalid block size %u at %s", __func__, nSize, pos.ToString());
+        block.resize(nSize);
+        filein.read((char*)block.data(), nSize);
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), hpos.ToString());
+    }
+
+    // Check that this is the block asked for, as ReadBlockFromDisk does
+    if (block.size() < 80)
+        return error("%s: invalid block size %u at %s", __func__, block.size(), pos.ToString());
+    uint256 hashRead;
+    CHash256().Write(block.data(), 80).Finalize(hashRead.begin());
+    if (hashRead != hash)
+        return error("%s: hash %s doesn't match %s at %s", __func__, hashRead.ToString(), hash.ToString(), pos.ToString());
+    return true;
+}
+
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    CDiskBlockPos blockPos;
+    {
+        LOCK(cs_main);
+        blockPos = pindex->GetBlockPos();
+    }
+    return ReadRawBlockFromDisk(block, blockPos, pindex->GetBlockHash(), messageStart);
+}
+
+namespace {
+
+/**
+ * Walks a serialized block, moving the parts to keep towards its start. The
+ * write position never passes the read position, so this works in place.
+ */
+class RawBlockStripper
+{
+    std::vector<unsigned char>& m_data;
+    size_t m_read = 0;
+    size_t m_write = 0;
+
+public:
+    explicit RawBlockStripper(std::vector<unsigned char>& data) : m_data(data) {}
+
+    // Stream interface for ReadCompactSize
+    void read(char* pch, size_t nSize)
+    {
+        if (nSize > m_data.size() - m_read)
+            throw std::ios_base::failure("RawBlockStripper::read(): end of data");
+        memcpy(pch, m_data.data() + m_read, nSize);
+        m_read += nSize;
+    }
+
+    unsigned char Peek() const
+    {
+        if (m_read == m_data.size())
+            throw std::ios_base::failure("RawBlockStripper::Peek(): end of data");
+        return m_data[m_read];
+    }
+
+    void Skip(size_t nSize)
+    {
+        if (nSize > m_data.size() - m_read)
+            throw std::ios_base::failure("RawBlockStripper::Skip(): end of data");
+        m_read += nSize;
+    }
+
+    void Keep(size_t nSize)
+    {
+        if (nSize > m_data.size() - m_read)
+            throw std::ios_base::failure("RawBlockStripper::Keep(): end of data");
+        if (m_write != m_read)
+            memmove(m_data.data() + m_write, m_data.data() + m_read, nSize);
+        m_read += nSize;
+        m_write += nSize;
+    }
+
+    uint64_t KeepCompactSize()
+    {
+        const size_t nStart = m_read;
+        const uint64_t n = ReadCompactSize(*this);
+        m_read = nStart;
+        Keep(GetSizeOfCompactSize(n));
+        return n;
+    }
+
+    bool Done()
+    {
+        if (m_read != m_data.size())
+            return false;
+        m_data.resize(m_write);
+        return true;
+    }
+};
+
+} // namespace
+
+bool StripRawBlockWitness(std::vector<unsigned char>& block)
+{
+    // Mirrors SerializeTransaction: the extended format has an empty vin
+    // marker followed by the flags, and the witnesses go before nLockTime.
+    RawBlockStripper stripper(block);
+    try {
+        stripper.Keep(80); // CBlockHeader
+        const uint64_t nTx = stripper.KeepCompactSize();
+        for (uint64_t i = 0; i < nTx; i++) {
+            stripper.Keep(4); // nVersion
+            const bool fWitness = stripper.Peek() == 0;
+            if (fWitness) {
+                unsigned char marker, flags;
+                stripper.read((char*)&marker, 1);
+                stripper.read((char*)&flags, 1);
+                if (flags != 1)
+                    return false;
+            }
+            const uint64_t nIn = stripper.KeepCompactSize();
+            for (uint64_t j = 0; j < nIn; j++) {
+                stripper.Keep(36); // prevout
+                stripper.Keep(stripper.KeepCompactSize()); // scriptSig
+                stripper.Keep(4); // nSequence
+            }
+            const uint64_t nOut = stripper.KeepCompactSize();
+            for (uint64_t j = 0; j < nOut; j++) {
+                stripper.Keep(8); // nValue
+                stripper.Keep(stripper.KeepCompactSize()); // scriptPubKey
+            }
+            if (fWitness) {
+                for (uint64_t j = 0; j < nIn; j++) {
+                    const uint64_t nItems = ReadCompactSize(stripper);
+                    for (uint64_t k = 0; k < nItems; k++) {
+                        stripper.Skip(ReadCompactSize(stripper));
+                    }
+                }
+            }
+            stripper.Keep(4); // nLockTime
+        }
+    } catch (const std::ios_base::failure&) {
+        return false;
+    }
+    return stripper.Done();
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
@@ -1337,11 +1860,34 @@ int GetSpendHeight(const CCoinsViewCache& inputs)
 static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
 static uint256 scriptExecutionCacheNonce(GetRandHash());
 
+// Script execution cache lookups, for the per-block hit rate. Protected by cs_main
+static uint64_t nScriptExecutionCacheHits = 0;
+static uint64_t nScriptExecutionCacheMisses = 0;
+
+void GetScriptExecutionCacheStats(uint64_t& nHits, uint64_t& nMisses)
+{
+    LOCK(cs_main);
+    nHits = nScriptExecutionCacheHits;
+    nMisses = nScriptExecutionCacheMisses;
+}
+
+static uint256 GetScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 hashCacheEntry;
+    // We only use the first 19 bytes of nonce to avoid a second SHA
+    // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
+    static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+    return hashCacheEntry;
+}
+
 void InitScriptExecutionCache() {
     // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
     // setup_bytes creates the minimum possible cache (2 elements).
     size_t nMaxCacheSize = std::min(std::max((int64_t)0, gArgs.GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) / 2), MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
     size_t nElems = scriptExecutionCache.setup_bytes(nMaxCacheSize);
+    // Entries that survive a same-size setup become unreachable.
+    scriptExecutionCacheNonce = GetRandHash();
     LogPrintf("Using %zu MiB out of %zu/2 requested for script execution cache, able to store %zu elements\n",
             (nElems*sizeof(uint256)) >>20, (nMaxCacheSize*2)>>20, nElems);
 }
@@ -1382,15 +1928,13 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
             // correct (ie that the transaction hash which is in tx's prevouts
             // properly commits to the scriptPubKey in the inputs view of that
             // transaction).
-            uint256 hashCacheEntry;
-            // We only use the first 19 bytes of nonce to avoid a second SHA
-            // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
-            static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
-            CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            uint256 hashCacheEntry = GetScriptExecutionCacheEntry(tx, flags);
             AssertLockHeld(cs_main); //TODO: Remove this requirement by making CuckooCache not require external locks
             if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
+                nScriptExecutionCacheHits++;
                 return true;
             }
+            nScriptExecutionCacheMisses++;
 
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
@@ -1443,6 +1987,84 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
     return true;
 }
 
+void CheckInputsMany(const std::vector<CTransactionRef>& txs, const CCoinsViewCache& inputs, unsigned int flags, bool cacheSigStore, std::vector<bool>& valid)
+{
+    CTxScriptBatch batch(flags, cacheSigStore);
+    for (const CTransactionRef& ptx : txs) {
+        batch.Add(ptx, inputs);
+    }
+    batch.Verify();
+    valid.resize(txs.size());
+    for (size_t i = 0; i < txs.size(); i++) {
+        valid[i] = batch.IsValid(i);
+    }
+}
+
+unsigned int PreverifyTransactions(CTxMemPool& pool, const std::vector<CTransactionRef>& txs, bool bypass_limits)
+{
+    if (nTxVerifyThreads == 0) return 0;
+
+    // Weed out what AcceptToMemoryPool rejects without looking at the inputs
+    // before taking any lock.
+    std::vector<CTransactionRef> vCandidates;
+    vCandidates.reserve(txs.size());
+    for (const CTransactionRef& ptx : txs) {
+        CValidationState state;
+        if (!ptx->IsCoinBase() && CheckTransaction(*ptx, state)) {
+            vCandidates.push_back(ptx);
+        }
+    }
+    if (vCandidates.empty()) return 0;
+
+    const CChainParams& chainparams = Params();
+    const unsigned int flags = GetMempoolScriptFlags(chainparams);
+    const int64_t nAcceptTime = GetTime();
+    // Store signatures in the signature cache too, so that they are not
+    // verified again when AcceptToMemoryPool checks the current block's flags.
+    CTxScriptBatch batch(flags, true);
+    // Coins pulled into the coins cache for each transaction in the batch.
+    std::vector<std::vector<COutPoint>> vCoinsToUncache;
+    {
+        // Scripts are checked last to make denial of service expensive, so
+        // only those of transactions that pass all other checks are queued.
+        LOCK2(cs_main, pool.cs);
+        for (const CTransactionRef& ptx : vCandidates) {
+            CValidationState state;
+            std::vector<COutPoint> coins_to_uncache;
+            if (AcceptToMemoryPoolWorker(chainparams, pool, state, ptx, nullptr, nAcceptTime, nullptr, bypass_limits,
+                                         0 /* nAbsurdFee */, coins_to_uncache, false /* in_package */, &batch)) {
+                vCoinsToUncache.push_back(std::move(coins_to_uncache));
+            } else {
+                for (const COutPoint& outpoint : coins_to_uncache)
+                    pcoinsTip->Uncache(outpoint);
+            }
+        }
+    }
+
+    batch.Verify();
+
+    // Transactions that passed keep their coins cached, as they are about to
+    // be accepted; those of the ones that failed are dropped again, and the
+    // failures are kept for AcceptToMemoryPool to report.
+    unsigned int nValid = 0;
+    LOCK(cs_main);
+    mapPreverifyFailures.clear();
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (batch.IsValid(i)) {
+            scriptExecutionCache.insert(GetScriptExecutionCacheEntry(batch.GetTx(i), flags));
+            nValid++;
+        } else {
+            CValidationState state;
+            if (batch.GetScriptFailure(i, state)) {
+                mapPreverifyFailures.emplace(batch.GetTx(i).GetWitnessHash(), std::make_pair(flags, state));
+            }
+            for (const COutPoint& outpoint : vCoinsToUncache[i])
+                pcoinsTip->Uncache(outpoint);
+        }
+    }
+    return nValid;
+}
+
 namespace {
 
 bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
@@ -1687,6 +2309,285 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+/** Closure representing one coin lookup of a CCoinsPrefetch, run on a prefetch thread. */
+class CCoinsPrefetchCheck
+{
+private:
+    CCoinsPrefetch* m_prefetch;
+    size_t m_index;
+
+public:
+    CCoinsPrefetchCheck() : m_prefetch(nullptr), m_index(0) {}
+    CCoinsPrefetchCheck(CCoinsPrefetch* prefetch, size_t index) : m_prefetch(prefetch), m_index(index) {}
+
+    bool operator()();
+
+    void swap(CCoinsPrefetchCheck& check) {
+        std::swap(m_prefetch, check.m_prefetch);
+        std::swap(m_index, check.m_index);
+    }
+};
+
+/**
+ * Reads the coins spent by a block from the coins database on the prefetch
+ * threads, while the validation thread is still working through the block.
+ * The validation thread moves finished lookups into the coins cache with
+ * Apply() just before it needs them; lookups that are not done by then are
+ * left to the cache's regular synchronous path.
+ */
+class CCoinsPrefetch
+{
+private:
+    struct Entry {
+        COutPoint outpoint;
+        Coin coin;
+        bool found = false;
+        std::atomic<bool> done{false};
+    };
+
+    //! The cache to warm. Only touched from the validation thread.
+    CCoinsViewCache& m_cache;
+    //! Thread-safe view the cache is (indirectly) backed by.
+    const CCoinsView* m_source;
+    std::unique_ptr<Entry[]> m_entries;
+    //! Entries for the inputs of transaction i are [m_tx_begin[i], m_tx_begin[i + 1]).
+    std::vector<size_t> m_tx_begin;
+    std::atomic<bool> m_cancelled{false};
+    unsigned int m_applied = 0;
+    unsigned int m_missed = 0;
+    // Must be declared last so it is destroyed (waiting for all workers) first.
+    std::unique_ptr<CCheckQueueControl<CCoinsPrefetchCheck>> m_control;
+
+public:
+    CCoinsPrefetch(const CBlock& block, CCoinsViewCache& cache, const CCoinsView* source);
+    ~CCoinsPrefetch() { Cancel(); }
+
+    /** Perform lookup number i. Called from the prefetch threads. */
+    void Fetch(size_t i);
+    /** Move the finished lookups for the inputs of transaction tx_index into the cache. */
+    void Apply(size_t tx_index);
+    /** Skip all lookups that have not started yet and wait for the running ones. */
+    void Cancel();
+
+    unsigned int Size() const { return m_tx_begin.back(); }
+    unsigned int Applied() const { return m_applied; }
+    unsigned int Missed() const { return m_missed; }
+};
+
+static CCheckQueue<CCoinsPrefetchCheck> coinsprefetchqueue(16);
+
+void ThreadCoinsPrefetch() {
+    RenameThread("starwels-prefetch");
+    coinsprefetchqueue.Thread();
+}
+
+bool CCoinsPrefetchCheck::operator()() {
+    m_prefetch->Fetch(m_index);
+    return true;
+}
+
+CCoinsPrefetch::CCoinsPrefetch(const CBlock& block, CCoinsViewCache& cache, const CCoinsView* source) : m_cache(cache), m_source(source)
+{
+    // Outputs created by the block itself will never be found on disk.
+    std::set<uint256> block_txids;
+    for (const auto& tx : block.vtx) {
+        block_txids.insert(tx->GetHash());
+    }
+
+    std::vector<const COutPoint*> outpoints;
+    m_tx_begin.reserve(block.vtx.size() + 1);
+    for (const auto& tx : block.vtx) {
+        m_tx_begin.push_back(outpoints.size());
+        if (tx->IsCoinBase()) continue;
+        for (const CTxIn& txin : tx->vin) {
+            if (block_txids.count(txin.prevout.hash) || m_cache.HaveCoinInCache(txin.prevout)) continue;
+            outpoints.push_back(&txin.prevout);
+        }
+    }
+    m_tx_begin.push_back(outpoints.size());
+
+    m_entries.reset(new Entry[outpoints.size()]);
+    std::vector<CCoinsPrefetchCheck> checks;
+    checks.reserve(outpoints.size());
+    for (size_t i = 0; i < outpoints.size(); ++i) {
+        m_entries[i].outpoint = *outpoints[i];
+        // Workers pick up their share front to back, so the lookups are
+        // done roughly in the order the block spends them.
+        checks.emplace_back(this, i);
+    }
+    m_control.reset(new CCheckQueueControl<CCoinsPrefetchCheck>(&coinsprefetchqueue));
+    m_control->Add(checks);
+}
+
+void CCoinsPrefetch::Fetch(size_t i)
+{
+    Entry& entry = m_entries[i];
+    if (!m_cancelled.load(std::memory_order_relaxed)) {
+        try {
+            entry.found = m_source->GetCoin(entry.outpoint, entry.coin);
+        } catch (const std::runtime_error& e) {
+            // Leave it to the validation thread, whose own read of this coin
+            // goes through the error handling of the regular view stack.
+            entry.found = false;
+        }
+    }
+    entry.done.store(true, std::memory_order_release);
+}
+
+void CCoinsPrefetch::Apply(size_t tx_index)
+{
+    for (size_t i = m_tx_begin[tx_index]; i < m_tx_begin[tx_index + 1]; ++i) {
+        Entry& entry = m_entries[i];
+        if (!entry.done.load(std::memory_order_acquire)) {
+            m_missed++;
+            continue;
+        }
+        if (entry.found && m_cache.PopulateCoin(entry.outpoint, std::move(entry.coin))) {
+            m_applied++;
+        }
+    }
+}
+
+void CCoinsPrefetch::Cancel()
+{
+    m_cancelled = true;
+    if (m_control) m_control->Wait();
+}
+
+/**
+ * Mempool prevalidation: transactions are only put in the script execution
+ * cache under the flags of the current tip at acceptance time, so when the
+ * next block enforces different flags (e.g. at a soft fork activation) every
+ * mempool transaction it contains misses the cache. With -prevalidatemempool
+ * a background thread re-verifies mempool transactions under the flags
+ * expected for the next block, outside cs_main, and caches the results.
+ */
+static boost::mutex csPrevalidate;
+static boost::condition_variable condPrevalidate;
+// Transactions accepted to the mempool since the last pass. Protected by csPrevalidate
+static std::vector<CTransactionRef> vPrevalidateQueue;
+// Whether the tip changed since the last pass. Protected by csPrevalidate
+static bool fPrevalidateTipChanged = true;
+
+static void QueueMempoolPrevalidation(const CTransactionRef& ptx)
+{
+    if (!fPrevalidateMempool) return;
+    boost::unique_lock<boost::mutex> lock(csPrevalidate);
+    vPrevalidateQueue.push_back(ptx);
+    condPrevalidate.notify_one();
+}
+
+static void NotifyMempoolPrevalidationTip()
+{
+    if (!fPrevalidateMempool) return;
+    boost::unique_lock<boost::mutex> lock(csPrevalidate);
+    fPrevalidateTipChanged = true;
+    condPrevalidate.notify_one();
+}
+
+enum class PrevalidationResult { GONE, CACHED, VERIFIED, FAILED };
+
+/** Make sure a mempool transaction's scripts are in the script execution cache under the given flags. */
+static PrevalidationResult PrevalidateMempoolTransaction(const CTransactionRef& ptx, unsigned int flags)
+{
+    const CTransaction& tx = *ptx;
+    const uint256 hashCacheEntry = GetScriptExecutionCacheEntry(tx, flags);
+    PrecomputedTransactionData txdata(tx);
+    std::vector<CScriptCheck> vChecks;
+    {
+        LOCK2(cs_main, mempool.cs);
+        if (mempool.get(tx.GetHash()) != ptx) return PrevalidationResult::GONE;
+        if (scriptExecutionCache.contains(hashCacheEntry, false)) return PrevalidationResult::CACHED;
+        CCoinsViewMemPool viewMemPool(pcoinsTip.get(), mempool);
+        CCoinsViewCache view(&viewMemPool);
+        for (const CTxIn& txin : tx.vin) {
+            if (!view.HaveCoin(txin.prevout)) return PrevalidationResult::GONE;
+        }
+        CValidationState state;
+        if (!CheckInputs(tx, state, view, true, flags, true, false, txdata, &vChecks)) return PrevalidationResult::FAILED;
+    }
+    // The checks own copies of the spent outputs, so the expensive part can
+    // run without holding any lock.
+    for (CScriptCheck& check : vChecks) {
+        if (!check()) return PrevalidationResult::FAILED;
+    }
+    LOCK(cs_main);
+    scriptExecutionCache.insert(hashCacheEntry);
+    return PrevalidationResult::VERIFIED;
+}
+
+/** Prevalidate txs under flags, and log the outcome. Returns how many were verified. */
+static unsigned int PrevalidateMempoolTransactions(const std::vector<CTransactionRef>& vTxs, unsigned int nFlags)
+{
+    int64_t nTimeStart = GetTimeMicros();
+    unsigned int nResults[4] = {};
+    for (const CTransactionRef& ptx : vTxs) {
+        boost::this_thread::interruption_point();
+        nResults[(int)PrevalidateMempoolTransaction(ptx, nFlags)]++;
+    }
+    if (nResults[(int)PrevalidationResult::VERIFIED] || nResults[(int)PrevalidationResult::FAILED]) {
+        LogPrint(BCLog::MEMPOOL, "Prevalidated mempool for script flags %08x: %u verified, %u already cached, %u failed, %u gone (%.2fms)\n",
+            nFlags, nResults[(int)PrevalidationResult::VERIFIED], nResults[(int)PrevalidationResult::CACHED],
+            nResults[(int)PrevalidationResult::FAILED], nResults[(int)PrevalidationResult::GONE], (GetTimeMicros() - nTimeStart) * MILLI);
+    }
+    return nResults[(int)PrevalidationResult::VERIFIED];
+}
+
+static std::vector<CTransactionRef> GetMempoolTransactions()
+{
+    LOCK(mempool.cs);
+    std::vector<CTransactionRef> vTxs;
+    vTxs.reserve(mempool.mapTx.size());
+    for (const CTxMemPoolEntry& entry : mempool.mapTx) {
+        vTxs.push_back(entry.GetSharedTx());
+    }
+    return vTxs;
+}
+
+unsigned int PrevalidateMempool()
+{
+    unsigned int nFlags;
+    {
+        LOCK(cs_main);
+        nFlags = GetNextBlockScriptFlags(chainActive.Tip(), Params().GetConsensus());
+    }
+    return PrevalidateMempoolTransactions(GetMempoolTransactions(), nFlags);
+}
+
+void ThreadPrevalidateMempool()
+{
+    RenameThread("starwels-prevalidate");
+    bool fHaveFlags = false;
+    unsigned int nFlags = SCRIPT_VERIFY_NONE;
+    while (true) {
+        std::vector<CTransactionRef> vTxs;
+        bool fTipChanged;
+        {
+            boost::unique_lock<boost::mutex> lock(csPrevalidate);
+            while (vPrevalidateQueue.empty() && !fPrevalidateTipChanged)
+                condPrevalidate.wait(lock);
+            vTxs.swap(vPrevalidateQueue);
+            fTipChanged = fPrevalidateTipChanged;
+            fPrevalidateTipChanged = false;
+        }
+        if (fTipChanged) {
+            unsigned int nNextFlags;
+            {
+                LOCK(cs_main);
+                nNextFlags = GetNextBlockScriptFlags(chainActive.Tip(), Params().GetConsensus());
+            }
+            if (!fHaveFlags || nNextFlags != nFlags) {
+                // Everything in the mempool was cached under other flags.
+                vTxs = GetMempoolTransactions();
+                fHaveFlags = true;
+                nFlags = nNextFlags;
+            }
+        }
+
+        PrevalidateMempoolTransactions(vTxs, nFlags);
+    }
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -1732,33 +2633,34 @@ public:
 // Protected by cs_main
 static ThresholdConditionCache warningcache[VERSIONBITS_NUM_BITS];
 
-static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& consensusparams) {
+static unsigned int GetNextBlockScriptFlags(const CBlockIndex* pindexPrev, const Consensus::Params& consensusparams) {
     AssertLockHeld(cs_main);
 
+    const int nHeight = pindexPrev == nullptr ? 0 : pindexPrev->nHeight + 1;
     unsigned int flags = SCRIPT_VERIFY_NONE;
 
     // Start enforcing P2SH (BIP16)
-    if (pindex->nHeight >= consensusparams.BIP16Height) {
+    if (nHeight >= consensusparams.BIP16Height) {
         flags |= SCRIPT_VERIFY_P2SH;
     }
 
     // Start enforcing the DERSIG (BIP66) rule
-    if (pindex->nHeight >= consensusparams.BIP66Height) {
+    if (nHeight >= consensusparams.BIP66Height) {
         flags |= SCRIPT_VERIFY_DERSIG;
     }
 
     // Start enforcing CHECKLOCKTIMEVERIFY (BIP65) rule
-    if (pindex->nHeight >= consensusparams.BIP65Height) {
+    if (nHeight >= consensusparams.BIP65Height) {
         flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
     }
 
     // Start enforcing BIP68 (sequence locks) and BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
-    if (VersionBitsState(pindex->pprev, consensusparams, Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
+    if (VersionBitsState(pindexPrev, consensusparams, Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
         flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
     }
 
     // Start enforcing WITNESS rules using versionbits logic.
-    if (IsWitnessEnabled(pindex->pprev, consensusparams)) {
+    if (IsWitnessEnabled(pindexPrev, consensusparams)) {
         flags |= SCRIPT_VERIFY_WITNESS;
         flags |= SCRIPT_VERIFY_NULLDUMMY;
     }
@@ -1766,6 +2668,10 @@ static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consens
     return flags;
 }
 
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& consensusparams) {
+    return GetNextBlockScriptFlags(pindex->pprev, consensusparams);
+}
+
 
 
 static int64_t nTimeCheck = 0;
@@ -1781,7 +2687,8 @@ static int64_t nBlocksTotal = 0;
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
  *  can fail if those validity checks fail (among other reasons). */
 bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
+                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck,
+                  CCoinsPrefetch* prefetch)
 {
     AssertLockHeld(cs_main);
     assert(pindex);
@@ -1916,6 +2823,10 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
 
         nInputs += tx.vin.size();
 
+        if (prefetch) {
+            prefetch->Apply(i);
+        }
+
         if (!tx.IsCoinBase())
         {
             CAmount txfee = 0;
@@ -1968,6 +2879,10 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
         }
         UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
     }
+    if (prefetch) {
+        prefetch->Cancel();
+        LogPrint(BCLog::BENCH, "      - Prefetched %u/%u coins (%u not ready in time)\n", prefetch->Applied(), prefetch->Size(), prefetch->Missed());
+    }
     int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2;
     LogPrint(BCLog::BENCH, "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs (%.2fms/blk)]\n", (unsigned)block.vtx.size(), MILLI * (nTime3 - nTime2), MILLI * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : MILLI * (nTime3 - nTime2) / (nInputs-1), nTimeConnect * MICRO, nTimeConnect * MILLI / nBlocksTotal);
 
@@ -2056,7 +2971,8 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
             nLastSetChain = nNow;
         }
         int64_t nMempoolSizeMax = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
-        int64_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+        // Coins still being written by a background flush count against the limit too.
+        int64_t cacheSize = pcoinsTip->DynamicMemoryUsage() + pcoinsdbview->PendingMemoryUsage();
         int64_t nTotalSpace = nCoinCacheUsage + std::max<int64_t>(nMempoolSizeMax - nMempoolUsage, 0);
         // The cache is large and we're within 10% and 10 MiB of the limit, but we have time now (not in the middle of a block processing).
         bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize > std::max((9 * nTotalSpace) / 10, nTotalSpace - MAX_BLOCK_COINSDB_USAGE * 1024 * 1024);
@@ -2093,9 +3009,13 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
                     return AbortNode(state, "Failed to write to block index database");
                 }
             }
-            // Finally remove any pruned files
-            if (fFlushForPrune)
+            // Finally remove any pruned files, once no background write can
+            // leave the chainstate at a point that needs them to be replayed.
+            if (fFlushForPrune) {
+                if (!pcoinsdbview->WaitForWrite())
+                    return AbortNode(state, "Failed to write to coin database");
                 UnlinkPrunedFiles(setFilesToPrune);
+            }
             nLastWrite = nNow;
         }
         // Flush best chain related state. This can only be done if the blocks / block index write was also done.
@@ -2108,8 +3028,26 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
             if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
             // Flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            if (nCoinCacheRetain > 0 && mode != FLUSH_STATE_ALWAYS) {
+                // Write the modified coins but keep the ones used since the
+                // last write, and those created in the last few blocks, so
+                // the next blocks don't start against a cold cache.
+                if (!pcoinsTip->Sync())
+                    return AbortNode(state, "Failed to write to coin database");
+                pcoinsTip->Evict(nCoinCacheUsage / 100 * nCoinCacheRetain, chainActive.Height() - COINS_CACHE_YOUNG_DEPTH);
+            } else if (fBackgroundFlush && mode != FLUSH_STATE_ALWAYS && !fFlushForPrune) {
+                // Hand the cache over to a background write and carry on
+                // with an empty one on top of it. Flushes for pruning stay
+                // synchronous, as the files just unlinked are gone for good.
+                size_t nUsage = pcoinsTip->DynamicMemoryUsage();
+                auto fnFailed = [](const std::string& strError) {
+                    AbortNode("Failed to write to coin database in the background: " + strError);
+                };
+                if (!pcoinsdbview->BatchWriteAsync(pcoinsTip->Detach(), pcoinsTip->GetBestBlock(), nUsage, fnFailed))
+                    return AbortNode(state, "Failed to write to coin database");
+            } else if (!pcoinsTip->Flush()) {
                 return AbortNode(state, "Failed to write to coin database");
+            }
             nLastFlush = nNow;
         }
     }
@@ -2151,6 +3089,7 @@ static void DoWarning(const std::string& strWarning)
 void static UpdateTip(const CBlockIndex *pindexNew, const CChainParams& chainParams) {
     // New best block
     mempool.AddTransactionsUpdated(1);
+    NotifyMempoolPrevalidationTip();
 
     {
         WaitableLock lock(csBestBlock);
@@ -2356,8 +3295,21 @@ bool CChainState::ConnectTip(CValidationState& state, const CChainParams& chainp
     int64_t nTime3;
     LogPrint(BCLog::BENCH, "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * MILLI, nTimeReadFromDisk * MICRO);
     {
+        // Start reading the block's inputs from disk before connecting it.
+        std::unique_ptr<CCoinsPrefetch> prefetch;
+        if (nCoinsPrefetchThreads > 0) {
+            prefetch.reset(new CCoinsPrefetch(blockConnecting, *pcoinsTip, pcoinsdbview.get()));
+        }
         CCoinsViewCache view(pcoinsTip.get());
-        bool rv = ConnectBlock(blockConnecting, state, pindexNew, view, chainparams);
+        const uint64_t nCacheHitsBefore = nScriptExecutionCacheHits;
+        const uint64_t nCacheLookupsBefore = nScriptExecutionCacheHits + nScriptExecutionCacheMisses;
+        bool rv = ConnectBlock(blockConnecting, state, pindexNew, view, chainparams, false, prefetch.get());
+        prefetch.reset();
+        const uint64_t nCacheHits = nScriptExecutionCacheHits - nCacheHitsBefore;
+        const uint64_t nCacheLookups = nScriptExecutionCacheHits + nScriptExecutionCacheMisses - nCacheLookupsBefore;
+        if (nCacheLookups > 0) {
+            LogPrint(BCLog::BENCH, "  - Script execution cache: %u/%u txs cached (%.1f%%)\n", nCacheHits, nCacheLookups, 100.0 * nCacheHits / nCacheLookups);
+        }
         GetMainSignals().BlockChecked(blockConnecting, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2807,10 +3759,10 @@ bool ResetBlockFailureFlags(CBlockIndex *pindex) {
     return g_chainstate.ResetBlockFailureFlags(pindex);
 }
 
-CBlockIndex* CChainState::AddToBlockIndex(const CBlockHeader& block)
+CBlockIndex* CChainState::AddToBlockIndex(const CBlockHeader& block, const uint256* pHash)
 {
     // Check for duplicate
-    uint256 hash = block.GetHash();
+    uint256 hash = pHash ? *pHash : block.GetHash();
     BlockMap::iterator it = mapBlockIndex.find(hash);
     if (it != mapBlockIndex.end())
         return it->second;
@@ -2890,6 +3842,70 @@ bool CChainState::ReceivedBlockTransactions(const CBlock &block, CValidationStat
     return true;
 }
 
+void CChainState::ActivateSnapshotBase(CBlockIndex* pindexBase, uint64_t nChainTxBase, const Consensus::Params& consensusParams)
+{
+    AssertLockHeld(cs_main);
+
+    // The snapshot stands in for the transactions of every block up to its
+    // base, so treat those as blocks that were pruned since, but mark them
+    // as assumed valid rather than as having had their scripts checked.
+    // Their transaction counts are unknown; one per block keeps nChainTx
+    // increasing, and the base block gets the real chain total back.
+    std::vector<CBlockIndex*> vPath;
+    for (CBlockIndex* pindex = pindexBase; pindex->pprev; pindex = pindex->pprev) {
+        vPath.push_back(pindex);
+    }
+    for (auto it = vPath.rbegin(); it != vPath.rend(); ++it) {
+        CBlockIndex* pindex = *it;
+        if (pindex->nTx == 0) {
+            pindex->nTx = 1;
+            if (pindex == pindexBase && nChainTxBase > pindex->pprev->nChainTx) {
+                pindex->nTx = nChainTxBase - pindex->pprev->nChainTx;
+            }
+        }
+        pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+        if (IsWitnessEnabled(pindex->pprev, consensusParams)) {
+            pindex->nStatus |= BLOCK_OPT_WITNESS;
+        }
+        if (!pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
+            pindex->RaiseValidity(BLOCK_VALID_TRANSACTIONS);
+            pindex->nStatus |= BLOCK_ASSUMED_VALID;
+        }
+        setDirtyBlockIndex.insert(pindex);
+    }
+
+    // Link up any block whose parents now all count as having had data, and
+    // collect the candidates for the new tip, as LoadBlockIndex does.
+    std::vector<std::pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    for (const std::pair<const uint256, CBlockIndex*>& item : mapBlockIndex) {
+        vSortedByHeight.push_back(std::make_pair(item.second->nHeight, item.second));
+    }
+    std::sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    for (const std::pair<int, CBlockIndex*>& item : vSortedByHeight) {
+        CBlockIndex* pindex = item.second;
+        if (pindex->pprev && pindex->nTx > 0 && pindex->pprev->nChainTx > 0) {
+            if (pindex->nChainTx == 0) {
+                pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+            }
+            auto range = mapBlocksUnlinked.equal_range(pindex->pprev);
+            while (range.first != range.second) {
+                if (range.first->second == pindex) {
+                    range.first = mapBlocksUnlinked.erase(range.first);
+                } else {
+                    range.first++;
+                }
+            }
+        }
+        if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && pindex->nChainTx && !setBlockIndexCandidates.value_comp()(pindex, pindexBase)) {
+            setBlockIndexCandidates.insert(pindex);
+        }
+    }
+
+    chainActive.SetTip(pindexBase);
+    PruneBlockIndexCandidates();
+}
+
 static bool FindBlockPos(CDiskBlockPos &pos, unsigned int nAddSize, unsigned int nHeight, uint64_t nTime, bool fKnown = false)
 {
     LOCK(cs_LastBlockFile);
@@ -3247,11 +4263,12 @@ static bool ContextualCheckBlock(const CBlock& block, CValidationState& state, c
     return true;
 }
 
-bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+/** pHashChecked, if set, is the hash of block, whose proof of work was checked already. */
+bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, const uint256* pHashChecked)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
-    uint256 hash = block.GetHash();
+    uint256 hash = pHashChecked ? *pHashChecked : block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = nullptr;
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
@@ -3266,7 +4283,7 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState&
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), !pHashChecked))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -3296,7 +4313,7 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState&
         }
     }
     if (pindex == nullptr)
-        pindex = AddToBlockIndex(block);
+        pindex = AddToBlockIndex(block, &hash);
 
     if (ppindex)
         *ppindex = pindex;
@@ -3307,14 +4324,28 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState&
 }
 
 // Exposed wrapper for AcceptBlockHeader
-bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex, CBlockHeader *first_invalid)
+bool CheckBlockHeaders(const std::vector<CBlockHeader>& headers, std::vector<uint256>& hashes, CValidationState& state, const Consensus::Params& consensusParams)
 {
+    hashes.clear();
+    hashes.reserve(headers.size());
+    for (const CBlockHeader& header : headers) {
+        hashes.push_back(header.GetHash());
+        if (!CheckProofOfWork(hashes.back(), header.nBits, consensusParams))
+            return state.DoS(50, false, REJECT_INVALID, "high-hash", false, "proof of work failed");
+    }
+    return true;
+}
+
+bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex, CBlockHeader *first_invalid, const std::vector<uint256>* hashes)
+{
+    assert(!hashes || hashes->size() == headers.size());
     if (first_invalid != nullptr) first_invalid->SetNull();
     {
         LOCK(cs_main);
-        for (const CBlockHeader& header : headers) {
+        for (size_t i = 0; i < headers.size(); i++) {
+            const CBlockHeader& header = headers[i];
             CBlockIndex *pindex = nullptr; // Use a temp pindex instead of ppindex to avoid a const_cast
-            if (!g_chainstate.AcceptBlockHeader(header, state, chainparams, &pindex)) {
+            if (!g_chainstate.AcceptBlockHeader(header, state, chainparams, &pindex, hashes ? &(*hashes)[i] : nullptr)) {
                 if (first_invalid) *first_invalid = header;
                 return false;
             }
@@ -4396,8 +5427,9 @@ void CChainState::CheckBlockIndex(const Consensus::Params& consensusParams)
         if (pindexFirstNeverProcessed == nullptr && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != nullptr && pindexFirstNotTreeValid == nullptr && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != nullptr && pindexFirstNotTransactionsValid == nullptr && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TRANSACTIONS) pindexFirstNotTransactionsValid = pindex;
-        if (pindex->pprev != nullptr && pindexFirstNotChainValid == nullptr && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
-        if (pindex->pprev != nullptr && pindexFirstNotScriptsValid == nullptr && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
+        // Blocks below a UTXO snapshot count as valid for the blocks built on them.
+        if (pindex->pprev != nullptr && pindexFirstNotChainValid == nullptr && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN && !(pindex->nStatus & BLOCK_ASSUMED_VALID)) pindexFirstNotChainValid = pindex;
+        if (pindex->pprev != nullptr && pindexFirstNotScriptsValid == nullptr && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS && !(pindex->nStatus & BLOCK_ASSUMED_VALID)) pindexFirstNotScriptsValid = pindex;
 
         // Begin: actual consistency checks.
         if (pindex->pprev == nullptr) {
@@ -4689,6 +5721,252 @@ bool DumpMempool(void)
     return true;
 }
 
+static const uint64_t SIGCACHE_DUMP_VERSION = 2;
+
+bool WriteSignatureCacheFile(const fs::path& path, const SignatureCacheContents& contents)
+{
+    FILE* filestr = fsbridge::fopen(path, "wb");
+    if (!filestr) {
+        return false;
+    }
+
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    uint64_t version = SIGCACHE_DUMP_VERSION;
+    int nClientVersion = CLIENT_VERSION;
+    uint32_t nFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    hasher << version << nClientVersion << nFlags << contents.sigNonce << contents.sigEntries << contents.scriptNonce << contents.scriptEntries;
+    file << version << nClientVersion << nFlags << contents.sigNonce << contents.sigEntries << contents.scriptNonce << contents.scriptEntries;
+    file << hasher.GetHash();
+    FileCommit(file.Get());
+    file.fclose();
+    return true;
+}
+
+bool ReadSignatureCacheFile(const fs::path& path, SignatureCacheContents& contents)
+{
+    FILE* filestr = fsbridge::fopen(path, "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open signature cache file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    try {
+        CHashVerifier<CAutoFile> verifier(&file);
+        uint64_t version;
+        int nClientVersion;
+        uint32_t nFlags;
+        verifier >> version;
+        if (version != SIGCACHE_DUMP_VERSION) {
+            return false;
+        }
+        // Another build may verify under other flags or cache other entries,
+        // so only the exact build that wrote the file trusts it.
+        verifier >> nClientVersion >> nFlags;
+        if (nClientVersion != CLIENT_VERSION || nFlags != STANDARD_SCRIPT_VERIFY_FLAGS) {
+            LogPrintf("Signature cache file on disk was written by another version (%d, flags %08x). Discarding it.\n", nClientVersion, nFlags);
+            return false;
+        }
+        verifier >> contents.sigNonce >> contents.sigEntries >> contents.scriptNonce >> contents.scriptEntries;
+        uint256 hashChecksum;
+        file >> hashChecksum;
+        if (hashChecksum != verifier.GetHash()) {
+            LogPrintf("Signature cache file on disk is corrupt. Continuing anyway.\n");
+            return false;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize signature cache data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+bool LoadSignatureCaches()
+{
+    SignatureCacheContents contents;
+    if (!ReadSignatureCacheFile(GetDataDir() / "sigcache.dat", contents)) {
+        return false;
+    }
+
+    // Entries are salted hashes, so they are only usable under the nonce
+    // they were computed with, and that can only be swapped in while no
+    // entries were computed under a fresh one yet.
+    if (!SetSignatureCacheContents(contents.sigNonce, contents.sigEntries)) {
+        LogPrintf("Signature cache already in use, not loading it from disk.\n");
+        return false;
+    }
+    {
+        LOCK(cs_main);
+        if (nScriptExecutionCacheHits + nScriptExecutionCacheMisses != 0) {
+            LogPrintf("Script execution cache already in use, not loading it from disk.\n");
+            return false;
+        }
+        scriptExecutionCacheNonce = contents.scriptNonce;
+        for (const uint256& entry : contents.scriptEntries) {
+            scriptExecutionCache.insert(entry);
+        }
+    }
+
+    LogPrintf("Imported signature caches from disk: %u signatures, %u script executions\n", contents.sigEntries.size(), contents.scriptEntries.size());
+    return true;
+}
+
+bool DumpSignatureCaches()
+{
+    int64_t start = GetTimeMicros();
+
+    SignatureCacheContents contents;
+    GetSignatureCacheContents(contents.sigNonce, contents.sigEntries);
+    {
+        LOCK(cs_main);
+        contents.scriptNonce = scriptExecutionCacheNonce;
+        contents.scriptEntries = scriptExecutionCache.get_elements();
+    }
+
+    int64_t mid = GetTimeMicros();
+
+    try {
+        if (!WriteSignatureCacheFile(GetDataDir() / "sigcache.dat.new", contents)) {
+            return false;
+        }
+        RenameOver(GetDataDir() / "sigcache.dat.new", GetDataDir() / "sigcache.dat");
+        int64_t last = GetTimeMicros();
+        LogPrintf("Dumped signature caches: %gs to copy, %gs to dump\n", (mid-start)*MICRO, (last-mid)*MICRO);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump signature caches: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+bool LoadUTXOSnapshot(const fs::path& path, const CChainParams& chainparams, SnapshotMetadata& metadata, std::string& error)
+{
+    int64_t nStart = GetTimeMicros();
+    if (!fPruneMode) {
+        error = "Loading a UTXO snapshot requires -prune, as the blocks below its base are never downloaded";
+        return false;
+    }
+
+    // Decode the whole snapshot once before touching the coins database, so
+    // a malformed file can not leave it half written.
+    CUTXOSnapshotReader reader;
+    if (!reader.Open(path, error)) {
+        return false;
+    }
+    metadata = reader.GetMetadata();
+    if (memcmp(metadata.message_start, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE) != 0) {
+        error = "UTXO snapshot is for a different network";
+        return false;
+    }
+    if (metadata.base_height <= 0 || metadata.headers.size() != (size_t)metadata.base_height ||
+        metadata.headers.back().GetHash() != metadata.base_hash) {
+        error = "UTXO snapshot headers do not lead to its base block";
+        return false;
+    }
+    // Only a set known in advance is trusted in place of the blocks below it.
+    // Decoding checks that the coins really hash to utxo_hash.
+    auto itAssumeutxo = chainparams.Assumeutxo().find(metadata.base_height);
+    if (itAssumeutxo == chainparams.Assumeutxo().end()) {
+        error = strprintf("No UTXO snapshot is known at height %d", metadata.base_height);
+        return false;
+    }
+    if (metadata.utxo_hash != itAssumeutxo->second.hash_serialized || metadata.chain_tx != itAssumeutxo->second.nChainTx) {
+        error = strprintf("UTXO snapshot does not match the one known at height %d", metadata.base_height);
+        return false;
+    }
+    std::vector<std::pair<COutPoint, Coin>> coins;
+    try {
+        while (reader.ReadChunk(coins)) {}
+    } catch (const std::exception& e) {
+        error = strprintf("Malformed UTXO snapshot: %s", e.what());
+        return false;
+    }
+
+    {
+        LOCK(cs_main);
+        std::unique_ptr<CCoinsViewCursor> pcursor(pcoinsdbview->Cursor());
+        if (chainActive.Height() != 0 || pcursor->Valid() || pcoinsTip->GetCacheSize() != 0) {
+            error = "A UTXO snapshot can only be loaded into an empty chainstate";
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < metadata.headers.size(); i += MAX_HEADERS_RESULTS) {
+        std::vector<CBlockHeader> headers(metadata.headers.begin() + i, metadata.headers.begin() + std::min(i + MAX_HEADERS_RESULTS, metadata.headers.size()));
+        CValidationState state;
+        if (!ProcessNewBlockHeaders(headers, state, chainparams)) {
+            error = strprintf("Invalid header in UTXO snapshot: %s", FormatStateMessage(state));
+            return false;
+        }
+    }
+
+    CBlockIndex* pindexBase;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(metadata.base_hash);
+        if (mi == mapBlockIndex.end() || mi->second->nHeight != metadata.base_height) {
+            error = "UTXO snapshot headers do not lead to its base block";
+            return false;
+        }
+        pindexBase = mi->second;
+        if (chainActive.Height() != 0) {
+            error = "A UTXO snapshot can only be loaded into an empty chainstate";
+            return false;
+        }
+
+        // Get the base block's header on disk before the coins database
+        // starts referring to it.
+        CValidationState state;
+        if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS)) {
+            error = strprintf("Failed to flush the block index: %s", FormatStateMessage(state));
+            return false;
+        }
+
+        if (!reader.Open(path, error)) {
+            return false;
+        }
+        try {
+            while (reader.ReadChunk(coins)) {
+                if (!pcoinsdbview->WriteSnapshotCoins(coins, metadata.base_hash, false)) {
+                    error = "Failed to write to the coins database";
+                    return false;
+                }
+            }
+        } catch (const std::exception& e) {
+            error = strprintf("Malformed UTXO snapshot: %s", e.what());
+            return false;
+        }
+        if (!pcoinsdbview->WriteSnapshotCoins({}, metadata.base_hash, true)) {
+            error = "Failed to write to the coins database";
+            return false;
+        }
+        pcoinsTip->SetBestBlock(metadata.base_hash);
+
+        g_chainstate.ActivateSnapshotBase(pindexBase, metadata.chain_tx, chainparams.GetConsensus());
+        if (!fHavePruned) {
+            pblocktree->WriteFlag("prunedblockfiles", true);
+            fHavePruned = true;
+        }
+        UpdateTip(pindexBase, chainparams);
+        if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS)) {
+            error = strprintf("Failed to flush the block index: %s", FormatStateMessage(state));
+            return false;
+        }
+    }
+
+    LogPrintf("Loaded UTXO snapshot of %u coins at %s (height %d) in %.2fs\n", metadata.coins_count,
+        metadata.base_hash.ToString(), metadata.base_height, (GetTimeMicros() - nStart) * MICRO);
+
+    GetMainSignals().UpdatedBlockTip(pindexBase, pindexBase->GetAncestor(0), IsInitialBlockDownload());
+    uiInterface.NotifyBlockTip(IsInitialBlockDownload(), pindexBase);
+
+    // Connect whatever blocks past the base we may already have.
+    CValidationState state;
+    ActivateBestChain(state, chainparams);
+    return true;
+}
+
 //! Guess how far we are in the verification process at the given block index
 double GuessVerificationProgress(const ChainTxData& data, const CBlockIndex *pindex) {
     if (pindex == nullptr)
@@ -42,6 +42,7 @@ class CBlockPolicyEstimator;
 class CTxMemPool;
 class CValidationState;
 struct ChainTxData;
+struct SnapshotMetadata;
 
 struct PrecomputedTransactionData;
 struct LockPoints;
@@ -66,6 +67,12 @@ static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
 static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 /** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -limitclustercount, max number of transactions in a mempool cluster */
+static const unsigned int DEFAULT_CLUSTER_LIMIT = 100;
+/** Maximum number of transactions in a package accepted to the mempool at once */
+static const unsigned int MAX_PACKAGE_COUNT = 25;
+/** Maximum kilobytes of virtual size of a package accepted to the mempool at once */
+static const unsigned int MAX_PACKAGE_SIZE = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
 /** Maximum kilobytes for transactions to store for processing during reorg */
@@ -81,6 +88,14 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of coins prefetch threads allowed */
+static const int MAX_COINS_PREFETCH_THREADS = 16;
+/** -prefetchthreads default (number of threads reading block inputs from the coins database ahead of validation) */
+static const int DEFAULT_COINS_PREFETCH_THREADS = 4;
+/** Maximum number of transaction verification threads allowed */
+static const int MAX_TXVERIFY_THREADS = 16;
+/** -txverifythreads default (number of threads verifying the scripts of loose transactions before they are accepted to the mempool, 0 = disabled) */
+static const int DEFAULT_TXVERIFY_THREADS = 2;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -102,6 +117,8 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Coins created within this many blocks of the tip are among the last evicted from a retained coins cache. */
+static const int COINS_CACHE_YOUNG_DEPTH = 144;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 /** Average delay between local address broadcasts in seconds. */
@@ -134,6 +151,18 @@ static const bool DEFAULT_TXINDEX = false;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 /** Default for -persistmempool */
 static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -persistsigcache */
+static const bool DEFAULT_PERSIST_SIGCACHE = true;
+/** Default for -prevalidatemempool */
+static const bool DEFAULT_PREVALIDATE_MEMPOOL = false;
+/** Default for -backgroundflush */
+static const bool DEFAULT_BACKGROUND_FLUSH = false;
+/** Default for -dbcacheretain, in percent of the coins cache size */
+static const int DEFAULT_COINS_CACHE_RETAIN = 0;
+/** Maximum for -dbcacheretain, leaving room below the 90% mark that triggers a write */
+static const int MAX_COINS_CACHE_RETAIN = 75;
+/** Default for -mempoolclusters */
+static const bool DEFAULT_MEMPOOL_CLUSTERS = false;
 /** Default for -mempoolreplacement */
 static const bool DEFAULT_ENABLE_REPLACEMENT = true;
 /** Default for using fee filter */
@@ -170,12 +199,19 @@ extern uint256 hashBestBlock;
 extern std::atomic_bool fImporting;
 extern std::atomic_bool fReindex;
 extern int nScriptCheckThreads;
+extern int nCoinsPrefetchThreads;
+extern int nTxVerifyThreads;
+extern bool fPrevalidateMempool;
+/** Whether periodic and cache-size triggered chainstate flushes are written in the background */
+extern bool fBackgroundFlush;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
 extern size_t nCoinCacheUsage;
+/** Percentage of nCoinCacheUsage kept populated after the coins cache is written (0 empties it) */
+extern int nCoinCacheRetain;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
 extern CFeeRate minRelayTxFee;
 /** Absolute maximum transaction fee (in satoshis) used by wallet and mempool (rejects high fee in sendrawtransaction) */
@@ -252,8 +288,22 @@ bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<cons
  * @param[in]  chainparams The params for the chain we want to connect to
  * @param[out] ppindex If set, the pointer will be set to point to the last new block index object for the given headers
  * @param[out] first_invalid First header that fails validation, if one exists
+ * @param[in]  hashes If set, the hashes of the headers, whose proof of work was checked by CheckBlockHeaders
  */
-bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& block, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex=nullptr, CBlockHeader *first_invalid=nullptr);
+bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& block, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex=nullptr, CBlockHeader *first_invalid=nullptr, const std::vector<uint256>* hashes=nullptr);
+
+/**
+ * Hash block headers and check their proof of work, the checks that do not
+ * need anything else. Call without cs_main held, before passing the hashes to
+ * ProcessNewBlockHeaders, so that headers from several peers can be checked
+ * in parallel.
+ *
+ * @param[in]  headers The block headers
+ * @param[out] hashes Their hashes, up to the first that fails
+ * @param[out] state Set to an invalid state if a header fails
+ * @param[in]  consensusParams The params of the chain they are meant for
+ */
+bool CheckBlockHeaders(const std::vector<CBlockHeader>& headers, std::vector<uint256>& hashes, CValidationState& state, const Consensus::Params& consensusParams);
 
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
@@ -274,6 +324,14 @@ bool LoadChainTip(const CChainParams& chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the coins prefetch thread */
+void ThreadCoinsPrefetch();
+/** Run an instance of the transaction verification thread */
+void ThreadTxVerify();
+/** Run the thread that verifies mempool transactions under the next block's script flags */
+void ThreadPrevalidateMempool();
+/** Verify every mempool transaction under the next block's script flags now, as that thread does. Returns how many were verified. */
+unsigned int PrevalidateMempool();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -311,6 +369,36 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                         bool* pfMissingInputs, std::list<CTransactionRef>* plTxnReplaced,
                         bool bypass_limits, const CAmount nAbsurdFee);
 
+/**
+ * (try to) add a package to the memory pool at once: a child and its
+ * unconfirmed parents, parents first. Parents paying too little to be accepted
+ * on their own get in if the fees of the whole package make up for them, as
+ * long as the child pays enough for itself. Either the whole package ends up
+ * in the mempool or none of it. On failure pfailed_txid is set to the
+ * transaction that failed, if it was not the package as a whole.
+ */
+bool AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState& state, const std::vector<CTransactionRef>& package,
+                               uint256* pfailed_txid, const CAmount nAbsurdFee);
+
+/**
+ * Verify the scripts of a batch of loose transactions on the transaction
+ * verification threads, without holding cs_main while they run unless the
+ * caller does, and put the ones that pass in the script execution cache.
+ * Only transactions that pass all the checks AcceptToMemoryPool does before
+ * the scripts, with the given bypass_limits, get their scripts verified; the
+ * others are left to AcceptToMemoryPool. It then finds the scripts in the
+ * cache, or reports the script failure found here without verifying them
+ * again. Returns the number of transactions whose scripts passed.
+ */
+unsigned int PreverifyTransactions(CTxMemPool& pool, const std::vector<CTransactionRef>& txs, bool bypass_limits = false);
+
+/**
+ * Verify the scripts of txs, whose inputs must all be in inputs, on the
+ * transaction verification threads. valid receives the result for each
+ * transaction. Requires cs_main.
+ */
+void CheckInputsMany(const std::vector<CTransactionRef>& txs, const CCoinsViewCache& inputs, unsigned int flags, bool cacheSigStore, std::vector<bool>& valid);
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
@@ -391,13 +479,28 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
-/** Initializes the script-execution cache */
+/** Initializes the script-execution cache, dropping whatever it held */
 void InitScriptExecutionCache();
 
+/** Number of script-execution cache lookups that hit and missed so far */
+void GetScriptExecutionCacheStats(uint64_t& nHits, uint64_t& nMisses);
+
 
 /** Functions for disk access for blocks */
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/**
+ * Read a block as serialized on disk (with witness data), without
+ * deserializing it. This is also how it is sent to peers that want witnesses.
+ */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CDiskBlockPos& pos, const uint256& hash, const CMessageHeader::MessageStartChars& messageStart);
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
+/**
+ * Turn a serialized block into its serialization without witness data, in a
+ * single pass and in place. Returns false if it could not be parsed, in which
+ * case the contents of block are unspecified.
+ */
+bool StripRawBlockWitness(std::vector<unsigned char>& block);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -485,4 +588,32 @@ bool DumpMempool();
 /** Load the mempool from disk. */
 bool LoadMempool();
 
+/** The salts and entries of the signature and script execution caches, as kept in sigcache.dat */
+struct SignatureCacheContents
+{
+    uint256 sigNonce;
+    std::vector<uint256> sigEntries;
+    uint256 scriptNonce;
+    std::vector<uint256> scriptEntries;
+};
+
+/** Write contents to path, along with the client version and script flags they are valid for. */
+bool WriteSignatureCacheFile(const fs::path& path, const SignatureCacheContents& contents);
+
+/** Read contents from path. Fails on a file written by another client version or under other script flags. */
+bool ReadSignatureCacheFile(const fs::path& path, SignatureCacheContents& contents);
+
+/** Dump the signature and script execution caches to disk. */
+bool DumpSignatureCaches();
+
+/** Load the signature and script execution caches from disk. */
+bool LoadSignatureCaches();
+
+/**
+ * Replace an empty chainstate with the UTXO set in the snapshot at path,
+ * making its base block the tip. Requires pruning, since the blocks below the
+ * base are never downloaded.
+ */
+bool LoadUTXOSnapshot(const fs::path& path, const CChainParams& chainparams, SnapshotMetadata& metadata, std::string& error);
+
 #endif // STARWELS_VALIDATION_H